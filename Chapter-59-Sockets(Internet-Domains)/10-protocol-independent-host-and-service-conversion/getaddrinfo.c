@@ -2,15 +2,24 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/un.h>
 #include <arpa/inet.h>
 #include <string.h>
+#include <time.h>
+#include "../12-internet-domain-sockets-library/utils/resolver-cache.h"
+
+// build: gcc getaddrinfo.c ../12-internet-domain-sockets-library/utils/resolver-cache.c -pthread
+// usage: ./a.out [host] [service] [lookups]
+// repeated lookups go through the resolver cache, only the first one calls getaddrinfo
+// (try a name from /etc/hosts, like localhost, to see it work without network)
 
 int main(int argc, char const *argv[])
 {
     struct addrinfo hints, *res, *temp;
-    char host[] = "google.com";
-    char service[] = "http";
+    const char *host = argc > 1 ? argv[1] : "google.com";
+    const char *service = argc > 2 ? argv[2] : "http";
+    int lookups = argc > 3 ? atoi(argv[3]) : 1;
     int status;
 
     memset(&hints, 0, sizeof(struct addrinfo));
@@ -19,20 +28,41 @@ int main(int argc, char const *argv[])
     hints.ai_family = AF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM;
 
+    // answers live 60s, failures 5s, expired answers are served 30s more while refreshing
+    ResolverCache *cache = createResolverCache(60000, 5000, 30000);
+    if (cache == NULL)
+    {
+        fprintf(stdout, "failed to create the resolver cache\n");
+        return 1;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
     // there can be many resolved addresses for that host so it gives a linked list
-    if ((status = getaddrinfo("google.com", "http", &hints, &res)) != 0)
+    for (int i = 0; i < lookups; i++)
     {
-        fprintf(stdout, "getaddrinfo error: %s\n", gai_strerror(status));
-        return 2;
+        if ((status = resolverLookup(cache, host, service, &hints, &res)) != 0)
+        {
+            fprintf(stdout, "getaddrinfo error: %s\n", gai_strerror(status));
+            destroyResolverCache(cache);
+            return 2;
+        }
+
+        // only the last answer is printed
+        if (i < lookups - 1)
+            resolverFreeAddrInfo(res);
     }
 
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
     fprintf(stdout, "IP addresses for %s:\n", host);
 
     // traverse the linked list to get the resolved addresses
     for (temp = res; temp != NULL; temp = temp->ai_next)
     {
         void *addr = NULL;
-        char ipversion[4] = "";
+        char ipversion[5] = "";
 
         // when it is ipv4
         if (temp->ai_family == AF_INET)
@@ -42,7 +72,7 @@ int main(int argc, char const *argv[])
 
             // getting the binary address
             addr = &(ipv4->sin_addr);
-            strncpy(ipversion, "IPv4", 4);
+            strncpy(ipversion, "IPv4", 5);
         }
         else
         {
@@ -51,7 +81,7 @@ int main(int argc, char const *argv[])
 
             // getting the binary address
             addr = &(ipv6->sin6_addr);
-            strncpy(ipversion, "IPv6", 4);
+            strncpy(ipversion, "IPv6", 5);
         }
 
         // for storing the address string
@@ -64,7 +94,14 @@ int main(int argc, char const *argv[])
     }
 
     // free the linked list
-    freeaddrinfo(res);
+    resolverFreeAddrInfo(res);
+
+    ResolverStats stats;
+    resolverGetStats(cache, &stats);
+    double elapsedUs = (end.tv_sec - start.tv_sec) * 1e6 + (end.tv_nsec - start.tv_nsec) / 1e3;
+    fprintf(stdout, "%d lookups in %.0f us, cache hits: %zu, misses: %zu\n", lookups, elapsedUs, stats.hits, stats.misses);
+
+    destroyResolverCache(cache);
 
     return 0;
 }
@@ -1,72 +1,526 @@
-#include <stdio.h>
-#include <sys/socket.h>
-#include <arpa/inet.h>
-#include <unistd.h>
-#include <fcntl.h>
-#include <stdlib.h>
-#include <string.h>
-#include <math.h>
-
-#define PORT 8000
-#define MAX_CLIENTS 10
-#define BUFFER_SIZE 5
-#define RESPONSE_SIZE 15
-
-int main(int argc, char const *argv[])
+// sequence number client (binary protocol, sequence-protocol.h)
+// - every line of stdin is a count, each range is printed as "id: start,end" when it comes back
+// - requests are packed up to -b per frame and up to -w frames are in flight on the one
+//   connection (pipelining), answers are matched to their requests by id
+// - with -n the requests are generated instead (-n of -s numbers each), the rate is printed
+//   and every range is checked against the one before it
+// - with -t the ids are taken one by one through the id allocator (id-allocator.h) from -t
+//   threads: -n ids, leased in blocks of -s (65536 by default)
+// - -c talks to a cluster instead of host and port ("host:port,host:port", sequence-cluster.h):
+//   the connection goes to a random node, or the next one up when it is down, and moves to
+//   the next node when its node fails (the requests in flight are reported lost), the id
+//   allocator moves on the same way
+// usage: ./client [-b requests per frame] [-w frames in flight] [-n requests] [-s size]
+//                 [-t threads] [-c nodes] [host] [port]
+
+#include "socket-library.h"
+#include "frame-reader.h"
+#include "sequence-protocol.h"
+#include "id-allocator.h"
+#include "sequence-cluster.h"
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+
+#define PORT "8000"
+#define DEFAULT_BATCH 64
+#define DEFAULT_WINDOW 8
+#define DEFAULT_SIZE 5
+#define INPUT_BUFFER_SIZE 4096
+
+#define DEFAULT_LEASE_IDS 10000000
+#define DEFAULT_LEASE_BLOCK 65536
+#define LEASE_PREFETCH_AT 0.7
+
+typedef struct
 {
-    int sfd;
-    char buffer[BUFFER_SIZE + 1];
-    char response[RESPONSE_SIZE];
-    ssize_t bytes_received, bytes_sent;
-    struct sockaddr_in server_addr;
-    socklen_t addr_len = sizeof(struct sockaddr_in);
+    SequenceCluster *cluster;
+    int sfd; // connected to the current node of the cluster
+    FrameReader reader;
+    int batch;  // requests per frame
+    int window; // frames in flight
+
+    // generated requests (-n), stdin is read when generate is 0
+    int generate;
+    uint64_t remaining;
+    uint64_t size;
 
-    memset(&server_addr, 0, addr_len);
+    // counts read from stdin and not sent yet, a ring of batch * window
+    uint64_t *queued;
+    size_t queueHead, queueTail, queueCapacity;
+    char line[INPUT_BUFFER_SIZE];
+    size_t lineLen;
+    int inputDone;
 
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(PORT);
-    server_addr.sin_addr.s_addr = INADDR_ANY; // localhost
+    // requests of the frames in flight (a ring of window), answers come back in the order sent
+    int *frameEntries;
+    int inFlight;
+    uint64_t framesSent;
+    uint32_t nextId;
+    uint32_t expectedId;  // first id of the oldest frame in flight
+    double replyDeadline; // the node failed when the oldest frame is not answered by then
+
+    uint64_t answered;
+    uint64_t refused;
+    uint64_t lost; // in flight when their node failed
+    uint64_t overlaps;
+    uint64_t lastEnd; // ranges of one connection only grow
+    int failovers;
+} SequenceClient;
+
+static const char *const statusNames[] = {
+    [SEQUENCE_OK] = "ok",
+    [SEQUENCE_INVALID] = "invalid range",
+    [SEQUENCE_EXHAUSTED] = "sequence exhausted",
+    [SEQUENCE_UNAVAILABLE] = "sequence unavailable",
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t queuedRequests(const SequenceClient *client)
+{
+    return client->queueTail - client->queueHead;
+}
+
+// a line which is not a number is sent as 0, the server answers it as invalid
+static void queueLine(SequenceClient *client, const char *line)
+{
+    char *end;
+    errno = 0;
+    uint64_t count = strtoull(line, &end, 10);
+    if (errno != 0 || end == line || (*end != '\0' && *end != '\r'))
+        count = 0;
+
+    client->queued[client->queueTail++ % client->queueCapacity] = count;
+}
 
-    if ((sfd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+// reads what stdin has, complete lines become requests
+static void readInput(SequenceClient *client)
+{
+    ssize_t bytes_read = read(STDIN_FILENO, client->line + client->lineLen, sizeof(client->line) - 1 - client->lineLen);
+    if (bytes_read == -1 && errno == EINTR)
+        return;
+    if (bytes_read == -1)
+        fatal("read");
+
+    if (bytes_read == 0)
     {
-        perror("socket");
-        return 1;
+        // a last line without newline still counts
+        client->line[client->lineLen] = '\0';
+        if (client->lineLen > 0)
+            queueLine(client, client->line);
+        client->lineLen = 0;
+        client->inputDone = 1;
+        return;
     }
 
-    // connect with server
-    if (connect(sfd, (struct sockaddr *)&server_addr, addr_len) == -1)
+    client->lineLen += bytes_read;
+    client->line[client->lineLen] = '\0';
+
+    char *start = client->line, *newline;
+    while ((newline = strchr(start, '\n')) != NULL)
     {
-        perror("connect");
-        close(sfd);
-        return 1;
+        *newline = '\0';
+        if (newline > start)
+            queueLine(client, start);
+        start = newline + 1;
     }
 
-    while (1)
+    client->lineLen -= start - client->line;
+    memmove(client->line, start, client->lineLen);
+
+    // a line longer than the buffer is no count
+    if (client->lineLen == sizeof(client->line) - 1)
+    {
+        client->line[0] = 'x';
+        client->lineLen = 1;
+    }
+}
+
+// one frame of up to batch requests, 0 when there is nothing to send, -1 when the node failed
+static int sendFrame(SequenceClient *client)
+{
+    char buffer[sequenceFrameSize(SEQUENCE_MAX_ENTRIES, SEQUENCE_REQUEST_SIZE)];
+
+    int entries;
+    if (client->generate)
+        entries = client->remaining < (uint64_t)client->batch ? (int)client->remaining : client->batch;
+    else
+        entries = queuedRequests(client) < (size_t)client->batch ? (int)queuedRequests(client) : client->batch;
+    if (entries == 0)
+        return 0;
+
+    char *out = putSequenceHeader(buffer, SEQUENCE_FRAME_REQUEST, entries, SEQUENCE_REQUEST_SIZE);
+
+    for (int i = 0; i < entries; i++)
+    {
+        SequenceRequest request = {.id = client->nextId++};
+        if (client->generate)
+            request.count = client->size;
+        else
+            request.count = client->queued[client->queueHead++ % client->queueCapacity];
+        out = putSequenceRequest(out, &request);
+    }
+
+    if (client->generate)
+        client->remaining -= entries;
+    client->frameEntries[client->framesSent++ % client->window] = entries;
+
+    // counted in flight before it is sent, a failed send loses it like the frames before it
+    if (client->inFlight++ == 0)
+        client->replyDeadline = now() + SEQUENCE_REPLY_TIMEOUT_MS / 1000.0;
+
+    size_t len = out - buffer;
+    for (size_t sent = 0; sent < len;)
     {
-        printf("enter range \n");
-        ssize_t bytes_read = read(STDIN_FILENO, buffer, BUFFER_SIZE);
+        ssize_t bytes_sent = send(client->sfd, buffer + sent, len - sent, MSG_NOSIGNAL);
+        if (bytes_sent == -1 && errno == EINTR)
+            continue;
+        if (bytes_sent == -1)
+            return -1;
+        sent += bytes_sent;
+    }
+    return 1;
+}
+
+static int onResponseFrame(void *userData, const char *frame, size_t len)
+{
+    SequenceClient *client = userData;
+
+    int entries = getSequenceHeader(frame, len, SEQUENCE_FRAME_RESPONSE, SEQUENCE_RESPONSE_SIZE);
+    if (entries == -1 || client->inFlight == 0 ||
+        entries != client->frameEntries[(client->framesSent - client->inFlight) % client->window])
+    {
+        errno = EPROTO;
+        return -1;
+    }
 
-        printf("%d \n", bytes_read);
-        if (buffer[bytes_read - 1] == '\n')
+    uint32_t expected = client->expectedId;
+    const char *in = frame + SEQUENCE_HEADER_SIZE;
+
+    for (int i = 0; i < entries; i++)
+    {
+        SequenceResponse response;
+        in = getSequenceResponse(in, &response);
+
+        if (response.id != expected + (uint32_t)i)
         {
-            buffer[bytes_read - 1] = '\0';
+            errno = EPROTO;
+            return -1;
         }
 
-        // send the request to server
-        if ((bytes_sent = send(sfd, buffer, bytes_read - 1, 0)) == -1)
+        if (response.status != SEQUENCE_OK)
         {
-            perror("send");
-            close(sfd);
-            return 1;
+            client->refused++;
+            if (!client->generate)
+                printf("%" PRIu32 ": error %s\n", response.id,
+                       response.status <= SEQUENCE_UNAVAILABLE ? statusNames[response.status] : "unknown");
+            continue;
         }
 
-        // receive response from server
-        bytes_received = recv(sfd, response, RESPONSE_SIZE, 0);
-        response[bytes_received] = '\0';
+        if (response.start <= client->lastEnd)
+            client->overlaps++;
+        client->lastEnd = response.start + response.count - 1;
+        client->answered++;
 
-        printf("data received: %s \n", response);
+        if (!client->generate)
+            printf("%" PRIu32 ": %" PRIu64 ",%" PRIu64 "\n", response.id, response.start, client->lastEnd);
     }
-    close(sfd);
 
+    client->expectedId += entries;
+    client->inFlight--;
+    client->replyDeadline = now() + SEQUENCE_REPLY_TIMEOUT_MS / 1000.0;
     return 0;
 }
+
+// the node failed: the frames in flight are lost, the requests after them go to the next node
+static void failOver(SequenceClient *client, const char *reason)
+{
+    SequenceNode *node = &client->cluster->nodes[client->cluster->current];
+    fprintf(stderr, "node %s:%s %s, moving to the next node\n", node->host, node->port, reason);
+
+    for (; client->inFlight > 0; client->inFlight--)
+    {
+        int entries = client->frameEntries[(client->framesSent - client->inFlight) % client->window];
+        if (!client->generate)
+            for (int i = 0; i < entries; i++)
+                printf("%" PRIu32 ": error node failed\n", client->expectedId + (uint32_t)i);
+
+        client->expectedId += entries;
+        client->lost += entries;
+    }
+
+    // a partial frame of the old connection must not be continued
+    close(client->sfd);
+    freeFrameReader(&client->reader);
+    if (initFrameReader(&client->reader, FRAME_LENGTH_PREFIX, NULL, SEQUENCE_MAX_PAYLOAD, onResponseFrame, client) == -1)
+        fatal("initFrameReader");
+
+    nextSequenceNode(client->cluster);
+    client->sfd = connectSequenceCluster(client->cluster);
+    if (client->sfd == -1)
+        fatal("connectSequenceCluster");
+
+    // the next node hands out another partition, ranges only grow per node
+    client->lastEnd = 0;
+    client->failovers++;
+}
+
+static int moreToSend(const SequenceClient *client)
+{
+    return client->generate ? client->remaining > 0 : queuedRequests(client) > 0;
+}
+
+static void run(SequenceClient *client)
+{
+    while (1)
+    {
+        // keep the window full, a frame goes out as soon as there is something for it
+        int sent = 1;
+        while (client->inFlight < client->window && (sent = sendFrame(client)) == 1)
+            ;
+        if (sent == -1)
+        {
+            failOver(client, strerror(errno));
+            continue;
+        }
+
+        int inputOpen = !client->generate && !client->inputDone;
+        if (!inputOpen && !moreToSend(client) && client->inFlight == 0)
+            break;
+
+        // stdin is read only while the queue has room for what it may bring
+        struct pollfd fds[2] = {{.fd = client->sfd, .events = POLLIN}, {.fd = STDIN_FILENO, .events = POLLIN}};
+        int watchInput = inputOpen && queuedRequests(client) + INPUT_BUFFER_SIZE / 2 <= client->queueCapacity;
+
+        // a stopped or unreachable node never closes the connection, only the deadline tells
+        int timeout = -1;
+        if (client->inFlight > 0)
+        {
+            double left = client->replyDeadline - now();
+            if (left <= 0)
+            {
+                failOver(client, "did not answer in time");
+                continue;
+            }
+            timeout = (int)(left * 1000) + 1;
+        }
+
+        if (poll(fds, watchInput ? 2 : 1, timeout) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            fatal("poll");
+        }
+
+        if (fds[0].revents != 0)
+        {
+            ssize_t bytes_read = frameReaderRead(&client->reader, client->sfd);
+            if (bytes_read == 0)
+            {
+                failOver(client, "closed the connection");
+                continue;
+            }
+            if (bytes_read == -1 && errno != EINTR && errno != EAGAIN)
+            {
+                failOver(client, strerror(errno));
+                continue;
+            }
+        }
+
+        if (watchInput && fds[1].revents != 0)
+            readInput(client);
+
+        fflush(stdout);
+    }
+}
+
+typedef struct
+{
+    IdAllocator *allocator;
+    uint64_t count;
+    uint64_t failed;
+    uint64_t outOfOrder; // the ids of one thread only grow
+} LeaseWorker;
+
+static void *leaseIds(void *arg)
+{
+    LeaseWorker *worker = arg;
+    uint64_t last = 0;
+
+    for (uint64_t i = 0; i < worker->count; i++)
+    {
+        uint64_t id = allocateId(worker->allocator);
+        if (id == 0)
+        {
+            worker->failed++;
+            continue;
+        }
+
+        if (id <= last)
+            worker->outOfOrder++;
+        last = id;
+    }
+    return NULL;
+}
+
+static int runLeasing(const char *nodes, int threads, uint64_t ids, uint64_t blockSize)
+{
+    IdAllocator *allocator = createIdAllocator(nodes, blockSize, LEASE_PREFETCH_AT);
+    if (allocator == NULL)
+        fatal("createIdAllocator");
+
+    LeaseWorker *workers = calloc(threads, sizeof(LeaseWorker));
+    pthread_t *tids = calloc(threads, sizeof(pthread_t));
+    if (workers == NULL || tids == NULL)
+        fatal("calloc");
+
+    double started = now();
+    for (int i = 0; i < threads; i++)
+    {
+        workers[i].allocator = allocator;
+        workers[i].count = ids / threads + ((uint64_t)i < ids % threads);
+
+        int status = pthread_create(&tids[i], NULL, leaseIds, &workers[i]);
+        if (status != 0)
+        {
+            errno = status;
+            fatal("pthread_create");
+        }
+    }
+
+    uint64_t failed = 0, outOfOrder = 0;
+    for (int i = 0; i < threads; i++)
+    {
+        pthread_join(tids[i], NULL);
+        failed += workers[i].failed;
+        outOfOrder += workers[i].outOfOrder;
+    }
+    double elapsed = now() - started;
+
+    IdAllocatorStats stats;
+    getIdAllocatorStats(allocator, &stats);
+    destroyIdAllocator(allocator);
+
+    printf("%" PRIu64 " ids in %.2fs, %.0f ids/s (%d threads, blocks of %" PRIu64 ")\n",
+           ids, elapsed, elapsed > 0 ? ids / elapsed : 0, threads, blockSize);
+    printf("blocks %" PRIu64 " in %" PRIu64 " round trips, waits %" PRIu64 ", failovers %" PRIu64 ", failed %" PRIu64
+           ", out of order %" PRIu64 "\n",
+           stats.blocks, stats.frames, stats.waits, stats.failovers, failed, outOfOrder);
+
+    free(workers);
+    free(tids);
+
+    // a failover to a lower partition sends the ids of a thread back
+    return failed > 0 || (outOfOrder > 0 && stats.failovers == 0);
+}
+
+int main(int argc, char *argv[])
+{
+    SequenceClient client;
+    memset(&client, 0, sizeof(client));
+    client.batch = DEFAULT_BATCH;
+    client.window = DEFAULT_WINDOW;
+    client.size = 0;
+    int threads = 0;
+    const char *nodes = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:w:n:s:t:c:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            client.batch = atoi(optarg);
+            break;
+        case 'w':
+            client.window = atoi(optarg);
+            break;
+        case 'n':
+            client.generate = 1;
+            client.remaining = strtoull(optarg, NULL, 10);
+            break;
+        case 's':
+            client.size = strtoull(optarg, NULL, 10);
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'c':
+            nodes = optarg;
+            break;
+        default:
+            exitWithMessage("usage: ./client [-b requests per frame] [-w frames in flight] [-n requests] [-s size] [-t threads] [-c nodes] [host] [port]\n");
+        }
+    }
+
+    if (client.batch < 1 || client.batch > SEQUENCE_MAX_ENTRIES || client.window < 1)
+        exitWithMessage("requests per frame must be 1 to 1024, frames in flight at least 1\n");
+
+    const char *host = optind < argc ? argv[optind] : "localhost";
+    const char *port = optind + 1 < argc ? argv[optind + 1] : PORT;
+
+    // host and port are a cluster of one
+    char single[512];
+    if (nodes == NULL)
+    {
+        snprintf(single, sizeof(single), strchr(host, ':') != NULL ? "[%s]:%s" : "%s:%s", host, port);
+        nodes = single;
+    }
+
+    SequenceCluster cluster;
+    if (parseSequenceCluster(&cluster, nodes) == -1)
+        exitWithMessage("nodes must be host:port,host:port,...\n");
+
+    if (threads > 0)
+        return runLeasing(nodes, threads, client.generate ? client.remaining : DEFAULT_LEASE_IDS,
+                          client.size > 0 ? client.size : DEFAULT_LEASE_BLOCK);
+    if (client.size == 0)
+        client.size = DEFAULT_SIZE;
+
+    // stdin lines are at least 2 bytes, so a full input buffer never overflows the queue
+    client.queueCapacity = (size_t)client.batch * client.window + INPUT_BUFFER_SIZE;
+    client.queued = malloc(client.queueCapacity * sizeof(uint64_t));
+    client.frameEntries = malloc(client.window * sizeof(int));
+    if (client.queued == NULL || client.frameEntries == NULL)
+        fatal("malloc");
+
+    if (initFrameReader(&client.reader, FRAME_LENGTH_PREFIX, NULL, SEQUENCE_MAX_PAYLOAD, onResponseFrame, &client) == -1)
+        fatal("initFrameReader");
+
+    client.cluster = &cluster;
+    client.sfd = connectSequenceCluster(&cluster);
+    if (client.sfd == -1)
+        fatal("connectSequenceCluster");
+
+    if (!client.generate && isatty(STDIN_FILENO))
+        printf("enter range\n");
+
+    uint64_t requests = client.remaining;
+    double started = now();
+    run(&client);
+    double elapsed = now() - started;
+
+    if (client.generate)
+    {
+        printf("%" PRIu64 " requests in %.2fs, %.0f requests/s (%d per frame, %d frames in flight)\n",
+               requests, elapsed, elapsed > 0 ? requests / elapsed : 0, client.batch, client.window);
+        printf("granted %" PRIu64 ", refused %" PRIu64 ", lost %" PRIu64 " in %d failovers, overlapping %" PRIu64
+               ", last number %" PRIu64 "\n",
+               client.answered, client.refused, client.lost, client.failovers, client.overlaps, client.lastEnd);
+    }
+
+    freeFrameReader(&client.reader);
+    free(client.queued);
+    free(client.frameEntries);
+    close(client.sfd);
+    return client.overlaps > 0;
+}
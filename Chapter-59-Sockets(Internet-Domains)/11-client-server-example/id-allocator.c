@@ -0,0 +1,399 @@
+#include "socket-library.h"
+#include "frame-reader.h"
+#include "id-allocator.h"
+#include "sequence-cluster.h"
+#include "sequence-protocol.h"
+#include <errno.h>
+#include <pthread.h>
+
+// published blocks, a slot is reused BLOCK_SLOTS blocks later
+#define BLOCK_SLOTS 16
+
+// blocks asked for in one frame at most
+#define MAX_BLOCKS_PER_FRAME (BLOCK_SLOTS / 2)
+
+// tag of a slot while its start changes
+#define BLOCK_WRITING UINT64_MAX
+
+typedef struct
+{
+    uint64_t block; // which block the start belongs to
+    uint64_t start;
+} BlockSlot;
+
+struct IdAllocator
+{
+    // allocations so far, alone on its cache line: the only write of the fast path
+    _Alignas(64) uint64_t taken;
+
+    // read by every allocation, written once per block
+    _Alignas(64) uint64_t ready; // blocks 0 to ready - 1 are published
+    uint64_t blockSize;
+    uint64_t prefetchOffset;
+    BlockSlot slots[BLOCK_SLOTS];
+
+    // under lock
+    _Alignas(64) pthread_mutex_t lock;
+    pthread_cond_t fetchNeeded;
+    pthread_cond_t blockReady;
+    uint64_t wanted; // blocks the fetch thread should have published
+    int lastError;
+    int stopping;
+    IdAllocatorStats stats;
+
+    // owned by the fetch thread (by createIdAllocator before it starts)
+    pthread_t thread;
+    SequenceCluster cluster;
+    int sfd; // connected to the current node of the cluster
+    FrameReader reader;
+    uint32_t nextId;
+    uint64_t starts[MAX_BLOCKS_PER_FRAME];
+    int expected; // answers of the frame in flight
+    int answered;
+    int leaseError; // set by onLeaseFrame, the frame reader only reports ECANCELED
+};
+
+// seqlock read: a slot which is rewritten while it is read does not match the block
+static int readSlot(IdAllocator *allocator, uint64_t block, uint64_t *start)
+{
+    BlockSlot *slot = &allocator->slots[block % BLOCK_SLOTS];
+
+    uint64_t tag = __atomic_load_n(&slot->block, __ATOMIC_ACQUIRE);
+    *start = __atomic_load_n(&slot->start, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    return tag == block && __atomic_load_n(&slot->block, __ATOMIC_RELAXED) == block;
+}
+
+static void writeSlot(IdAllocator *allocator, uint64_t block, uint64_t start)
+{
+    BlockSlot *slot = &allocator->slots[block % BLOCK_SLOTS];
+
+    __atomic_store_n(&slot->block, BLOCK_WRITING, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&slot->start, start, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->block, block, __ATOMIC_RELEASE);
+}
+
+static int onLeaseFrame(void *userData, const char *frame, size_t len)
+{
+    IdAllocator *allocator = userData;
+
+    int entries = getSequenceHeader(frame, len, SEQUENCE_FRAME_RESPONSE, SEQUENCE_RESPONSE_SIZE);
+    if (entries != allocator->expected || allocator->answered)
+    {
+        allocator->leaseError = EPROTO;
+        return -1;
+    }
+
+    const char *in = frame + SEQUENCE_HEADER_SIZE;
+    for (int i = 0; i < entries; i++)
+    {
+        SequenceResponse response;
+        in = getSequenceResponse(in, &response);
+
+        if (response.id != allocator->nextId - entries + i)
+        {
+            allocator->leaseError = EPROTO;
+            return -1;
+        }
+
+        // the server is out of numbers or cannot store its counter, a failed grant has no count
+        if (response.status != SEQUENCE_OK)
+        {
+            allocator->leaseError = response.status == SEQUENCE_EXHAUSTED ? ENOSPC : EIO;
+            return -1;
+        }
+
+        if (response.count != allocator->blockSize)
+        {
+            allocator->leaseError = EPROTO;
+            return -1;
+        }
+        allocator->starts[i] = response.start;
+    }
+
+    allocator->answered = 1;
+    return 0;
+}
+
+static void disconnect(IdAllocator *allocator)
+{
+    if (allocator->sfd == -1)
+        return;
+
+    close(allocator->sfd);
+    allocator->sfd = -1;
+
+    // a partial frame of the old connection must not be continued
+    freeFrameReader(&allocator->reader);
+}
+
+// one frame of count blocks, their starts end up in allocator->starts
+static int leaseBlocks(IdAllocator *allocator, int count)
+{
+    // connect lazily, also again after a failed round trip
+    if (allocator->sfd == -1)
+    {
+        if (initFrameReader(&allocator->reader, FRAME_LENGTH_PREFIX, NULL, SEQUENCE_MAX_PAYLOAD, onLeaseFrame, allocator) == -1)
+            return -1;
+
+        allocator->sfd = connectSequenceNode(&allocator->cluster.nodes[allocator->cluster.current]);
+        if (allocator->sfd == -1)
+        {
+            freeFrameReader(&allocator->reader);
+            return -1;
+        }
+    }
+
+    char buffer[sequenceFrameSize(MAX_BLOCKS_PER_FRAME, SEQUENCE_REQUEST_SIZE)];
+    char *out = putSequenceHeader(buffer, SEQUENCE_FRAME_REQUEST, count, SEQUENCE_REQUEST_SIZE);
+
+    for (int i = 0; i < count; i++)
+    {
+        SequenceRequest request = {.id = allocator->nextId++, .count = allocator->blockSize};
+        out = putSequenceRequest(out, &request);
+    }
+
+    size_t len = out - buffer;
+    for (size_t sent = 0; sent < len;)
+    {
+        ssize_t bytes_sent = send(allocator->sfd, buffer + sent, len - sent, MSG_NOSIGNAL);
+        if (bytes_sent == -1 && errno == EINTR)
+            continue;
+        if (bytes_sent == -1)
+        {
+            disconnect(allocator);
+            return -1;
+        }
+        sent += bytes_sent;
+    }
+
+    allocator->expected = count;
+    allocator->answered = 0;
+    allocator->leaseError = 0;
+
+    // a node which stopped answering fails the round trip instead of hanging every waiter
+    long long deadline = 0;
+    while (!allocator->answered)
+    {
+        if (waitForSequenceReply(allocator->sfd, &deadline) == -1)
+        {
+            int savedErrno = errno;
+            disconnect(allocator);
+            errno = savedErrno;
+            return -1;
+        }
+
+        ssize_t bytes_read = frameReaderRead(&allocator->reader, allocator->sfd);
+        if (bytes_read == -1 && (errno == EINTR || errno == EAGAIN))
+            continue;
+        if (bytes_read <= 0)
+        {
+            int savedErrno = bytes_read == 0 ? ECONNRESET : allocator->leaseError != 0 ? allocator->leaseError : errno;
+            disconnect(allocator);
+            errno = savedErrno;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// every node gets one try, the one which answered stays the current node
+// returns the number of moves to another node, -1 when no node answered
+static int leaseFromCluster(IdAllocator *allocator, int count)
+{
+    for (int tried = 0; tried < allocator->cluster.count; tried++)
+    {
+        if (leaseBlocks(allocator, count) == 0)
+            return tried;
+        nextSequenceNode(&allocator->cluster);
+    }
+    return -1;
+}
+
+// keeps ready up to wanted, one frame per round trip
+static void *fetchLoop(void *arg)
+{
+    IdAllocator *allocator = arg;
+    pthread_mutex_lock(&allocator->lock);
+
+    while (!allocator->stopping)
+    {
+        uint64_t ready = allocator->ready;
+        if (ready >= allocator->wanted)
+        {
+            pthread_cond_wait(&allocator->fetchNeeded, &allocator->lock);
+            continue;
+        }
+
+        uint64_t missing = allocator->wanted - ready;
+        int count = missing < MAX_BLOCKS_PER_FRAME ? (int)missing : MAX_BLOCKS_PER_FRAME;
+
+        pthread_mutex_unlock(&allocator->lock);
+        int failovers = leaseFromCluster(allocator, count);
+        int savedErrno = errno;
+
+        if (failovers != -1)
+        {
+            for (int i = 0; i < count; i++)
+                writeSlot(allocator, ready + i, allocator->starts[i]);
+        }
+        pthread_mutex_lock(&allocator->lock);
+
+        allocator->stats.frames++;
+        if (failovers == -1)
+        {
+            // the waiting callers fail, the next one to ask tries again
+            allocator->stats.failures++;
+            allocator->lastError = savedErrno;
+            allocator->wanted = ready;
+        }
+        else
+        {
+            allocator->stats.failovers += failovers;
+            allocator->stats.blocks += count;
+            __atomic_store_n(&allocator->ready, ready + count, __ATOMIC_RELEASE);
+        }
+        pthread_cond_broadcast(&allocator->blockReady);
+    }
+
+    pthread_mutex_unlock(&allocator->lock);
+    return NULL;
+}
+
+// ask the fetch thread for the blocks below wanted without waiting
+static void requestBlocks(IdAllocator *allocator, uint64_t wanted)
+{
+    pthread_mutex_lock(&allocator->lock);
+    if (wanted > allocator->wanted)
+    {
+        allocator->wanted = wanted;
+        pthread_cond_signal(&allocator->fetchNeeded);
+    }
+    pthread_mutex_unlock(&allocator->lock);
+}
+
+// slow path: the block is not published yet, returns -1 when its round trip failed
+static int waitForBlock(IdAllocator *allocator, uint64_t block)
+{
+    pthread_mutex_lock(&allocator->lock);
+
+    allocator->stats.waits++;
+    uint64_t failures = allocator->stats.failures;
+
+    if (block + 1 > allocator->wanted)
+    {
+        allocator->wanted = block + 1;
+        pthread_cond_signal(&allocator->fetchNeeded);
+    }
+
+    while (allocator->ready <= block && allocator->stats.failures == failures)
+        pthread_cond_wait(&allocator->blockReady, &allocator->lock);
+
+    int status = allocator->ready > block ? 0 : -1;
+    int lastError = allocator->lastError;
+    pthread_mutex_unlock(&allocator->lock);
+
+    if (status == -1)
+        errno = lastError;
+    return status;
+}
+
+uint64_t allocateId(IdAllocator *allocator)
+{
+    while (1)
+    {
+        uint64_t taken = __atomic_fetch_add(&allocator->taken, 1, __ATOMIC_RELAXED);
+        uint64_t block = taken / allocator->blockSize;
+        uint64_t offset = taken % allocator->blockSize;
+
+        if (block >= __atomic_load_n(&allocator->ready, __ATOMIC_ACQUIRE) && waitForBlock(allocator, block) == -1)
+            return 0;
+
+        // exactly one allocation per block passes the mark, it asks for the next block
+        if (offset == allocator->prefetchOffset)
+            requestBlocks(allocator, block + 2);
+
+        uint64_t start;
+        if (readSlot(allocator, block, &start))
+            return start + offset;
+
+        // the slot was reused while this thread was stalled, the id is skipped
+    }
+}
+
+IdAllocator *createIdAllocator(const char *nodes, uint64_t blockSize, double prefetchAt)
+{
+    // the server answers larger blocks with SEQUENCE_INVALID
+    if (blockSize == 0 || blockSize > SEQUENCE_MAX_RANGE || prefetchAt < 0 || prefetchAt > 1)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    IdAllocator *allocator = aligned_alloc(64, sizeof(IdAllocator));
+    if (allocator == NULL)
+        return NULL;
+    memset(allocator, 0, sizeof(IdAllocator));
+
+    allocator->blockSize = blockSize;
+    allocator->prefetchOffset = (uint64_t)(prefetchAt * blockSize);
+    if (allocator->prefetchOffset >= blockSize)
+        allocator->prefetchOffset = blockSize - 1;
+
+    allocator->sfd = -1;
+    pthread_mutex_init(&allocator->lock, NULL);
+    pthread_cond_init(&allocator->fetchNeeded, NULL);
+    pthread_cond_init(&allocator->blockReady, NULL);
+
+    // the first block is leased right away, so a cluster which is not there shows up here
+    int status = -1, failovers = -1;
+    if (parseSequenceCluster(&allocator->cluster, nodes) == 0 && (failovers = leaseFromCluster(allocator, 1)) != -1)
+    {
+        writeSlot(allocator, 0, allocator->starts[0]);
+        allocator->ready = allocator->wanted = 1;
+        allocator->stats.blocks = allocator->stats.frames = 1;
+        allocator->stats.failovers = failovers;
+
+        status = pthread_create(&allocator->thread, NULL, fetchLoop, allocator);
+        if (status != 0)
+        {
+            errno = status;
+            status = -1;
+        }
+    }
+
+    if (status == -1)
+    {
+        int savedErrno = errno;
+        disconnect(allocator);
+        free(allocator);
+        errno = savedErrno;
+        return NULL;
+    }
+    return allocator;
+}
+
+void destroyIdAllocator(IdAllocator *allocator)
+{
+    pthread_mutex_lock(&allocator->lock);
+    allocator->stopping = 1;
+    pthread_cond_signal(&allocator->fetchNeeded);
+    pthread_mutex_unlock(&allocator->lock);
+
+    pthread_join(allocator->thread, NULL);
+
+    disconnect(allocator);
+    pthread_mutex_destroy(&allocator->lock);
+    pthread_cond_destroy(&allocator->fetchNeeded);
+    pthread_cond_destroy(&allocator->blockReady);
+    free(allocator);
+}
+
+void getIdAllocatorStats(IdAllocator *allocator, IdAllocatorStats *stats)
+{
+    pthread_mutex_lock(&allocator->lock);
+    *stats = allocator->stats;
+    pthread_mutex_unlock(&allocator->lock);
+}
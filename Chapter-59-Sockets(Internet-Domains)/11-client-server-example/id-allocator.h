@@ -0,0 +1,43 @@
+// client side id allocator on top of the sequence server
+// - ids are leased from the server in blocks of blockSize, allocateId hands them out with
+//   one atomic increment, any number of threads can share an allocator
+// - allocation n takes offset n % blockSize of block n / blockSize, published blocks sit in
+//   a small ring guarded by a sequence tag
+// - a background thread fetches the next block once prefetchAt (0 to 1) of the current one
+//   is used, so callers only wait for the network when they outrun it
+// - blocks needed together are asked for in one frame of the binary protocol
+// - the server can be a cluster (sequence-cluster.h): blocks come from the home node, a
+//   failed round trip is tried again on the next node before any caller sees an error
+// ids are unique but not dense: leases which are never used up are skipped
+
+#ifndef ID_ALLOCATOR_H
+#define ID_ALLOCATOR_H
+
+#include <stdint.h>
+
+typedef struct IdAllocator IdAllocator;
+
+typedef struct
+{
+    uint64_t blocks;    // leased from the server
+    uint64_t frames;    // round trips for them
+    uint64_t waits;     // allocations which found no block ready
+    uint64_t failures;  // fetches which no node answered
+    uint64_t failovers; // moves to the next node
+} IdAllocatorStats;
+
+// nodes is a node list of sequence-cluster.h, the first block is leased right away
+// returns NULL with errno set: EINVAL when the list is malformed or blockSize is 0 or above
+// SEQUENCE_MAX_RANGE, the error of the last node tried when no node granted the first block
+IdAllocator *createIdAllocator(const char *nodes, uint64_t blockSize, double prefetchAt);
+
+// stops the prefetch thread, no allocation may run any more
+void destroyIdAllocator(IdAllocator *allocator);
+
+// returns a new id (never 0), or 0 with errno set when no node granted the block:
+// ENOSPC when the nodes are out of numbers, EIO when they cannot store their counter
+uint64_t allocateId(IdAllocator *allocator);
+
+void getIdAllocatorStats(IdAllocator *allocator, IdAllocatorStats *stats);
+
+#endif
@@ -0,0 +1,117 @@
+#include "socket-library.h"
+#include "sequence-cluster.h"
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+
+// splits one "host:port" or "[address]:port" entry
+static int parseNode(SequenceNode *node, const char *entry, size_t len)
+{
+    const char *colon = NULL;
+    for (size_t i = 0; i < len; i++)
+        if (entry[i] == ':')
+            colon = entry + i;
+
+    if (colon == NULL || colon == entry || colon == entry + len - 1)
+        return -1;
+
+    const char *host = entry;
+    size_t hostLen = colon - entry;
+    if (host[0] == '[' && host[hostLen - 1] == ']' && hostLen > 2)
+    {
+        host++;
+        hostLen -= 2;
+    }
+
+    size_t portLen = entry + len - colon - 1;
+    if (hostLen >= sizeof(node->host) || portLen >= sizeof(node->port))
+        return -1;
+
+    memcpy(node->host, host, hostLen);
+    node->host[hostLen] = '\0';
+    memcpy(node->port, colon + 1, portLen);
+    node->port[portLen] = '\0';
+    return 0;
+}
+
+int parseSequenceCluster(SequenceCluster *cluster, const char *list)
+{
+    cluster->count = 0;
+
+    for (const char *entry = list; *entry != '\0';)
+    {
+        size_t len = strcspn(entry, ",");
+
+        if (cluster->count == MAX_SEQUENCE_NODES || parseNode(&cluster->nodes[cluster->count], entry, len) == -1)
+        {
+            errno = EINVAL;
+            return -1;
+        }
+        cluster->count++;
+
+        entry += len;
+        if (*entry == ',')
+            entry++;
+    }
+
+    if (cluster->count == 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // clients started together still pick different home nodes
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    cluster->current = (unsigned)(getpid() ^ ts.tv_nsec) % cluster->count;
+    return 0;
+}
+
+void nextSequenceNode(SequenceCluster *cluster)
+{
+    cluster->current = (cluster->current + 1) % cluster->count;
+}
+
+int connectSequenceNode(const SequenceNode *node)
+{
+    return createRacingConnection(AF_UNSPEC, SOCK_STREAM, node->host, node->port,
+                                  SEQUENCE_CONNECT_STAGGER_MS, SEQUENCE_CONNECT_TIMEOUT_MS, NULL);
+}
+
+int connectSequenceCluster(SequenceCluster *cluster)
+{
+    for (int tried = 0; tried < cluster->count; tried++)
+    {
+        int sfd = connectSequenceNode(&cluster->nodes[cluster->current]);
+        if (sfd != -1)
+            return sfd;
+        nextSequenceNode(cluster);
+    }
+    return -1;
+}
+
+static long long nowMs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+int waitForSequenceReply(int sfd, long long *deadline)
+{
+    if (*deadline == 0)
+        *deadline = nowMs() + SEQUENCE_REPLY_TIMEOUT_MS;
+
+    while (1)
+    {
+        long long left = *deadline - nowMs();
+        struct pollfd pfd = {.fd = sfd, .events = POLLIN};
+
+        int ready = left > 0 ? poll(&pfd, 1, (int)left) : 0;
+        if (ready == -1 && errno == EINTR)
+            continue;
+        if (ready == 0)
+            errno = ETIMEDOUT;
+        return ready > 0 ? 0 : -1;
+    }
+}
@@ -0,0 +1,53 @@
+// client side view of a sequence cluster
+// - a node list is "host:port,host:port,..." ("[address]:port" for ipv6), a single
+//   "host:port" is a cluster of one
+// - every node hands out its own partition of the numbers (server.c node/nodes), so any node
+//   can answer any request and the client does all the routing
+// - a client sticks to a home node picked at random, which spreads the clients over the
+//   cluster, and moves on to the next node when its node fails
+// - a node fails when it does not connect within SEQUENCE_CONNECT_TIMEOUT_MS or leaves a
+//   request unanswered for SEQUENCE_REPLY_TIMEOUT_MS, so a stopped or unreachable node
+//   cannot hang its clients
+
+#ifndef SEQUENCE_CLUSTER_H
+#define SEQUENCE_CLUSTER_H
+
+#define MAX_SEQUENCE_NODES 64
+
+#define SEQUENCE_CONNECT_TIMEOUT_MS 1000
+#define SEQUENCE_REPLY_TIMEOUT_MS 2000
+
+// between the connect attempts to the addresses of one node (connectRacing)
+#define SEQUENCE_CONNECT_STAGGER_MS 250
+
+typedef struct
+{
+    char host[256];
+    char port[32];
+} SequenceNode;
+
+typedef struct
+{
+    SequenceNode nodes[MAX_SEQUENCE_NODES];
+    int count;
+    int current; // node requests go to
+} SequenceCluster;
+
+// returns -1 (errno EINVAL) for a malformed list
+int parseSequenceCluster(SequenceCluster *cluster, const char *list);
+
+// the current node failed, requests go to the next one
+void nextSequenceNode(SequenceCluster *cluster);
+
+// connect to one node, returns the socket or -1 (errno ETIMEDOUT when it did not answer in time)
+int connectSequenceNode(const SequenceNode *node);
+
+// connect to the current node or, when it fails, to the ones after it
+// current is left at the node connected, returns the socket or -1 when no node answered
+int connectSequenceCluster(SequenceCluster *cluster);
+
+// wait until sfd is readable or the reply timeout passed since deadline was set (0 the first
+// time), returns -1 with errno ETIMEDOUT once the node took too long
+int waitForSequenceReply(int sfd, long long *deadline);
+
+#endif
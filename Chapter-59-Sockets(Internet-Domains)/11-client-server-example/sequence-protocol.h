@@ -0,0 +1,146 @@
+// binary protocol of the sequence server
+// - a frame is a uint32_t payload length and the payload (frame-reader.h FRAME_LENGTH_PREFIX),
+//   every integer is in network byte order
+// - payload: version, type and entry count (4 bytes), then fixed size entries
+// - a request frame carries up to SEQUENCE_MAX_ENTRIES ranges, its response frame answers
+//   them in the same order, the ids are picked by the client and sent back unchanged
+// - the first byte of a frame is the top byte of its length, always 0, a text request
+//   starts with a digit: the server tells the two protocols apart by it
+// the text protocol ("count\n" -> "start,end\n") stays for telnet and the load generator
+
+#ifndef SEQUENCE_PROTOCOL_H
+#define SEQUENCE_PROTOCOL_H
+
+#include <endian.h>
+#include <stdint.h>
+#include <string.h>
+
+#define SEQUENCE_PROTOCOL_VERSION 1
+#define SEQUENCE_MAX_ENTRIES 1024
+
+// largest range one request may ask for, larger counts are answered SEQUENCE_INVALID
+#define SEQUENCE_MAX_RANGE 1000000000000ull
+
+#define SEQUENCE_PREFIX_SIZE 4
+#define SEQUENCE_HEADER_SIZE 4
+#define SEQUENCE_REQUEST_SIZE 12  // id, count
+#define SEQUENCE_RESPONSE_SIZE 24 // id, status, start, count
+
+// largest payload of either direction
+#define SEQUENCE_MAX_PAYLOAD (SEQUENCE_HEADER_SIZE + SEQUENCE_MAX_ENTRIES * SEQUENCE_RESPONSE_SIZE)
+
+typedef enum
+{
+    SEQUENCE_FRAME_REQUEST = 1,
+    SEQUENCE_FRAME_RESPONSE = 2
+} SequenceFrameType;
+
+typedef enum
+{
+    SEQUENCE_OK,
+    SEQUENCE_INVALID,    // count is 0 or above the largest range
+    SEQUENCE_EXHAUSTED,  // the counter reached its limit
+    SEQUENCE_UNAVAILABLE // the high-water mark could not be made durable
+} SequenceStatus;
+
+typedef struct
+{
+    uint32_t id;
+    uint64_t count;
+} SequenceRequest;
+
+// start is the first number of the range, both are 0 unless status is SEQUENCE_OK
+typedef struct
+{
+    uint32_t id;
+    uint32_t status;
+    uint64_t start;
+    uint64_t count;
+} SequenceResponse;
+
+static inline char *putUint32(char *out, uint32_t value)
+{
+    value = htobe32(value);
+    memcpy(out, &value, sizeof(value));
+    return out + sizeof(value);
+}
+
+static inline char *putUint64(char *out, uint64_t value)
+{
+    value = htobe64(value);
+    memcpy(out, &value, sizeof(value));
+    return out + sizeof(value);
+}
+
+static inline const char *getUint32(const char *in, uint32_t *value)
+{
+    memcpy(value, in, sizeof(*value));
+    *value = be32toh(*value);
+    return in + sizeof(*value);
+}
+
+static inline const char *getUint64(const char *in, uint64_t *value)
+{
+    memcpy(value, in, sizeof(*value));
+    *value = be64toh(*value);
+    return in + sizeof(*value);
+}
+
+// bytes of a whole frame, prefix included
+static inline size_t sequenceFrameSize(int entries, size_t entrySize)
+{
+    return SEQUENCE_PREFIX_SIZE + SEQUENCE_HEADER_SIZE + entries * entrySize;
+}
+
+// length prefix and header, returns where the first entry goes
+static inline char *putSequenceHeader(char *out, SequenceFrameType type, int entries, size_t entrySize)
+{
+    out = putUint32(out, SEQUENCE_HEADER_SIZE + entries * entrySize);
+    out[0] = SEQUENCE_PROTOCOL_VERSION;
+    out[1] = type;
+    out[2] = entries >> 8;
+    out[3] = entries & 0xff;
+    return out + SEQUENCE_HEADER_SIZE;
+}
+
+// checks the header against the payload length, returns the entry count or -1
+static inline int getSequenceHeader(const char *payload, size_t len, SequenceFrameType type, size_t entrySize)
+{
+    if (len < SEQUENCE_HEADER_SIZE || payload[0] != SEQUENCE_PROTOCOL_VERSION || payload[1] != (char)type)
+        return -1;
+
+    int entries = (unsigned char)payload[2] << 8 | (unsigned char)payload[3];
+    if (entries > SEQUENCE_MAX_ENTRIES || len != SEQUENCE_HEADER_SIZE + entries * entrySize)
+        return -1;
+    return entries;
+}
+
+static inline char *putSequenceRequest(char *out, const SequenceRequest *request)
+{
+    out = putUint32(out, request->id);
+    return putUint64(out, request->count);
+}
+
+static inline const char *getSequenceRequest(const char *in, SequenceRequest *request)
+{
+    in = getUint32(in, &request->id);
+    return getUint64(in, &request->count);
+}
+
+static inline char *putSequenceResponse(char *out, const SequenceResponse *response)
+{
+    out = putUint32(out, response->id);
+    out = putUint32(out, response->status);
+    out = putUint64(out, response->start);
+    return putUint64(out, response->count);
+}
+
+static inline const char *getSequenceResponse(const char *in, SequenceResponse *response)
+{
+    in = getUint32(in, &response->id);
+    in = getUint32(in, &response->status);
+    in = getUint64(in, &response->start);
+    return getUint64(in, &response->count);
+}
+
+#endif
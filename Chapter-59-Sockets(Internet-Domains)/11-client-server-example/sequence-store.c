@@ -0,0 +1,255 @@
+#include "socket-library.h"
+#include "sequence-store.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#define STORE_MAGIC 0x3130514553ull // "SEQ01"
+
+// one slot per sector, a torn write can only damage the slot being written
+#define SLOT_SIZE 512
+#define SLOT_COUNT 2
+
+typedef struct
+{
+    uint64_t magic;
+    uint64_t generation; // grows with every write, the newest valid slot wins
+    uint64_t limit;
+    uint64_t checksum;
+} StoreSlot;
+
+static int storeFd = -1;
+static uint64_t leaseAhead;
+static uint64_t generation;
+
+// read without the lock by the fast path of sequenceStoreReserve
+static uint64_t durableLimit;
+
+static pthread_mutex_t storeLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t refillNeeded = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t limitMoved = PTHREAD_COND_INITIALIZER;
+
+// all under storeLock
+static uint64_t requestedEnd; // highest end a grant asked for
+static int failed;
+static uint64_t commits;
+static uint64_t waits;
+
+// fnv-1a over the fields before the checksum
+static uint64_t slotChecksum(const StoreSlot *slot)
+{
+    const unsigned char *bytes = (const unsigned char *)slot;
+    uint64_t hash = 0xcbf29ce484222325ull;
+
+    for (size_t i = 0; i < offsetof(StoreSlot, checksum); i++)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+// returns the limit of the newest valid slot, 0 when there is none
+static uint64_t readLimit(int fd)
+{
+    uint64_t limit = 0, newest = 0;
+
+    for (int i = 0; i < SLOT_COUNT; i++)
+    {
+        StoreSlot slot;
+        if (pread(fd, &slot, sizeof(slot), (off_t)i * SLOT_SIZE) != sizeof(slot))
+            continue;
+        if (slot.magic != STORE_MAGIC || slot.checksum != slotChecksum(&slot))
+            continue;
+
+        if (slot.generation >= newest)
+        {
+            newest = slot.generation;
+            limit = slot.limit;
+        }
+    }
+
+    generation = newest;
+    return limit;
+}
+
+// overwrites the older slot and waits for the disk
+static int writeLimit(uint64_t limit)
+{
+    StoreSlot slot;
+    memset(&slot, 0, sizeof(slot));
+    slot.magic = STORE_MAGIC;
+    slot.generation = ++generation;
+    slot.limit = limit;
+    slot.checksum = slotChecksum(&slot);
+
+    off_t offset = (off_t)(slot.generation % SLOT_COUNT) * SLOT_SIZE;
+    ssize_t written;
+    do
+        written = pwrite(storeFd, &slot, sizeof(slot), offset);
+    while (written == -1 && errno == EINTR);
+
+    if (written != sizeof(slot))
+    {
+        if (written >= 0)
+            errno = EIO;
+        return -1;
+    }
+
+    // the file size only changes on the first writes, data is all that has to be synced
+    return fdatasync(storeFd);
+}
+
+// a new file is durable only once its directory entry is
+static int syncDirectory(const char *path)
+{
+    char *copy = strdup(path);
+    if (copy == NULL)
+        return -1;
+
+    int dfd = open(dirname(copy), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    free(copy);
+    if (dfd == -1)
+        return -1;
+
+    int status = fsync(dfd);
+    close(dfd);
+    return status;
+}
+
+// the only writer of the file, grants wait for it on limitMoved
+static void *commitLoop(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&storeLock);
+
+    while (1)
+    {
+        // refill once less than half of the lease is left past the highest grant
+        while (requestedEnd + leaseAhead / 2 <= durableLimit)
+            pthread_cond_wait(&refillNeeded, &storeLock);
+
+        // every grant which asked so far is covered by this one write
+        uint64_t target = requestedEnd + leaseAhead;
+
+        pthread_mutex_unlock(&storeLock);
+        int status = writeLimit(target);
+        pthread_mutex_lock(&storeLock);
+
+        commits++;
+        if (status == -1)
+        {
+            perror("sequence store");
+            failed = 1;
+            pthread_cond_broadcast(&limitMoved);
+            break;
+        }
+
+        __atomic_store_n(&durableLimit, target, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&limitMoved);
+    }
+
+    pthread_mutex_unlock(&storeLock);
+    return NULL;
+}
+
+int openSequenceStore(const char *path, uint64_t lease, uint64_t floor, uint64_t *first)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1)
+        return -1;
+
+    // two servers on one file would hand out the same numbers
+    struct stat st;
+    if (flock(fd, LOCK_EX | LOCK_NB) == -1 || fstat(fd, &st) == -1)
+    {
+        int savedErrno = errno;
+        close(fd);
+        errno = savedErrno;
+        return -1;
+    }
+
+    // a new file starts the sequence at floor, an existing one must hold a valid slot
+    uint64_t limit = floor;
+    if (st.st_size > 0 && (limit = readLimit(fd)) == 0)
+    {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    if (limit < floor)
+        limit = floor;
+
+    storeFd = fd;
+    leaseAhead = lease > 0 ? lease : 1;
+
+    // nothing is handed out before the first lease is on disk
+    if (writeLimit(limit + leaseAhead) == -1 || (st.st_size == 0 && syncDirectory(path) == -1))
+    {
+        int savedErrno = errno;
+        close(fd);
+        storeFd = -1;
+        errno = savedErrno;
+        return -1;
+    }
+
+    durableLimit = limit + leaseAhead;
+    requestedEnd = limit;
+    *first = limit;
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    int status = pthread_create(&thread, &attr, commitLoop, NULL);
+    pthread_attr_destroy(&attr);
+
+    if (status != 0)
+    {
+        errno = status;
+        return -1;
+    }
+    return 0;
+}
+
+int sequenceStoreReserve(uint64_t end)
+{
+    // common case: well inside the lease, nothing to ask for
+    if (end + leaseAhead / 2 <= __atomic_load_n(&durableLimit, __ATOMIC_ACQUIRE))
+        return 0;
+
+    pthread_mutex_lock(&storeLock);
+
+    if (end > requestedEnd)
+        requestedEnd = end;
+    pthread_cond_signal(&refillNeeded);
+
+    // past the limit: the answer must wait until the commit covering it is done
+    int waited = 0;
+    while (!failed && durableLimit < end)
+    {
+        waited = 1;
+        pthread_cond_wait(&limitMoved, &storeLock);
+    }
+    waits += waited;
+
+    int status = end <= durableLimit ? 0 : -1;
+    pthread_mutex_unlock(&storeLock);
+
+    if (status == -1)
+        errno = EIO;
+    return status;
+}
+
+void getSequenceStoreStats(SequenceStoreStats *stats)
+{
+    pthread_mutex_lock(&storeLock);
+    stats->limit = durableLimit;
+    stats->commits = commits;
+    stats->waits = waits;
+    pthread_mutex_unlock(&storeLock);
+}
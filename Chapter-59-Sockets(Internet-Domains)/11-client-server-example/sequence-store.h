@@ -0,0 +1,37 @@
+// crash durable high-water mark of the sequence counter
+// - the file holds a limit: no number at or above it was ever handed out, a restart
+//   continues from it so ids are never repeated (the ones leased but unused are skipped)
+// - lease ahead: the limit is written leaseAhead numbers past what is needed, grants below
+//   it only compare two numbers and never touch the disk
+// - group commit: one background thread moves the limit, every grant waiting for it is
+//   released by the same pwrite + fdatasync
+// - the refill starts when half of the lease is used, so a grant waits only when the
+//   counter runs faster than the disk
+// - two checksummed slots in separate sectors are written in turn, a torn write leaves the
+//   older one intact
+
+#ifndef SEQUENCE_STORE_H
+#define SEQUENCE_STORE_H
+
+#include <stdint.h>
+
+typedef struct
+{
+    uint64_t limit;   // durable, every number below it may be handed out
+    uint64_t commits; // pwrite + fdatasync rounds
+    uint64_t waits;   // grants which had to wait for a commit
+} SequenceStoreStats;
+
+// read (or create) the state file, make the first lease durable and start the commit thread
+// *first is the number to continue from, never below floor (where a new file starts)
+// the file is locked, returns -1 with errno set (EINVAL for a damaged file, EWOULDBLOCK
+// when another process uses it)
+int openSequenceStore(const char *path, uint64_t leaseAhead, uint64_t floor, uint64_t *first);
+
+// returns once every number below end is durable, -1 when the disk failed
+// (the store stays failed: after a failed fdatasync nothing written can be trusted)
+int sequenceStoreReserve(uint64_t end);
+
+void getSequenceStoreStats(SequenceStoreStats *stats);
+
+#endif
@@ -1,134 +1,429 @@
-#include <stdio.h>
-#include <sys/socket.h>
-#include <arpa/inet.h>
-#include <unistd.h>
-#include <fcntl.h>
-#include <stdlib.h>
-#include <string.h>
-#include <math.h>
+// sequence number server
+// - a client asks for count numbers and gets a range of them, no two ranges ever overlap
+// - two protocols, told apart by the first byte of the connection:
+//   binary frames (sequence-protocol.h): many requests per frame, each with an id
+//   text lines: "count\n" answered by "start,end\n" (both included)
+// - connections are persistent, any number of requests can be sent without waiting for the
+//   answers (pipelining), answers come back in request order
+// - one SO_REUSEPORT listener and event loop per worker thread (the socket library of
+//   12-internet-domain-sockets-library), the counter is a single 64 bit atomic
+// - all requests of a frame (or of one read in text) are granted with one fetch_add and
+//   answered with one send, so the shared cache line is touched once per batch
+// - the high-water mark survives crashes and restarts (sequence-store.h): numbers are leased
+//   from the state file far ahead, so a grant only waits for the disk when the lease runs out
+// - cluster: node i of n only hands out numbers of the i-th of n equal partitions of the
+//   number space, the nodes never talk to each other (clients route, id-allocator.h)
+//   ./server 8000 0 epoll "" 0/3 & ./server 8001 0 epoll "" 1/3 & ./server 8002 0 epoll "" 2/3
+// usage: ./server [port] [workers] [pool|blocking|epoll|uring] [state file] [node/nodes]
+// the state file and metrics socket default to ./sequence-<port>.state and .sock
+
+#include "reuseport-server.h"
+#include "frame-reader.h"
+#include "sequence-protocol.h"
+#include "sequence-store.h"
+#include <inttypes.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/resource.h>
 
 #define PORT 8000
-#define MAX_CLIENTS 10
-#define BUFFER_SIZE 5
-#define RESPONSE_SIZE 15
 
-int extract_number(char *num, int len)
+// ranges are granted below this, so the counter can never wrap around
+#define SEQUENCE_LIMIT (1ull << 63)
+
+// a partition holds at least 2^51 numbers
+#define MAX_NODES 4096
+
+// requests granted together (a whole binary frame), their sum stays far below a partition
+#define GRANT_BATCH SEQUENCE_MAX_ENTRIES
+
+#define RESPONSE_BUFFER_SIZE 16384
+
+// longer numbers could overflow while they are parsed
+#define MAX_DIGITS 19
+
+// one of each per node, so several nodes can run in the same directory
+#define METRICS_SOCKET_FORMAT "./sequence-metrics-%d.sock"
+#define STATE_FILE_FORMAT "./sequence-%d.state"
+
+// numbers made durable ahead of the counter, a crash skips at most this many (plus a range)
+#define SEQUENCE_LEASE (1ull << 24)
+
+// fds kept free for listeners, epoll/io_uring, the spare fd, the state file and metrics
+#define RESERVED_FDS 64
+
+// clients accepted per wakeup of a loop
+#define ACCEPT_BATCH 64
+
+static AdmissionControl admission;
+
+// next number to hand out, alone on its cache line
+static _Alignas(64) _Atomic uint64_t nextSequence = 1;
+
+// numbers of this node: [partitionStart, partitionEnd)
+static uint64_t partitionStart = 1;
+static uint64_t partitionEnd = SEQUENCE_LIMIT;
+
+typedef enum
 {
-    int extracted_num = 0;
-    int place_value = 1;
-    printf("len: %d\n", len);
+    PROTOCOL_UNKNOWN, // nothing received yet
+    PROTOCOL_TEXT,
+    PROTOCOL_BINARY
+} Protocol;
 
-    for (int i = len - 1; i >= 0; i--)
+typedef struct
+{
+    Connection *conn;
+    Protocol protocol;
+
+    // text: the request line being parsed, it can be split over reads
+    uint64_t value;
+    int digits;
+    int invalid;
+
+    // binary: frames split over reads are put together here
+    FrameReader reader;
+} SequenceClient;
+
+// requests of one read or frame, 0 marks an invalid one
+typedef struct
+{
+    uint64_t counts[GRANT_BATCH];
+    uint32_t ids[GRANT_BATCH]; // binary requests only
+    int count;
+} GrantBatch;
+
+static int formatNumber(char *out, uint64_t value)
+{
+    char digits[20];
+    int len = 0;
+
+    do
     {
-        int digit = (int)(num[i] - '0');
-        printf("digit: %d\n", digit);
-        extracted_num = (int)(digit * place_value + extracted_num);
-        printf("extracted num: %d \n", extracted_num);
-        place_value *= 10;
-    }
-    return extracted_num;
+        digits[len++] = '0' + value % 10;
+        value /= 10;
+    } while (value > 0);
+
+    for (int i = 0; i < len; i++)
+        out[i] = digits[len - 1 - i];
+    return len;
 }
 
-int convert_to_string(int start, int end, char *str, int max_size)
+// one atomic add for the whole batch, the ranges are cut from *start in order
+// returns SEQUENCE_OK or why nothing was granted
+static SequenceStatus grantBatch(const GrantBatch *batch, uint64_t *start)
 {
-    return snprintf(str, max_size, "%d,%d", start, end);
+    uint64_t total = 0;
+    for (int i = 0; i < batch->count; i++)
+        total += batch->counts[i];
+
+    *start = 0;
+    if (total == 0)
+        return SEQUENCE_OK;
+    if (atomic_load_explicit(&nextSequence, memory_order_relaxed) >= partitionEnd)
+        return SEQUENCE_EXHAUSTED;
+
+    // a batch reaching into the next partition is refused as a whole
+    *start = atomic_fetch_add_explicit(&nextSequence, total, memory_order_relaxed);
+    if (*start >= partitionEnd || partitionEnd - *start < total)
+        return SEQUENCE_EXHAUSTED;
+
+    // no range is answered before it is below the durable limit, this blocks the
+    // event loop only when the lease ran out
+    if (sequenceStoreReserve(*start + total) == -1)
+        return SEQUENCE_UNAVAILABLE;
+    return SEQUENCE_OK;
 }
 
-int main(int argc, char const *argv[])
+// grant every valid request of the batch and queue the answer lines in request order
+static void answerText(Connection *conn, GrantBatch *batch)
 {
-    int sfd;
-    int counter = 0;
-    char buffer[BUFFER_SIZE + 1];
-    char response[RESPONSE_SIZE];
-    ssize_t bytes_received, bytes_sent;
-    struct sockaddr_in server_addr;
-    socklen_t addr_len = sizeof(struct sockaddr_in);
-
-    memset(&server_addr, 0, addr_len);
+    static const char *const refusals[] = {
+        [SEQUENCE_INVALID] = "error invalid range\n",
+        [SEQUENCE_EXHAUSTED] = "error sequence exhausted\n",
+        [SEQUENCE_UNAVAILABLE] = "error sequence unavailable\n",
+    };
+    char buffer[RESPONSE_BUFFER_SIZE];
+    size_t len = 0;
 
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(PORT);
-    server_addr.sin_addr.s_addr = INADDR_ANY; // localhost
+    uint64_t start;
+    SequenceStatus granted = grantBatch(batch, &start);
 
-    if ((sfd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+    for (int i = 0; i < batch->count; i++)
     {
-        perror("socket");
-        return 1;
-    }
+        // the longest answer is two 20 digit numbers
+        if (len + 48 > sizeof(buffer))
+        {
+            connectionSend(conn, buffer, len);
+            len = 0;
+        }
 
-    if (bind(sfd, (struct sockaddr *)&server_addr, addr_len) == -1)
-    {
-        perror("bind");
-        close(sfd);
-        return 1;
+        uint64_t count = batch->counts[i];
+        SequenceStatus status = count == 0 ? SEQUENCE_INVALID : granted;
+        if (status != SEQUENCE_OK)
+        {
+            size_t refusalLen = strlen(refusals[status]);
+            memcpy(buffer + len, refusals[status], refusalLen);
+            len += refusalLen;
+        }
+        else
+        {
+            len += formatNumber(buffer + len, start);
+            buffer[len++] = ',';
+            len += formatNumber(buffer + len, start + count - 1);
+            buffer[len++] = '\n';
+            start += count;
+        }
     }
 
-    if (listen(sfd, MAX_CLIENTS) == -1)
-    {
-        perror("listen");
-        close(sfd);
-        return 1;
-    }
+    if (len > 0)
+        connectionSend(conn, buffer, len);
+    batch->count = 0;
+}
 
-    while (1)
-    {
+// same for a binary frame, answered by one response frame
+static void answerBinary(Connection *conn, const GrantBatch *batch)
+{
+    char buffer[sequenceFrameSize(GRANT_BATCH, SEQUENCE_RESPONSE_SIZE)];
+    char *out = putSequenceHeader(buffer, SEQUENCE_FRAME_RESPONSE, batch->count, SEQUENCE_RESPONSE_SIZE);
 
-        int cfd = accept(sfd, NULL, NULL);
+    uint64_t start;
+    SequenceStatus granted = grantBatch(batch, &start);
 
-        if ((bytes_received = recv(cfd, buffer, BUFFER_SIZE, 0)) == -1)
+    for (int i = 0; i < batch->count; i++)
+    {
+        SequenceResponse response = {.id = batch->ids[i]};
+        response.status = batch->counts[i] == 0 ? SEQUENCE_INVALID : granted;
+
+        if (response.status == SEQUENCE_OK)
         {
-            perror("recv");
-            close(sfd);
-            return 1;
+            response.start = start;
+            response.count = batch->counts[i];
+            start += batch->counts[i];
         }
-        buffer[bytes_received] = '\0';
+        out = putSequenceResponse(out, &response);
+    }
 
-        printf("received buffer %s\n", buffer);
+    connectionSend(conn, buffer, out - buffer);
+}
 
-        // extract the given range string as number
-        int range = extract_number(buffer, bytes_received);
+static int onSequenceFrame(void *userData, const char *frame, size_t len)
+{
+    SequenceClient *client = userData;
+    GrantBatch batch;
 
-        printf("received range %d\n", range);
+    batch.count = getSequenceHeader(frame, len, SEQUENCE_FRAME_REQUEST, SEQUENCE_REQUEST_SIZE);
+    if (batch.count == -1)
+        return -1;
 
-        // when requested amount of numbers are beyond limit then exit
-        if (range > 10)
-        {
-            printf("large range %d is not allowed\n", range);
-            close(sfd);
-            return 1;
-        }
+    const char *in = frame + SEQUENCE_HEADER_SIZE;
+    for (int i = 0; i < batch.count; i++)
+    {
+        SequenceRequest request;
+        in = getSequenceRequest(in, &request);
 
-        int start = counter + 1;
-        int end = counter + range;
-        counter += range;
+        batch.ids[i] = request.id;
+        batch.counts[i] = request.count <= SEQUENCE_MAX_RANGE ? request.count : 0;
+    }
 
-        printf("unique sequence: [%d,%d]\n", start, end);
+    answerBinary(client->conn, &batch);
+    return 0;
+}
+
+static void onSequenceOpen(Connection *conn)
+{
+    SequenceClient *client = calloc(1, sizeof(SequenceClient));
+    conn->state = client;
 
-        // create a string using start and end
-        int response_bytes = 0;
+    if (client == NULL)
+        connectionClose(conn);
+    else
+        client->conn = conn;
+}
 
-        if (range > 0)
+static void onSequenceClose(Connection *conn)
+{
+    SequenceClient *client = conn->state;
+
+    if (client != NULL && client->protocol == PROTOCOL_BINARY)
+        freeFrameReader(&client->reader);
+    free(client);
+    conn->state = NULL;
+}
+
+// digits are parsed straight from the received bytes, nothing is copied
+static void parseText(SequenceClient *client, const char *data, size_t len)
+{
+    GrantBatch batch;
+    batch.count = 0;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        char c = data[i];
+
+        if (c >= '0' && c <= '9')
         {
-            response_bytes = convert_to_string(start, end, response, RESPONSE_SIZE);
+            if (++client->digits > MAX_DIGITS)
+                client->invalid = 1;
+            else
+                client->value = client->value * 10 + (c - '0');
+            continue;
         }
-        else
+
+        // telnet and friends end their lines with \r\n
+        if (c == '\r')
+            continue;
+
+        if (c != '\n')
         {
-            strcpy(response, "");
+            client->invalid = 1;
+            continue;
         }
 
-        printf("actual response size: %d\n", response_bytes);
+        int valid = !client->invalid && client->digits > 0 && client->value > 0 && client->value <= SEQUENCE_MAX_RANGE;
+        batch.counts[batch.count++] = valid ? client->value : 0;
+        client->value = 0;
+        client->digits = 0;
+        client->invalid = 0;
+
+        if (batch.count == GRANT_BATCH)
+            answerText(client->conn, &batch);
+    }
 
-        // sending the unique sequence range
-        if ((bytes_sent = send(cfd, response, response_bytes, 0)) == -1)
+    if (batch.count > 0)
+        answerText(client->conn, &batch);
+}
+
+static void onSequenceData(Connection *conn, const char *data, size_t len)
+{
+    SequenceClient *client = conn->state;
+
+    if (client == NULL || len == 0)
+        return;
+
+    // a binary frame starts with the top byte of its length, which is always 0
+    if (client->protocol == PROTOCOL_UNKNOWN)
+    {
+        client->protocol = data[0] == 0 ? PROTOCOL_BINARY : PROTOCOL_TEXT;
+
+        if (client->protocol == PROTOCOL_BINARY &&
+            initFrameReader(&client->reader, FRAME_LENGTH_PREFIX, NULL, SEQUENCE_MAX_PAYLOAD, onSequenceFrame, client) == -1)
         {
-            perror("send");
-            close(sfd);
-            return 1;
+            client->protocol = PROTOCOL_UNKNOWN;
+            connectionClose(conn);
+            return;
         }
+    }
 
-        printf("%d bytes sent\n", (int)bytes_sent);
+    if (client->protocol == PROTOCOL_TEXT)
+        parseText(client, data, len);
+    // a malformed frame leaves nothing to resynchronise on
+    else if (frameReaderFeed(&client->reader, data, len) == -1)
+        connectionClose(conn);
+}
+
+// raise the open files limit so that the loops can hold thousands of clients, returns the limit
+static size_t raiseFileLimit(void)
+{
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == -1)
+        return 0;
+
+    if (limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+        getrlimit(RLIMIT_NOFILE, &limit);
     }
-    close(sfd);
+    return limit.rlim_cur;
+}
+
+// admit as many clients as the fd limit allows, the ones above are turned away instead of
+// failing inside the backends (and a full fd table is shed instead of spinning)
+static void startAdmissionControl(void)
+{
+    size_t fileLimit = raiseFileLimit();
+    size_t maxConnections = fileLimit > 2 * RESERVED_FDS ? fileLimit - RESERVED_FDS : fileLimit / 2;
+
+    if (initAdmissionControl(&admission, maxConnections, ACCEPT_BATCH) == -1)
+        fatal("initAdmissionControl");
+    useAdmissionControl(&admission);
+}
+
+static void writeSequenceMetrics(FILE *out, void *arg)
+{
+    (void)arg;
+    SequenceStoreStats stats;
+    getSequenceStoreStats(&stats);
+
+    fprintf(out, "sequence_partition_start %" PRIu64 "\n", partitionStart);
+    fprintf(out, "sequence_partition_end %" PRIu64 "\n", partitionEnd);
+    fprintf(out, "sequence_next %" PRIu64 "\n", (uint64_t)atomic_load(&nextSequence));
+    fprintf(out, "sequence_durable_limit %" PRIu64 "\n", stats.limit);
+    fprintf(out, "sequence_commits %" PRIu64 "\n", stats.commits);
+    fprintf(out, "sequence_commit_waits %" PRIu64 "\n", stats.waits);
+}
+
+int main(int argc, char const *argv[])
+{
+    int port = argc > 1 ? atoi(argv[1]) : PORT;
+    int workers = argc > 2 ? atoi(argv[2]) : 0;
+    int backend = argc > 3 ? parseServerBackend(argv[3]) : BACKEND_EPOLL;
+    int node = 0, nodes = 1;
+
+    if (port <= 0 || backend == -1 ||
+        (argc > 5 && (sscanf(argv[5], "%d/%d", &node, &nodes) != 2 || nodes < 1 || nodes > MAX_NODES || node < 0 || node >= nodes)))
+        exitWithMessage("usage: ./server [port] [workers] [pool|blocking|epoll|uring] [state file] [node/nodes]\n");
+
+    char stateFile[PATH_MAX], metricsSocket[PATH_MAX];
+    if (argc > 4 && argv[4][0] != '\0')
+        snprintf(stateFile, sizeof(stateFile), "%s", argv[4]);
+    else
+        snprintf(stateFile, sizeof(stateFile), STATE_FILE_FORMAT, port);
+    snprintf(metricsSocket, sizeof(metricsSocket), METRICS_SOCKET_FORMAT, port);
+
+    // 0 is never handed out, the id allocator uses it for errors
+    uint64_t partitionSize = SEQUENCE_LIMIT / nodes;
+    partitionStart = node == 0 ? 1 : node * partitionSize;
+    partitionEnd = (node + 1) * partitionSize;
+
+    // continue after every number a previous run may have handed out
+    uint64_t first;
+    if (openSequenceStore(stateFile, SEQUENCE_LEASE, partitionStart, &first) == -1)
+        fatal("openSequenceStore");
+    if (first >= partitionEnd)
+        exitWithMessage("the state file is past the partition of this node\n");
+    atomic_store(&nextSequence, first);
+
+    // every answer is a few bytes which the client waits for
+    static const SocketTuning tuning = {.profile = TUNING_LOW_LATENCY};
+    useSocketTuning(&tuning);
+    startAdmissionControl();
+
+    addMetricsSource(writeSequenceMetrics, NULL);
+    if (startMetricsServer(metricsSocket) == -1)
+        perror("startMetricsServer");
+
+    static const StreamHandlers handlers = {
+        .onOpen = onSequenceOpen,
+        .onData = onSequenceData,
+        .onClose = onSequenceClose,
+    };
+
+    ReusePortConfig config = {
+        .domain = AF_INET,
+        .port = port,
+        .ip = "0.0.0.0",
+        .backlog = SOMAXCONN,
+        .workers = workers,
+        .backend = backend,
+    };
+
+    printf("sequence server %d/%d on port %d, continuing from %" PRIu64 " (partition ends at %" PRIu64 ")\n",
+           node, nodes, port, first, partitionEnd);
 
+    if (runReusePortServer(&config, &handlers, NULL) == -1)
+        fatal("runReusePortServer");
     return 0;
 }
@@ -0,0 +1,112 @@
+// hit latency of the response cache with every thread looking up the same key set
+// - the cache is filled first, so every lookup is a hit: shard lock, lru move, reference
+// - with one shard every thread fights for one lock, the default sharding spreads them
+// usage: ./cache-benchmark [threads] [lookups per thread] [keys]
+
+#include "utils/response-cache.h"
+#include "utils/socket-library.h"
+#include <pthread.h>
+#include <time.h>
+
+#define DEFAULT_LOOKUPS 1000000
+#define DEFAULT_KEYS 10000
+#define BODY_SIZE 1024
+
+typedef struct
+{
+    ResponseCache *cache;
+    long lookups;
+    int keys;
+    unsigned int seed;
+    long failed;
+} Worker;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static CacheEntry *fillEntry(void *arg)
+{
+    static const char body[BODY_SIZE];
+    const char *key = arg;
+    return createCacheEntry(key, strlen(key), 200, "", 0, body, sizeof(body), 3600 * 1000);
+}
+
+static void *lookup(void *arg)
+{
+    Worker *worker = arg;
+    char key[32];
+
+    for (long i = 0; i < worker->lookups; i++)
+    {
+        int keyLen = snprintf(key, sizeof(key), "/object/%d", rand_r(&worker->seed) % worker->keys);
+
+        CacheResult result;
+        CacheEntry *entry = cacheGet(worker->cache, key, keyLen, fillEntry, key, &result);
+        if (entry == NULL || result != CACHE_HIT)
+            worker->failed++;
+        cacheRelease(entry);
+    }
+    return NULL;
+}
+
+static void run(int threads, long lookups, int keys, int shards)
+{
+    ResponseCache *cache = createResponseCache((size_t)keys * (BODY_SIZE + 512), shards);
+    if (cache == NULL)
+        fatal("createResponseCache");
+
+    char key[32];
+    for (int i = 0; i < keys; i++)
+    {
+        CacheResult result;
+        snprintf(key, sizeof(key), "/object/%d", i);
+        cacheRelease(cacheGet(cache, key, strlen(key), fillEntry, key, &result));
+    }
+
+    Worker *workers = calloc(threads, sizeof(Worker));
+    pthread_t *ids = calloc(threads, sizeof(pthread_t));
+    if (workers == NULL || ids == NULL)
+        fatal("calloc");
+
+    double start = now();
+    for (int i = 0; i < threads; i++)
+    {
+        workers[i] = (Worker){.cache = cache, .lookups = lookups, .keys = keys, .seed = i + 1};
+        if (pthread_create(&ids[i], NULL, lookup, &workers[i]) != 0)
+            fatal("pthread_create");
+    }
+
+    long failed = 0;
+    for (int i = 0; i < threads; i++)
+    {
+        pthread_join(ids[i], NULL);
+        failed += workers[i].failed;
+    }
+    double seconds = now() - start;
+
+    double total = (double)threads * lookups;
+    printf("%3d threads %5s shards  %8.1f ns per hit  %7.2f M hits/s  (%ld not hits)\n",
+           threads, shards == 1 ? "1" : "auto", seconds * 1e9 * threads / total, total / seconds / 1e6, failed);
+
+    free(ids);
+    free(workers);
+    destroyResponseCache(cache);
+}
+
+int main(int argc, char const *argv[])
+{
+    int threads = argc > 1 ? atoi(argv[1]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    long lookups = argc > 2 ? atol(argv[2]) : DEFAULT_LOOKUPS;
+    int keys = argc > 3 ? atoi(argv[3]) : DEFAULT_KEYS;
+
+    if (threads <= 0 || lookups <= 0 || keys <= 0)
+        exitWithMessage("usage: ./cache-benchmark [threads] [lookups per thread] [keys]\n");
+
+    run(threads, lookups, keys, 1);
+    run(threads, lookups, keys, 0);
+    return 0;
+}
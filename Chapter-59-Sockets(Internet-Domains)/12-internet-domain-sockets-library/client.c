@@ -1,24 +1,52 @@
-#include "utils/socket-library.h"
+#include "utils/connection-pool.h"
 
 #define BUFFER_SIZE 1024
 
+// usage: ./client [host] [service] [requests]
+// every request reuses the kept alive connection of the previous one
 int main(int argc, char const *argv[])
 {
     char buffer[BUFFER_SIZE];
-    struct sockaddr_in addr;
+    const char *host = argc > 1 ? argv[1] : "google.com";
+    const char *service = argc > 2 ? argv[2] : "http";
+    int requests = argc > 3 ? atoi(argv[3]) : 1;
 
-    int cfd = createConnection(AF_INET, SOCK_STREAM, "google.com", "http", (struct sockaddr_storage *)&addr);
+    // new connections of the pool resolve the host once per minute at most
+    ResolverCache *resolver = createResolverCache(60000, 5000, 30000);
+    if (resolver == NULL)
+        fatal("createResolverCache");
+    useResolverCache(resolver);
 
-    sendMessage(cfd, 0, "GET / HTTP/1.1\r\nHost: www.google.com\r\nConnection: close\r\n\r\n");
+    ConnectionPool *pool = createConnectionPool(4, 30000);
+    if (pool == NULL)
+        fatal("createConnectionPool");
 
-    printf("sent request to google.com\n");
+    for (int i = 0; i < requests; i++)
+    {
+        PooledConnection *conn = poolAcquire(pool, AF_INET, SOCK_STREAM, host, service);
+        if (conn == NULL)
+            fatal("poolAcquire");
 
-    // ssize_t receivedBytes = recvMessage(cfd, 0, buffer, BUFFER_SIZE);
-    recvAllData(cfd, buffer, BUFFER_SIZE, 0);
+        sendMessage(conn->fd, MSG_NOSIGNAL, "GET / HTTP/1.1\r\nHost: %s\r\nConnection: keep-alive\r\n\r\n", host);
 
-    printf("received data from google.com\n");
+        printf("sent request to %s (%s connection)\n", host, conn->reused ? "reused" : "new");
 
-    printf("received data: %s\n", buffer);
+        ssize_t receivedBytes = recvMessage(conn->fd, 0, buffer, BUFFER_SIZE);
 
+        printf("received data from %s\n", host);
+
+        printf("received data: %s\n", receivedBytes > 0 ? buffer : "");
+
+        // a response left partly unread is caught by the liveness check on the next checkout
+        poolRelease(pool, conn, receivedBytes > 0);
+    }
+
+    PoolStats stats;
+    poolGetStats(pool, &stats);
+    printf("connections opened: %zu, reused: %zu\n", stats.connected, stats.reused);
+
+    destroyConnectionPool(pool);
+    useResolverCache(NULL);
+    destroyResolverCache(resolver);
     return 0;
 }
@@ -0,0 +1,691 @@
+// load generator for the servers of the library
+// - protocols: echo (the payload comes back unchanged), http (GET, POST when a payload size
+//   is given) and sequence ("count\n" answered by a "start,end\n" line)
+// - every thread drives its share of the connections from one epoll loop, each connection
+//   keeps up to depth requests in flight (pipelining)
+// - closed loop (default): a connection sends its next request once a response arrived,
+//   latency runs from the actual send
+// - open loop (-r): requests are due at a constant rate whatever the server does, latency
+//   runs from the time a request was due, so a stalled server shows up in the percentiles
+//   instead of silently slowing the generator down (coordinated omission)
+// - latencies go to a log-linear histogram per thread, merged at the end
+// usage: ./load-generator [-p echo|http|sequence] [-c connections] [-t threads] [-d depth]
+//                         [-s payload size] [-r requests per second] [-D seconds]
+//                         [-w warmup seconds] [-u http path] [host] [port]
+
+#include "utils/socket-library.h"
+#include "utils/http-parser.h"
+#include "utils/latency-histogram.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <time.h>
+
+#define READ_BUFFER_SIZE 65536
+
+// upper bound of the pipelined copies of a request kept ready for one send
+#define MAX_BATCH_BYTES (1 << 20)
+
+#define MAX_EVENTS 256
+
+// pause between attempts to replace a broken connection
+#define RECONNECT_DELAY_MS 10
+
+typedef enum
+{
+    PROTOCOL_ECHO,
+    PROTOCOL_HTTP,
+    PROTOCOL_SEQUENCE
+} Protocol;
+
+typedef struct
+{
+    Protocol protocol;
+    const char *host;
+    const char *port;
+    const char *path;
+    int connections;
+    int threads;
+    int depth;
+    size_t size;
+    double rate; // requests per second over all connections, 0 for closed loop
+    double seconds;
+    double warmupSeconds;
+} LoadConfig;
+
+typedef struct
+{
+    int fd;
+    int waitingOutput; // EPOLLOUT is registered
+
+    // all requests are the same bytes, so only the amount still to write is kept
+    size_t unsentBytes;
+    size_t sendOffset; // position inside the request
+
+    uint64_t issued;    // requests handed to the output
+    uint64_t completed; // responses received
+
+    // closed loop: send times of the requests in flight, indexed by request number % depth
+    uint64_t *sentAt;
+
+    // open loop: request k is due at firstDue + k * interval
+    uint64_t firstDue;
+    uint64_t interval;
+
+    size_t echoReceived;  // bytes of the current echo response
+    char *input;          // http responses not complete yet
+    size_t inputLen;
+    size_t inputCapacity;
+    HttpParser parser;
+} LoadConnection;
+
+typedef struct
+{
+    const LoadConfig *config;
+    LoadConnection *conns;
+    int connCount;
+    int firstConn; // global number of the first connection, spreads the open loop schedule
+
+    const char *batch; // depth copies of the request
+    size_t batchLen;
+    size_t requestLen;
+
+    uint64_t measureStart;
+    uint64_t end;
+    int broken; // connections waiting for a new socket
+
+    // measured window only
+    LatencyHistogram histogram;
+    uint64_t requests;
+    uint64_t errors;
+    uint64_t bytesIn;
+    uint64_t bytesOut;
+    uint64_t reconnects;
+    uint64_t missed; // open loop requests which were due but never answered
+} LoadThread;
+
+static uint64_t nowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// one request in wire format
+static char *buildRequest(const LoadConfig *config, size_t *len)
+{
+    char *request = NULL;
+    FILE *stream = open_memstream(&request, len);
+    if (stream == NULL)
+        return NULL;
+
+    switch (config->protocol)
+    {
+    case PROTOCOL_ECHO:
+        for (size_t i = 0; i < config->size; i++)
+            fputc('a' + i % 26, stream);
+        break;
+
+    case PROTOCOL_SEQUENCE:
+        fprintf(stream, "%zu\n", config->size);
+        break;
+
+    case PROTOCOL_HTTP:
+        if (config->size == 0)
+        {
+            fprintf(stream, "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n", config->path, config->host);
+            break;
+        }
+
+        fprintf(stream, "POST %s HTTP/1.1\r\nHost: %s\r\nContent-Type: application/octet-stream\r\nContent-Length: %zu\r\n\r\n",
+                config->path, config->host, config->size);
+        for (size_t i = 0; i < config->size; i++)
+            fputc('a' + i % 26, stream);
+        break;
+    }
+
+    fclose(stream);
+    return request;
+}
+
+static int openLoadConnection(LoadThread *thread, LoadConnection *c, int epfd)
+{
+    c->fd = openConnection(AF_UNSPEC, SOCK_STREAM, thread->config->host, thread->config->port, NULL);
+    if (c->fd == -1)
+        return -1;
+
+    if (setNonBlocking(c->fd) == -1)
+    {
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = c};
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &event) == -1)
+    {
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+
+    c->waitingOutput = 0;
+    return 0;
+}
+
+// the requests in flight are lost, they count as errors and the numbering moves past them
+// the connection gets a new socket with its next pump
+static void resetLoadConnection(LoadThread *thread, LoadConnection *c, uint64_t now)
+{
+    close(c->fd);
+    c->fd = -1;
+    thread->broken++;
+
+    if (now >= thread->measureStart)
+    {
+        thread->errors += c->issued - c->completed;
+        thread->reconnects++;
+    }
+
+    c->completed = c->issued;
+    c->unsentBytes = 0;
+    c->sendOffset = 0;
+    c->echoReceived = 0;
+    c->inputLen = 0;
+    freeHttpParser(&c->parser);
+    initHttpParser(&c->parser, 0, 0);
+}
+
+// start time of the next response to arrive
+static uint64_t requestStart(const LoadThread *thread, const LoadConnection *c)
+{
+    if (thread->config->rate > 0)
+        return c->firstDue + c->completed * c->interval;
+    return c->sentAt[c->completed % thread->config->depth];
+}
+
+static void completeRequest(LoadThread *thread, LoadConnection *c, uint64_t now, int failed)
+{
+    uint64_t start = requestStart(thread, c);
+    c->completed++;
+
+    // throughput counts every response of the window, latency only the requests which also
+    // started in it (an overloaded open loop answers the warmup backlog for a while)
+    if (now < thread->measureStart || now > thread->end)
+        return;
+
+    if (failed)
+        thread->errors++;
+    thread->requests++;
+    if (start >= thread->measureStart)
+        histogramRecord(&thread->histogram, now - start);
+}
+
+// returns -1 when the stream is broken
+static int handleInput(LoadThread *thread, LoadConnection *c, const char *data, size_t len, uint64_t now)
+{
+    const LoadConfig *config = thread->config;
+
+    switch (config->protocol)
+    {
+    case PROTOCOL_ECHO:
+        c->echoReceived += len;
+        while (c->echoReceived >= config->size && c->completed < c->issued)
+        {
+            c->echoReceived -= config->size;
+            completeRequest(thread, c, now, 0);
+        }
+        return c->echoReceived > 0 && c->completed == c->issued ? -1 : 0;
+
+    case PROTOCOL_SEQUENCE:
+        for (const char *p = data; (p = memchr(p, '\n', data + len - p)) != NULL; p++)
+        {
+            if (c->completed == c->issued)
+                return -1;
+            completeRequest(thread, c, now, 0);
+        }
+        return 0;
+
+    case PROTOCOL_HTTP:
+        if (c->inputLen + len > c->inputCapacity)
+        {
+            size_t capacity = c->inputCapacity > 0 ? c->inputCapacity : READ_BUFFER_SIZE;
+            while (capacity < c->inputLen + len)
+                capacity *= 2;
+
+            char *input = realloc(c->input, capacity);
+            if (input == NULL)
+                return -1;
+            c->input = input;
+            c->inputCapacity = capacity;
+        }
+        memcpy(c->input + c->inputLen, data, len);
+        c->inputLen += len;
+
+        size_t offset = 0;
+        while (offset < c->inputLen)
+        {
+            ssize_t parsed = httpParseResponse(&c->parser, c->input + offset, c->inputLen - offset, 0, 0);
+            if (parsed == 0)
+                break;
+            if (parsed == -1 || c->completed == c->issued)
+                return -1;
+
+            int status = c->parser.response.status;
+            completeRequest(thread, c, now, status < 200 || status >= 400);
+            offset += parsed;
+        }
+
+        memmove(c->input, c->input + offset, c->inputLen - offset);
+        c->inputLen -= offset;
+        return 0;
+    }
+    return -1;
+}
+
+// returns -1 when the connection failed
+static int readResponses(LoadThread *thread, LoadConnection *c, char *buffer, uint64_t now)
+{
+    while (1)
+    {
+        ssize_t received = recv(c->fd, buffer, READ_BUFFER_SIZE, 0);
+        if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (received == -1 && errno == EINTR)
+            continue;
+        if (received <= 0)
+            return -1;
+
+        if (now >= thread->measureStart)
+            thread->bytesIn += received;
+
+        if (handleInput(thread, c, buffer, received, now) == -1)
+            return -1;
+
+        if (received < READ_BUFFER_SIZE)
+            return 0;
+    }
+}
+
+// hand the requests which may go out now to the output
+static void issueRequests(LoadThread *thread, LoadConnection *c, uint64_t now)
+{
+    const LoadConfig *config = thread->config;
+    uint64_t limit = c->completed + config->depth;
+
+    if (config->rate > 0)
+    {
+        // every request due by now, as far as the depth allows
+        uint64_t due = now >= c->firstDue ? (now - c->firstDue) / c->interval + 1 : 0;
+        if (due < limit)
+            limit = due;
+    }
+
+    while (c->issued < limit)
+    {
+        if (config->rate == 0)
+            c->sentAt[c->issued % config->depth] = now;
+        c->issued++;
+        c->unsentBytes += thread->requestLen;
+    }
+}
+
+// returns -1 when the connection failed
+static int flushRequests(LoadThread *thread, LoadConnection *c, uint64_t now, int epfd)
+{
+    while (c->unsentBytes > 0)
+    {
+        size_t len = thread->batchLen - c->sendOffset;
+        if (len > c->unsentBytes)
+            len = c->unsentBytes;
+
+        ssize_t sent = send(c->fd, thread->batch + c->sendOffset, len, MSG_NOSIGNAL);
+        if (sent == -1 && errno == EINTR)
+            continue;
+        if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (sent == -1)
+            return -1;
+
+        if (now >= thread->measureStart)
+            thread->bytesOut += sent;
+        c->unsentBytes -= sent;
+        c->sendOffset = (c->sendOffset + sent) % thread->requestLen;
+    }
+
+    // wait for room only while something is left
+    int wantOutput = c->unsentBytes > 0;
+    if (wantOutput != c->waitingOutput)
+    {
+        struct epoll_event event = {.events = EPOLLIN | (wantOutput ? EPOLLOUT : 0), .data.ptr = c};
+        if (epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &event) == -1)
+            return -1;
+        c->waitingOutput = wantOutput;
+    }
+    return 0;
+}
+
+// issue, send and mark a broken connection for a new one
+static void pumpConnection(LoadThread *thread, LoadConnection *c, uint64_t now, int epfd)
+{
+    if (c->fd == -1)
+    {
+        if (openLoadConnection(thread, c, epfd) == -1)
+            return;
+        thread->broken--;
+    }
+
+    issueRequests(thread, c, now);
+    if (flushRequests(thread, c, now, epfd) == -1)
+        resetLoadConnection(thread, c, now);
+}
+
+static void *runLoadThread(void *arg)
+{
+    LoadThread *thread = arg;
+    const LoadConfig *config = thread->config;
+    struct epoll_event events[MAX_EVENTS];
+    char *buffer = malloc(READ_BUFFER_SIZE);
+
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1 || buffer == NULL)
+        fatal("runLoadThread");
+
+    for (int i = 0; i < thread->connCount; i++)
+    {
+        LoadConnection *c = &thread->conns[i];
+        if (openLoadConnection(thread, c, epfd) == -1)
+            fatal("openConnection");
+    }
+
+    // the schedule starts once every connection is open
+    uint64_t start = nowNs();
+    thread->measureStart = start + (uint64_t)(config->warmupSeconds * 1e9);
+    thread->end = thread->measureStart + (uint64_t)(config->seconds * 1e9);
+
+    for (int i = 0; i < thread->connCount; i++)
+    {
+        LoadConnection *c = &thread->conns[i];
+        if (config->rate > 0)
+        {
+            // every connection runs at rate / connections, their slots interleave evenly
+            c->interval = (uint64_t)(config->connections * 1e9 / config->rate);
+            if (c->interval == 0)
+                c->interval = 1;
+            c->firstDue = start + (uint64_t)((thread->firstConn + i) * 1e9 / config->rate);
+        }
+        pumpConnection(thread, c, start, epfd);
+    }
+
+    while (1)
+    {
+        uint64_t now = nowNs();
+        if (now >= thread->end)
+            break;
+
+        // the closed loop only acts on responses, the open loop also on the clock
+        int timeoutMs = (int)((thread->end - now) / 1000000) + 1;
+        if (config->rate > 0)
+        {
+            uint64_t nextDue = thread->end;
+            for (int i = 0; i < thread->connCount; i++)
+            {
+                LoadConnection *c = &thread->conns[i];
+                uint64_t due = c->firstDue + c->issued * c->interval;
+                if (c->issued < c->completed + config->depth && due < nextDue)
+                    nextDue = due;
+            }
+            timeoutMs = nextDue > now ? (int)((nextDue - now) / 1000000) : 0;
+        }
+        if (thread->broken > 0 && timeoutMs > RECONNECT_DELAY_MS)
+            timeoutMs = RECONNECT_DELAY_MS;
+
+        int ready = epoll_wait(epfd, events, MAX_EVENTS, timeoutMs);
+        if (ready == -1 && errno != EINTR)
+            fatal("epoll_wait");
+
+        now = nowNs();
+        for (int i = 0; i < ready; i++)
+        {
+            LoadConnection *c = events[i].data.ptr;
+            if (c->fd == -1)
+                continue;
+
+            if ((events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) &&
+                readResponses(thread, c, buffer, now) == -1)
+            {
+                resetLoadConnection(thread, c, now);
+                continue;
+            }
+
+            if (config->rate == 0 || (events[i].events & EPOLLOUT))
+                pumpConnection(thread, c, now, epfd);
+        }
+
+        // the open loop has something due on any connection, the closed loop only replaces
+        // broken ones
+        if (config->rate > 0 || thread->broken > 0)
+            for (int i = 0; i < thread->connCount; i++)
+                if (config->rate > 0 || thread->conns[i].fd == -1)
+                    pumpConnection(thread, &thread->conns[i], now, epfd);
+    }
+
+    // open loop requests due in the window which never got an answer
+    if (config->rate > 0)
+    {
+        for (int i = 0; i < thread->connCount; i++)
+        {
+            LoadConnection *c = &thread->conns[i];
+            uint64_t due = thread->end >= c->firstDue ? (thread->end - c->firstDue) / c->interval + 1 : 0;
+            uint64_t firstMeasured = thread->measureStart > c->firstDue
+                                         ? (thread->measureStart - c->firstDue + c->interval - 1) / c->interval
+                                         : 0;
+            uint64_t answered = c->completed > firstMeasured ? c->completed : firstMeasured;
+            if (due > answered)
+                thread->missed += due - answered;
+        }
+    }
+
+    for (int i = 0; i < thread->connCount; i++)
+        if (thread->conns[i].fd != -1)
+            close(thread->conns[i].fd);
+    close(epfd);
+    free(buffer);
+    return NULL;
+}
+
+static void printLatency(const char *label, uint64_t ns)
+{
+    printf("  %-8s %10.2f us\n", label, ns / 1000.0);
+}
+
+static void usage(void)
+{
+    exitWithMessage("usage: ./load-generator [-p echo|http|sequence] [-c connections] [-t threads] [-d depth]\n"
+                    "                        [-s payload size] [-r requests per second] [-D seconds]\n"
+                    "                        [-w warmup seconds] [-u http path] [host] [port]\n");
+}
+
+int main(int argc, char *argv[])
+{
+    LoadConfig config = {
+        .protocol = PROTOCOL_ECHO,
+        .path = "/",
+        .connections = 16,
+        .threads = 0,
+        .depth = 1,
+        .size = 64,
+        .rate = 0,
+        .seconds = 10,
+        .warmupSeconds = 1,
+    };
+    int sizeGiven = 0;
+
+    int option;
+    while ((option = getopt(argc, argv, "p:c:t:d:s:r:D:w:u:")) != -1)
+    {
+        switch (option)
+        {
+        case 'p':
+            if (strcmp(optarg, "echo") == 0)
+                config.protocol = PROTOCOL_ECHO;
+            else if (strcmp(optarg, "http") == 0)
+                config.protocol = PROTOCOL_HTTP;
+            else if (strcmp(optarg, "sequence") == 0)
+                config.protocol = PROTOCOL_SEQUENCE;
+            else
+                usage();
+            break;
+        case 'c':
+            config.connections = atoi(optarg);
+            break;
+        case 't':
+            config.threads = atoi(optarg);
+            break;
+        case 'd':
+            config.depth = atoi(optarg);
+            break;
+        case 's':
+            config.size = strtoul(optarg, NULL, 10);
+            sizeGiven = 1;
+            break;
+        case 'r':
+            config.rate = atof(optarg);
+            break;
+        case 'D':
+            config.seconds = atof(optarg);
+            break;
+        case 'w':
+            config.warmupSeconds = atof(optarg);
+            break;
+        case 'u':
+            config.path = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    // http sends a GET unless a body size is given, a sequence request asks for one number
+    if (!sizeGiven && config.protocol != PROTOCOL_ECHO)
+        config.size = config.protocol == PROTOCOL_SEQUENCE ? 1 : 0;
+
+    config.host = optind < argc ? argv[optind] : "localhost";
+    config.port = optind + 1 < argc ? argv[optind + 1] : "3000";
+
+    if (config.threads <= 0)
+        config.threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (config.threads > config.connections)
+        config.threads = config.connections;
+
+    if (config.connections <= 0 || config.threads <= 0 || config.depth <= 0 || config.seconds <= 0 ||
+        config.rate < 0 || config.warmupSeconds < 0 || (config.protocol == PROTOCOL_ECHO && config.size == 0))
+        usage();
+
+    size_t requestLen;
+    char *request = buildRequest(&config, &requestLen);
+    if (request == NULL)
+        fatal("buildRequest");
+
+    // as many copies as fit, so a whole pipelined batch leaves with one send
+    size_t copies = MAX_BATCH_BYTES / requestLen;
+    if (copies > (size_t)config.depth)
+        copies = config.depth;
+    if (copies == 0)
+        copies = 1;
+
+    char *batch = malloc(copies * requestLen);
+    if (batch == NULL)
+        fatal("malloc");
+    for (size_t i = 0; i < copies; i++)
+        memcpy(batch + i * requestLen, request, requestLen);
+
+    LoadThread *threads = calloc(config.threads, sizeof(LoadThread));
+    LoadConnection *conns = calloc(config.connections, sizeof(LoadConnection));
+    uint64_t *sentAt = calloc((size_t)config.connections * config.depth, sizeof(uint64_t));
+    pthread_t *ids = calloc(config.threads, sizeof(pthread_t));
+    if (threads == NULL || conns == NULL || sentAt == NULL || ids == NULL)
+        fatal("calloc");
+
+    for (int i = 0; i < config.connections; i++)
+    {
+        conns[i].fd = -1;
+        conns[i].sentAt = sentAt + (size_t)i * config.depth;
+        initHttpParser(&conns[i].parser, 0, 0);
+    }
+
+    printf("%s %s:%s, %d connections on %d threads, depth %d, %s, %gs (+%gs warmup)\n",
+           config.protocol == PROTOCOL_ECHO ? "echo" : config.protocol == PROTOCOL_HTTP ? "http" : "sequence",
+           config.host, config.port, config.connections, config.threads, config.depth,
+           config.rate > 0 ? "open loop" : "closed loop", config.seconds, config.warmupSeconds);
+    if (config.rate > 0)
+        printf("target rate %.0f requests/s\n", config.rate);
+
+    // connections are spread as evenly as possible over the threads
+    int next = 0;
+    for (int i = 0; i < config.threads; i++)
+    {
+        LoadThread *thread = &threads[i];
+        int count = config.connections / config.threads + (i < config.connections % config.threads);
+
+        thread->config = &config;
+        thread->conns = conns + next;
+        thread->connCount = count;
+        thread->firstConn = next;
+        thread->batch = batch;
+        thread->batchLen = copies * requestLen;
+        thread->requestLen = requestLen;
+        initLatencyHistogram(&thread->histogram);
+        next += count;
+
+        if (pthread_create(&ids[i], NULL, runLoadThread, thread) != 0)
+            fatal("pthread_create");
+    }
+
+    LatencyHistogram histogram;
+    initLatencyHistogram(&histogram);
+    uint64_t requests = 0, errors = 0, bytesIn = 0, bytesOut = 0, reconnects = 0, missed = 0;
+
+    for (int i = 0; i < config.threads; i++)
+    {
+        pthread_join(ids[i], NULL);
+        histogramMerge(&histogram, &threads[i].histogram);
+        requests += threads[i].requests;
+        errors += threads[i].errors;
+        bytesIn += threads[i].bytesIn;
+        bytesOut += threads[i].bytesOut;
+        reconnects += threads[i].reconnects;
+        missed += threads[i].missed;
+    }
+
+    printf("\n%" PRIu64 " requests in %.2fs, %.1f requests/s, %.2f MB/s in, %.2f MB/s out\n",
+           requests, config.seconds, requests / config.seconds,
+           bytesIn / config.seconds / 1e6, bytesOut / config.seconds / 1e6);
+    printf("errors %" PRIu64 ", reconnects %" PRIu64, errors, reconnects);
+    if (config.rate > 0)
+        printf(", due but unanswered %" PRIu64, missed);
+    printf("\n\nlatency of %" PRIu64 " requests started in the window\n", histogram.total);
+
+    printLatency("min", histogram.total > 0 ? histogram.min : 0);
+    printLatency("p50", histogramPercentile(&histogram, 50));
+    printLatency("p90", histogramPercentile(&histogram, 90));
+    printLatency("p99", histogramPercentile(&histogram, 99));
+    printLatency("p99.9", histogramPercentile(&histogram, 99.9));
+    printLatency("p99.99", histogramPercentile(&histogram, 99.99));
+    printLatency("max", histogram.max);
+    printLatency("mean", (uint64_t)histogramMean(&histogram));
+
+    for (int i = 0; i < config.connections; i++)
+    {
+        freeHttpParser(&conns[i].parser);
+        free(conns[i].input);
+    }
+    free(ids);
+    free(sentAt);
+    free(conns);
+    free(threads);
+    free(batch);
+    free(request);
+    return 0;
+}
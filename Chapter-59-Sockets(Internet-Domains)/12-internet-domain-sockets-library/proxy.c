@@ -0,0 +1,504 @@
+// caching reverse proxy in front of one upstream http server
+// - clients are served by the http server on the thread pool backend
+// - upstream connections are kept alive in a connection pool and reused across requests
+// - GET/HEAD responses are kept in a sharded lru cache for the time Cache-Control allows,
+//   never when they carry Vary, concurrent misses of one url are sent upstream once
+// - a miss blocks its pool worker until the upstream answered, give slow upstreams more threads
+// - server and cache metrics are served on the unix socket METRICS_SOCKET
+// usage: ./proxy [upstream host] [upstream port] [port] [cache megabytes] [threads]
+
+#include "utils/http-server.h"
+#include "utils/pool-backend.h"
+#include "utils/connection-pool.h"
+#include "utils/response-cache.h"
+#include <errno.h>
+#include <strings.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+
+#define DEFAULT_PORT 3100
+#define DEFAULT_CACHE_MEGABYTES 256
+#define METRICS_SOCKET "./proxy-metrics.sock"
+
+// idle upstream connections are closed after this
+#define UPSTREAM_IDLE_MS 30000
+
+// an upstream which does not answer within this is reported as 502
+#define UPSTREAM_TIMEOUT_SECONDS 10
+
+// a stale kept alive connection is retried on a new one
+#define UPSTREAM_ATTEMPTS 2
+
+#define UPSTREAM_READ_SIZE 16384
+#define MAX_RESPONSE_SIZE (16 * 1024 * 1024)
+
+typedef struct
+{
+    const char *host;
+    const char *port;
+    ConnectionPool *connections;
+    ResponseCache *cache;
+} Upstream;
+
+static Upstream upstream;
+
+// one request on its way upstream
+typedef struct
+{
+    const HttpRequest *request;
+    const char *key;
+    size_t keyLen;
+    int forCache; // GET for a HEAD too, conditionals left out so the full response comes back
+} UpstreamRequest;
+
+// growable byte buffer
+typedef struct
+{
+    char *data;
+    size_t len;
+    size_t capacity;
+} Buffer;
+
+static int bufferReserve(Buffer *buffer, size_t extra)
+{
+    if (buffer->len + extra <= buffer->capacity)
+        return 0;
+
+    size_t capacity = buffer->capacity > 0 ? buffer->capacity : 4096;
+    while (capacity < buffer->len + extra)
+        capacity *= 2;
+
+    char *data = realloc(buffer->data, capacity);
+    if (data == NULL)
+        return -1;
+    buffer->data = data;
+    buffer->capacity = capacity;
+    return 0;
+}
+
+static int bufferAppend(Buffer *buffer, const void *data, size_t len)
+{
+    if (bufferReserve(buffer, len) == -1)
+        return -1;
+    memcpy(buffer->data + buffer->len, data, len);
+    buffer->len += len;
+    return 0;
+}
+
+static int bufferAppendHeader(Buffer *buffer, HttpSlice name, HttpSlice value)
+{
+    return bufferAppend(buffer, name.data, name.len) == -1 ||
+                   bufferAppend(buffer, ": ", 2) == -1 ||
+                   bufferAppend(buffer, value.data, value.len) == -1 ||
+                   bufferAppend(buffer, "\r\n", 2) == -1
+               ? -1
+               : 0;
+}
+
+// headers which describe one connection and are never forwarded
+static int isHopByHop(HttpSlice name)
+{
+    static const char *names[] = {
+        "connection", "keep-alive", "proxy-connection", "te", "trailer",
+        "transfer-encoding", "upgrade", "content-length", "expect",
+    };
+
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+        if (httpSliceEquals(name, names[i]))
+            return 1;
+    return 0;
+}
+
+static int isMethod(const HttpRequest *request, const char *method)
+{
+    size_t len = strlen(method);
+    return request->method.len == len && memcmp(request->method.data, method, len) == 0;
+}
+
+// "name=value" directive of a Cache-Control list, -1 when missing
+static long directiveSeconds(HttpSlice list, const char *name)
+{
+    size_t nameLen = strlen(name);
+    const char *p = list.data, *end = list.data + list.len;
+
+    while (p < end)
+    {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            p++;
+
+        if ((size_t)(end - p) > nameLen && strncasecmp(p, name, nameLen) == 0 && p[nameLen] == '=')
+        {
+            long seconds = 0;
+            for (p += nameLen + 1; p < end && *p >= '0' && *p <= '9'; p++)
+                seconds = seconds * 10 + (*p - '0');
+            return seconds;
+        }
+
+        while (p < end && *p != ',')
+            p++;
+    }
+    return -1;
+}
+
+// how long a shared cache may keep the response, 0 when it must not
+static long responseTtlMs(const HttpResponse *response)
+{
+    switch (response->status)
+    {
+    case 200:
+    case 203:
+    case 204:
+    case 300:
+    case 301:
+    case 404:
+    case 410:
+        break;
+    default:
+        return 0;
+    }
+
+    // responses setting cookies belong to one client
+    if (httpFindHeader(response->headers, response->headerCount, "set-cookie") != NULL)
+        return 0;
+
+    // the key is only host and target, a response varying on request headers (or "*") would
+    // be served to clients which sent different ones
+    if (httpFindHeader(response->headers, response->headerCount, "vary") != NULL)
+        return 0;
+
+    const HttpSlice *control = httpFindHeader(response->headers, response->headerCount, "cache-control");
+    if (control == NULL)
+        return 0;
+
+    if (httpListContains(*control, "no-store") || httpListContains(*control, "private") ||
+        httpListContains(*control, "no-cache"))
+        return 0;
+
+    // s-maxage is meant for shared caches like this one
+    long seconds = directiveSeconds(*control, "s-maxage");
+    if (seconds < 0)
+        seconds = directiveSeconds(*control, "max-age");
+    return seconds > 0 ? seconds * 1000 : 0;
+}
+
+// request line and headers as they go upstream
+static int buildUpstreamHead(const UpstreamRequest *req, Buffer *head)
+{
+    const HttpRequest *request = req->request;
+    HttpSlice method = req->forCache ? (HttpSlice){"GET", 3} : request->method;
+
+    if (bufferAppend(head, method.data, method.len) == -1 ||
+        bufferAppend(head, " ", 1) == -1 ||
+        bufferAppend(head, request->target.data, request->target.len) == -1 ||
+        bufferAppend(head, " HTTP/1.1\r\n", 11) == -1)
+        return -1;
+
+    for (size_t i = 0; i < request->headerCount; i++)
+    {
+        const HttpHeader *header = &request->headers[i];
+        if (isHopByHop(header->name))
+            continue;
+
+        // a 304 for one client would end up in the cache for everyone
+        if (req->forCache && (httpSliceEquals(header->name, "if-none-match") ||
+                              httpSliceEquals(header->name, "if-modified-since")))
+            continue;
+
+        if (bufferAppendHeader(head, header->name, header->value) == -1)
+            return -1;
+    }
+
+    char length[64];
+    int len = 0;
+    if (!req->forCache && (request->body.len > 0 || isMethod(request, "POST") || isMethod(request, "PUT")))
+        len = snprintf(length, sizeof(length), "Content-Length: %zu\r\n", request->body.len);
+
+    if (bufferAppend(head, length, len) == -1 || bufferAppend(head, "\r\n", 2) == -1)
+        return -1;
+    return 0;
+}
+
+static int sendAll(int fd, struct iovec *iov, int count)
+{
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+
+    while (msg.msg_iovlen > 0)
+    {
+        ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (sent == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        while (msg.msg_iovlen > 0 && (size_t)sent >= msg.msg_iov->iov_len)
+        {
+            sent -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0)
+        {
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + sent;
+            msg.msg_iov->iov_len -= sent;
+        }
+    }
+    return 0;
+}
+
+// read one response, returns its length or -1; *received tells whether any byte came back
+static ssize_t readResponse(int fd, HttpParser *parser, Buffer *in, int noBody, int *received)
+{
+    while (1)
+    {
+        ssize_t parsed = httpParseResponse(parser, in->data, in->len, noBody, 0);
+        if (parsed != 0)
+            return parsed;
+
+        if (bufferReserve(in, UPSTREAM_READ_SIZE) == -1)
+            return -1;
+
+        ssize_t bytes_received = recv(fd, in->data + in->len, UPSTREAM_READ_SIZE, 0);
+        if (bytes_received == -1 && errno == EINTR)
+            continue;
+        if (bytes_received == -1)
+            return -1;
+        if (bytes_received == 0)
+            return httpParseResponse(parser, in->data, in->len, noBody, 1);
+
+        in->len += bytes_received;
+        *received = 1;
+    }
+}
+
+// response without the framing headers, they are recomputed for the client
+static CacheEntry *entryFromResponse(const UpstreamRequest *req, const HttpResponse *response)
+{
+    Buffer headers = {0};
+
+    for (size_t i = 0; i < response->headerCount; i++)
+    {
+        const HttpHeader *header = &response->headers[i];
+        if (!isHopByHop(header->name) && bufferAppendHeader(&headers, header->name, header->value) == -1)
+        {
+            free(headers.data);
+            return NULL;
+        }
+    }
+
+    long ttlMs = req->forCache ? responseTtlMs(response) : 0;
+    CacheEntry *entry = createCacheEntry(req->key, req->keyLen, response->status, headers.data, headers.len,
+                                         response->body.data, response->body.len, ttlMs);
+    free(headers.data);
+    return entry;
+}
+
+// send the request on a pooled connection and read the answer, NULL when the upstream failed
+static CacheEntry *fetchUpstream(void *arg)
+{
+    UpstreamRequest *req = arg;
+    const HttpRequest *request = req->request;
+    int noBody = !req->forCache && isMethod(request, "HEAD");
+
+    Buffer head = {0};
+    if (buildUpstreamHead(req, &head) == -1)
+    {
+        free(head.data);
+        return NULL;
+    }
+
+    CacheEntry *entry = NULL;
+    HttpParser parser;
+    initHttpParser(&parser, 0, MAX_RESPONSE_SIZE);
+    Buffer in = {0};
+
+    for (int attempt = 0; attempt < UPSTREAM_ATTEMPTS && entry == NULL; attempt++)
+    {
+        PooledConnection *conn = poolAcquire(upstream.connections, AF_INET, SOCK_STREAM, upstream.host, upstream.port);
+        if (conn == NULL)
+            break;
+
+        if (!conn->reused)
+        {
+            struct timeval timeout = {.tv_sec = UPSTREAM_TIMEOUT_SECONDS};
+            setsockopt(conn->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            setsockopt(conn->fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        }
+
+        struct iovec iov[2] = {
+            {.iov_base = head.data, .iov_len = head.len},
+            {.iov_base = (void *)request->body.data, .iov_len = req->forCache ? 0 : request->body.len},
+        };
+
+        int received = 0;
+        in.len = 0;
+        initHttpParser(&parser, 0, MAX_RESPONSE_SIZE);
+
+        ssize_t responseLen = -1;
+        if (sendAll(conn->fd, iov, 2) == 0)
+            responseLen = readResponse(conn->fd, &parser, &in, noBody, &received);
+
+        if (responseLen > 0)
+            entry = entryFromResponse(req, &parser.response);
+
+        // extra bytes after the response would desync the next request on this connection
+        int reusable = responseLen > 0 && parser.response.keepAlive && (size_t)responseLen == in.len;
+        int stale = conn->reused && !received;
+        poolRelease(upstream.connections, conn, reusable);
+        freeHttpParser(&parser);
+
+        // only a kept alive connection closed by the upstream meanwhile is worth another try
+        if (entry == NULL && !stale)
+            break;
+    }
+
+    free(in.data);
+    free(head.data);
+    return entry;
+}
+
+static void sendEntry(HttpConnection *hc, CacheEntry *entry, const char *cacheStatus)
+{
+    char age[32];
+    snprintf(age, sizeof(age), "%lld", cacheEntryAge(entry) / 1000);
+
+    httpAddHeader(hc, "X-Cache", cacheStatus);
+    if (strcmp(cacheStatus, "HIT") == 0)
+        httpAddHeader(hc, "Age", age);
+
+    httpRespondWithHeaders(hc, entry->status, NULL, entry->headers, entry->headersLen, entry->body, entry->bodyLen);
+}
+
+static void onProxyRequest(HttpConnection *hc, const HttpRequest *request)
+{
+    // the key is the url as the client sees it
+    char key[2048];
+    const HttpSlice *host = httpFindHeader(request->headers, request->headerCount, "host");
+    int keyLen = snprintf(key, sizeof(key), "%.*s%.*s", host != NULL ? (int)host->len : 0, host != NULL ? host->data : "",
+                          (int)request->target.len, request->target.data);
+
+    const HttpSlice *control = httpFindHeader(request->headers, request->headerCount, "cache-control");
+    int readOnly = isMethod(request, "GET") || isMethod(request, "HEAD");
+    int cacheable = readOnly && keyLen < (int)sizeof(key) &&
+                    httpFindHeader(request->headers, request->headerCount, "authorization") == NULL &&
+                    (control == NULL || !httpListContains(*control, "no-store"));
+
+    UpstreamRequest req = {
+        .request = request,
+        .key = key,
+        .keyLen = keyLen < (int)sizeof(key) ? keyLen : 0,
+        .forCache = cacheable,
+    };
+
+    CacheEntry *entry;
+    CacheResult result = CACHE_MISS;
+
+    if (cacheable)
+        entry = cacheGet(upstream.cache, key, keyLen, fetchUpstream, &req, &result);
+    else
+        entry = fetchUpstream(&req);
+
+    if (entry == NULL)
+    {
+        const char *text = "upstream failed\n";
+        httpRespond(hc, 502, "text/plain", text, strlen(text));
+        return;
+    }
+
+    // whatever was cached for the url is out of date once it changed
+    if (!readOnly && entry->status < 400 && req.keyLen > 0)
+        cacheRemove(upstream.cache, key, keyLen);
+
+    sendEntry(hc, entry, result == CACHE_HIT ? "HIT" : result == CACHE_COALESCED ? "COALESCED" : "MISS");
+    cacheRelease(entry);
+}
+
+static void onStatsRequest(HttpConnection *hc, const HttpRequest *request)
+{
+    (void)request;
+    CacheStats cache;
+    PoolStats pool;
+    char text[512];
+
+    getCacheStats(upstream.cache, &cache);
+    poolGetStats(upstream.connections, &pool);
+
+    int len = snprintf(text, sizeof(text),
+                       "hits %zu\nmisses %zu\ncoalesced %zu\nstored %zu\nevicted %zu\nexpired %zu\n"
+                       "entries %zu\nbytes %zu\nupstream connected %zu\nupstream reused %zu\n",
+                       cache.hits, cache.misses, cache.coalesced, cache.stored, cache.evicted, cache.expired,
+                       cache.entries, cache.bytes, pool.connected, pool.reused);
+    httpRespond(hc, 200, "text/plain", text, len);
+}
+
+// cache and upstream counters next to the server metrics
+static void writeProxyMetrics(FILE *out, void *arg)
+{
+    (void)arg;
+    CacheStats cache;
+    PoolStats pool;
+
+    getCacheStats(upstream.cache, &cache);
+    poolGetStats(upstream.connections, &pool);
+
+    fprintf(out, "cache_hits %zu\ncache_misses %zu\ncache_coalesced %zu\ncache_stored %zu\n"
+                 "cache_evicted %zu\ncache_expired %zu\ncache_entries %zu\ncache_bytes %zu\n"
+                 "upstream_connected %zu\nupstream_reused %zu\n",
+            cache.hits, cache.misses, cache.coalesced, cache.stored, cache.evicted, cache.expired,
+            cache.entries, cache.bytes, pool.connected, pool.reused);
+}
+
+int main(int argc, char const *argv[])
+{
+    upstream.host = argc > 1 ? argv[1] : "127.0.0.1";
+    upstream.port = argc > 2 ? argv[2] : "3000";
+    int port = argc > 3 ? atoi(argv[3]) : DEFAULT_PORT;
+    long megabytes = argc > 4 ? atol(argv[4]) : DEFAULT_CACHE_MEGABYTES;
+    int threads = argc > 5 ? atoi(argv[5]) : 0;
+
+    if (port <= 0 || megabytes <= 0)
+        exitWithMessage("usage: ./proxy [upstream host] [upstream port] [port] [cache megabytes] [threads]\n");
+
+    // small requests and responses both ways, nothing gains from Nagle
+    static const SocketTuning tuning = {.profile = TUNING_LOW_LATENCY};
+    useSocketTuning(&tuning);
+
+    // upstream addresses are resolved once a minute at most
+    ResolverCache *resolver = createResolverCache(60000, 5000, 30000);
+    if (resolver == NULL)
+        fatal("createResolverCache");
+    useResolverCache(resolver);
+
+    if ((upstream.connections = createConnectionPool(0, UPSTREAM_IDLE_MS)) == NULL)
+        fatal("createConnectionPool");
+    if ((upstream.cache = createResponseCache((size_t)megabytes * 1024 * 1024, 0)) == NULL)
+        fatal("createResponseCache");
+
+    static const HttpRoute routes[] = {
+        {"GET", "/.proxy/stats", onStatsRequest},
+        {NULL, "*", onProxyRequest},
+    };
+    static HttpServer server = {
+        .routes = routes,
+        .routeCount = sizeof(routes) / sizeof(routes[0]),
+    };
+
+    struct sockaddr_storage addr;
+    int sfd = createServer(AF_INET, SOCK_STREAM, port, SOMAXCONN, "0.0.0.0", &addr);
+    if (sfd == -1)
+        fatal("createServer");
+
+    addMetricsSource(writeProxyMetrics, NULL);
+    if (startMetricsServer(METRICS_SOCKET) == -1)
+        perror("startMetricsServer");
+
+    printf("proxy on port %d for %s:%s\n", port, upstream.host, upstream.port);
+
+    if (runPoolServer(sfd, threads, &httpStreamHandlers, &server) == -1)
+        fatalWithClose(sfd, "runPoolServer");
+    return 0;
+}
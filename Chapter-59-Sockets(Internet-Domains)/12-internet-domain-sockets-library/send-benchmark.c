@@ -0,0 +1,92 @@
+// compares messages/sec of the formatted send paths
+// - legacy: vsnprintf twice + malloc/free per message (the old sendMessage)
+// - sendMessage: formats once into a per thread buffer
+// - sendMessageWithBuffer: formats once into a caller supplied buffer
+// a reader thread drains the other end of a unix socket pair so only the send side is measured
+// usage: ./send-benchmark [messages]
+
+#include "utils/socket-library.h"
+#include <pthread.h>
+#include <time.h>
+
+#define DEFAULT_MESSAGES 1000000
+#define DRAIN_BUFFER_SIZE 65536
+
+// the previous implementation of sendMessage, kept only for comparison
+static ssize_t legacySendMessage(int fd, int flags, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int size = vsnprintf(NULL, 0, format, args) + 1;
+    va_end(args);
+
+    char *buffer = (char *)malloc(size);
+    if (buffer == NULL)
+        return -1;
+
+    va_start(args, format);
+    vsnprintf(buffer, size, format, args);
+    va_end(args);
+
+    ssize_t bytes_sent = send(fd, buffer, size - 1, flags);
+    free(buffer);
+    return bytes_sent;
+}
+
+static void *drain(void *arg)
+{
+    int fd = *(int *)arg;
+    char buffer[DRAIN_BUFFER_SIZE];
+
+    while (recv(fd, buffer, sizeof(buffer), 0) > 0)
+        ;
+    return NULL;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, long messages, double seconds)
+{
+    printf("%-24s %10.0f msgs/sec  (%.3f s)\n", name, messages / seconds, seconds);
+}
+
+int main(int argc, char const *argv[])
+{
+    long messages = argc > 1 ? atol(argv[1]) : DEFAULT_MESSAGES;
+    char buffer[MESSAGE_BUFFER_SIZE];
+    int fds[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+        fatal("socketpair");
+
+    pthread_t reader;
+    if (pthread_create(&reader, NULL, drain, &fds[1]) != 0)
+        fatal("pthread_create");
+
+    double start = now();
+    for (long i = 0; i < messages; i++)
+        legacySendMessage(fds[0], 0, "%d bytes data got at server from client   ", (int)i);
+    report("legacy (malloc)", messages, now() - start);
+
+    start = now();
+    for (long i = 0; i < messages; i++)
+        sendMessage(fds[0], 0, "%d bytes data got at server from client   ", (int)i);
+    report("sendMessage", messages, now() - start);
+
+    start = now();
+    for (long i = 0; i < messages; i++)
+        sendMessageWithBuffer(fds[0], 0, buffer, sizeof(buffer), "%d bytes data got at server from client   ", (int)i);
+    report("sendMessageWithBuffer", messages, now() - start);
+
+    shutdown(fds[0], SHUT_WR);
+    pthread_join(reader, NULL);
+
+    close(fds[0]);
+    close(fds[1]);
+    return 0;
+}
@@ -1,29 +1,511 @@
-#include "utils/socket-library.h"
+#include "utils/reuseport-server.h"
+#include "utils/prefork-server.h"
+#include "utils/http-server.h"
+#include <errno.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <linux/openat2.h>
 
-#define BUFFER_SIZE 100
+#define DATAGRAM_SIZE 2048
 
-int main(int argc, char const *argv[])
+// upper bound of the lines "/chunked" streams
+#define MAX_CHUNKED_LINES 100000
+
+// fds kept free for listeners, epoll/io_uring, the spare fd and the handlers
+#define RESERVED_FDS 64
+
+// clients accepted per wakeup of a loop
+#define ACCEPT_BATCH 64
+
+// longest request head the static server waits for
+#define MAX_STATIC_REQUEST 8192
+
+// plain text metrics of the server, "socat - UNIX-CONNECT:./server-metrics.sock" prints them
+#define METRICS_SOCKET "./server-metrics.sock"
+
+static AdmissionControl admission;
+
+// acknowledgements are tiny and sent right away, nothing is gained by batching them
+// clients always speak first, so they are accepted only once their first request arrived
+static const SocketTuning tuning = {
+    .profile = TUNING_LOW_LATENCY,
+    .fastOpenQueue = 256,
+    .deferAcceptSeconds = 5,
+};
+
+// files are streamed, large buffers keep the pipe full
+static const SocketTuning staticTuning = {
+    .profile = TUNING_BULK,
+    .fastOpenQueue = 256,
+    .deferAcceptSeconds = 5,
+};
+
+// raise the open files limit so that the loop can hold thousands of clients, returns the limit
+static size_t raiseFileLimit(void)
+{
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == -1)
+        return 0;
+
+    if (limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+        getrlimit(RLIMIT_NOFILE, &limit);
+    }
+    return limit.rlim_cur;
+}
+
+// admit as many clients as the fd limit allows, the ones above are turned away instead of
+// failing inside the backends
+static void startAdmissionControl(void)
 {
-    // for storing server address
-    struct sockaddr_in addr;
+    size_t fileLimit = raiseFileLimit();
+    size_t maxConnections = fileLimit > 2 * RESERVED_FDS ? fileLimit - RESERVED_FDS : fileLimit / 2;
 
-    // for storing data
-    char buffer[BUFFER_SIZE];
+    if (initAdmissionControl(&admission, maxConnections, ACCEPT_BATCH) == -1)
+        fatal("initAdmissionControl");
+    useAdmissionControl(&admission);
 
-    // for storing amount of bytes data received/sent
-    ssize_t bytes_received = 0, bytes_sent = 0;
+    // forked workers (prefork) count in their own process, only the master's show up here
+    if (startMetricsServer(METRICS_SOCKET) == -1)
+        perror("startMetricsServer");
+}
 
-    // create a server and return the socket file descriptor and address
-    int sfd = createServer(AF_INET, SOCK_STREAM, 3000, 10, "0.0.0.0", (struct sockaddr_storage *)&addr);
+// acknowledge every chunk of data the client sent
+static void onClientData(Connection *conn, const char *data, size_t len)
+{
+    printf("received data: %s\n%d\n", data, (int)len);
+
+    // queued, all acknowledgements of a batch are written together
+    connectionPrintf(conn, "%d bytes data got at server from client   ", (int)len);
+}
+
+// send every byte back as it came, a target for the load generator
+static void onEchoData(Connection *conn, const char *data, size_t len)
+{
+    connectionSend(conn, data, len);
+}
+
+// open a regular file below the root, returns its fd or -1
+// every mode serves files through this: the kernel resolves the path beneath rootFd, so no
+// absolute path, ".." or symlink can reach a file outside the root
+static int openRegularFile(int rootFd, const char *path, struct stat *st)
+{
+    // openat would ignore rootFd for an absolute path
+    if (path[0] == '\0' || path[0] == '/')
+    {
+        errno = EACCES;
+        return -1;
+    }
+
+    // non-blocking so a fifo does not hang the worker, regular files ignore the flag
+    struct open_how how;
+    memset(&how, 0, sizeof(how));
+    how.flags = O_RDONLY | O_NONBLOCK | O_CLOEXEC;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+
+    int fileFd = (int)syscall(__NR_openat2, rootFd, path, &how, sizeof(how));
+
+    // kernels before 5.6: no "..", and the file itself must not be a symlink
+    if (fileFd == -1 && errno == ENOSYS)
+    {
+        if (strstr(path, "..") != NULL)
+        {
+            errno = EACCES;
+            return -1;
+        }
+        fileFd = openat(rootFd, path, O_RDONLY | O_NONBLOCK | O_CLOEXEC | O_NOFOLLOW);
+    }
+    if (fileFd == -1)
+        return -1;
+
+    if (fstat(fileFd, st) == -1 || !S_ISREG(st->st_mode))
+    {
+        close(fileFd);
+        return -1;
+    }
+    return fileFd;
+}
+
+// open the file a request line asks for, returns its fd or -1 with the error status to answer
+static int openRequestedFile(int rootFd, const char *data, struct stat *st, const char **status)
+{
+    char method[8], target[1024];
+
+    *status = "400 Bad Request";
+    if (sscanf(data, "%7s %1023s", method, target) != 2 || target[0] != '/')
+        return -1;
+
+    *status = "405 Method Not Allowed";
+    if (strcmp(method, "GET") != 0)
+        return -1;
+
+    // nothing outside the root is served
+    *status = "403 Forbidden";
+    if (strstr(target, "..") != NULL || target[1] == '/')
+        return -1;
+
+    *status = "404 Not Found";
+    return openRegularFile(rootFd, target[1] != '\0' ? target + 1 : "index.html", st);
+}
+
+// request head of a static connection, collected over as many reads as it takes
+typedef struct
+{
+    size_t len;
+    int answered;
+    char head[MAX_STATIC_REQUEST + 1];
+} StaticRequest;
+
+// "GET /path": the file below the root directory goes out with sendfile, never through a user buffer
+// one request per connection (http/1.0), anything the client sends after its head is ignored
+static void onStaticRequest(Connection *conn, const char *data, size_t len)
+{
+    StaticRequest *request = conn->state;
+    if (request == NULL && (request = conn->state = calloc(1, sizeof(StaticRequest))) == NULL)
+    {
+        connectionClose(conn);
+        return;
+    }
+    if (request->answered)
+        return;
+
+    size_t room = MAX_STATIC_REQUEST - request->len;
+    memcpy(request->head + request->len, data, len < room ? len : room);
+    request->len += len < room ? len : room;
+    request->head[request->len] = '\0';
+
+    int complete = strstr(request->head, "\r\n\r\n") != NULL;
+    if (!complete && request->len < MAX_STATIC_REQUEST)
+        return;
+    request->answered = 1;
+
+    struct stat st;
+    const char *status = "431 Request Header Fields Too Large";
+    int fileFd = -1;
+
+    if (complete)
+        fileFd = openRequestedFile(*(int *)conn->userData, request->head, &st, &status);
+
+    if (fileFd == -1)
+        connectionPrintf(conn, "HTTP/1.0 %s\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", status);
+    else
+    {
+        // the header is flushed together with the start of the file
+        connectionPrintf(conn, "HTTP/1.0 200 OK\r\nContent-Length: %lld\r\nConnection: close\r\n\r\n", (long long)st.st_size);
+        if (connectionSendFile(conn, fileFd, 0, st.st_size) == -1)
+            perror("connectionSendFile");
+    }
+
+    // the client may still be sending, the close lingers until it is done (connectionClose)
+    connectionClose(conn);
+}
+
+static void onStaticClose(Connection *conn)
+{
+    free(conn->state);
+}
+
+// "/": fixed plain text, the usual target of load generators
+static void onHelloRequest(HttpConnection *hc, const HttpRequest *request)
+{
+    (void)request;
+    static const char hello[] = "Hello, World!";
+    httpRespond(hc, 200, "text/plain", hello, sizeof(hello) - 1);
+}
+
+// "POST /echo": the body comes back, chunked uploads included
+static void onEchoRequest(HttpConnection *hc, const HttpRequest *request)
+{
+    const HttpSlice *type = httpFindHeader(request->headers, request->headerCount, "content-type");
+    char contentType[128] = "application/octet-stream";
+
+    if (type != NULL && type->len < sizeof(contentType))
+        snprintf(contentType, sizeof(contentType), "%.*s", (int)type->len, type->data);
+
+    httpRespond(hc, 200, contentType, request->body.data, request->body.len);
+}
+
+// "/chunked?n": n lines of unknown total length
+static void onChunkedRequest(HttpConnection *hc, const HttpRequest *request)
+{
+    // the query is followed by the rest of the request line, atoi stops at the space
+    int lines = request->query.len > 0 ? atoi(request->query.data) : 10;
+    if (lines < 0 || lines > MAX_CHUNKED_LINES)
+        lines = MAX_CHUNKED_LINES;
+
+    httpBeginChunked(hc, 200, "text/plain");
+    for (int i = 0; i < lines; i++)
+    {
+        char line[64];
+        int len = snprintf(line, sizeof(line), "line %d\n", i);
+        httpSendChunk(hc, line, len);
+    }
+    httpEndChunked(hc);
+}
+
+// "/time?seconds": the current time, caches may keep it for the given seconds
+static void onTimeRequest(HttpConnection *hc, const HttpRequest *request)
+{
+    char control[32], text[64];
+    int seconds = request->query.len > 0 ? atoi(request->query.data) : 5;
+
+    snprintf(control, sizeof(control), "max-age=%d", seconds);
+    httpAddHeader(hc, "Cache-Control", control);
+
+    int len = snprintf(text, sizeof(text), "%ld\n", (long)time(NULL));
+    httpRespond(hc, 200, "text/plain", text, len);
+}
+
+// "/files/path": the file below the working directory, sent with sendfile
+static void onFileRequest(HttpConnection *hc, const HttpRequest *request)
+{
+    char path[1024];
+    struct stat st;
+    int fileFd = -1;
+
+    // same checks as the static mode: openRegularFile refuses "/etc/..." and resolves the
+    // rest beneath the root, a lexical check of its own could drift from that
+    HttpSlice name = {request->path.data + 7, request->path.len - 7};
+    if (name.len > 0 && name.len < sizeof(path) && name.data[0] != '/')
+    {
+        snprintf(path, sizeof(path), "%.*s", (int)name.len, name.data);
+        fileFd = openRegularFile(*(int *)hc->server->userData, path, &st);
+    }
+
+    if (fileFd == -1)
+        httpRespond(hc, 404, "text/plain", "not found\n", 10);
+    else
+        httpRespondFile(hc, 200, "application/octet-stream", fileFd, 0, st.st_size);
+}
+
+// echo every datagram back to its sender, a whole batch per recvmmsg/sendmmsg
+static void runUdpEchoServer(int sfd)
+{
+    static char buffers[PACKET_BATCH_SIZE][DATAGRAM_SIZE];
+    Datagram packets[PACKET_BATCH_SIZE];
+
+    for (int i = 0; i < PACKET_BATCH_SIZE; i++)
+    {
+        packets[i].buffer = buffers[i];
+        packets[i].bufferSize = DATAGRAM_SIZE;
+    }
 
     while (1)
     {
-        int cfd = acceptClient(sfd, NULL, NULL);
+        // blocks for the first datagram, then takes whatever else is already queued
+        int received = recvMessagePackets(sfd, packets, PACKET_BATCH_SIZE, MSG_WAITFORONE);
+        if (received == -1)
+        {
+            perror("recvmmsg");
+            continue;
+        }
+
+        // a truncated datagram cannot be echoed unchanged, so it is dropped
+        int kept = 0;
+        for (int i = 0; i < received; i++)
+        {
+            if (packets[i].truncated)
+                continue;
+
+            Datagram packet = packets[kept];
+            packets[kept++] = packets[i];
+            packets[i] = packet;
+        }
+
+        // same buffers and addresses, the payload goes back unchanged
+        if (sendMessagePackets(sfd, packets, kept, 0) == -1)
+            perror("sendmmsg");
+    }
+}
+
+// usage: ./server [pool|blocking|epoll|uring|udp-echo|prefork] [workers] [steer]
+//        ./server static [root] [pool|blocking|epoll|uring]
+//        ./server http [pool|blocking|epoll|uring] [workers]
+//        ./server echo [pool|blocking|epoll|uring] [workers]
+int main(int argc, char const *argv[])
+{
+    // for storing server address, createServer fills a whole sockaddr_storage
+    struct sockaddr_storage addr;
+
+    useSocketTuning(argc > 1 && strcmp(argv[1], "static") == 0 ? &staticTuning : &tuning);
+
+    if (argc > 1 && strcmp(argv[1], "udp-echo") == 0)
+    {
+        int sfd = createServer(AF_INET, SOCK_DGRAM, 3000, 0, "0.0.0.0", &addr);
+        if (sfd == -1)
+            fatal("createServer");
+        runUdpEchoServer(sfd);
+    }
+
+    static const StreamHandlers handlers = {
+        .onData = onClientData,
+    };
+
+    // files of the root directory, every backend sends them zero copy except io_uring
+    if (argc > 1 && strcmp(argv[1], "static") == 0)
+    {
+        static const StreamHandlers staticHandlers = {
+            .onData = onStaticRequest,
+            .onClose = onStaticClose,
+        };
+        static int rootFd;
+
+        int backend = argc > 3 ? parseServerBackend(argv[3]) : BACKEND_POOL;
+        if (backend == -1)
+            exitWithMessage("usage: ./server static [root] [pool|blocking|epoll|uring]\n");
+
+        if ((rootFd = open(argc > 2 ? argv[2] : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+            fatal("open root");
+
+        startAdmissionControl();
+        int sfd = createServer(AF_INET, SOCK_STREAM, 3000, SOMAXCONN, "0.0.0.0", &addr);
+        if (sfd == -1)
+            fatal("createServer");
+
+        if (runStreamServer(sfd, backend, &staticHandlers, &rootFd) == -1)
+            fatalWithClose(sfd, "runStreamServer");
+        return 0;
+    }
+
+    // http/1.1 with keep-alive and pipelining, files come from the working directory
+    if (argc > 1 && strcmp(argv[1], "http") == 0)
+    {
+        static const HttpRoute routes[] = {
+            {"GET", "/", onHelloRequest},
+            {"POST", "/echo", onEchoRequest},
+            {"GET", "/chunked", onChunkedRequest},
+            {"GET", "/time", onTimeRequest},
+            {"GET", "/files/*", onFileRequest},
+        };
+        static int rootFd;
+        static HttpServer httpServer = {
+            .routes = routes,
+            .routeCount = sizeof(routes) / sizeof(routes[0]),
+            .userData = &rootFd,
+        };
+
+        int backend = argc > 2 ? parseServerBackend(argv[2]) : BACKEND_POOL;
+        if (backend == -1)
+            exitWithMessage("usage: ./server http [pool|blocking|epoll|uring] [workers]\n");
+
+        if ((rootFd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+            fatal("open root");
+
+        startAdmissionControl();
+
+        if (argc > 3)
+        {
+            ReusePortConfig config = {
+                .domain = AF_INET,
+                .port = 3000,
+                .ip = "0.0.0.0",
+                .backlog = SOMAXCONN,
+                .workers = atoi(argv[3]),
+                .backend = backend,
+            };
+
+            if (runReusePortServer(&config, &httpStreamHandlers, &httpServer) == -1)
+                fatal("runReusePortServer");
+            return 0;
+        }
+
+        int sfd = createServer(AF_INET, SOCK_STREAM, 3000, SOMAXCONN, "0.0.0.0", &addr);
+        if (sfd == -1)
+            fatal("createServer");
+
+        if (runHttpServer(sfd, backend, &httpServer) == -1)
+            fatalWithClose(sfd, "runHttpServer");
+        return 0;
+    }
+
+    // plain tcp echo
+    if (argc > 1 && strcmp(argv[1], "echo") == 0)
+    {
+        static const StreamHandlers echoHandlers = {
+            .onData = onEchoData,
+        };
+
+        int backend = argc > 2 ? parseServerBackend(argv[2]) : BACKEND_POOL;
+        if (backend == -1)
+            exitWithMessage("usage: ./server echo [pool|blocking|epoll|uring] [workers]\n");
+
+        startAdmissionControl();
+
+        if (argc > 3)
+        {
+            ReusePortConfig config = {
+                .domain = AF_INET,
+                .port = 3000,
+                .ip = "0.0.0.0",
+                .backlog = SOMAXCONN,
+                .workers = atoi(argv[3]),
+                .backend = backend,
+            };
+
+            if (runReusePortServer(&config, &echoHandlers, NULL) == -1)
+                fatal("runReusePortServer");
+            return 0;
+        }
+
+        int sfd = createServer(AF_INET, SOCK_STREAM, 3000, SOMAXCONN, "0.0.0.0", &addr);
+        if (sfd == -1)
+            fatal("createServer");
+
+        if (runStreamServer(sfd, backend, &echoHandlers, NULL) == -1)
+            fatalWithClose(sfd, "runStreamServer");
+        return 0;
+    }
+
+    // master accepts, forked workers serve the clients it passes them
+    if (argc > 1 && strcmp(argv[1], "prefork") == 0)
+    {
+        startAdmissionControl();
+        int sfd = createServer(AF_INET, SOCK_STREAM, 3000, SOMAXCONN, "0.0.0.0", &addr);
+        if (sfd == -1)
+            fatal("createServer");
+
+        if (runPreforkServer(sfd, argc > 2 ? atoi(argv[2]) : 0, &handlers, NULL) == -1)
+            fatalWithClose(sfd, "runPreforkServer");
+        return 0;
+    }
+
+    // connections and their handlers run on the work stealing pool unless told otherwise
+    int backend = argc > 1 ? parseServerBackend(argv[1]) : BACKEND_POOL;
+    if (backend == -1)
+        exitWithMessage("usage: ./server [pool|blocking|epoll|uring|udp-echo|prefork|static|http|echo] [workers] [steer]\n");
 
-        bytes_received = recvMessage(cfd, 0, buffer, BUFFER_SIZE);
-        printf("received data: %s\n%d\n", buffer, (int)bytes_received);
+    startAdmissionControl();
+
+    // several workers, each with its own SO_REUSEPORT listener and loop
+    if (argc > 2)
+    {
+        ReusePortConfig config = {
+            .domain = AF_INET,
+            .port = 3000,
+            .ip = "0.0.0.0",
+            .backlog = SOMAXCONN,
+            .workers = atoi(argv[2]),
+            .steerByCpu = argc > 3 && strcmp(argv[3], "steer") == 0,
+            .backend = backend,
+        };
 
-        bytes_sent = sendMessage(cfd, 0, "%d bytes data got at server from client   ", (int)bytes_received);
+        if (runReusePortServer(&config, &handlers, NULL) == -1)
+            fatal("runReusePortServer");
+        return 0;
     }
+
+    // create a server and return the socket file descriptor and address
+    int sfd = createServer(AF_INET, SOCK_STREAM, 3000, SOMAXCONN, "0.0.0.0", &addr);
+    if (sfd == -1)
+        fatal("createServer");
+
+    if (runStreamServer(sfd, backend, &handlers, NULL) == -1)
+        fatalWithClose(sfd, "runStreamServer");
+
+    close(sfd);
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,213 @@
+// compares the socket tuning profiles over loopback tcp
+// - latency: every request is written as a header and a body (two sends) and answered with
+//   64 bytes; with Nagle the body waits for the ack of the header, which the peer delays
+// - throughput: a stream of 128 byte records, bulk batches them with MSG_MORE so only
+//   full segments leave, low-latency pushes a segment per record
+// both ends of every test use the profile under test, the server side runs in a thread
+// usage: ./tuning-benchmark [round trips] [megabytes]
+
+#include "utils/socket-library.h"
+#include <pthread.h>
+#include <time.h>
+
+#define DEFAULT_ROUND_TRIPS 200
+#define DEFAULT_MEGABYTES 256
+#define BASE_PORT 3200
+
+#define HEADER_SIZE 16
+#define BODY_SIZE 48
+#define RESPONSE_SIZE 64
+#define RECORD_SIZE 128
+#define RECORDS_PER_BATCH 64
+#define DRAIN_BUFFER_SIZE 65536
+
+typedef enum
+{
+    TEST_LATENCY,
+    TEST_THROUGHPUT
+} TestType;
+
+typedef struct
+{
+    int sfd;
+    TestType type;
+    TuningProfile profile;
+} ServerSide;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compareDoubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void *serve(void *arg)
+{
+    ServerSide *side = arg;
+    char buffer[DRAIN_BUFFER_SIZE];
+
+    int cfd = acceptClient(side->sfd, NULL, NULL);
+    if (cfd == -1)
+    {
+        perror("accept");
+        return NULL;
+    }
+
+    if (side->type == TEST_LATENCY)
+    {
+        char response[RESPONSE_SIZE] = {0};
+
+        while (recv(cfd, buffer, HEADER_SIZE + BODY_SIZE, MSG_WAITALL) == HEADER_SIZE + BODY_SIZE)
+        {
+            // the kernel falls back to delayed acks after a while
+            if (side->profile == TUNING_LOW_LATENCY)
+                refreshQuickAck(cfd);
+            if (send(cfd, response, sizeof(response), MSG_NOSIGNAL) != sizeof(response))
+                break;
+        }
+    }
+    else
+    {
+        while (recv(cfd, buffer, sizeof(buffer), 0) > 0)
+            ;
+
+        // everything arrived, tell the sender
+        send(cfd, "", 1, MSG_NOSIGNAL);
+    }
+
+    close(cfd);
+    return NULL;
+}
+
+// listener and client of one test, both tuned with the profile
+static int openPair(TuningProfile profile, TestType type, ServerSide *side, pthread_t *thread)
+{
+    SocketTuning tuning = {.profile = profile};
+    useSocketTuning(&tuning);
+
+    struct sockaddr_storage addr;
+    int port = BASE_PORT + profile;
+    char service[16];
+    snprintf(service, sizeof(service), "%d", port);
+
+    side->type = type;
+    side->profile = profile;
+    if ((side->sfd = createServer(AF_INET, SOCK_STREAM, port, 1, "127.0.0.1", &addr)) == -1)
+        fatal("createServer");
+
+    if (pthread_create(thread, NULL, serve, side) != 0)
+        fatal("pthread_create");
+
+    int cfd = openConnection(AF_INET, SOCK_STREAM, "127.0.0.1", service, NULL);
+    if (cfd == -1)
+        fatal("openConnection");
+    return cfd;
+}
+
+static void closePair(int cfd, ServerSide *side, pthread_t thread)
+{
+    close(cfd);
+    pthread_join(thread, NULL);
+    close(side->sfd);
+}
+
+static void measureLatency(TuningProfile profile, int roundTrips)
+{
+    ServerSide side;
+    pthread_t thread;
+    int cfd = openPair(profile, TEST_LATENCY, &side, &thread);
+
+    char request[HEADER_SIZE + BODY_SIZE] = {0};
+    char response[RESPONSE_SIZE];
+    double *samples = malloc(sizeof(double) * roundTrips);
+    if (samples == NULL)
+        fatal("malloc");
+
+    // bulk tells the kernel the body follows, so header and body leave as one segment
+    int headerFlags = MSG_NOSIGNAL | (profile == TUNING_BULK ? MSG_MORE : 0);
+    double total = 0;
+    int done = 0;
+
+    for (; done < roundTrips; done++)
+    {
+        double start = now();
+
+        if (send(cfd, request, HEADER_SIZE, headerFlags) != HEADER_SIZE ||
+            send(cfd, request + HEADER_SIZE, BODY_SIZE, MSG_NOSIGNAL) != BODY_SIZE ||
+            recv(cfd, response, sizeof(response), MSG_WAITALL) != sizeof(response))
+            break;
+
+        if (profile == TUNING_LOW_LATENCY)
+            refreshQuickAck(cfd);
+
+        samples[done] = (now() - start) * 1e6;
+        total += samples[done];
+    }
+
+    if (done > 0)
+    {
+        qsort(samples, done, sizeof(double), compareDoubles);
+        printf("%-12s latency     avg %9.1f us  p50 %9.1f us  p99 %9.1f us\n",
+               tuningProfileName(profile), total / done, samples[done / 2], samples[done * 99 / 100]);
+    }
+
+    free(samples);
+    closePair(cfd, &side, thread);
+}
+
+static void measureThroughput(TuningProfile profile, long megabytes)
+{
+    ServerSide side;
+    pthread_t thread;
+    int cfd = openPair(profile, TEST_THROUGHPUT, &side, &thread);
+
+    char record[RECORD_SIZE];
+    memset(record, 'x', sizeof(record));
+    long records = megabytes * 1024 * 1024 / RECORD_SIZE;
+
+    double start = now();
+    for (long i = 0; i < records; i++)
+    {
+        // only the last record of a batch pushes the segment out
+        int flags = MSG_NOSIGNAL;
+        if (profile == TUNING_BULK && (i + 1) % RECORDS_PER_BATCH != 0 && i + 1 < records)
+            flags |= MSG_MORE;
+
+        if (send(cfd, record, sizeof(record), flags) != sizeof(record))
+            fatal("send");
+    }
+
+    // the receiver has everything once it answers the end of stream
+    char done;
+    shutdown(cfd, SHUT_WR);
+    recv(cfd, &done, 1, 0);
+    double seconds = now() - start;
+
+    printf("%-12s throughput  %9.1f MB/s  (%.3f s)\n", tuningProfileName(profile), megabytes / seconds, seconds);
+    closePair(cfd, &side, thread);
+}
+
+int main(int argc, char const *argv[])
+{
+    int roundTrips = argc > 1 ? atoi(argv[1]) : DEFAULT_ROUND_TRIPS;
+    long megabytes = argc > 2 ? atol(argv[2]) : DEFAULT_MEGABYTES;
+    TuningProfile profiles[] = {TUNING_DEFAULT, TUNING_LOW_LATENCY, TUNING_BULK};
+    int count = sizeof(profiles) / sizeof(profiles[0]);
+
+    if (roundTrips <= 0 || megabytes <= 0)
+        exitWithMessage("usage: ./tuning-benchmark [round trips] [megabytes]\n");
+
+    for (int i = 0; i < count; i++)
+        measureLatency(profiles[i], roundTrips);
+
+    for (int i = 0; i < count; i++)
+        measureThroughput(profiles[i], megabytes);
+
+    return 0;
+}
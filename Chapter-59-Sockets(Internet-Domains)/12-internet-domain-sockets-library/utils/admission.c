@@ -0,0 +1,136 @@
+#include "socket-library.h"
+#include <errno.h>
+#include <poll.h>
+
+static AdmissionControl *admission = NULL;
+
+static int openSpareFd(void)
+{
+    return open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+int initAdmissionControl(AdmissionControl *control, size_t maxConnections, int acceptBatch)
+{
+    int spareFd = openSpareFd();
+    if (spareFd == -1)
+        return -1;
+
+    control->maxConnections = maxConnections;
+    control->acceptBatch = acceptBatch;
+    atomic_init(&control->spareFd, spareFd);
+    atomic_init(&control->active, 0);
+    return 0;
+}
+
+void freeAdmissionControl(AdmissionControl *control)
+{
+    int spareFd = atomic_exchange(&control->spareFd, -1);
+    if (spareFd != -1)
+        close(spareFd);
+}
+
+void useAdmissionControl(AdmissionControl *control)
+{
+    admission = control;
+}
+
+int shedClient(int sfd)
+{
+    if (admission == NULL)
+        return -1;
+
+    // another thread is already shedding with the spare
+    int spareFd = atomic_exchange(&admission->spareFd, -1);
+    if (spareFd == -1)
+        return -1;
+
+    close(spareFd);
+
+    // the fd was reserved before looking at the queue, it can be empty (blocking listeners)
+    int shed = -1;
+    struct pollfd pfd = {.fd = sfd, .events = POLLIN};
+    if (poll(&pfd, 1, 0) == 1)
+    {
+        int cfd = accept4(sfd, NULL, NULL, SOCK_CLOEXEC);
+        if (cfd != -1)
+        {
+            close(cfd);
+            metricsIncrement(METRIC_CONNECTIONS_SHED);
+            shed = 0;
+        }
+    }
+
+    // when this fails shedding stops until the next init, the limit still applies
+    atomic_store(&admission->spareFd, openSpareFd());
+    return shed;
+}
+
+int admitAcceptedClient(int cfd)
+{
+    if (admission != NULL)
+    {
+        size_t active = atomic_fetch_add(&admission->active, 1);
+        if (admission->maxConnections > 0 && active >= admission->maxConnections)
+        {
+            atomic_fetch_sub(&admission->active, 1);
+            metricsIncrement(METRIC_CONNECTIONS_REJECTED);
+            close(cfd);
+            return -1;
+        }
+    }
+
+    // counted without a control too, releaseClient balances the active gauge
+    metricsIncrement(METRIC_CONNECTIONS_ACCEPTED);
+    metricsIncrement(METRIC_CONNECTIONS_ACTIVE);
+    return 0;
+}
+
+int admitClient(int sfd, struct sockaddr *addr, socklen_t *addrLen, int flags)
+{
+    int cfd = accept4(sfd, addr, addrLen, flags);
+    metricsIncrement(METRIC_SYSCALLS);
+    if (cfd == -1)
+    {
+        if (errno == EWOULDBLOCK)
+            errno = EAGAIN;
+        if (errno == EAGAIN)
+            metricsIncrement(METRIC_EAGAIN);
+
+        if ((errno == EMFILE || errno == ENFILE) && shedClient(sfd) == 0)
+            errno = ECONNABORTED;
+        return -1;
+    }
+
+    if (admitAcceptedClient(cfd) == -1)
+    {
+        errno = ECONNABORTED;
+        return -1;
+    }
+    return cfd;
+}
+
+void releaseClient(void)
+{
+    if (admission != NULL)
+        atomic_fetch_sub(&admission->active, 1);
+    metricsAdd(METRIC_CONNECTIONS_ACTIVE, -1);
+}
+
+int acceptBatchSize(void)
+{
+    if (admission == NULL || admission->acceptBatch <= 0)
+        return 0;
+    return admission->acceptBatch;
+}
+
+void getAdmissionStats(AdmissionStats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    if (admission == NULL)
+        return;
+
+    stats->active = atomic_load(&admission->active);
+    stats->accepted = metricsValue(METRIC_CONNECTIONS_ACCEPTED);
+    stats->rejected = metricsValue(METRIC_CONNECTIONS_REJECTED);
+    stats->shed = metricsValue(METRIC_CONNECTIONS_SHED);
+}
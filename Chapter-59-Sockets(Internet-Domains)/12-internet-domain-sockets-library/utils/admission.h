@@ -0,0 +1,68 @@
+// admission control for accepting clients
+// - at most maxConnections clients are served at once, the ones above are accepted and
+//   closed right away (rejected) so they fail fast instead of waiting in the backlog
+// - a spare fd is kept open: on EMFILE/ENFILE it is closed, the waiting client is accepted
+//   and closed (shed) and the spare is opened again, so a full fd table does not leave
+//   the listener readable forever and the loop spinning on it
+// - loops take at most acceptBatch clients per wakeup, a connection storm cannot starve
+//   the clients already connected
+// - when nothing can be shed the backends stop accepting for ACCEPT_BACKOFF_MS instead of
+//   retrying a listener which stays readable
+// one control is shared by every backend of the process, the active count is atomic,
+// the other counters are metrics (recorded per thread)
+
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+
+// pause of a listener whose accept failed for lack of fds or memory
+#define ACCEPT_BACKOFF_MS 100
+
+typedef struct
+{
+    size_t maxConnections; // 0 means no limit
+    int acceptBatch;       // <= 0 means until the backlog is empty
+    atomic_int spareFd;
+    atomic_size_t active;
+} AdmissionControl;
+
+typedef struct
+{
+    size_t active;   // admitted and not released yet
+    size_t accepted; // admitted since the start
+    size_t rejected; // closed because of maxConnections
+    size_t shed;     // closed because the process ran out of fds
+} AdmissionStats;
+
+// returns -1 when the spare fd cannot be opened
+int initAdmissionControl(AdmissionControl *control, size_t maxConnections, int acceptBatch);
+
+void freeAdmissionControl(AdmissionControl *control);
+
+// every accept of the process goes through this control, NULL admits everyone
+void useAdmissionControl(AdmissionControl *control);
+
+// accept4 with the admission policy, returns the client or -1 with errno:
+// EAGAIN when the backlog is empty, ECONNABORTED when the client was rejected or shed
+// (accept the next one), anything else is an accept error
+int admitClient(int sfd, struct sockaddr *addr, socklen_t *addrLen, int flags);
+
+// policy for a client accepted some other way (io_uring), returns -1 when it was closed
+int admitAcceptedClient(int cfd);
+
+// call on EMFILE/ENFILE from an accept the control did not make,
+// returns 0 when a waiting client was shed
+int shedClient(int sfd);
+
+// an admitted client was closed
+void releaseClient(void);
+
+// clients to accept per wakeup, 0 means no limit
+int acceptBatchSize(void);
+
+void getAdmissionStats(AdmissionStats *stats);
+
+#endif
@@ -0,0 +1,283 @@
+#include "connection-pool.h"
+#include <errno.h>
+#include <pthread.h>
+
+#define POOL_BUCKETS 64
+
+struct PoolHost
+{
+    char *hostname;
+    char *service;
+    int domain;
+    int type;
+
+    // idle connections, most recently released first
+    PooledConnection *idle;
+    size_t total; // idle + in use + being connected
+
+    pthread_cond_t available;
+    PoolHost *next;
+};
+
+struct ConnectionPool
+{
+    pthread_mutex_t lock;
+    size_t maxPerHost;
+    long idleTimeoutMs;
+    PoolHost *buckets[POOL_BUCKETS];
+    PoolStats stats;
+};
+
+static unsigned long hashKey(int domain, int type, const char *hostname, const char *service)
+{
+    // fnv-1a
+    unsigned long hash = 2166136261u ^ (unsigned long)(domain * 31 + type);
+    for (const char *c = hostname; *c; c++)
+        hash = (hash ^ (unsigned char)*c) * 16777619u;
+    hash = (hash ^ ':') * 16777619u;
+    for (const char *c = service; *c; c++)
+        hash = (hash ^ (unsigned char)*c) * 16777619u;
+    return hash;
+}
+
+static long elapsedMs(const struct timespec *since, const struct timespec *now)
+{
+    return (now->tv_sec - since->tv_sec) * 1000 + (now->tv_nsec - since->tv_nsec) / 1000000;
+}
+
+ConnectionPool *createConnectionPool(size_t maxPerHost, int idleTimeoutMs)
+{
+    ConnectionPool *pool = calloc(1, sizeof(ConnectionPool));
+    if (pool == NULL)
+        return NULL;
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->maxPerHost = maxPerHost;
+    pool->idleTimeoutMs = idleTimeoutMs;
+    return pool;
+}
+
+static void closePooled(PoolHost *host, PooledConnection *conn)
+{
+    close(conn->fd);
+    free(conn);
+    host->total--;
+}
+
+void destroyConnectionPool(ConnectionPool *pool)
+{
+    if (pool == NULL)
+        return;
+
+    for (int i = 0; i < POOL_BUCKETS; i++)
+    {
+        while (pool->buckets[i] != NULL)
+        {
+            PoolHost *host = pool->buckets[i];
+            pool->buckets[i] = host->next;
+
+            while (host->idle != NULL)
+            {
+                PooledConnection *conn = host->idle;
+                host->idle = conn->next;
+                closePooled(host, conn);
+            }
+
+            pthread_cond_destroy(&host->available);
+            free(host->hostname);
+            free(host->service);
+            free(host);
+        }
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+// called with the lock held
+static PoolHost *findHost(ConnectionPool *pool, int domain, int type, const char *hostname, const char *service)
+{
+    PoolHost **bucket = &pool->buckets[hashKey(domain, type, hostname, service) % POOL_BUCKETS];
+
+    for (PoolHost *host = *bucket; host != NULL; host = host->next)
+        if (host->domain == domain && host->type == type &&
+            strcmp(host->hostname, hostname) == 0 && strcmp(host->service, service) == 0)
+            return host;
+
+    PoolHost *host = calloc(1, sizeof(PoolHost));
+    if (host == NULL)
+        return NULL;
+
+    host->hostname = strdup(hostname);
+    host->service = strdup(service);
+    if (host->hostname == NULL || host->service == NULL)
+    {
+        free(host->hostname);
+        free(host->service);
+        free(host);
+        return NULL;
+    }
+
+    host->domain = domain;
+    host->type = type;
+    pthread_cond_init(&host->available, NULL);
+
+    host->next = *bucket;
+    *bucket = host;
+    return host;
+}
+
+// idle list is ordered by release time, so everything after the first expired one is expired too
+static size_t evictExpired(ConnectionPool *pool, PoolHost *host, const struct timespec *now)
+{
+    if (pool->idleTimeoutMs <= 0)
+        return 0;
+
+    PooledConnection **link = &host->idle;
+    while (*link != NULL && elapsedMs(&(*link)->lastUsed, now) < pool->idleTimeoutMs)
+        link = &(*link)->next;
+
+    size_t evicted = 0;
+    while (*link != NULL)
+    {
+        PooledConnection *conn = *link;
+        *link = conn->next;
+        closePooled(host, conn);
+        evicted++;
+    }
+
+    pool->stats.evicted += evicted;
+    if (evicted > 0)
+        pthread_cond_broadcast(&host->available);
+    return evicted;
+}
+
+// an idle stream must have nothing to read: eof means the peer closed it,
+// data means a response was left unread and the stream is out of sync
+static int isAlive(PooledConnection *conn, int type)
+{
+    if (type != SOCK_STREAM)
+        return 1;
+
+    char byte;
+    ssize_t peeked = recv(conn->fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return peeked == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+PooledConnection *poolAcquire(
+    ConnectionPool *pool,
+    int domain,
+    int type,
+    const char *hostname,
+    const char *service)
+{
+    pthread_mutex_lock(&pool->lock);
+
+    PoolHost *host = findHost(pool, domain, type, hostname, service);
+    if (host == NULL)
+    {
+        pthread_mutex_unlock(&pool->lock);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    while (1)
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        evictExpired(pool, host, &now);
+
+        while (host->idle != NULL)
+        {
+            PooledConnection *conn = host->idle;
+            host->idle = conn->next;
+
+            if (isAlive(conn, type))
+            {
+                conn->reused = 1;
+                pool->stats.reused++;
+                pthread_mutex_unlock(&pool->lock);
+                return conn;
+            }
+
+            closePooled(host, conn);
+            pool->stats.dead++;
+        }
+
+        if (pool->maxPerHost == 0 || host->total < pool->maxPerHost)
+            break;
+
+        pthread_cond_wait(&host->available, &pool->lock);
+    }
+
+    // the slot is taken now, connect without holding the lock
+    host->total++;
+    pthread_mutex_unlock(&pool->lock);
+
+    PooledConnection *conn = calloc(1, sizeof(PooledConnection));
+    if (conn != NULL)
+        conn->fd = openConnection(domain, type, hostname, service, &conn->addr);
+
+    if (conn == NULL || conn->fd == -1)
+    {
+        int savedErrno = conn == NULL ? ENOMEM : errno;
+        free(conn);
+
+        pthread_mutex_lock(&pool->lock);
+        host->total--;
+        pthread_cond_signal(&host->available);
+        pthread_mutex_unlock(&pool->lock);
+
+        errno = savedErrno;
+        return NULL;
+    }
+
+    conn->host = host;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stats.connected++;
+    pthread_mutex_unlock(&pool->lock);
+    return conn;
+}
+
+void poolRelease(ConnectionPool *pool, PooledConnection *conn, int reusable)
+{
+    PoolHost *host = conn->host;
+
+    pthread_mutex_lock(&pool->lock);
+
+    if (reusable)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &conn->lastUsed);
+        conn->next = host->idle;
+        host->idle = conn;
+        evictExpired(pool, host, &conn->lastUsed);
+    }
+    else
+        closePooled(host, conn);
+
+    pthread_cond_signal(&host->available);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+size_t poolEvictIdle(ConnectionPool *pool)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    size_t evicted = 0;
+    pthread_mutex_lock(&pool->lock);
+    for (int i = 0; i < POOL_BUCKETS; i++)
+        for (PoolHost *host = pool->buckets[i]; host != NULL; host = host->next)
+            evicted += evictExpired(pool, host, &now);
+    pthread_mutex_unlock(&pool->lock);
+
+    return evicted;
+}
+
+void poolGetStats(ConnectionPool *pool, PoolStats *stats)
+{
+    pthread_mutex_lock(&pool->lock);
+    *stats = pool->stats;
+    pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,59 @@
+// keep-alive connection pool for clients
+// - connections are keyed by (host, service, domain, type)
+// - released connections stay open and are handed out again, most recently used first
+// - at most maxPerHost connections per key (idle + in use), acquire waits for a free slot
+// - idle connections are checked before reuse and closed once idle longer than the timeout
+// one pool can be shared by every thread of a client
+
+#ifndef CONNECTION_POOL_H
+#define CONNECTION_POOL_H
+
+#include "socket-library.h"
+#include <time.h>
+
+typedef struct ConnectionPool ConnectionPool;
+typedef struct PoolHost PoolHost;
+
+typedef struct PooledConnection
+{
+    int fd;
+    struct sockaddr_storage addr;
+    int reused; // 1 when it was taken from the idle list instead of connecting
+
+    // owned by the pool
+    PoolHost *host;
+    struct timespec lastUsed;
+    struct PooledConnection *next;
+} PooledConnection;
+
+typedef struct
+{
+    size_t connected; // new connections opened
+    size_t reused;    // acquires served from the idle list
+    size_t dead;      // idle connections found closed/unusable on checkout
+    size_t evicted;   // idle connections closed by the timeout
+} PoolStats;
+
+// maxPerHost 0 means no limit, idleTimeoutMs 0 keeps idle connections forever
+ConnectionPool *createConnectionPool(size_t maxPerHost, int idleTimeoutMs);
+
+// closes every idle connection, connections in use must be released before
+void destroyConnectionPool(ConnectionPool *pool);
+
+// idle connection for the key or a new one, returns NULL when connecting failed
+PooledConnection *poolAcquire(
+    ConnectionPool *pool,
+    int domain,
+    int type,
+    const char *hostname,
+    const char *service);
+
+// give the connection back, reusable 0 closes it (error, unread response, peer asked to close)
+void poolRelease(ConnectionPool *pool, PooledConnection *conn, int reusable);
+
+// close every idle connection past the timeout, returns how many were closed
+size_t poolEvictIdle(ConnectionPool *pool);
+
+void poolGetStats(ConnectionPool *pool, PoolStats *stats);
+
+#endif
@@ -0,0 +1,350 @@
+#include "event-loop.h"
+#include <errno.h>
+#include <time.h>
+
+struct EventLoop
+{
+    int epfd;
+    int maxEvents;
+    int running;
+    struct epoll_event *events;
+
+    // every registered connection/listener
+    Connection *connections;
+    size_t connectionCount;
+
+    // closed during the current iteration, freed after dispatching
+    Connection *closedConnections;
+
+    // monotonic ms when the paused listeners are watched again, 0 when none is paused
+    long long acceptResumeAt;
+};
+
+static long long nowMs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+EventLoop *createEventLoop(int maxEvents)
+{
+    EventLoop *loop = calloc(1, sizeof(EventLoop));
+    if (loop == NULL)
+        return NULL;
+
+    loop->maxEvents = maxEvents > 0 ? maxEvents : 1024;
+    loop->events = malloc(sizeof(struct epoll_event) * loop->maxEvents);
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+
+    if (loop->events == NULL || loop->epfd == -1)
+    {
+        if (loop->epfd != -1)
+            close(loop->epfd);
+        free(loop->events);
+        free(loop);
+        return NULL;
+    }
+    return loop;
+}
+
+// link the connection in the list of registered connections
+static void linkConnection(EventLoop *loop, Connection *conn)
+{
+    conn->prev = NULL;
+    conn->next = loop->connections;
+    if (loop->connections != NULL)
+        loop->connections->prev = conn;
+    loop->connections = conn;
+
+    if (!conn->isListener)
+        loop->connectionCount++;
+}
+
+static void unlinkConnection(EventLoop *loop, Connection *conn)
+{
+    if (conn->prev != NULL)
+        conn->prev->next = conn->next;
+    else
+        loop->connections = conn->next;
+    if (conn->next != NULL)
+        conn->next->prev = conn->prev;
+
+    if (!conn->isListener)
+        loop->connectionCount--;
+}
+
+static void freeClosedConnections(EventLoop *loop)
+{
+    while (loop->closedConnections != NULL)
+    {
+        Connection *conn = loop->closedConnections;
+        loop->closedConnections = conn->next;
+        free(conn);
+    }
+}
+
+// allocate and register a connection, EPOLLET is part of events for clients
+static Connection *registerConnection(
+    EventLoop *loop,
+    int fd,
+    uint32_t events,
+    const ConnectionCallbacks *callbacks,
+    void *userData)
+{
+    Connection *conn = calloc(1, sizeof(Connection));
+    if (conn == NULL)
+        return NULL;
+
+    conn->fd = fd;
+    conn->loop = loop;
+    conn->callbacks = callbacks;
+    conn->userData = userData;
+    conn->addrLen = sizeof(conn->addr);
+
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = conn;
+
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+    {
+        free(conn);
+        return NULL;
+    }
+    return conn;
+}
+
+void destroyEventLoop(EventLoop *loop)
+{
+    if (loop == NULL)
+        return;
+
+    // close everything still registered, listeners are left to the caller
+    while (loop->connections != NULL)
+    {
+        Connection *conn = loop->connections;
+        if (conn->isListener)
+        {
+            unlinkConnection(loop, conn);
+            free(conn);
+            continue;
+        }
+        closeConnection(conn);
+    }
+    freeClosedConnections(loop);
+
+    close(loop->epfd);
+    free(loop->events);
+    free(loop);
+}
+
+int eventLoopAddListener(EventLoop *loop, int sfd, const ConnectionCallbacks *callbacks, void *userData)
+{
+    if (setNonBlocking(sfd) == -1)
+        return -1;
+
+    // level triggered, clients left over by a batch are reported again
+    Connection *listener = registerConnection(loop, sfd, EPOLLIN, callbacks, userData);
+    if (listener == NULL)
+        return -1;
+
+    listener->isListener = 1;
+    linkConnection(loop, listener);
+    return 0;
+}
+
+Connection *eventLoopAddConnection(EventLoop *loop, int fd, const ConnectionCallbacks *callbacks, void *userData)
+{
+    if (setNonBlocking(fd) == -1)
+        return NULL;
+
+    // EPOLLOUT is registered once, with edge triggering it only fires when the buffer drains
+    Connection *conn = registerConnection(loop, fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, callbacks, userData);
+    if (conn == NULL)
+        return NULL;
+
+    conn->addrLen = 0;
+    linkConnection(loop, conn);
+
+    if (callbacks != NULL && callbacks->onOpen != NULL)
+        callbacks->onOpen(conn);
+    return conn;
+}
+
+// the listener stays readable while accept fails, so it is taken out of epoll for a while
+static void pauseListener(EventLoop *loop, Connection *listener)
+{
+    struct epoll_event ev;
+    ev.events = 0;
+    ev.data.ptr = listener;
+
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, listener->fd, &ev) == -1)
+        return;
+
+    listener->acceptPaused = 1;
+    if (loop->acceptResumeAt == 0)
+        loop->acceptResumeAt = nowMs() + ACCEPT_BACKOFF_MS;
+}
+
+static void resumeListeners(EventLoop *loop)
+{
+    for (Connection *conn = loop->connections; conn != NULL; conn = conn->next)
+    {
+        if (!conn->isListener || !conn->acceptPaused)
+            continue;
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = conn;
+
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, conn->fd, &ev) == 0)
+            conn->acceptPaused = 0;
+    }
+    loop->acceptResumeAt = 0;
+}
+
+// accept one batch of pending clients
+static void acceptPendingClients(EventLoop *loop, Connection *listener)
+{
+    int batch = acceptBatchSize();
+
+    for (int accepted = 0; !listener->closed && (batch == 0 || accepted < batch); accepted++)
+    {
+        struct sockaddr_storage addr;
+        socklen_t addrLen = sizeof(addr);
+
+        int cfd = admitClient(listener->fd, (struct sockaddr *)&addr, &addrLen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (cfd == -1)
+        {
+            // interrupted, client already gone, rejected or shed: try the next one
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+
+            // queue is empty
+            if (errno == EAGAIN)
+                break;
+
+            // out of fds (and no spare left to shed) or memory, retrying right away would only spin
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+            {
+                pauseListener(loop, listener);
+                break;
+            }
+
+            perror("accept4");
+            break;
+        }
+
+        Connection *conn = registerConnection(loop, cfd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, listener->callbacks, listener->userData);
+        if (conn == NULL)
+        {
+            close(cfd);
+            releaseClient();
+            continue;
+        }
+
+        tuneAcceptedSocket(cfd);
+        memcpy(&conn->addr, &addr, addrLen);
+        conn->addrLen = addrLen;
+        conn->admitted = 1;
+        linkConnection(loop, conn);
+
+        if (conn->callbacks != NULL && conn->callbacks->onOpen != NULL)
+            conn->callbacks->onOpen(conn);
+    }
+}
+
+static void dispatchEvent(EventLoop *loop, Connection *conn, uint32_t events)
+{
+    if (conn->closed)
+        return;
+
+    if (conn->isListener)
+    {
+        acceptPendingClients(loop, conn);
+        return;
+    }
+
+    const ConnectionCallbacks *callbacks = conn->callbacks;
+
+    // errors and hangups are reported as readable so the callback sees the failing recv
+    if ((events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && callbacks->onReadable != NULL)
+        callbacks->onReadable(conn);
+
+    if (conn->closed)
+        return;
+
+    if ((events & EPOLLOUT) && callbacks->onWritable != NULL)
+        callbacks->onWritable(conn);
+
+    // nobody handles the error, so drop the connection
+    if (!conn->closed && (events & (EPOLLHUP | EPOLLERR)) && callbacks->onReadable == NULL)
+        closeConnection(conn);
+}
+
+int eventLoopRun(EventLoop *loop)
+{
+    loop->running = 1;
+
+    while (loop->running)
+    {
+        int timeout = -1;
+        if (loop->acceptResumeAt != 0)
+        {
+            long long left = loop->acceptResumeAt - nowMs();
+            timeout = left > 0 ? (int)left : 0;
+        }
+
+        int nEvents = epoll_wait(loop->epfd, loop->events, loop->maxEvents, timeout);
+        metricsIncrement(METRIC_SYSCALLS);
+        if (nEvents == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        for (int i = 0; i < nEvents; i++)
+            dispatchEvent(loop, loop->events[i].data.ptr, loop->events[i].events);
+
+        // now no event of this batch can point to a closed connection
+        freeClosedConnections(loop);
+
+        if (loop->acceptResumeAt != 0 && nowMs() >= loop->acceptResumeAt)
+            resumeListeners(loop);
+    }
+    return 0;
+}
+
+void eventLoopStop(EventLoop *loop)
+{
+    loop->running = 0;
+}
+
+void closeConnection(Connection *conn)
+{
+    if (conn->closed)
+        return;
+    conn->closed = 1;
+
+    EventLoop *loop = conn->loop;
+
+    if (conn->callbacks != NULL && conn->callbacks->onClose != NULL && !conn->isListener)
+        conn->callbacks->onClose(conn);
+
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    freeOutputQueue(&conn->output);
+
+    if (conn->admitted)
+        releaseClient();
+
+    unlinkConnection(loop, conn);
+    conn->next = loop->closedConnections;
+    loop->closedConnections = conn;
+}
+
+size_t eventLoopConnectionCount(const EventLoop *loop)
+{
+    return loop->connectionCount;
+}
@@ -0,0 +1,92 @@
+// edge triggered epoll reactor
+// - listeners are level triggered, each wakeup accepts at most acceptBatchSize() clients
+//   through the admission control, the rest are taken on the next iteration
+// - a listener whose accept fails for lack of fds or memory is paused for a moment
+// - every accepted client becomes a Connection with its own callbacks
+// - readable/writable callbacks must drain the socket until EAGAIN (edge triggered)
+
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include "socket-library.h"
+#include "output-queue.h"
+#include <stdint.h>
+#include <sys/epoll.h>
+
+typedef struct EventLoop EventLoop;
+typedef struct Connection Connection;
+
+typedef void (*ConnectionCallback)(Connection *conn);
+
+// callbacks of a connection, any of them can be NULL
+typedef struct
+{
+    ConnectionCallback onOpen;     // connection accepted/registered
+    ConnectionCallback onReadable; // data (or eof) is available
+    ConnectionCallback onWritable; // socket buffer has space again
+    ConnectionCallback onClose;    // connection is about to be closed
+} ConnectionCallbacks;
+
+// used by backends which do not own connections through the event loop (io_uring)
+typedef struct
+{
+    ssize_t (*send)(Connection *conn, const void *data, size_t len);
+    // takes ownership of fileFd, NULL when the backend can only send memory
+    int (*sendFile)(Connection *conn, int fileFd, off_t offset, size_t len);
+    void (*close)(Connection *conn);
+    size_t (*queuedBytes)(Connection *conn);
+} ConnectionOps;
+
+struct Connection
+{
+    int fd;
+    struct sockaddr_storage addr;
+    socklen_t addrLen;
+    EventLoop *loop;
+    const ConnectionCallbacks *callbacks;
+    void *userData;
+    void *state; // per connection data of the handlers, NULL until they set it
+
+    // NULL when the connection belongs to the event loop or the blocking backend
+    const ConnectionOps *ops;
+
+    // data waiting for the socket, flushed with one sendmsg per batch
+    OutputQueue output;
+    int readPaused;
+    int closeWhenFlushed;
+    int lingering; // output shut down, input discarded until eof
+    size_t discarded;
+
+    // internal state of the loop
+    int isListener;
+    int acceptPaused; // listener out of epoll after accept ran out of resources
+    int admitted;     // counted by the admission control until closed
+    int closed;
+    Connection *prev, *next;
+};
+
+// create an epoll instance which can report maxEvents per wait
+EventLoop *createEventLoop(int maxEvents);
+
+// free the loop, all the connections still registered are closed
+void destroyEventLoop(EventLoop *loop);
+
+// register a listening socket, accepted clients will get the callbacks
+int eventLoopAddListener(EventLoop *loop, int sfd, const ConnectionCallbacks *callbacks, void *userData);
+
+// register an already connected socket (client side, pipes etc.)
+Connection *eventLoopAddConnection(EventLoop *loop, int fd, const ConnectionCallbacks *callbacks, void *userData);
+
+// run until eventLoopStop is called, returns -1 when epoll_wait fails
+int eventLoopRun(EventLoop *loop);
+
+// make eventLoopRun return after the current iteration
+void eventLoopStop(EventLoop *loop);
+
+// unregister and close the connection, memory is released after the current iteration
+void closeConnection(Connection *conn);
+
+// number of open connections (listeners excluded)
+size_t eventLoopConnectionCount(const EventLoop *loop);
+
+#endif
@@ -0,0 +1,268 @@
+#include "frame-reader.h"
+#include <errno.h>
+#include <sys/uio.h>
+
+#define FRAME_INITIAL_CAPACITY 4096
+#define FRAME_MIN_READ 1024
+#define FRAME_PREFIX_SIZE 4
+
+int initFrameReader(
+    FrameReader *reader,
+    FrameMode mode,
+    const char *delimiter,
+    size_t maxFrameSize,
+    FrameCallback onFrame,
+    void *userData)
+{
+    memset(reader, 0, sizeof(*reader));
+
+    reader->data = malloc(FRAME_INITIAL_CAPACITY);
+    if (reader->data == NULL)
+        return -1;
+
+    reader->capacity = FRAME_INITIAL_CAPACITY;
+    reader->mode = mode;
+    reader->maxFrameSize = maxFrameSize;
+    reader->onFrame = onFrame;
+    reader->userData = userData;
+
+    if (mode == FRAME_DELIMITER)
+    {
+        reader->delimiterLen = strlen(delimiter);
+        if (reader->delimiterLen == 0 || reader->delimiterLen >= sizeof(reader->delimiter))
+        {
+            free(reader->data);
+            errno = EINVAL;
+            return -1;
+        }
+        memcpy(reader->delimiter, delimiter, reader->delimiterLen);
+    }
+    return 0;
+}
+
+void freeFrameReader(FrameReader *reader)
+{
+    free(reader->data);
+    free(reader->scratch);
+    memset(reader, 0, sizeof(*reader));
+}
+
+size_t frameReaderPending(const FrameReader *reader)
+{
+    return reader->tail - reader->head;
+}
+
+// copy len bytes starting at the absolute position pos, handling the wrap around
+static void ringCopyOut(const FrameReader *reader, size_t pos, char *dest, size_t len)
+{
+    size_t offset = pos & (reader->capacity - 1);
+    size_t first = reader->capacity - offset < len ? reader->capacity - offset : len;
+
+    memcpy(dest, reader->data + offset, first);
+    memcpy(dest + first, reader->data, len - first);
+}
+
+// make room for at least needed more bytes, the content is linearized on growth
+static int ringReserve(FrameReader *reader, size_t needed)
+{
+    size_t used = reader->tail - reader->head;
+    if (reader->capacity - used >= needed)
+        return 0;
+
+    size_t capacity = reader->capacity;
+    while (capacity - used < needed)
+        capacity *= 2;
+
+    char *data = malloc(capacity);
+    if (data == NULL)
+        return -1;
+
+    ringCopyOut(reader, reader->head, data, used);
+    free(reader->data);
+
+    reader->data = data;
+    reader->capacity = capacity;
+    reader->scanned -= reader->head;
+    reader->tail = used;
+    reader->head = 0;
+    return 0;
+}
+
+static int deliverFrame(FrameReader *reader, size_t pos, size_t len)
+{
+    size_t offset = pos & (reader->capacity - 1);
+
+    // contiguous in the ring, the callback reads it in place
+    if (offset + len <= reader->capacity)
+        return reader->onFrame(reader->userData, reader->data + offset, len);
+
+    if (reader->scratchSize < len)
+    {
+        char *scratch = realloc(reader->scratch, len);
+        if (scratch == NULL)
+            return -1;
+        reader->scratch = scratch;
+        reader->scratchSize = len;
+    }
+
+    ringCopyOut(reader, pos, reader->scratch, len);
+    return reader->onFrame(reader->userData, reader->scratch, len);
+}
+
+static int delimiterAt(const FrameReader *reader, size_t pos)
+{
+    for (size_t i = 0; i < reader->delimiterLen; i++)
+        if (reader->data[(pos + i) & (reader->capacity - 1)] != reader->delimiter[i])
+            return 0;
+    return 1;
+}
+
+// search the delimiter from the absolute position from, memchr on each contiguous part
+static int findDelimiter(const FrameReader *reader, size_t from, size_t *found)
+{
+    size_t pos = from;
+
+    while (pos + reader->delimiterLen <= reader->tail)
+    {
+        size_t offset = pos & (reader->capacity - 1);
+        size_t contiguous = reader->capacity - offset;
+        if (contiguous > reader->tail - pos)
+            contiguous = reader->tail - pos;
+
+        char *hit = memchr(reader->data + offset, reader->delimiter[0], contiguous);
+        if (hit == NULL)
+        {
+            pos += contiguous;
+            continue;
+        }
+
+        pos += hit - (reader->data + offset);
+        if (pos + reader->delimiterLen > reader->tail)
+            return 0;
+
+        if (delimiterAt(reader, pos))
+        {
+            *found = pos;
+            return 1;
+        }
+        pos++;
+    }
+    return 0;
+}
+
+// deliver every complete frame in the buffer
+static int parseFrames(FrameReader *reader)
+{
+    while (1)
+    {
+        size_t used = reader->tail - reader->head;
+        size_t frameStart, frameLen, frameEnd;
+
+        if (reader->mode == FRAME_LENGTH_PREFIX)
+        {
+            if (used < FRAME_PREFIX_SIZE)
+                break;
+
+            uint32_t prefix;
+            ringCopyOut(reader, reader->head, (char *)&prefix, FRAME_PREFIX_SIZE);
+            frameLen = ntohl(prefix);
+
+            if (frameLen > reader->maxFrameSize)
+            {
+                errno = EMSGSIZE;
+                return -1;
+            }
+
+            // incomplete, make sure the whole frame will fit once it arrives
+            if (used < FRAME_PREFIX_SIZE + frameLen)
+            {
+                if (ringReserve(reader, FRAME_PREFIX_SIZE + frameLen - used) == -1)
+                    return -1;
+                break;
+            }
+
+            frameStart = reader->head + FRAME_PREFIX_SIZE;
+            frameEnd = frameStart + frameLen;
+        }
+        else
+        {
+            size_t from = reader->scanned > reader->head ? reader->scanned : reader->head;
+            size_t found;
+
+            if (!findDelimiter(reader, from, &found))
+            {
+                // the next search starts where a delimiter could still begin
+                size_t keep = reader->delimiterLen - 1;
+                reader->scanned = used > keep ? reader->tail - keep : reader->head;
+
+                if (used > reader->maxFrameSize + reader->delimiterLen)
+                {
+                    errno = EMSGSIZE;
+                    return -1;
+                }
+                break;
+            }
+
+            frameStart = reader->head;
+            frameLen = found - reader->head;
+            frameEnd = found + reader->delimiterLen;
+        }
+
+        if (deliverFrame(reader, frameStart, frameLen) == -1)
+        {
+            errno = ECANCELED;
+            return -1;
+        }
+
+        reader->head = frameEnd;
+        reader->scanned = frameEnd;
+    }
+
+    // empty buffer starts over at offset 0, so the next frames are contiguous
+    if (reader->head == reader->tail)
+        reader->head = reader->tail = reader->scanned = 0;
+    return 0;
+}
+
+ssize_t frameReaderRead(FrameReader *reader, int fd)
+{
+    if (reader->capacity - (reader->tail - reader->head) < FRAME_MIN_READ &&
+        ringReserve(reader, FRAME_MIN_READ) == -1)
+        return -1;
+
+    size_t freeSpace = reader->capacity - (reader->tail - reader->head);
+    size_t offset = reader->tail & (reader->capacity - 1);
+    size_t first = reader->capacity - offset < freeSpace ? reader->capacity - offset : freeSpace;
+
+    // free space can wrap around, readv fills both parts with one syscall
+    struct iovec iov[2];
+    iov[0].iov_base = reader->data + offset;
+    iov[0].iov_len = first;
+    iov[1].iov_base = reader->data;
+    iov[1].iov_len = freeSpace - first;
+
+    ssize_t bytes_read = readv(fd, iov, iov[1].iov_len > 0 ? 2 : 1);
+    if (bytes_read <= 0)
+        return bytes_read;
+
+    reader->tail += bytes_read;
+
+    if (parseFrames(reader) == -1)
+        return -1;
+    return bytes_read;
+}
+
+int frameReaderFeed(FrameReader *reader, const char *data, size_t len)
+{
+    if (ringReserve(reader, len) == -1)
+        return -1;
+
+    size_t offset = reader->tail & (reader->capacity - 1);
+    size_t first = reader->capacity - offset < len ? reader->capacity - offset : len;
+
+    memcpy(reader->data + offset, data, first);
+    memcpy(reader->data, data + first, len - first);
+    reader->tail += len;
+
+    return parseFrames(reader);
+}
@@ -0,0 +1,67 @@
+// framed stream reader
+// - bytes are read into a growable ring buffer (readv fills both free regions at once)
+// - frames are cut by a big endian length prefix or by a delimiter
+// - every complete frame goes to the callback, pointing into the ring when it is contiguous
+// so many pipelined requests are handled per read syscall
+
+#ifndef FRAME_READER_H
+#define FRAME_READER_H
+
+#include "socket-library.h"
+#include <stdint.h>
+
+typedef enum
+{
+    FRAME_LENGTH_PREFIX, // uint32_t length in network byte order, then the payload
+    FRAME_DELIMITER      // payload, then the delimiter (for example "\r\n")
+} FrameMode;
+
+// frame is valid only during the call, the prefix/delimiter is not part of it
+// return -1 to stop parsing (the reader then reports an error)
+typedef int (*FrameCallback)(void *userData, const char *frame, size_t len);
+
+typedef struct
+{
+    // ring buffer, capacity is a power of 2, head/tail only grow
+    char *data;
+    size_t capacity;
+    size_t head;
+    size_t tail;
+
+    FrameMode mode;
+    char delimiter[8];
+    size_t delimiterLen;
+    size_t maxFrameSize;
+    size_t scanned; // delimiter search resumes here
+
+    // used only for frames which wrap around the end of the ring
+    char *scratch;
+    size_t scratchSize;
+
+    FrameCallback onFrame;
+    void *userData;
+} FrameReader;
+
+// delimiter is ignored for FRAME_LENGTH_PREFIX, returns -1 when allocation fails
+int initFrameReader(
+    FrameReader *reader,
+    FrameMode mode,
+    const char *delimiter,
+    size_t maxFrameSize,
+    FrameCallback onFrame,
+    void *userData);
+
+void freeFrameReader(FrameReader *reader);
+
+// one readv from fd then every complete frame is delivered
+// returns bytes read, 0 on eof and -1 on error (errno EAGAIN when nothing was available,
+// EMSGSIZE when a frame exceeds maxFrameSize)
+ssize_t frameReaderRead(FrameReader *reader, int fd);
+
+// same as frameReaderRead for data received some other way (stream server handlers)
+int frameReaderFeed(FrameReader *reader, const char *data, size_t len);
+
+// bytes buffered which are not a complete frame yet
+size_t frameReaderPending(const FrameReader *reader);
+
+#endif
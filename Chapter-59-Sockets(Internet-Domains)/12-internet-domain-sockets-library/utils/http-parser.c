@@ -0,0 +1,567 @@
+#include "http-parser.h"
+#include <ctype.h>
+#include <strings.h>
+
+// longest chunk size line (size and extensions) accepted
+#define CHUNK_LINE_MAX 1024
+
+enum
+{
+    CHUNK_SIZE,     // hex size line
+    CHUNK_DATA,     // chunkLeft bytes of data
+    CHUNK_DATA_END, // CRLF after the data
+    CHUNK_TRAILER   // trailer lines until an empty one
+};
+
+void initHttpParser(HttpParser *parser, size_t maxHeadSize, size_t maxBodySize)
+{
+    memset(parser, 0, sizeof(*parser));
+    parser->maxHeadSize = maxHeadSize > 0 ? maxHeadSize : HTTP_DEFAULT_MAX_HEAD_SIZE;
+    parser->maxBodySize = maxBodySize > 0 ? maxBodySize : HTTP_DEFAULT_MAX_BODY_SIZE;
+}
+
+void freeHttpParser(HttpParser *parser)
+{
+    free(parser->chunkBody);
+    parser->chunkBody = NULL;
+    parser->chunkBodyCapacity = 0;
+}
+
+int httpSliceEquals(HttpSlice slice, const char *str)
+{
+    size_t len = strlen(str);
+    return slice.len == len && strncasecmp(slice.data, str, len) == 0;
+}
+
+const HttpSlice *httpFindHeader(const HttpHeader *headers, size_t count, const char *name)
+{
+    for (size_t i = 0; i < count; i++)
+        if (httpSliceEquals(headers[i].name, name))
+            return &headers[i].value;
+    return NULL;
+}
+
+const char *httpStatusText(int status)
+{
+    switch (status)
+    {
+    case 100:
+        return "Continue";
+    case 200:
+        return "OK";
+    case 204:
+        return "No Content";
+    case 206:
+        return "Partial Content";
+    case 301:
+        return "Moved Permanently";
+    case 304:
+        return "Not Modified";
+    case 400:
+        return "Bad Request";
+    case 403:
+        return "Forbidden";
+    case 404:
+        return "Not Found";
+    case 405:
+        return "Method Not Allowed";
+    case 413:
+        return "Content Too Large";
+    case 431:
+        return "Request Header Fields Too Large";
+    case 500:
+        return "Internal Server Error";
+    case 501:
+        return "Not Implemented";
+    case 502:
+        return "Bad Gateway";
+    case 503:
+        return "Service Unavailable";
+    case 504:
+        return "Gateway Timeout";
+    case 505:
+        return "HTTP Version Not Supported";
+    default:
+        return "Unknown";
+    }
+}
+
+static int fail(HttpParser *parser, int status)
+{
+    parser->status = status;
+    return -1;
+}
+
+int httpListContains(HttpSlice list, const char *token)
+{
+    size_t tokenLen = strlen(token);
+    const char *p = list.data, *end = list.data + list.len;
+
+    while (p < end)
+    {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            p++;
+
+        const char *start = p;
+        while (p < end && *p != ',')
+            p++;
+
+        const char *last = p;
+        while (last > start && (last[-1] == ' ' || last[-1] == '\t'))
+            last--;
+
+        if ((size_t)(last - start) == tokenLen && strncasecmp(start, token, tokenLen) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+// the last coding of Transfer-Encoding has to be chunked, nothing else is decoded
+static int lastCodingIsChunked(HttpSlice list)
+{
+    const char *end = list.data + list.len;
+    while (end > list.data && (end[-1] == ' ' || end[-1] == '\t'))
+        end--;
+
+    const char *start = end;
+    while (start > list.data && start[-1] != ',' && start[-1] != ' ' && start[-1] != '\t')
+        start--;
+
+    return end - start == 7 && strncasecmp(start, "chunked", 7) == 0;
+}
+
+static int parseLength(HttpSlice value, size_t *length)
+{
+    if (value.len == 0 || value.len > 18)
+        return -1;
+
+    size_t n = 0;
+    for (size_t i = 0; i < value.len; i++)
+    {
+        if (!isdigit((unsigned char)value.data[i]))
+            return -1;
+        n = n * 10 + (value.data[i] - '0');
+    }
+    *length = n;
+    return 0;
+}
+
+static int parseRequestLine(HttpParser *parser, const char *line, size_t len)
+{
+    HttpRequest *request = &parser->request;
+    const char *end = line + len;
+
+    const char *space = memchr(line, ' ', len);
+    if (space == NULL || space == line)
+        return fail(parser, 400);
+    request->method = (HttpSlice){line, space - line};
+
+    const char *target = space + 1;
+    space = memchr(target, ' ', end - target);
+    if (space == NULL || space == target)
+        return fail(parser, 400);
+    request->target = (HttpSlice){target, space - target};
+
+    // "*" (OPTIONS) and absolute forms are accepted, only origin forms get a path
+    const char *question = memchr(target, '?', request->target.len);
+    if (question != NULL)
+    {
+        request->path = (HttpSlice){target, question - target};
+        request->query = (HttpSlice){question + 1, space - question - 1};
+    }
+    else
+    {
+        request->path = request->target;
+        request->query = (HttpSlice){space, 0};
+    }
+
+    const char *version = space + 1;
+    if (end - version != 8 || memcmp(version, "HTTP/", 5) != 0)
+        return fail(parser, 400);
+    if (version[5] != '1' || version[6] != '.' || (version[7] != '0' && version[7] != '1'))
+        return fail(parser, 505);
+
+    request->versionMinor = version[7] - '0';
+    return 0;
+}
+
+// status line of a response: "HTTP/1.1 200 OK"
+static int parseStatusLine(HttpParser *parser, const char *line, size_t len)
+{
+    HttpResponse *response = &parser->response;
+
+    if (len < 12 || memcmp(line, "HTTP/1.", 7) != 0 || (line[7] != '0' && line[7] != '1') || line[8] != ' ')
+        return fail(parser, 502);
+    if (!isdigit((unsigned char)line[9]) || !isdigit((unsigned char)line[10]) || !isdigit((unsigned char)line[11]))
+        return fail(parser, 502);
+    if (len > 12 && line[12] != ' ')
+        return fail(parser, 502);
+
+    response->versionMinor = line[7] - '0';
+    response->status = (line[9] - '0') * 100 + (line[10] - '0') * 10 + (line[11] - '0');
+    response->reason = len > 13 ? (HttpSlice){line + 13, len - 13} : (HttpSlice){line + len, 0};
+    return 0;
+}
+
+// header fields after the first line, up to the empty line, returns 1 with a Content-Length
+// framing headers are applied to the parser, malformed input fails with badStatus
+static int parseHeaderLines(
+    HttpParser *parser,
+    const char *p,
+    const char *end,
+    int versionMinor,
+    HttpHeader *headers,
+    size_t *headerCount,
+    int *keepAlive,
+    int *expectContinue,
+    int badStatus)
+{
+    int closeRequested = 0, keepAliveRequested = 0, hasLength = 0;
+
+    *headerCount = 0;
+
+    while (1)
+    {
+        // the head ends with CRLF CRLF, so every line has its LF
+        const char *lf = memchr(p, '\n', end - p);
+        if (lf == p || lf[-1] != '\r')
+            return fail(parser, badStatus);
+
+        size_t lineLen = lf - 1 - p;
+        if (lineLen == 0)
+            break;
+
+        // obsolete line folding
+        if (*p == ' ' || *p == '\t')
+            return fail(parser, badStatus);
+
+        const char *colon = memchr(p, ':', lineLen);
+        if (colon == NULL || colon == p || colon[-1] == ' ' || colon[-1] == '\t')
+            return fail(parser, badStatus);
+
+        if (*headerCount == HTTP_MAX_HEADERS)
+            return fail(parser, badStatus == 400 ? 431 : badStatus);
+
+        const char *value = colon + 1, *valueEnd = lf - 1;
+        while (value < valueEnd && (*value == ' ' || *value == '\t'))
+            value++;
+        while (valueEnd > value && (valueEnd[-1] == ' ' || valueEnd[-1] == '\t'))
+            valueEnd--;
+
+        HttpHeader *header = &headers[(*headerCount)++];
+        header->name = (HttpSlice){p, colon - p};
+        header->value = (HttpSlice){value, valueEnd - value};
+
+        // framing and connection handling, the rest is for the caller
+        if (httpSliceEquals(header->name, "content-length"))
+        {
+            size_t length;
+            if (parseLength(header->value, &length) == -1 || (hasLength && length != parser->bodyLength))
+                return fail(parser, badStatus);
+            parser->bodyLength = length;
+            hasLength = 1;
+        }
+        else if (httpSliceEquals(header->name, "transfer-encoding"))
+        {
+            if (!lastCodingIsChunked(header->value))
+                return fail(parser, badStatus == 400 ? 501 : badStatus);
+            parser->bodyChunked = 1;
+        }
+        else if (httpSliceEquals(header->name, "connection"))
+        {
+            closeRequested |= httpListContains(header->value, "close");
+            keepAliveRequested |= httpListContains(header->value, "keep-alive");
+        }
+        else if (expectContinue != NULL && httpSliceEquals(header->name, "expect"))
+            *expectContinue = httpSliceEquals(header->value, "100-continue");
+
+        p = lf + 1;
+    }
+
+    // both framings at once is how requests are smuggled past proxies
+    if (parser->bodyChunked && hasLength)
+        return fail(parser, badStatus);
+
+    if (parser->bodyLength > parser->maxBodySize)
+        return fail(parser, badStatus == 400 ? 413 : badStatus);
+
+    // persistent by default since http/1.1
+    *keepAlive = versionMinor >= 1 ? !closeRequested : keepAliveRequested && !closeRequested;
+    return hasLength;
+}
+
+// fill the request or the response from the complete head (first line, headers, empty line)
+static int parseHead(HttpParser *parser, const char *head, size_t headLen, int isResponse, int noBody)
+{
+    const char *lf = memchr(head, '\n', headLen);
+    if (lf == head || lf[-1] != '\r')
+        return fail(parser, isResponse ? 502 : 400);
+
+    size_t lineLen = lf - 1 - head;
+    const char *end = head + headLen;
+    int hasLength;
+
+    parser->bodyLength = 0;
+    parser->bodyChunked = 0;
+    parser->bodyUntilEof = 0;
+
+    if (!isResponse)
+    {
+        HttpRequest *request = &parser->request;
+        memset(request, 0, sizeof(*request));
+
+        if (parseRequestLine(parser, head, lineLen) == -1)
+            return -1;
+
+        hasLength = parseHeaderLines(parser, lf + 1, end, request->versionMinor, request->headers,
+                                     &request->headerCount, &request->keepAlive, &request->expectContinue, 400);
+        if (hasLength == -1)
+            return -1;
+
+        request->contentLength = parser->bodyLength;
+        request->chunked = parser->bodyChunked;
+        return 0;
+    }
+
+    HttpResponse *response = &parser->response;
+    memset(response, 0, sizeof(*response));
+
+    if (parseStatusLine(parser, head, lineLen) == -1)
+        return -1;
+
+    hasLength = parseHeaderLines(parser, lf + 1, end, response->versionMinor, response->headers,
+                                 &response->headerCount, &response->keepAlive, NULL, 502);
+    if (hasLength == -1)
+        return -1;
+
+    // 1xx, 204 and 304 never have a body, neither does the answer to HEAD
+    if (noBody || response->status < 200 || response->status == 204 || response->status == 304)
+    {
+        parser->bodyLength = 0;
+        parser->bodyChunked = 0;
+    }
+    else if (!parser->bodyChunked && !hasLength)
+    {
+        parser->bodyUntilEof = 1;
+        response->keepAlive = 0;
+    }
+
+    response->contentLength = parser->bodyLength;
+    response->chunked = parser->bodyChunked;
+    return 0;
+}
+
+static int appendChunk(HttpParser *parser, const char *data, size_t len)
+{
+    if (parser->chunkBodyLen + len > parser->chunkBodyCapacity)
+    {
+        size_t capacity = parser->chunkBodyCapacity > 0 ? parser->chunkBodyCapacity : 4096;
+        while (capacity < parser->chunkBodyLen + len)
+            capacity *= 2;
+
+        char *body = realloc(parser->chunkBody, capacity);
+        if (body == NULL)
+            return fail(parser, 500);
+        parser->chunkBody = body;
+        parser->chunkBodyCapacity = capacity;
+    }
+
+    memcpy(parser->chunkBody + parser->chunkBodyLen, data, len);
+    parser->chunkBodyLen += len;
+    return 0;
+}
+
+static int parseChunkSize(HttpParser *parser, const char *line, const char *end, size_t *size)
+{
+    size_t n = 0;
+    const char *p = line;
+
+    for (; p < end && isxdigit((unsigned char)*p); p++)
+    {
+        if (n >> (sizeof(size_t) * 8 - 4) != 0)
+            return fail(parser, 413);
+        n = n * 16 + (isdigit((unsigned char)*p) ? *p - '0' : (tolower((unsigned char)*p) - 'a' + 10));
+    }
+
+    // extensions after ';' are ignored
+    if (p == line || (p < end && *p != ';' && *p != ' ' && *p != '\t'))
+        return fail(parser, 400);
+
+    *size = n;
+    return 0;
+}
+
+// decode as many chunks as have arrived, returns 1 once the last chunk and trailers are
+// in, 0 when more bytes are needed and -1 on malformed input
+static int decodeChunks(HttpParser *parser, const char *message, size_t len)
+{
+    while (1)
+    {
+        const char *p = message + parser->rawOffset;
+        size_t available = len - parser->rawOffset;
+
+        switch (parser->chunkState)
+        {
+        case CHUNK_SIZE:
+        case CHUNK_TRAILER:
+        {
+            const char *lf = memchr(p, '\n', available);
+            if (lf == NULL)
+            {
+                if (available > CHUNK_LINE_MAX)
+                    return fail(parser, parser->chunkState == CHUNK_SIZE ? 400 : 431);
+                return 0;
+            }
+            if (lf == p || lf[-1] != '\r')
+                return fail(parser, 400);
+
+            parser->rawOffset += lf + 1 - p;
+
+            if (parser->chunkState == CHUNK_TRAILER)
+            {
+                // trailer fields are dropped, an empty line ends the body
+                if (lf - 1 == p)
+                    return 1;
+                if (parser->rawOffset - parser->headLen > parser->maxBodySize + parser->maxHeadSize)
+                    return fail(parser, 431);
+                break;
+            }
+
+            size_t size;
+            if (parseChunkSize(parser, p, lf - 1, &size) == -1)
+                return -1;
+            if (size > parser->maxBodySize - parser->chunkBodyLen)
+                return fail(parser, 413);
+
+            parser->chunkLeft = size;
+            parser->chunkState = size > 0 ? CHUNK_DATA : CHUNK_TRAILER;
+            break;
+        }
+
+        case CHUNK_DATA:
+        {
+            size_t n = available < parser->chunkLeft ? available : parser->chunkLeft;
+            if (n == 0)
+                return 0;
+            if (appendChunk(parser, p, n) == -1)
+                return -1;
+
+            parser->rawOffset += n;
+            if ((parser->chunkLeft -= n) == 0)
+                parser->chunkState = CHUNK_DATA_END;
+            break;
+        }
+
+        case CHUNK_DATA_END:
+            if (available < 2)
+                return 0;
+            if (p[0] != '\r' || p[1] != '\n')
+                return fail(parser, 400);
+            parser->rawOffset += 2;
+            parser->chunkState = CHUNK_SIZE;
+            break;
+        }
+    }
+}
+
+// ready for the next message, the chunk buffer is kept
+static void resetParser(HttpParser *parser)
+{
+    parser->scanned = 0;
+    parser->headLen = 0;
+    parser->chunkState = CHUNK_SIZE;
+    parser->rawOffset = 0;
+    parser->chunkLeft = 0;
+    parser->chunkBodyLen = 0;
+}
+
+// the head and body of a request or response at the start of data, returns its length,
+// 0 when incomplete or -1
+static ssize_t parseMessage(HttpParser *parser, const char *message, size_t len, int isResponse, int noBody, int eof)
+{
+    int headParsed = 0;
+
+    if (parser->headLen == 0)
+    {
+        // the terminator may straddle the previous read
+        size_t from = parser->scanned > 3 ? parser->scanned - 3 : 0;
+        const char *end = len > from ? memmem(message + from, len - from, "\r\n\r\n", 4) : NULL;
+
+        if (end == NULL)
+        {
+            parser->scanned = len;
+            if (len > parser->maxHeadSize)
+                return fail(parser, isResponse ? 502 : 431);
+            return eof ? fail(parser, isResponse ? 502 : 400) : 0;
+        }
+
+        parser->headLen = end + 4 - message;
+        if (parser->headLen > parser->maxHeadSize)
+            return fail(parser, isResponse ? 502 : 431);
+
+        if (parseHead(parser, message, parser->headLen, isResponse, noBody) == -1)
+            return -1;
+        headParsed = 1;
+        parser->rawOffset = parser->headLen;
+    }
+
+    size_t messageLen;
+    HttpSlice body;
+
+    if (parser->bodyChunked)
+    {
+        int status = decodeChunks(parser, message, len);
+        if (status == 0 && eof)
+            return fail(parser, isResponse ? 502 : 400);
+        if (status <= 0)
+            return status;
+
+        messageLen = parser->rawOffset;
+        body = (HttpSlice){parser->chunkBody, parser->chunkBodyLen};
+    }
+    else if (parser->bodyUntilEof)
+    {
+        if (len - parser->headLen > parser->maxBodySize)
+            return fail(parser, 502);
+        if (!eof)
+            return 0;
+
+        messageLen = len;
+        body = (HttpSlice){message + parser->headLen, len - parser->headLen};
+    }
+    else
+    {
+        messageLen = parser->headLen + parser->bodyLength;
+        if (len < messageLen)
+            return eof ? fail(parser, isResponse ? 502 : 400) : 0;
+        body = (HttpSlice){message + parser->headLen, parser->bodyLength};
+    }
+
+    // the head was parsed in an earlier call, its slices point to where the bytes were then
+    if (!headParsed && parseHead(parser, message, parser->headLen, isResponse, noBody) == -1)
+        return -1;
+
+    if (isResponse)
+        parser->response.body = body;
+    else
+        parser->request.body = body;
+
+    resetParser(parser);
+    return messageLen;
+}
+
+ssize_t httpParseRequest(HttpParser *parser, const char *data, size_t len)
+{
+    // empty lines before a request are ignored, some clients send CRLF after a body
+    size_t skipped = 0;
+    while (skipped < len && (data[skipped] == '\r' || data[skipped] == '\n'))
+        skipped++;
+
+    ssize_t requestLen = parseMessage(parser, data + skipped, len - skipped, 0, 0, 0);
+    return requestLen > 0 ? (ssize_t)skipped + requestLen : requestLen;
+}
+
+ssize_t httpParseResponse(HttpParser *parser, const char *data, size_t len, int noBody, int eof)
+{
+    return parseMessage(parser, data, len, 1, noBody, eof);
+}
@@ -0,0 +1,123 @@
+// incremental http/1.x request and response parser
+// - nothing is copied: method, target, headers and bodies are slices into the caller's buffer
+// - the end of the head is searched from where the previous call stopped, so a request
+//   arriving byte by byte is not scanned again on every read
+// - Content-Length and chunked bodies, chunked bodies are the only data copied as their
+//   chunks are not contiguous in the buffer
+// - pipelined requests are parsed one per call, the return value says where the next starts
+// - responses are framed the same way, or by the end of the stream when they have no length
+
+#ifndef HTTP_PARSER_H
+#define HTTP_PARSER_H
+
+#include "socket-library.h"
+
+#define HTTP_MAX_HEADERS 32
+
+// limits used when the parser is initialized with 0
+#define HTTP_DEFAULT_MAX_HEAD_SIZE (8 * 1024)
+#define HTTP_DEFAULT_MAX_BODY_SIZE (1024 * 1024)
+
+// bytes of the buffer, not null terminated
+typedef struct
+{
+    const char *data;
+    size_t len;
+} HttpSlice;
+
+typedef struct
+{
+    HttpSlice name;
+    HttpSlice value;
+} HttpHeader;
+
+typedef struct
+{
+    HttpSlice method;
+    HttpSlice target; // as sent, path and query together
+    HttpSlice path;
+    HttpSlice query; // after '?', empty when there is none
+    int versionMinor; // 0 for HTTP/1.0, 1 for HTTP/1.1
+
+    HttpHeader headers[HTTP_MAX_HEADERS];
+    size_t headerCount;
+
+    HttpSlice body;
+    size_t contentLength;
+    int chunked;
+    int keepAlive;      // Connection header applied to the default of the version
+    int expectContinue; // the client waits for "100 Continue" before sending the body
+} HttpRequest;
+
+typedef struct
+{
+    int status;
+    int versionMinor;
+    HttpSlice reason;
+
+    HttpHeader headers[HTTP_MAX_HEADERS];
+    size_t headerCount;
+
+    HttpSlice body;
+    size_t contentLength;
+    int chunked;
+    int keepAlive;
+} HttpResponse;
+
+typedef struct
+{
+    size_t maxHeadSize;
+    size_t maxBodySize;
+
+    size_t scanned; // search for the end of the head resumes here
+    size_t headLen; // 0 while the head is incomplete
+
+    // framing of the body, taken from the head
+    size_t bodyLength;
+    int bodyChunked;
+    int bodyUntilEof; // response without length, it ends with the connection
+
+    // chunked body decoding, offsets are relative to the start of the message
+    int chunkState;
+    size_t rawOffset;  // next byte not decoded yet
+    size_t chunkLeft;  // bytes of the current chunk still to come
+    char *chunkBody;   // decoded chunks
+    size_t chunkBodyLen;
+    size_t chunkBodyCapacity;
+
+    int status; // status to answer when parsing failed
+
+    HttpRequest request;
+    HttpResponse response;
+} HttpParser;
+
+// 0 picks the default limits
+void initHttpParser(HttpParser *parser, size_t maxHeadSize, size_t maxBodySize);
+
+void freeHttpParser(HttpParser *parser);
+
+// parse the request at the start of data, the same bytes (and more) are passed again
+// until it is complete, they may move in memory between calls
+// returns its length (leading empty lines included) once complete, parser->request then
+// points into data until the next call; 0 when more bytes are needed; -1 when the request
+// is malformed or too big, parser->status is the status to answer
+ssize_t httpParseRequest(HttpParser *parser, const char *data, size_t len);
+
+// same for the response at the start of data
+// noBody is set when the response answers a HEAD request, which has no body whatever the
+// headers say; eof tells that the stream ended, which completes a response without length
+ssize_t httpParseResponse(HttpParser *parser, const char *data, size_t len, int noBody, int eof);
+
+// value of the first header with this name (case insensitive), NULL when missing
+const HttpSlice *httpFindHeader(const HttpHeader *headers, size_t count, const char *name);
+
+// the comma separated list contains the token (case insensitive), for Connection, Cache-Control
+int httpListContains(HttpSlice list, const char *token);
+
+// case insensitive comparison with a string
+int httpSliceEquals(HttpSlice slice, const char *str);
+
+// reason phrase of a status code
+const char *httpStatusText(int status);
+
+#endif
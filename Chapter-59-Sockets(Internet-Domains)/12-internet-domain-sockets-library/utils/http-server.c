@@ -0,0 +1,401 @@
+#include "http-server.h"
+#include <time.h>
+
+// status line and headers of one response
+#define HTTP_HEAD_BUFFER_SIZE 1024
+
+// a buffer this big is released once the request it held is done
+#define HTTP_BUFFER_KEEP_SIZE (64 * 1024)
+
+static uint64_t monotonicNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// the Date header changes once a second, formatting it per response is wasted work
+static const char *httpDate(void)
+{
+    static __thread time_t cachedTime;
+    static __thread char cachedDate[32];
+
+    time_t now = time(NULL);
+    if (now != cachedTime)
+    {
+        struct tm tm;
+        gmtime_r(&now, &tm);
+        strftime(cachedDate, sizeof(cachedDate), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        cachedTime = now;
+    }
+    return cachedDate;
+}
+
+int httpAddHeader(HttpConnection *hc, const char *name, const char *value)
+{
+    size_t space = sizeof(hc->extraHeaders) - hc->extraHeadersLen;
+    int size = snprintf(hc->extraHeaders + hc->extraHeadersLen, space, "%s: %s\r\n", name, value);
+    if (size < 0 || (size_t)size >= space)
+        return -1;
+
+    hc->extraHeadersLen += size;
+    return 0;
+}
+
+void httpCloseAfterResponse(HttpConnection *hc)
+{
+    hc->keepAlive = 0;
+}
+
+// status line and headers, length -1 for a chunked body
+// headers are "Name: value\r\n" lines of the caller, NULL when there are none
+static int writeHead(HttpConnection *hc, int status, const char *contentType, long long length, const char *headers, size_t headersLen)
+{
+    char head[HTTP_HEAD_BUFFER_SIZE];
+
+    // http/1.0 clients cannot read chunks, their body ends with the connection
+    if (length < 0 && hc->versionMinor == 0)
+        hc->keepAlive = 0;
+
+    // every append checks the room left, one check at the end catches a truncation
+    size_t size = snprintf(head, sizeof(head), "HTTP/1.1 %d %s\r\nDate: %s\r\n", status, httpStatusText(status), httpDate());
+
+    if (contentType != NULL && size < sizeof(head))
+        size += snprintf(head + size, sizeof(head) - size, "Content-Type: %s\r\n", contentType);
+
+    if (length >= 0 && size < sizeof(head))
+        size += snprintf(head + size, sizeof(head) - size, "Content-Length: %lld\r\n", length);
+    else if (hc->versionMinor >= 1 && size < sizeof(head))
+        size += snprintf(head + size, sizeof(head) - size, "Transfer-Encoding: chunked\r\n");
+
+    if (!hc->keepAlive && size < sizeof(head))
+        size += snprintf(head + size, sizeof(head) - size, "Connection: close\r\n");
+    else if (hc->versionMinor == 0 && size < sizeof(head))
+        size += snprintf(head + size, sizeof(head) - size, "Connection: keep-alive\r\n");
+
+    if (size < sizeof(head))
+        size += snprintf(head + size, sizeof(head) - size, "%.*s", (int)hc->extraHeadersLen, hc->extraHeaders);
+
+    // room for the empty line
+    if (size + 2 >= sizeof(head))
+        return -1;
+    hc->extraHeadersLen = 0;
+
+    if (headersLen == 0)
+    {
+        memcpy(head + size, "\r\n", 2);
+        return connectionSend(hc->conn, head, size + 2) == -1 ? -1 : 0;
+    }
+
+    // queued back to back, the output queue puts them in the same segment
+    if (connectionSend(hc->conn, head, size) == -1 ||
+        connectionSend(hc->conn, headers, headersLen) == -1 ||
+        connectionSend(hc->conn, "\r\n", 2) == -1)
+        return -1;
+    return 0;
+}
+
+int httpRespond(HttpConnection *hc, int status, const char *contentType, const void *body, size_t len)
+{
+    return httpRespondWithHeaders(hc, status, contentType, NULL, 0, body, len);
+}
+
+int httpRespondWithHeaders(
+    HttpConnection *hc,
+    int status,
+    const char *contentType,
+    const char *headers,
+    size_t headersLen,
+    const void *body,
+    size_t len)
+{
+    // one response per request
+    if (hc->responded || hc->chunked)
+        return -1;
+    hc->responded = 1;
+
+    if (writeHead(hc, status, contentType, (long long)len, headers, headersLen) == -1)
+        return -1;
+
+    if (hc->headRequest || len == 0)
+        return 0;
+    return connectionSend(hc->conn, body, len) == -1 ? -1 : 0;
+}
+
+int httpRespondFile(HttpConnection *hc, int status, const char *contentType, int fileFd, off_t offset, size_t len)
+{
+    if (hc->responded || hc->chunked || writeHead(hc, status, contentType, (long long)len, NULL, 0) == -1)
+    {
+        close(fileFd);
+        return -1;
+    }
+    hc->responded = 1;
+
+    if (hc->headRequest || len == 0)
+    {
+        close(fileFd);
+        return 0;
+    }
+    return connectionSendFile(hc->conn, fileFd, offset, len);
+}
+
+int httpBeginChunked(HttpConnection *hc, int status, const char *contentType)
+{
+    if (hc->responded || hc->chunked)
+        return -1;
+
+    hc->chunked = 1;
+    return writeHead(hc, status, contentType, -1, NULL, 0);
+}
+
+int httpSendChunk(HttpConnection *hc, const void *data, size_t len)
+{
+    // an empty chunk would end the body
+    if (!hc->chunked || hc->headRequest || len == 0)
+        return hc->chunked ? 0 : -1;
+
+    if (hc->versionMinor == 0)
+        return connectionSend(hc->conn, data, len) == -1 ? -1 : 0;
+
+    // size line, data and CRLF end up in the same output segment
+    if (connectionPrintf(hc->conn, "%zx\r\n", len) == -1 ||
+        connectionSend(hc->conn, data, len) == -1 ||
+        connectionSend(hc->conn, "\r\n", 2) == -1)
+        return -1;
+    return 0;
+}
+
+int httpEndChunked(HttpConnection *hc)
+{
+    if (!hc->chunked)
+        return -1;
+
+    hc->chunked = 0;
+    hc->responded = 1;
+
+    if (hc->headRequest || hc->versionMinor == 0)
+        return 0;
+    return connectionSend(hc->conn, "0\r\n\r\n", 5) == -1 ? -1 : 0;
+}
+
+// a route path ending with '*' matches every path starting with the rest, HEAD is answered by GET routes
+static HttpHandler findHandler(const HttpServer *server, const HttpRequest *request)
+{
+    for (size_t i = 0; i < server->routeCount; i++)
+    {
+        const HttpRoute *route = &server->routes[i];
+
+        if (route->method != NULL)
+        {
+            size_t methodLen = strlen(route->method);
+            int sameMethod = request->method.len == methodLen && memcmp(request->method.data, route->method, methodLen) == 0;
+            int headForGet = strcmp(route->method, "GET") == 0 && request->method.len == 4 && memcmp(request->method.data, "HEAD", 4) == 0;
+            if (!sameMethod && !headForGet)
+                continue;
+        }
+
+        size_t pathLen = strlen(route->path);
+        int prefix = pathLen > 0 && route->path[pathLen - 1] == '*';
+        if (prefix)
+            pathLen--;
+
+        if ((prefix ? request->path.len >= pathLen : request->path.len == pathLen) &&
+            memcmp(request->path.data, route->path, pathLen) == 0)
+            return route->handler;
+    }
+    return server->notFound;
+}
+
+static void dispatchRequest(HttpConnection *hc, const HttpRequest *request)
+{
+    hc->versionMinor = request->versionMinor;
+    hc->keepAlive = request->keepAlive;
+    hc->headRequest = request->method.len == 4 && memcmp(request->method.data, "HEAD", 4) == 0;
+    hc->responded = 0;
+    hc->chunked = 0;
+    hc->extraHeadersLen = 0;
+
+    HttpHandler handler = findHandler(hc->server, request);
+    if (handler == NULL)
+    {
+        const char *text = "not found\n";
+        httpRespond(hc, 404, "text/plain", text, strlen(text));
+        return;
+    }
+
+    handler(hc, request);
+
+    // the handler forgot the last chunk or to answer at all
+    if (hc->chunked)
+        httpEndChunked(hc);
+    else if (!hc->responded)
+    {
+        const char *text = "no response\n";
+        hc->extraHeadersLen = 0;
+        httpRespond(hc, 500, "text/plain", text, strlen(text));
+    }
+}
+
+// parsing failed, the stream cannot be trusted anymore so the connection goes after the answer
+static void rejectRequest(HttpConnection *hc, int status)
+{
+    char text[64];
+    int len = snprintf(text, sizeof(text), "%d %s\n", status, httpStatusText(status));
+
+    hc->versionMinor = 1;
+    hc->keepAlive = 0;
+    hc->headRequest = 0;
+    hc->responded = 0;
+    hc->chunked = 0;
+    hc->extraHeadersLen = 0;
+    httpRespond(hc, status, "text/plain", text, len);
+}
+
+// the client asked to wait for a go-ahead before sending the body
+static void sendContinue(HttpConnection *hc)
+{
+    HttpParser *parser = &hc->parser;
+
+    if (parser->headLen > 0 && parser->request.expectContinue && !hc->continueSent && parser->request.versionMinor >= 1)
+    {
+        hc->continueSent = 1;
+        connectionSend(hc->conn, "HTTP/1.1 100 Continue\r\n\r\n", 25);
+    }
+}
+
+// handle every complete request in data, returns the bytes used or -1 when the connection
+// was closed (the HttpConnection may be gone already)
+static ssize_t handleRequests(HttpConnection *hc, const char *data, size_t len)
+{
+    size_t used = 0;
+
+    while (used < len)
+    {
+        ssize_t requestLen = httpParseRequest(&hc->parser, data + used, len - used);
+        if (requestLen == 0)
+        {
+            sendContinue(hc);
+            break;
+        }
+
+        if (requestLen == -1)
+            rejectRequest(hc, hc->parser.status);
+        else
+        {
+            uint64_t start = monotonicNs();
+            dispatchRequest(hc, &hc->parser.request);
+            metricsRecord(HISTOGRAM_REQUEST_LATENCY, monotonicNs() - start);
+            hc->continueSent = 0;
+            used += requestLen;
+        }
+
+        if (requestLen == -1 || !hc->keepAlive)
+        {
+            // queued responses are still flushed before the socket goes
+            hc->closing = 1;
+            connectionClose(hc->conn);
+            return -1;
+        }
+    }
+    return used;
+}
+
+// keep the start of a request until the rest arrives
+static int keepBytes(HttpConnection *hc, const char *data, size_t len)
+{
+    if (hc->bufferLen + len > hc->bufferCapacity)
+    {
+        size_t capacity = hc->bufferCapacity > 0 ? hc->bufferCapacity : MESSAGE_BUFFER_SIZE;
+        while (capacity < hc->bufferLen + len)
+            capacity *= 2;
+
+        char *buffer = realloc(hc->buffer, capacity);
+        if (buffer == NULL)
+            return -1;
+        hc->buffer = buffer;
+        hc->bufferCapacity = capacity;
+    }
+
+    memcpy(hc->buffer + hc->bufferLen, data, len);
+    hc->bufferLen += len;
+    return 0;
+}
+
+static void onHttpOpen(Connection *conn)
+{
+    HttpConnection *hc = calloc(1, sizeof(HttpConnection));
+    if (hc == NULL)
+    {
+        connectionClose(conn);
+        return;
+    }
+
+    hc->conn = conn;
+    hc->server = conn->userData;
+    initHttpParser(&hc->parser, hc->server->maxHeadSize, hc->server->maxBodySize);
+    conn->state = hc;
+}
+
+static void onHttpData(Connection *conn, const char *data, size_t len)
+{
+    HttpConnection *hc = conn->state;
+    if (hc == NULL || hc->closing)
+        return;
+
+    // common case: whole requests, parsed right in the receive buffer of the backend
+    if (hc->bufferLen == 0)
+    {
+        ssize_t used = handleRequests(hc, data, len);
+        if (used != -1 && (size_t)used < len && keepBytes(hc, data + used, len - used) == -1)
+        {
+            hc->closing = 1;
+            connectionClose(conn);
+        }
+        return;
+    }
+
+    if (keepBytes(hc, data, len) == -1)
+    {
+        hc->closing = 1;
+        connectionClose(conn);
+        return;
+    }
+
+    ssize_t used = handleRequests(hc, hc->buffer, hc->bufferLen);
+    if (used == -1)
+        return;
+
+    hc->bufferLen -= used;
+    memmove(hc->buffer, hc->buffer + used, hc->bufferLen);
+
+    // one large upload should not pin its buffer for the rest of the connection
+    if (hc->bufferLen == 0 && hc->bufferCapacity > HTTP_BUFFER_KEEP_SIZE)
+    {
+        free(hc->buffer);
+        hc->buffer = NULL;
+        hc->bufferCapacity = 0;
+    }
+}
+
+static void onHttpClose(Connection *conn)
+{
+    HttpConnection *hc = conn->state;
+    if (hc == NULL)
+        return;
+
+    conn->state = NULL;
+    freeHttpParser(&hc->parser);
+    free(hc->buffer);
+    free(hc);
+}
+
+const StreamHandlers httpStreamHandlers = {
+    .onOpen = onHttpOpen,
+    .onData = onHttpData,
+    .onClose = onHttpClose,
+};
+
+int runHttpServer(int sfd, ServerBackend backend, HttpServer *server)
+{
+    return runStreamServer(sfd, backend, &httpStreamHandlers, server);
+}
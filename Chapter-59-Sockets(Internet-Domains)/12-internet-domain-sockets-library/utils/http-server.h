@@ -0,0 +1,106 @@
+// http/1.1 on top of the stream server
+// - requests are parsed where they were received, only a request split across reads is
+//   kept in a per connection buffer until the rest arrives
+// - keep-alive and pipelining: every complete request of a read is handled in order, the
+//   responses are queued and leave together with one syscall per batch
+// - handlers are picked by method and path from a route table and answer through
+//   httpRespond, httpRespondFile or a chunked response
+// - the same handlers run on every backend of the stream server
+
+#ifndef HTTP_SERVER_H
+#define HTTP_SERVER_H
+
+#include "stream-server.h"
+#include "http-parser.h"
+
+// room for the headers a handler adds to one response
+#define HTTP_EXTRA_HEADERS_SIZE 512
+
+typedef struct HttpConnection HttpConnection;
+
+// the request and its slices are valid only during the call
+// the handler has to answer before returning, an unanswered request gets a 500
+typedef void (*HttpHandler)(HttpConnection *hc, const HttpRequest *request);
+
+typedef struct
+{
+    const char *method; // NULL matches every method
+    const char *path;   // exact path, or a prefix when it ends with '*' ("/files/*")
+    HttpHandler handler;
+} HttpRoute;
+
+typedef struct
+{
+    const HttpRoute *routes; // first match wins
+    size_t routeCount;
+    HttpHandler notFound; // NULL answers 404
+
+    size_t maxHeadSize; // 0 picks the parser defaults
+    size_t maxBodySize;
+
+    void *userData; // for the handlers
+} HttpServer;
+
+struct HttpConnection
+{
+    Connection *conn;
+    HttpServer *server;
+    HttpParser parser;
+
+    // bytes of a request which did not arrive completely yet
+    char *buffer;
+    size_t bufferLen;
+    size_t bufferCapacity;
+
+    // the request being answered
+    int versionMinor;
+    int keepAlive;
+    int headRequest; // response without body
+    int responded;
+    int chunked;        // a chunked response is open
+    int continueSent;   // "100 Continue" already sent for the current request
+    int closing;
+
+    char extraHeaders[HTTP_EXTRA_HEADERS_SIZE];
+    size_t extraHeadersLen;
+};
+
+// stream handlers running the http server, the HttpServer is their userData
+extern const StreamHandlers httpStreamHandlers;
+
+// serve http on the listening socket, returns -1 on error
+int runHttpServer(int sfd, ServerBackend backend, HttpServer *server);
+
+// add a header to the next response, returns -1 when it does not fit
+int httpAddHeader(HttpConnection *hc, const char *name, const char *value);
+
+// close the connection once the current response is sent
+void httpCloseAfterResponse(HttpConnection *hc);
+
+// answer with the body, contentType may be NULL
+int httpRespond(HttpConnection *hc, int status, const char *contentType, const void *body, size_t len);
+
+// same with headers of the caller ("Name: value\r\n" lines, no Content-Length or Connection),
+// for responses relayed from somewhere else
+int httpRespondWithHeaders(
+    HttpConnection *hc,
+    int status,
+    const char *contentType,
+    const char *headers,
+    size_t headersLen,
+    const void *body,
+    size_t len);
+
+// answer with len bytes of the file, sent with sendfile where the backend allows it
+// the connection owns fileFd from now on
+int httpRespondFile(HttpConnection *hc, int status, const char *contentType, int fileFd, off_t offset, size_t len);
+
+// chunked response of unknown length, http/1.0 clients get the raw body and a close
+int httpBeginChunked(HttpConnection *hc, int status, const char *contentType);
+
+int httpSendChunk(HttpConnection *hc, const void *data, size_t len);
+
+// last chunk, the handler's response is complete after it
+int httpEndChunked(HttpConnection *hc);
+
+#endif
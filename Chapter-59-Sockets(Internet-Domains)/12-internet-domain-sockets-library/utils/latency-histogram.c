@@ -0,0 +1,110 @@
+#include "latency-histogram.h"
+#include <string.h>
+
+// values below HISTOGRAM_SUB_BUCKETS are exact, the ones above keep their top 7 bits:
+// bucket b (from 1) covers [2^(b+6), 2^(b+7)) with 64 slots of width 2^b
+static size_t bucketIndex(uint64_t value)
+{
+    if (value < HISTOGRAM_SUB_BUCKETS)
+        return value;
+
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - HISTOGRAM_SUB_BUCKET_BITS + 1;
+
+    return HISTOGRAM_SUB_BUCKETS + (size_t)(shift - 1) * (HISTOGRAM_SUB_BUCKETS / 2) +
+           ((value >> shift) - HISTOGRAM_SUB_BUCKETS / 2);
+}
+
+// largest value which lands in the bucket
+static uint64_t bucketHighest(size_t index)
+{
+    if (index < HISTOGRAM_SUB_BUCKETS)
+        return index;
+
+    int shift = (index - HISTOGRAM_SUB_BUCKETS) / (HISTOGRAM_SUB_BUCKETS / 2) + 1;
+    uint64_t mantissa = (index - HISTOGRAM_SUB_BUCKETS) % (HISTOGRAM_SUB_BUCKETS / 2) + HISTOGRAM_SUB_BUCKETS / 2;
+
+    return ((mantissa + 1) << shift) - 1;
+}
+
+void initLatencyHistogram(LatencyHistogram *histogram)
+{
+    memset(histogram, 0, sizeof(LatencyHistogram));
+    histogram->min = UINT64_MAX;
+}
+
+// the recording thread is the only writer, a relaxed load and store cost the same as a
+// plain increment but a concurrent merge never reads a torn value
+static void add(uint64_t *field, uint64_t delta)
+{
+    __atomic_store_n(field, __atomic_load_n(field, __ATOMIC_RELAXED) + delta, __ATOMIC_RELAXED);
+}
+
+static uint64_t load(const uint64_t *field)
+{
+    return __atomic_load_n(field, __ATOMIC_RELAXED);
+}
+
+void histogramRecord(LatencyHistogram *histogram, uint64_t value)
+{
+    add(&histogram->counts[bucketIndex(value)], 1);
+    add(&histogram->total, 1);
+    add(&histogram->sum, value);
+
+    if (value < load(&histogram->min))
+        __atomic_store_n(&histogram->min, value, __ATOMIC_RELAXED);
+    if (value > load(&histogram->max))
+        __atomic_store_n(&histogram->max, value, __ATOMIC_RELAXED);
+}
+
+void histogramMerge(LatencyHistogram *into, const LatencyHistogram *from)
+{
+    uint64_t total = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        uint64_t count = load(&from->counts[i]);
+        into->counts[i] += count;
+        total += count;
+    }
+
+    // the buckets read decide the total, so percentiles of a live histogram stay consistent
+    into->total += total;
+    into->sum += load(&from->sum);
+
+    uint64_t min = load(&from->min), max = load(&from->max);
+    if (min < into->min)
+        into->min = min;
+    if (max > into->max)
+        into->max = max;
+}
+
+uint64_t histogramPercentile(const LatencyHistogram *histogram, double percentile)
+{
+    if (histogram->total == 0)
+        return 0;
+
+    // rank of the value, the 100th percentile is the largest one
+    uint64_t rank = (uint64_t)(percentile / 100.0 * histogram->total + 0.5);
+    if (rank < 1)
+        rank = 1;
+    if (rank > histogram->total)
+        rank = histogram->total;
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        seen += histogram->counts[i];
+        if (seen >= rank)
+        {
+            // the bucket bound may lie past anything recorded
+            uint64_t value = bucketHighest(i);
+            return value < histogram->max ? value : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+double histogramMean(const LatencyHistogram *histogram)
+{
+    return histogram->total > 0 ? (double)histogram->sum / histogram->total : 0;
+}
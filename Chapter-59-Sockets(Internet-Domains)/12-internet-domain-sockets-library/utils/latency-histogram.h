@@ -0,0 +1,39 @@
+// log-linear latency histogram (the HdrHistogram layout)
+// - values below 128 get a bucket each, every power of 2 above is split into 64 buckets,
+//   so any recorded value is known to within 1/64 (about 1.6%) of itself
+// - recording is an index computation and an increment, no allocation and no lock
+// - one writer per histogram (a thread of its own), merged when the results are read,
+//   also while the writer is still recording
+
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define HISTOGRAM_SUB_BUCKET_BITS 7
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_BUCKETS (HISTOGRAM_SUB_BUCKETS + (64 - HISTOGRAM_SUB_BUCKET_BITS) * (HISTOGRAM_SUB_BUCKETS / 2))
+
+typedef struct
+{
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    uint64_t sum;
+} LatencyHistogram;
+
+void initLatencyHistogram(LatencyHistogram *histogram);
+
+void histogramRecord(LatencyHistogram *histogram, uint64_t value);
+
+// adds the counts of from to into
+void histogramMerge(LatencyHistogram *into, const LatencyHistogram *from);
+
+// highest value of the bucket holding the given percentile (0 to 100), 0 when empty
+uint64_t histogramPercentile(const LatencyHistogram *histogram, double percentile);
+
+double histogramMean(const LatencyHistogram *histogram);
+
+#endif
@@ -0,0 +1,255 @@
+#include "socket-library.h"
+#include "metrics.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+
+#define METRICS_BACKLOG 16
+#define METRICS_ACCEPT_BACKOFF_MS 100
+
+// written by one thread only, aligned so no two threads share a cache line
+typedef struct MetricsShard
+{
+    int64_t values[METRIC_COUNT];
+    LatencyHistogram histograms[HISTOGRAM_COUNT];
+    struct MetricsShard *next; // set once before the shard is published
+    int inUse;                 // owned by a live thread
+} __attribute__((aligned(64))) MetricsShard;
+
+static const char *const metricNames[METRIC_COUNT] = {
+    [METRIC_CONNECTIONS_ACCEPTED] = "connections_accepted",
+    [METRIC_CONNECTIONS_REJECTED] = "connections_rejected",
+    [METRIC_CONNECTIONS_SHED] = "connections_shed",
+    [METRIC_BYTES_IN] = "bytes_in",
+    [METRIC_BYTES_OUT] = "bytes_out",
+    [METRIC_SYSCALLS] = "syscalls",
+    [METRIC_EAGAIN] = "eagain",
+    [METRIC_CONNECTIONS_ACTIVE] = "connections_active",
+    [METRIC_OUTPUT_QUEUED_BYTES] = "output_queued_bytes",
+    [METRIC_POOL_QUEUED_TASKS] = "pool_queued_tasks",
+};
+
+static const char *const histogramNames[HISTOGRAM_COUNT] = {
+    [HISTOGRAM_REQUEST_LATENCY] = "request_latency_us",
+};
+
+// shards are only ever added, so readers walk the list without a lock
+static MetricsShard *shards = NULL;
+static __thread MetricsShard *localShard = NULL;
+
+static pthread_once_t shardKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t shardKey;
+
+static pthread_mutex_t sourcesLock = PTHREAD_MUTEX_INITIALIZER;
+static struct
+{
+    MetricsSource source;
+    void *arg;
+} sources[MAX_METRICS_SOURCES];
+static int sourceCount = 0;
+
+// runs when a thread exits, its counts stay and the next new thread continues them
+static void releaseShard(void *shard)
+{
+    __atomic_store_n(&((MetricsShard *)shard)->inUse, 0, __ATOMIC_RELEASE);
+}
+
+static void createShardKey(void)
+{
+    pthread_key_create(&shardKey, releaseShard);
+}
+
+// first metric of the thread: reuse the shard of an exited thread or add a new one
+// errno is kept, callers record right after the syscall they look at
+static MetricsShard *claimShard(void)
+{
+    int savedErrno = errno;
+    pthread_once(&shardKeyOnce, createShardKey);
+
+    MetricsShard *shard;
+    for (shard = __atomic_load_n(&shards, __ATOMIC_ACQUIRE); shard != NULL; shard = shard->next)
+    {
+        int expected = 0;
+        if (__atomic_compare_exchange_n(&shard->inUse, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+
+    if (shard == NULL)
+    {
+        shard = aligned_alloc(64, sizeof(MetricsShard));
+        if (shard == NULL)
+        {
+            errno = savedErrno;
+            return NULL;
+        }
+
+        memset(shard, 0, sizeof(MetricsShard));
+        for (int i = 0; i < HISTOGRAM_COUNT; i++)
+            initLatencyHistogram(&shard->histograms[i]);
+        shard->inUse = 1;
+
+        shard->next = __atomic_load_n(&shards, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&shards, &shard->next, shard, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+
+    pthread_setspecific(shardKey, shard);
+    localShard = shard;
+    errno = savedErrno;
+    return shard;
+}
+
+void metricsAdd(Metric metric, int64_t delta)
+{
+    MetricsShard *shard = localShard != NULL ? localShard : claimShard();
+    if (shard == NULL)
+        return;
+
+    // only this thread writes the shard, the atomic store just keeps readers from tearing
+    int64_t *value = &shard->values[metric];
+    __atomic_store_n(value, __atomic_load_n(value, __ATOMIC_RELAXED) + delta, __ATOMIC_RELAXED);
+}
+
+void metricsRecord(MetricHistogram histogram, uint64_t value)
+{
+    MetricsShard *shard = localShard != NULL ? localShard : claimShard();
+    if (shard != NULL)
+        histogramRecord(&shard->histograms[histogram], value);
+}
+
+void getMetricsSnapshot(MetricsSnapshot *snapshot)
+{
+    memset(snapshot->values, 0, sizeof(snapshot->values));
+    for (int i = 0; i < HISTOGRAM_COUNT; i++)
+        initLatencyHistogram(&snapshot->histograms[i]);
+
+    for (MetricsShard *shard = __atomic_load_n(&shards, __ATOMIC_ACQUIRE); shard != NULL; shard = shard->next)
+    {
+        for (int i = 0; i < METRIC_COUNT; i++)
+            snapshot->values[i] += __atomic_load_n(&shard->values[i], __ATOMIC_RELAXED);
+        for (int i = 0; i < HISTOGRAM_COUNT; i++)
+            histogramMerge(&snapshot->histograms[i], &shard->histograms[i]);
+    }
+}
+
+int64_t metricsValue(Metric metric)
+{
+    int64_t total = 0;
+    for (MetricsShard *shard = __atomic_load_n(&shards, __ATOMIC_ACQUIRE); shard != NULL; shard = shard->next)
+        total += __atomic_load_n(&shard->values[metric], __ATOMIC_RELAXED);
+    return total;
+}
+
+int addMetricsSource(MetricsSource source, void *arg)
+{
+    pthread_mutex_lock(&sourcesLock);
+
+    int status = -1;
+    if (sourceCount < MAX_METRICS_SOURCES)
+    {
+        sources[sourceCount].source = source;
+        sources[sourceCount].arg = arg;
+        sourceCount++;
+        status = 0;
+    }
+
+    pthread_mutex_unlock(&sourcesLock);
+    return status;
+}
+
+void writeMetrics(FILE *out)
+{
+    static const double quantiles[] = {50, 90, 99, 99.9};
+
+    // histograms make the snapshot too big for the stack of a small thread
+    MetricsSnapshot *snapshot = malloc(sizeof(MetricsSnapshot));
+    if (snapshot == NULL)
+        return;
+    getMetricsSnapshot(snapshot);
+
+    for (int i = 0; i < METRIC_COUNT; i++)
+        fprintf(out, "%s %" PRId64 "\n", metricNames[i], snapshot->values[i]);
+
+    for (int i = 0; i < HISTOGRAM_COUNT; i++)
+    {
+        const LatencyHistogram *histogram = &snapshot->histograms[i];
+        const char *name = histogramNames[i];
+
+        fprintf(out, "%s_count %" PRIu64 "\n", name, histogram->total);
+        for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++)
+            fprintf(out, "%s{quantile=\"%g\"} %.3f\n", name, quantiles[q] / 100,
+                    histogramPercentile(histogram, quantiles[q]) / 1000.0);
+        fprintf(out, "%s_max %.3f\n", name, histogram->max / 1000.0);
+        fprintf(out, "%s_mean %.3f\n", name, histogramMean(histogram) / 1000.0);
+    }
+    free(snapshot);
+
+    pthread_mutex_lock(&sourcesLock);
+    for (int i = 0; i < sourceCount; i++)
+        sources[i].source(out, sources[i].arg);
+    pthread_mutex_unlock(&sourcesLock);
+}
+
+// one client at a time: the whole text, then the connection is closed
+static void *serveMetrics(void *arg)
+{
+    int sfd = (int)(intptr_t)arg;
+
+    while (1)
+    {
+        // not through the admission control, the metrics socket must answer when it is full
+        int cfd = accept4(sfd, NULL, NULL, SOCK_CLOEXEC);
+        if (cfd == -1)
+        {
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+                poll(NULL, 0, METRICS_ACCEPT_BACKOFF_MS);
+            continue;
+        }
+
+        char *text = NULL;
+        size_t textLen = 0;
+        FILE *out = open_memstream(&text, &textLen);
+        if (out != NULL)
+        {
+            writeMetrics(out);
+            fclose(out);
+
+            for (size_t sent = 0; sent < textLen;)
+            {
+                ssize_t bytes_sent = send(cfd, text + sent, textLen - sent, MSG_NOSIGNAL);
+                if (bytes_sent == -1 && errno == EINTR)
+                    continue;
+                if (bytes_sent <= 0)
+                    break;
+                sent += bytes_sent;
+            }
+            free(text);
+        }
+        close(cfd);
+    }
+    return NULL;
+}
+
+int startMetricsServer(const char *path)
+{
+    int sfd = createUnixServer(path, METRICS_BACKLOG);
+    if (sfd == -1)
+        return -1;
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    int status = pthread_create(&thread, &attr, serveMetrics, (void *)(intptr_t)sfd);
+    pthread_attr_destroy(&attr);
+
+    if (status != 0)
+    {
+        close(sfd);
+        errno = status;
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,80 @@
+// runtime metrics of the process
+// - every thread records into its own shard (counters, gauges and latency histograms), so
+//   recording is a plain add on a cache line nobody else writes: no lock, no atomic rmw
+// - readers sum the shards on demand, a value can be a few events behind but never torn
+// - gauges are per thread deltas (+1 on open, -1 on close), their sum is the current value
+//   even when the two sides run on different threads
+// - shards of exited threads keep their counts and are handed to the next new thread
+// - startMetricsServer serves the totals as plain text on a unix domain socket:
+//   "socat - UNIX-CONNECT:./server-metrics.sock" (or "nc -U") prints them
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "latency-histogram.h"
+#include <stdio.h>
+#include <stdint.h>
+
+typedef enum
+{
+    // counters
+    METRIC_CONNECTIONS_ACCEPTED,
+    METRIC_CONNECTIONS_REJECTED, // over the connection limit
+    METRIC_CONNECTIONS_SHED,     // out of fds
+    METRIC_BYTES_IN,
+    METRIC_BYTES_OUT,
+    METRIC_SYSCALLS, // accept, recv, send, epoll and io_uring calls of the library
+    METRIC_EAGAIN,   // of which found nothing to do
+
+    // gauges
+    METRIC_CONNECTIONS_ACTIVE,
+    METRIC_OUTPUT_QUEUED_BYTES, // accepted by the send path, not written to a socket yet
+    METRIC_POOL_QUEUED_TASKS,   // submitted to a thread pool, not run yet
+
+    METRIC_COUNT
+} Metric;
+
+typedef enum
+{
+    HISTOGRAM_REQUEST_LATENCY, // ns from a complete request to its queued response
+
+    HISTOGRAM_COUNT
+} MetricHistogram;
+
+typedef struct
+{
+    int64_t values[METRIC_COUNT];
+    LatencyHistogram histograms[HISTOGRAM_COUNT];
+} MetricsSnapshot;
+
+// extra lines appended to the text output (cache, pool or application counters)
+typedef void (*MetricsSource)(FILE *out, void *arg);
+
+#define MAX_METRICS_SOURCES 8
+
+void metricsAdd(Metric metric, int64_t delta);
+
+static inline void metricsIncrement(Metric metric)
+{
+    metricsAdd(metric, 1);
+}
+
+void metricsRecord(MetricHistogram histogram, uint64_t value);
+
+// sum of every shard
+void getMetricsSnapshot(MetricsSnapshot *snapshot);
+
+// sum of one metric over every shard
+int64_t metricsValue(Metric metric);
+
+// returns -1 when MAX_METRICS_SOURCES are registered already
+int addMetricsSource(MetricsSource source, void *arg);
+
+// "name value" lines, histograms as quantiles in microseconds
+void writeMetrics(FILE *out);
+
+// listen on the unix socket path (an old socket file is replaced) and answer every client
+// with writeMetrics from a background thread, returns -1 when the socket cannot be created
+int startMetricsServer(const char *path);
+
+#endif
@@ -0,0 +1,270 @@
+#include "output-queue.h"
+#include <errno.h>
+#include <sys/uio.h>
+
+// iovecs passed to one sendmsg
+#define FLUSH_IOVECS 64
+
+void initOutputQueue(OutputQueue *queue)
+{
+    memset(queue, 0, sizeof(*queue));
+}
+
+static void freeSegment(OutputSegment *segment)
+{
+    if (segment->fileFd != -1)
+        close(segment->fileFd);
+    free(segment);
+}
+
+void freeOutputQueue(OutputQueue *queue)
+{
+    while (queue->head != NULL)
+    {
+        OutputSegment *segment = queue->head;
+        queue->head = segment->next;
+        freeSegment(segment);
+    }
+    metricsAdd(METRIC_OUTPUT_QUEUED_BYTES, -(int64_t)queue->queuedBytes);
+    initOutputQueue(queue);
+}
+
+static OutputSegment *appendSegment(OutputQueue *queue, size_t capacity)
+{
+    OutputSegment *segment = malloc(sizeof(OutputSegment) + capacity);
+    if (segment == NULL)
+        return NULL;
+
+    segment->next = NULL;
+    segment->capacity = capacity;
+    segment->len = 0;
+    segment->offset = 0;
+    segment->fileFd = -1;
+    segment->fileOffset = 0;
+
+    if (queue->tail != NULL)
+        queue->tail->next = segment;
+    else
+        queue->head = segment;
+    queue->tail = segment;
+    queue->segments++;
+    return segment;
+}
+
+// free space at the end of the tail, a file range has none
+static size_t tailSpace(const OutputQueue *queue)
+{
+    const OutputSegment *tail = queue->tail;
+    if (tail == NULL || tail->fileFd != -1)
+        return 0;
+    return tail->capacity - tail->len;
+}
+
+// segment at the tail with at least len free bytes
+static OutputSegment *reserveSegment(OutputQueue *queue, size_t len)
+{
+    if (queue->tail != NULL && tailSpace(queue) >= len)
+        return queue->tail;
+
+    return appendSegment(queue, len > OUTPUT_SEGMENT_SIZE ? len : OUTPUT_SEGMENT_SIZE);
+}
+
+int outputQueueAppendFile(OutputQueue *queue, int fileFd, off_t offset, size_t len)
+{
+    if (len == 0)
+    {
+        close(fileFd);
+        return 0;
+    }
+
+    OutputSegment *segment = appendSegment(queue, 0);
+    if (segment == NULL)
+    {
+        close(fileFd);
+        return -1;
+    }
+
+    segment->fileFd = fileFd;
+    segment->fileOffset = offset;
+    segment->len = len;
+    queue->queuedBytes += len;
+    metricsAdd(METRIC_OUTPUT_QUEUED_BYTES, len);
+    return 0;
+}
+
+int outputQueueAppend(OutputQueue *queue, const void *data, size_t len)
+{
+    OutputSegment *segment = reserveSegment(queue, len);
+    if (segment == NULL)
+        return -1;
+
+    memcpy(segment->data + segment->len, data, len);
+    segment->len += len;
+    queue->queuedBytes += len;
+    metricsAdd(METRIC_OUTPUT_QUEUED_BYTES, len);
+    return 0;
+}
+
+int outputQueueVPrintf(OutputQueue *queue, const char *format, va_list args)
+{
+    va_list copy;
+
+    // try the free space of the tail first, most messages fit there
+    OutputSegment *tail = queue->tail;
+    size_t spaceLen = tailSpace(queue);
+    char *space = spaceLen > 0 ? tail->data + tail->len : NULL;
+
+    va_copy(copy, args);
+    int size = vsnprintf(space, spaceLen, format, copy);
+    va_end(copy);
+
+    if (size < 0)
+        return -1;
+
+    // +1 as vsnprintf always writes the terminator
+    if ((size_t)size >= spaceLen)
+    {
+        OutputSegment *segment = reserveSegment(queue, size + 1);
+        if (segment == NULL)
+            return -1;
+
+        vsnprintf(segment->data + segment->len, size + 1, format, args);
+        tail = segment;
+    }
+
+    // terminator is not part of the message
+    tail->len += size;
+    queue->queuedBytes += size;
+    metricsAdd(METRIC_OUTPUT_QUEUED_BYTES, size);
+    return size;
+}
+
+int outputQueuePrintf(OutputQueue *queue, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int size = outputQueueVPrintf(queue, format, args);
+    va_end(args);
+    return size;
+}
+
+// release segments which are sent completely
+static void consume(OutputQueue *queue, size_t bytes)
+{
+    queue->queuedBytes -= bytes;
+    metricsAdd(METRIC_OUTPUT_QUEUED_BYTES, -(int64_t)bytes);
+
+    while (bytes > 0)
+    {
+        OutputSegment *segment = queue->head;
+        size_t remaining = segment->len - segment->offset;
+
+        if (bytes < remaining)
+        {
+            segment->offset += bytes;
+            return;
+        }
+
+        bytes -= remaining;
+
+        // the tail is reused by the next append instead of being freed
+        if (segment == queue->tail && segment->fileFd == -1)
+        {
+            segment->len = 0;
+            segment->offset = 0;
+            return;
+        }
+
+        queue->head = segment->next;
+        if (queue->head == NULL)
+            queue->tail = NULL;
+        queue->segments--;
+        freeSegment(segment);
+    }
+}
+
+// the file range at the head of the queue
+static ssize_t flushFileSegment(OutputSegment *segment, int fd)
+{
+    ssize_t bytes_sent = sendFileRange(fd, segment->fileFd, segment->fileOffset + segment->offset, segment->len - segment->offset);
+
+    // the file is shorter than when it was queued, the peer would wait forever for the rest
+    if (bytes_sent == 0)
+    {
+        errno = EIO;
+        return -1;
+    }
+    return bytes_sent;
+}
+
+ssize_t outputQueueFlush(OutputQueue *queue, int fd)
+{
+    ssize_t total = 0;
+
+    while (queue->queuedBytes > 0)
+    {
+        struct iovec iov[FLUSH_IOVECS];
+        int iovcnt = 0;
+        int fileFollows = 0;
+        ssize_t bytes_sent;
+
+        OutputSegment *first = queue->head;
+        while (first->len == first->offset)
+            first = first->next;
+
+        // memory segments up to the next file range
+        for (OutputSegment *segment = first; segment != NULL && iovcnt < FLUSH_IOVECS; segment = segment->next)
+        {
+            if (segment->fileFd != -1)
+            {
+                fileFollows = 1;
+                break;
+            }
+            if (segment->len == segment->offset)
+                continue;
+            iov[iovcnt].iov_base = segment->data + segment->offset;
+            iov[iovcnt].iov_len = segment->len - segment->offset;
+            iovcnt++;
+        }
+
+        if (iovcnt == 0)
+            bytes_sent = flushFileSegment(first, fd);
+        else
+        {
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = iovcnt;
+
+            // sendmsg instead of writev, so a closed peer gives EPIPE instead of SIGPIPE
+            // a following file range fills up the last segment of the headers
+            bytes_sent = sendmsg(fd, &msg, MSG_NOSIGNAL | (fileFollows ? MSG_MORE : 0));
+        }
+
+        metricsIncrement(METRIC_SYSCALLS);
+        if (bytes_sent == -1)
+        {
+            if (errno == EINTR)
+                continue;
+
+            // socket buffer is full, the remainder waits for the next writable event
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                metricsIncrement(METRIC_EAGAIN);
+                return total;
+            }
+            return -1;
+        }
+
+        metricsAdd(METRIC_BYTES_OUT, bytes_sent);
+
+        consume(queue, bytes_sent);
+        total += bytes_sent;
+    }
+    return total;
+}
+
+size_t outputQueueDepth(const OutputQueue *queue)
+{
+    return queue->queuedBytes;
+}
@@ -0,0 +1,58 @@
+// per connection output queue
+// - small appends are coalesced into shared segments
+// - a flush writes every segment with one sendmsg (iovec per segment)
+// - file ranges are queued by reference and sent with sendFileRange, the memory
+//   segments before them go out with MSG_MORE so headers share segments with the file
+// - on EAGAIN/partial writes the unsent remainder stays queued
+
+#ifndef OUTPUT_QUEUE_H
+#define OUTPUT_QUEUE_H
+
+#include "socket-library.h"
+
+// minimum capacity of a segment, bigger appends get a segment of their own size
+#define OUTPUT_SEGMENT_SIZE 4096
+
+typedef struct OutputSegment
+{
+    struct OutputSegment *next;
+    size_t capacity;
+    size_t len;    // bytes stored (length of the range for files)
+    size_t offset; // bytes already sent
+    int fileFd;    // -1 for memory segments
+    off_t fileOffset;
+    char data[];
+} OutputSegment;
+
+typedef struct
+{
+    OutputSegment *head, *tail;
+    size_t queuedBytes;
+    size_t segments;
+} OutputQueue;
+
+void initOutputQueue(OutputQueue *queue);
+
+// drop everything still queued
+void freeOutputQueue(OutputQueue *queue);
+
+// copy data at the end of the queue, returns -1 when allocation fails
+int outputQueueAppend(OutputQueue *queue, const void *data, size_t len);
+
+// queue len bytes of the file from offset, the queue owns fileFd from now on
+// (closed once sent or dropped, also when -1 is returned)
+int outputQueueAppendFile(OutputQueue *queue, int fileFd, off_t offset, size_t len);
+
+// format directly into the queue, returns the formatted length or -1
+int outputQueuePrintf(OutputQueue *queue, const char *format, ...);
+
+// va_list version of outputQueuePrintf
+int outputQueueVPrintf(OutputQueue *queue, const char *format, va_list args);
+
+// write as much as the socket accepts, returns bytes written (0 on EAGAIN) or -1 on error
+ssize_t outputQueueFlush(OutputQueue *queue, int fd);
+
+// bytes waiting to be sent, callers use it for backpressure
+size_t outputQueueDepth(const OutputQueue *queue);
+
+#endif
@@ -0,0 +1,377 @@
+#include "pool-backend.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/timerfd.h>
+
+#define POOL_BUFFER_SIZE 4096
+#define POOL_MAX_EVENTS 256
+
+typedef struct PoolServer PoolServer;
+
+typedef struct
+{
+    Connection conn; // must stay first, handlers only see this part
+    PoolTask task;
+    PoolServer *server;
+    uint32_t events; // reported by the polling task
+    int closing;
+    int peerClosed;    // eof was read, the queued output is still flushed
+    int lingering;     // output shut down, input read and discarded until eof
+    size_t discarded;
+} PoolConnection;
+
+struct PoolServer
+{
+    int epfd;
+    int sfd;
+    int backoffFd; // timerfd which arms the listener again after an accept backoff
+    ThreadPool *pool;
+    const StreamHandlers *handlers;
+    void *userData;
+
+    // at most one of each is queued or running at any time
+    PoolTask pollTask;
+    PoolTask acceptTask;
+
+    pthread_mutex_t lock;
+    pthread_cond_t stopped;
+    int failed;
+};
+
+static PoolConnection *poolConnectionOf(PoolTask *task)
+{
+    return (PoolConnection *)((char *)task - offsetof(PoolConnection, task));
+}
+
+static ssize_t poolSend(Connection *conn, const void *data, size_t len)
+{
+    if (outputQueueAppend(&conn->output, data, len) == -1)
+        return -1;
+    return (ssize_t)len;
+}
+
+static int poolSendFile(Connection *conn, int fileFd, off_t offset, size_t len)
+{
+    return outputQueueAppendFile(&conn->output, fileFd, offset, len);
+}
+
+// flushed then closed by the task which owns the connection
+static void poolClose(Connection *conn)
+{
+    ((PoolConnection *)conn)->closing = 1;
+}
+
+static size_t poolQueuedBytes(Connection *conn)
+{
+    return outputQueueDepth(&conn->output);
+}
+
+static const ConnectionOps poolOps = {
+    .send = poolSend,
+    .sendFile = poolSendFile,
+    .close = poolClose,
+    .queuedBytes = poolQueuedBytes,
+};
+
+static void failServer(PoolServer *server)
+{
+    pthread_mutex_lock(&server->lock);
+    server->failed = 1;
+    pthread_cond_signal(&server->stopped);
+    pthread_mutex_unlock(&server->lock);
+}
+
+static void destroyPoolConnection(PoolConnection *pc)
+{
+    PoolServer *server = pc->server;
+
+    if (server->handlers->onClose != NULL)
+        server->handlers->onClose(&pc->conn);
+
+    epoll_ctl(server->epfd, EPOLL_CTL_DEL, pc->conn.fd, NULL);
+    close(pc->conn.fd);
+    freeOutputQueue(&pc->conn.output);
+    free(pc);
+    releaseClient();
+}
+
+// give the connection back to epoll, another worker may own it right after this
+static void rearmConnection(PoolConnection *pc)
+{
+    Connection *conn = &pc->conn;
+    struct epoll_event ev;
+
+    // a hangup already seen would be reported again and again
+    ev.events = EPOLLONESHOT;
+    if (!pc->peerClosed)
+        ev.events |= EPOLLRDHUP;
+    if (pc->lingering || (!conn->readPaused && !pc->closing))
+        ev.events |= EPOLLIN;
+    if (outputQueueDepth(&conn->output) > 0)
+        ev.events |= EPOLLOUT;
+    ev.data.ptr = pc;
+
+    metricsIncrement(METRIC_SYSCALLS);
+    if (epoll_ctl(pc->server->epfd, EPOLL_CTL_MOD, conn->fd, &ev) == -1)
+        destroyPoolConnection(pc);
+}
+
+// closing with unread input would reset the connection and drop the responses still in the
+// socket buffer, so the output is shut down and the input read and discarded until eof
+static void lingerConnection(PoolConnection *pc)
+{
+    char buffer[POOL_BUFFER_SIZE];
+    ssize_t bytes_received;
+
+    if (!pc->lingering)
+    {
+        pc->lingering = 1;
+        shutdown(pc->conn.fd, SHUT_WR);
+    }
+
+    while ((bytes_received = recv(pc->conn.fd, buffer, sizeof(buffer), 0)) > 0)
+        pc->discarded += bytes_received;
+
+    if (bytes_received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) && pc->discarded < LINGER_MAX_BYTES)
+        rearmConnection(pc);
+    else
+        destroyPoolConnection(pc);
+}
+
+static void runConnectionTask(PoolTask *task)
+{
+    PoolConnection *pc = poolConnectionOf(task);
+    Connection *conn = &pc->conn;
+    const StreamHandlers *handlers = pc->server->handlers;
+    char buffer[POOL_BUFFER_SIZE + 1];
+    int failed = 0;
+
+    if (pc->lingering)
+    {
+        lingerConnection(pc);
+        return;
+    }
+
+    // errors and hangups are seen by the failing recv
+    if ((pc->events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) || conn->readPaused)
+    {
+        conn->readPaused = 0;
+
+        while (!pc->closing)
+        {
+            // the client does not read its responses, stop reading its requests until it does
+            if (outputQueueDepth(&conn->output) > OUTPUT_HIGH_WATER)
+            {
+                conn->readPaused = 1;
+                break;
+            }
+
+            ssize_t bytes_received = recvMessage(conn->fd, 0, buffer, sizeof(buffer));
+            // the client is done sending but may still read, its responses are flushed first
+            if (bytes_received == 0)
+            {
+                pc->closing = pc->peerClosed = 1;
+                break;
+            }
+            if (bytes_received == -1)
+            {
+                failed = errno != EAGAIN && errno != EWOULDBLOCK;
+                break;
+            }
+            handlers->onData(conn, buffer, bytes_received);
+        }
+    }
+
+    // every response of this batch goes out with one syscall
+    if (outputQueueFlush(&conn->output, conn->fd) == -1)
+        failed = 1;
+
+    if (failed || (pc->peerClosed && outputQueueDepth(&conn->output) == 0))
+        destroyPoolConnection(pc);
+    else if (pc->closing && outputQueueDepth(&conn->output) == 0)
+        lingerConnection(pc);
+    else
+        rearmConnection(pc);
+}
+
+// the listener is left disarmed and the timer runs the accept task again, a task cannot sleep
+// as it would hold one of the workers
+static int backOffAccepting(PoolServer *server)
+{
+    struct itimerspec timeout;
+    memset(&timeout, 0, sizeof(timeout));
+    timeout.it_value.tv_sec = ACCEPT_BACKOFF_MS / 1000;
+    timeout.it_value.tv_nsec = ACCEPT_BACKOFF_MS % 1000 * 1000000L;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = server;
+
+    if (timerfd_settime(server->backoffFd, 0, &timeout, NULL) == -1 ||
+        epoll_ctl(server->epfd, EPOLL_CTL_MOD, server->backoffFd, &ev) == -1)
+        return -1;
+    return 0;
+}
+
+static void runAcceptTask(PoolTask *task)
+{
+    PoolServer *server = (PoolServer *)((char *)task - offsetof(PoolServer, acceptTask));
+    int batch = acceptBatchSize();
+
+    // the listener is level triggered, clients left over by the batch are reported again
+    for (int accepted = 0; batch == 0 || accepted < batch; accepted++)
+    {
+        struct sockaddr_storage addr;
+        socklen_t addrLen = sizeof(addr);
+
+        int cfd = admitClient(server->sfd, (struct sockaddr *)&addr, &addrLen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (cfd == -1)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+
+            // out of fds (and no spare left to shed) or memory, retrying right away would only spin
+            if ((errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) &&
+                backOffAccepting(server) == 0)
+                return;
+
+            if (errno != EAGAIN)
+                perror("accept4");
+            break;
+        }
+
+        PoolConnection *pc = calloc(1, sizeof(PoolConnection));
+        if (pc == NULL)
+        {
+            close(cfd);
+            releaseClient();
+            continue;
+        }
+
+        tuneAcceptedSocket(cfd);
+        pc->conn.fd = cfd;
+        pc->conn.ops = &poolOps;
+        pc->conn.userData = server->userData;
+        memcpy(&pc->conn.addr, &addr, addrLen);
+        pc->conn.addrLen = addrLen;
+        pc->task.run = runConnectionTask;
+        pc->server = server;
+
+        // nobody else can see the connection before it is registered
+        if (server->handlers->onOpen != NULL)
+            server->handlers->onOpen(&pc->conn);
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+        if (outputQueueDepth(&pc->conn.output) > 0)
+            ev.events |= EPOLLOUT;
+        ev.data.ptr = pc;
+
+        if (pc->closing || epoll_ctl(server->epfd, EPOLL_CTL_ADD, cfd, &ev) == -1)
+        {
+            if (server->handlers->onClose != NULL)
+                server->handlers->onClose(&pc->conn);
+            close(cfd);
+            freeOutputQueue(&pc->conn.output);
+            free(pc);
+            releaseClient();
+        }
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(server->epfd, EPOLL_CTL_MOD, server->sfd, &ev) == -1)
+        perror("epoll_ctl listener");
+}
+
+static void runPollTask(PoolTask *task)
+{
+    PoolServer *server = (PoolServer *)((char *)task - offsetof(PoolServer, pollTask));
+
+    // on the stack, the next poll may run on another worker before this one is done
+    struct epoll_event events[POOL_MAX_EVENTS];
+
+    int nEvents = epoll_wait(server->epfd, events, POOL_MAX_EVENTS, -1);
+    metricsIncrement(METRIC_SYSCALLS);
+    if (nEvents == -1 && errno != EINTR)
+    {
+        perror("epoll_wait");
+        failServer(server);
+        return;
+    }
+
+    // queued before the connections, so it sits on top of the deque where idle workers steal first
+    threadPoolSubmit(server->pool, &server->pollTask);
+
+    for (int i = 0; i < nEvents; i++)
+    {
+        PoolConnection *pc = events[i].data.ptr;
+
+        // the listener or the end of an accept backoff, only one of them is armed at a time
+        if (pc == NULL || events[i].data.ptr == server)
+            threadPoolSubmit(server->pool, &server->acceptTask);
+        else
+        {
+            pc->events = events[i].events;
+            threadPoolSubmit(server->pool, &pc->task);
+        }
+    }
+}
+
+int runPoolServer(int sfd, int threads, const StreamHandlers *handlers, void *userData)
+{
+    PoolServer server;
+    memset(&server, 0, sizeof(server));
+
+    server.sfd = sfd;
+    server.handlers = handlers;
+    server.userData = userData;
+    server.pollTask.run = runPollTask;
+    server.acceptTask.run = runAcceptTask;
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.stopped, NULL);
+
+    if (setNonBlocking(sfd) == -1 || (server.epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+        return -1;
+
+    if ((server.backoffFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1)
+    {
+        close(server.epfd);
+        return -1;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = NULL;
+
+    // the timer is registered disarmed, backOffAccepting arms it
+    struct epoll_event timerEv;
+    timerEv.events = 0;
+    timerEv.data.ptr = &server;
+
+    if (epoll_ctl(server.epfd, EPOLL_CTL_ADD, sfd, &ev) == -1 ||
+        epoll_ctl(server.epfd, EPOLL_CTL_ADD, server.backoffFd, &timerEv) == -1 ||
+        (server.pool = createThreadPool(threads)) == NULL)
+    {
+        close(server.backoffFd);
+        close(server.epfd);
+        return -1;
+    }
+
+    threadPoolSubmit(server.pool, &server.pollTask);
+
+    // the workers do everything, this thread only waits for a fatal error
+    pthread_mutex_lock(&server.lock);
+    while (!server.failed)
+        pthread_cond_wait(&server.stopped, &server.lock);
+    pthread_mutex_unlock(&server.lock);
+
+    destroyThreadPool(server.pool);
+    close(server.backoffFd);
+    close(server.epfd);
+    pthread_cond_destroy(&server.stopped);
+    pthread_mutex_destroy(&server.lock);
+    return -1;
+}
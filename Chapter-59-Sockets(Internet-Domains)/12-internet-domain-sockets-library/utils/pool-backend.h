@@ -0,0 +1,16 @@
+// thread pool backend of the stream server
+// - one epoll instance, every fd is armed with EPOLLONESHOT so one worker at a time owns a connection
+// - waiting on epoll is itself a pool task: it pushes the ready connections on its worker's
+//   deque and idle workers steal them, so accepting, reading and handlers run on any free core
+// - a connection is re-armed only after its handler returned and its output was flushed
+
+#ifndef POOL_BACKEND_H
+#define POOL_BACKEND_H
+
+#include "stream-server.h"
+#include "thread-pool.h"
+
+// threads <= 0 means one per online cpu, returns -1 on a fatal error
+int runPoolServer(int sfd, int threads, const StreamHandlers *handlers, void *userData);
+
+#endif
@@ -0,0 +1,471 @@
+#include "prefork-server.h"
+#include <errno.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#define MAX_FDS_PER_MESSAGE 16
+#define RESPAWN_DELAY_MS 1000 // a worker that could not be forked is tried again after this
+
+// master side of a worker
+typedef struct
+{
+    pid_t pid;
+    int channel;
+    uint32_t sent; // fds passed to it
+    int tried;     // already failed for the client being passed
+    LoadReport report;
+
+    // a report can arrive split over two reads
+    char partial[sizeof(LoadReport)];
+    size_t partialLen;
+} WorkerSlot;
+
+// state of the worker process, every worker is a process of its own so this is private to it
+static struct
+{
+    int channel;
+    EventLoop *loop;
+    ConnectionCallbacks *clientCallbacks;
+    const StreamHandlers *handlers;
+    void *userData;
+    LoadReport report;
+} worker;
+
+int sendDescriptor(int channel, int fd)
+{
+    // at least one byte of data has to go with the ancillary data
+    char data = 0;
+    struct iovec iov = {.iov_base = &data, .iov_len = 1};
+
+    union
+    {
+        char buffer[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    return sendmsg(channel, &msg, MSG_NOSIGNAL) == -1 ? -1 : 0;
+}
+
+// a lost report is fine, the next one carries the full state again
+static void reportLoad(void)
+{
+    send(worker.channel, &worker.report, sizeof(worker.report), MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+static void onWorkerOpen(Connection *conn)
+{
+    worker.report.active++;
+    reportLoad();
+
+    if (worker.handlers->onOpen != NULL)
+        worker.handlers->onOpen(conn);
+}
+
+static void onWorkerData(Connection *conn, const char *data, size_t len)
+{
+    worker.handlers->onData(conn, data, len);
+}
+
+static void onWorkerClose(Connection *conn)
+{
+    if (worker.handlers->onClose != NULL)
+        worker.handlers->onClose(conn);
+
+    worker.report.active--;
+    reportLoad();
+}
+
+static const StreamHandlers countingHandlers = {
+    .onOpen = onWorkerOpen,
+    .onData = onWorkerData,
+    .onClose = onWorkerClose,
+};
+
+// take every client fd the master has passed
+static void receiveClients(Connection *channel)
+{
+    while (1)
+    {
+        char data[MAX_FDS_PER_MESSAGE];
+        struct iovec iov = {.iov_base = data, .iov_len = sizeof(data)};
+
+        union
+        {
+            char buffer[CMSG_SPACE(sizeof(int) * MAX_FDS_PER_MESSAGE)];
+            struct cmsghdr align;
+        } control;
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buffer;
+        msg.msg_controllen = sizeof(control.buffer);
+
+        ssize_t bytes_received = recvmsg(channel->fd, &msg, MSG_CMSG_CLOEXEC);
+        if (bytes_received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+
+        // master is gone, nobody will pass clients anymore
+        if (bytes_received <= 0)
+        {
+            eventLoopStop(worker.loop);
+            return;
+        }
+
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+                continue;
+
+            size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (size_t i = 0; i < count; i++)
+            {
+                int cfd;
+                memcpy(&cfd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                worker.report.received++;
+
+                // onOpen reports the new load
+                if (eventLoopAddConnection(worker.loop, cfd, worker.clientCallbacks, worker.userData) == NULL)
+                {
+                    close(cfd);
+                    reportLoad();
+                }
+            }
+        }
+    }
+}
+
+static int runWorker(int channel, const StreamHandlers *handlers, void *userData)
+{
+    static const ConnectionCallbacks channelCallbacks = {
+        .onReadable = receiveClients,
+    };
+
+    worker.channel = channel;
+    worker.handlers = handlers;
+    worker.userData = userData;
+    worker.loop = createEventLoop(1024);
+    worker.clientCallbacks = createStreamCallbacks(&countingHandlers);
+
+    if (worker.loop == NULL || worker.clientCallbacks == NULL ||
+        eventLoopAddConnection(worker.loop, channel, &channelCallbacks, NULL) == NULL)
+        return -1;
+
+    int status = eventLoopRun(worker.loop);
+
+    destroyEventLoop(worker.loop);
+    free(worker.clientCallbacks);
+    return status;
+}
+
+static int spawnWorker(WorkerSlot *slots, int index, int count, int sfd, const StreamHandlers *handlers, void *userData)
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == -1)
+        return -1;
+
+    // buffered output would be printed again by the child
+    fflush(stdout);
+
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    // worker keeps only its own end, it never accepts itself
+    if (pid == 0)
+    {
+        close(fds[0]);
+        close(sfd);
+        for (int i = 0; i < count; i++)
+            if (i != index && slots[i].channel != -1)
+                close(slots[i].channel);
+
+        _exit(runWorker(fds[1], handlers, userData) == -1 ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+
+    close(fds[1]);
+    setNonBlocking(fds[0]);
+
+    memset(&slots[index], 0, sizeof(WorkerSlot));
+    slots[index].pid = pid;
+    slots[index].channel = fds[0];
+    return 0;
+}
+
+// keep the newest complete report, returns -1 when the worker is gone
+static int readReports(WorkerSlot *slot)
+{
+    char buffer[sizeof(LoadReport) * 64];
+
+    while (1)
+    {
+        memcpy(buffer, slot->partial, slot->partialLen);
+
+        ssize_t bytes_received = recv(slot->channel, buffer + slot->partialLen, sizeof(buffer) - slot->partialLen, 0);
+        if (bytes_received == 0)
+            return -1;
+        if (bytes_received == -1)
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+
+        size_t total = slot->partialLen + bytes_received;
+        size_t whole = total / sizeof(LoadReport);
+
+        if (whole > 0)
+            memcpy(&slot->report, buffer + (whole - 1) * sizeof(LoadReport), sizeof(LoadReport));
+
+        slot->partialLen = total - whole * sizeof(LoadReport);
+        memcpy(slot->partial, buffer + whole * sizeof(LoadReport), slot->partialLen);
+    }
+}
+
+static long long nowMs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// clients passed since the last report are counted as open
+static uint32_t loadOf(const WorkerSlot *slot)
+{
+    return slot->report.active + (slot->sent - slot->report.received);
+}
+
+// pass cfd to the least loaded worker whose channel takes it, the others are tried in load order
+// returns -1 with errno EAGAIN when every channel is full
+static int passClient(WorkerSlot *slots, int count, int cfd)
+{
+    int full = 0;
+
+    for (int i = 0; i < count; i++)
+        slots[i].tried = slots[i].channel == -1;
+
+    while (1)
+    {
+        int least = -1;
+        for (int i = 0; i < count; i++)
+            if (!slots[i].tried && (least == -1 || loadOf(&slots[i]) < loadOf(&slots[least])))
+                least = i;
+
+        if (least == -1)
+        {
+            errno = full ? EAGAIN : EPIPE;
+            return -1;
+        }
+
+        if (sendDescriptor(slots[least].channel, cfd) == 0)
+        {
+            slots[least].sent++;
+            return 0;
+        }
+
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
+            full = 1;
+        slots[least].tried = 1;
+    }
+}
+
+// the workers own the clients, so only shedding and batching apply here, not the connection limit
+// a client no channel could take is kept in pending, nothing is accepted until it is passed
+// returns -1 when accept ran out of fds or memory and nothing could be shed
+static int dispatchClients(int sfd, WorkerSlot *slots, int count, int *pending)
+{
+    int batch = acceptBatchSize();
+
+    if (*pending != -1)
+    {
+        if (passClient(slots, count, *pending) == -1 && errno == EAGAIN)
+            return 0;
+
+        // the worker has its own reference now, or no worker is left to take it
+        close(*pending);
+        *pending = -1;
+    }
+
+    for (int accepted = 0; batch == 0 || accepted < batch; accepted++)
+    {
+        int cfd = accept4(sfd, NULL, NULL, SOCK_CLOEXEC);
+        if (cfd == -1)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if ((errno == EMFILE || errno == ENFILE) && shedClient(sfd) == 0)
+                continue;
+
+            // the listener stays readable, polling it right away would only spin
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+                return -1;
+
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("accept4");
+            return 0;
+        }
+
+        tuneAcceptedSocket(cfd);
+
+        // every worker is busy reading: retry once a channel is writable again
+        if (passClient(slots, count, cfd) == -1 && errno == EAGAIN)
+        {
+            *pending = cfd;
+            return 0;
+        }
+
+        // the worker has its own reference now
+        close(cfd);
+    }
+    return 0;
+}
+
+int runPreforkServer(int sfd, int workers, const StreamHandlers *handlers, void *userData)
+{
+    if (workers <= 0)
+        workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers <= 0)
+        workers = 1;
+
+    WorkerSlot *slots = calloc(workers, sizeof(WorkerSlot));
+    struct pollfd *fds = calloc(workers + 1, sizeof(struct pollfd));
+    if (slots == NULL || fds == NULL || setNonBlocking(sfd) == -1)
+    {
+        free(slots);
+        free(fds);
+        return -1;
+    }
+
+    for (int i = 0; i < workers; i++)
+        slots[i].channel = -1;
+
+    for (int i = 0; i < workers; i++)
+    {
+        if (spawnWorker(slots, i, workers, sfd, handlers, userData) == 0)
+            continue;
+
+        // the workers already forked stop when their channel is closed
+        int saved = errno;
+        for (int j = 0; j < i; j++)
+        {
+            close(slots[j].channel);
+            waitpid(slots[j].pid, NULL, 0);
+        }
+
+        free(slots);
+        free(fds);
+        errno = saved;
+        return -1;
+    }
+
+    printf("master %d passes clients to %d workers...\n", getpid(), workers);
+
+    int pending = -1;
+    long long acceptResumeAt = 0; // the listener is not polled before this, 0 when it is
+    long long respawnAt = 0;      // missing workers are forked again at this time, 0 when none are
+
+    while (1)
+    {
+        long long now = nowMs();
+        if (acceptResumeAt != 0 && acceptResumeAt <= now)
+            acceptResumeAt = 0;
+
+        if (respawnAt != 0 && respawnAt <= now)
+        {
+            respawnAt = 0;
+            for (int i = 0; i < workers; i++)
+            {
+                if (slots[i].channel != -1 || spawnWorker(slots, i, workers, sfd, handlers, userData) == 0)
+                    continue;
+                perror("fork");
+                respawnAt = now + RESPAWN_DELAY_MS;
+            }
+        }
+
+        // sleep until the nearer of the two deadlines
+        long long wakeAt = acceptResumeAt;
+        if (respawnAt != 0 && (wakeAt == 0 || respawnAt < wakeAt))
+            wakeAt = respawnAt;
+        int timeout = wakeAt == 0 ? -1 : (int)(wakeAt - now);
+
+        fds[0].fd = sfd;
+        fds[0].events = pending == -1 && acceptResumeAt == 0 ? POLLIN : 0;
+        for (int i = 0; i < workers; i++)
+        {
+            fds[i + 1].fd = slots[i].channel;
+            fds[i + 1].events = pending == -1 ? POLLIN : POLLIN | POLLOUT;
+        }
+
+        if (poll(fds, workers + 1, timeout) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        // reports first, so the clients of this round go to the right workers
+        for (int i = 0; i < workers; i++)
+        {
+            if (!(fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)) || readReports(&slots[i]) == 0)
+                continue;
+
+            // the worker crashed or exited, only its own clients are lost
+            int status;
+            close(slots[i].channel);
+            slots[i].channel = -1;
+            waitpid(slots[i].pid, &status, 0);
+
+            if (WIFSIGNALED(status))
+                printf("worker %d killed by signal %d, forking a new one\n", slots[i].pid, WTERMSIG(status));
+            else
+                printf("worker %d exited with status %d, forking a new one\n", slots[i].pid, WEXITSTATUS(status));
+
+            // the others take its clients meanwhile
+            if (spawnWorker(slots, i, workers, sfd, handlers, userData) == -1)
+            {
+                fprintf(stderr, "forking a new worker failed: %s, retrying in %d ms\n", strerror(errno), RESPAWN_DELAY_MS);
+                slots[i].pid = 0;
+                if (respawnAt == 0)
+                    respawnAt = nowMs() + RESPAWN_DELAY_MS;
+            }
+        }
+
+        if (((fds[0].revents & POLLIN) || pending != -1) && acceptResumeAt == 0 &&
+            dispatchClients(sfd, slots, workers, &pending) == -1)
+            acceptResumeAt = nowMs() + ACCEPT_BACKOFF_MS;
+    }
+
+    if (pending != -1)
+        close(pending);
+
+    // closing the channels makes every worker stop
+    for (int i = 0; i < workers; i++)
+        if (slots[i].channel != -1)
+            close(slots[i].channel);
+    while (wait(NULL) > 0)
+        ;
+
+    free(slots);
+    free(fds);
+    return -1;
+}
@@ -0,0 +1,28 @@
+// pre-forked worker server
+// - the master forks the workers, each gets one end of a unix socket pair
+// - the master accepts and passes every client fd with SCM_RIGHTS to the least loaded worker
+// - workers serve their clients on their own event loop and report their load back
+// - a crashed worker only loses its own clients, the master reaps it and forks a new one
+// - when that fork fails the master goes on with one worker less and tries again later
+// no memory is shared, the load reports are the only thing the master knows about workers
+
+#ifndef PREFORK_SERVER_H
+#define PREFORK_SERVER_H
+
+#include "stream-server.h"
+
+// sent by a worker after every change of its connections
+typedef struct
+{
+    uint32_t active;   // clients currently open
+    uint32_t received; // fds received since the worker started
+} LoadReport;
+
+// runs the master loop on the listening socket, returns -1 on a fatal error
+// or when the first workers cannot all be forked, the ones that were are stopped again
+int runPreforkServer(int sfd, int workers, const StreamHandlers *handlers, void *userData);
+
+// send fd with SCM_RIGHTS over a unix socket, returns -1 on error
+int sendDescriptor(int channel, int fd);
+
+#endif
@@ -0,0 +1,385 @@
+#include "resolver-cache.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#define RESOLVER_BUCKETS 128
+
+typedef struct CacheEntry
+{
+    // key, hostname can be NULL like for getaddrinfo
+    char *hostname;
+    char *service;
+    int family, socktype, protocol, flags;
+
+    int status; // 0 or the EAI_* code of a cached failure
+    struct addrinfo *list;
+    long long expiresAt; // monotonic ms
+
+    int refreshing; // queued for / being resolved by the background thread
+    struct CacheEntry *next;
+    struct CacheEntry *nextRefresh;
+} CacheEntry;
+
+struct ResolverCache
+{
+    pthread_mutex_t lock;
+    pthread_cond_t refreshReady;
+    pthread_t refresher;
+    int running;
+
+    long long ttlMs, negativeTtlMs, staleMs;
+    CacheEntry *buckets[RESOLVER_BUCKETS];
+    CacheEntry *refreshHead, *refreshTail;
+    ResolverStats stats;
+};
+
+static long long nowMs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static unsigned long hashKey(const char *hostname, const char *service, const struct addrinfo *hints)
+{
+    // fnv-1a
+    unsigned long hash = 2166136261u ^ (unsigned long)(hints->ai_family * 31 + hints->ai_socktype);
+    for (const char *c = hostname ? hostname : ""; *c; c++)
+        hash = (hash ^ (unsigned char)*c) * 16777619u;
+    hash = (hash ^ ':') * 16777619u;
+    for (const char *c = service ? service : ""; *c; c++)
+        hash = (hash ^ (unsigned char)*c) * 16777619u;
+    return hash;
+}
+
+static int sameString(const char *a, const char *b)
+{
+    if (a == NULL || b == NULL)
+        return a == b;
+    return strcmp(a, b) == 0;
+}
+
+void resolverFreeAddrInfo(struct addrinfo *res)
+{
+    while (res != NULL)
+    {
+        struct addrinfo *next = res->ai_next;
+        free(res->ai_canonname);
+        free(res);
+        res = next;
+    }
+}
+
+// deep copy, each node holds its address right after itself
+static struct addrinfo *copyAddrInfo(const struct addrinfo *src)
+{
+    struct addrinfo *head = NULL, **link = &head;
+
+    for (; src != NULL; src = src->ai_next)
+    {
+        struct addrinfo *node = malloc(sizeof(struct addrinfo) + src->ai_addrlen);
+        if (node == NULL)
+        {
+            resolverFreeAddrInfo(head);
+            return NULL;
+        }
+
+        *node = *src;
+        node->ai_addr = (struct sockaddr *)(node + 1);
+        memcpy(node->ai_addr, src->ai_addr, src->ai_addrlen);
+        node->ai_canonname = src->ai_canonname ? strdup(src->ai_canonname) : NULL;
+        node->ai_next = NULL;
+
+        *link = node;
+        link = &node->ai_next;
+    }
+    return head;
+}
+
+// transient failures are retried by the next caller instead of being cached
+static int isCacheableFailure(int status)
+{
+    return status != EAI_AGAIN && status != EAI_SYSTEM && status != EAI_MEMORY;
+}
+
+// call getaddrinfo for the key of the entry, no lock is held
+static int resolveEntry(const CacheEntry *entry, struct addrinfo **list)
+{
+    struct addrinfo hints, *res;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = entry->family;
+    hints.ai_socktype = entry->socktype;
+    hints.ai_protocol = entry->protocol;
+    hints.ai_flags = entry->flags;
+
+    int status = getaddrinfo(entry->hostname, entry->service, &hints, &res);
+    if (status != 0)
+    {
+        *list = NULL;
+        return status;
+    }
+
+    *list = copyAddrInfo(res);
+    freeaddrinfo(res);
+    return *list == NULL ? EAI_MEMORY : 0;
+}
+
+// called with the lock held, the entry takes ownership of list
+static void storeResult(ResolverCache *cache, CacheEntry *entry, int status, struct addrinfo *list)
+{
+    if (status == 0)
+    {
+        resolverFreeAddrInfo(entry->list);
+        entry->list = list;
+        entry->status = 0;
+        entry->expiresAt = nowMs() + cache->ttlMs;
+    }
+    // a failed refresh keeps the old answer, it stays usable until the stale window ends
+    else if (isCacheableFailure(status) && entry->list == NULL)
+    {
+        entry->status = status;
+        entry->expiresAt = nowMs() + cache->negativeTtlMs;
+    }
+}
+
+static void *refreshLoop(void *arg)
+{
+    ResolverCache *cache = arg;
+
+    pthread_mutex_lock(&cache->lock);
+    while (1)
+    {
+        while (cache->running && cache->refreshHead == NULL)
+            pthread_cond_wait(&cache->refreshReady, &cache->lock);
+        if (!cache->running)
+            break;
+
+        CacheEntry *entry = cache->refreshHead;
+        cache->refreshHead = entry->nextRefresh;
+        if (cache->refreshHead == NULL)
+            cache->refreshTail = NULL;
+
+        // entries are only freed by destroyResolverCache, after this thread is joined
+        pthread_mutex_unlock(&cache->lock);
+        struct addrinfo *list;
+        int status = resolveEntry(entry, &list);
+        pthread_mutex_lock(&cache->lock);
+
+        storeResult(cache, entry, status, list);
+        entry->refreshing = 0;
+        cache->stats.refreshes++;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return NULL;
+}
+
+ResolverCache *createResolverCache(int ttlMs, int negativeTtlMs, int staleMs)
+{
+    ResolverCache *cache = calloc(1, sizeof(ResolverCache));
+    if (cache == NULL)
+        return NULL;
+
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_cond_init(&cache->refreshReady, NULL);
+    cache->ttlMs = ttlMs;
+    cache->negativeTtlMs = negativeTtlMs;
+    cache->staleMs = staleMs;
+
+    if (staleMs > 0)
+    {
+        cache->running = 1;
+        if (pthread_create(&cache->refresher, NULL, refreshLoop, cache) != 0)
+        {
+            pthread_cond_destroy(&cache->refreshReady);
+            pthread_mutex_destroy(&cache->lock);
+            free(cache);
+            return NULL;
+        }
+    }
+    return cache;
+}
+
+void destroyResolverCache(ResolverCache *cache)
+{
+    if (cache == NULL)
+        return;
+
+    if (cache->staleMs > 0)
+    {
+        pthread_mutex_lock(&cache->lock);
+        cache->running = 0;
+        pthread_cond_signal(&cache->refreshReady);
+        pthread_mutex_unlock(&cache->lock);
+        pthread_join(cache->refresher, NULL);
+    }
+
+    for (int i = 0; i < RESOLVER_BUCKETS; i++)
+    {
+        while (cache->buckets[i] != NULL)
+        {
+            CacheEntry *entry = cache->buckets[i];
+            cache->buckets[i] = entry->next;
+            resolverFreeAddrInfo(entry->list);
+            free(entry->hostname);
+            free(entry->service);
+            free(entry);
+        }
+    }
+
+    pthread_cond_destroy(&cache->refreshReady);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
+
+// called with the lock held, create says whether a missing entry is added
+static CacheEntry *findEntry(
+    ResolverCache *cache,
+    const char *hostname,
+    const char *service,
+    const struct addrinfo *hints,
+    int create)
+{
+    CacheEntry **bucket = &cache->buckets[hashKey(hostname, service, hints) % RESOLVER_BUCKETS];
+
+    for (CacheEntry *entry = *bucket; entry != NULL; entry = entry->next)
+        if (entry->family == hints->ai_family && entry->socktype == hints->ai_socktype &&
+            entry->protocol == hints->ai_protocol && entry->flags == hints->ai_flags &&
+            sameString(entry->hostname, hostname) && sameString(entry->service, service))
+            return entry;
+
+    if (!create)
+        return NULL;
+
+    CacheEntry *entry = calloc(1, sizeof(CacheEntry));
+    if (entry == NULL)
+        return NULL;
+
+    entry->hostname = hostname ? strdup(hostname) : NULL;
+    entry->service = service ? strdup(service) : NULL;
+    if ((hostname && entry->hostname == NULL) || (service && entry->service == NULL))
+    {
+        free(entry->hostname);
+        free(entry->service);
+        free(entry);
+        return NULL;
+    }
+
+    entry->family = hints->ai_family;
+    entry->socktype = hints->ai_socktype;
+    entry->protocol = hints->ai_protocol;
+    entry->flags = hints->ai_flags;
+    entry->expiresAt = 0; // nothing cached yet
+
+    entry->next = *bucket;
+    *bucket = entry;
+    return entry;
+}
+
+// called with the lock held
+static int answerFromEntry(const CacheEntry *entry, struct addrinfo **res)
+{
+    if (entry->status != 0)
+        return entry->status;
+
+    *res = copyAddrInfo(entry->list);
+    return *res == NULL ? EAI_MEMORY : 0;
+}
+
+int resolverLookup(
+    ResolverCache *cache,
+    const char *hostname,
+    const char *service,
+    const struct addrinfo *hints,
+    struct addrinfo **res)
+{
+    struct addrinfo noHints;
+    if (hints == NULL)
+    {
+        memset(&noHints, 0, sizeof(noHints));
+        noHints.ai_family = AF_UNSPEC;
+        hints = &noHints;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+
+    CacheEntry *entry = findEntry(cache, hostname, service, hints, 0);
+    long long now = nowMs();
+
+    if (entry != NULL && (entry->list != NULL || entry->status != 0))
+    {
+        if (now < entry->expiresAt)
+        {
+            if (entry->status != 0)
+                cache->stats.negativeHits++;
+            else
+                cache->stats.hits++;
+
+            int status = answerFromEntry(entry, res);
+            pthread_mutex_unlock(&cache->lock);
+            return status;
+        }
+
+        // expired but still inside the stale window, answer now and refresh in the background
+        if (entry->status == 0 && cache->staleMs > 0 && now < entry->expiresAt + cache->staleMs)
+        {
+            if (!entry->refreshing)
+            {
+                entry->refreshing = 1;
+                entry->nextRefresh = NULL;
+                if (cache->refreshTail != NULL)
+                    cache->refreshTail->nextRefresh = entry;
+                else
+                    cache->refreshHead = entry;
+                cache->refreshTail = entry;
+                pthread_cond_signal(&cache->refreshReady);
+            }
+
+            cache->stats.staleHits++;
+            int status = answerFromEntry(entry, res);
+            pthread_mutex_unlock(&cache->lock);
+            return status;
+        }
+    }
+
+    cache->stats.misses++;
+    pthread_mutex_unlock(&cache->lock);
+
+    // nothing usable, resolve in the caller like plain getaddrinfo
+    CacheEntry key;
+    memset(&key, 0, sizeof(key));
+    key.hostname = (char *)hostname;
+    key.service = (char *)service;
+    key.family = hints->ai_family;
+    key.socktype = hints->ai_socktype;
+    key.protocol = hints->ai_protocol;
+    key.flags = hints->ai_flags;
+
+    struct addrinfo *list;
+    int status = resolveEntry(&key, &list);
+
+    pthread_mutex_lock(&cache->lock);
+
+    entry = findEntry(cache, hostname, service, hints, 1);
+    if (entry == NULL)
+    {
+        // out of memory for the entry, still answer the caller
+        pthread_mutex_unlock(&cache->lock);
+        *res = list;
+        return status;
+    }
+
+    storeResult(cache, entry, status, list);
+    status = status == 0 ? answerFromEntry(entry, res) : status;
+    pthread_mutex_unlock(&cache->lock);
+    return status;
+}
+
+void resolverGetStats(ResolverCache *cache, ResolverStats *stats)
+{
+    pthread_mutex_lock(&cache->lock);
+    *stats = cache->stats;
+    pthread_mutex_unlock(&cache->lock);
+}
@@ -0,0 +1,45 @@
+// in process cache in front of getaddrinfo
+// - answers are kept for ttlMs (getaddrinfo does not report the dns ttl, so it is fixed)
+// - failed lookups (unknown host/service) are cached for negativeTtlMs
+// - for staleMs after expiry the old answer is still returned while a background
+//   thread resolves it again, so after warm up callers never wait for resolution
+// only needs libc and pthreads, other examples can compile it on its own
+
+#ifndef RESOLVER_CACHE_H
+#define RESOLVER_CACHE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+
+typedef struct ResolverCache ResolverCache;
+
+typedef struct
+{
+    size_t hits;         // fresh answers
+    size_t staleHits;    // expired answers served while refreshing
+    size_t negativeHits; // cached failures
+    size_t misses;       // callers which waited for getaddrinfo
+    size_t refreshes;    // background lookups
+} ResolverStats;
+
+// staleMs 0 disables stale-while-revalidate (no background thread is started)
+ResolverCache *createResolverCache(int ttlMs, int negativeTtlMs, int staleMs);
+
+void destroyResolverCache(ResolverCache *cache);
+
+// same contract as getaddrinfo: returns 0 or an EAI_* code, hints may be NULL
+// the list is a private copy, free it with resolverFreeAddrInfo
+int resolverLookup(
+    ResolverCache *cache,
+    const char *hostname,
+    const char *service,
+    const struct addrinfo *hints,
+    struct addrinfo **res);
+
+void resolverFreeAddrInfo(struct addrinfo *res);
+
+void resolverGetStats(ResolverCache *cache, ResolverStats *stats);
+
+#endif
@@ -0,0 +1,458 @@
+#include "response-cache.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#define CACHE_LINE 64
+#define INITIAL_BUCKETS 256
+
+// shards per online cpu, more shards than threads keeps two threads off the same lock
+#define SHARDS_PER_CPU 4
+
+// a fetch in progress, waiters of the key sleep on it
+typedef struct InFlight
+{
+    struct InFlight *next;
+    const char *key; // the leader's key, valid until it finishes
+    size_t keyLen;
+    uint64_t hash;
+
+    pthread_cond_t done;
+    int finished;
+    int waiters;
+    int failed;
+    CacheEntry *entry; // referenced for the waiters, NULL when not cacheable or failed
+} InFlight;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    CacheEntry **buckets;
+    size_t bucketCount; // power of 2
+    size_t entries;
+
+    // most recently used first
+    CacheEntry *lruHead, *lruTail;
+    size_t bytes;
+    size_t maxBytes;
+
+    InFlight *inFlight;
+    CacheStats stats;
+} __attribute__((aligned(CACHE_LINE))) CacheShard;
+
+struct ResponseCache
+{
+    CacheShard *shards;
+    size_t shardCount; // power of 2
+};
+
+static long long monotonicMs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// fnv-1a
+static uint64_t hashKey(const char *key, size_t len)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ (unsigned char)key[i]) * 1099511628211ull;
+    return hash;
+}
+
+ResponseCache *createResponseCache(size_t maxBytes, int shards)
+{
+    if (shards <= 0)
+        shards = (int)sysconf(_SC_NPROCESSORS_ONLN) * SHARDS_PER_CPU;
+
+    size_t shardCount = 1;
+    while ((int)shardCount < shards)
+        shardCount <<= 1;
+
+    ResponseCache *cache = calloc(1, sizeof(ResponseCache));
+    if (cache == NULL)
+        return NULL;
+
+    cache->shards = aligned_alloc(CACHE_LINE, sizeof(CacheShard) * shardCount);
+    if (cache->shards == NULL)
+    {
+        free(cache);
+        return NULL;
+    }
+    memset(cache->shards, 0, sizeof(CacheShard) * shardCount);
+    cache->shardCount = shardCount;
+
+    for (size_t i = 0; i < shardCount; i++)
+    {
+        CacheShard *shard = &cache->shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->maxBytes = maxBytes / shardCount;
+        shard->bucketCount = INITIAL_BUCKETS;
+        shard->buckets = calloc(INITIAL_BUCKETS, sizeof(CacheEntry *));
+        if (shard->buckets == NULL)
+        {
+            cache->shardCount = i + 1;
+            destroyResponseCache(cache);
+            return NULL;
+        }
+    }
+    return cache;
+}
+
+void cacheRelease(CacheEntry *entry)
+{
+    if (entry != NULL && atomic_fetch_sub_explicit(&entry->refs, 1, memory_order_acq_rel) == 1)
+        free(entry);
+}
+
+void destroyResponseCache(ResponseCache *cache)
+{
+    if (cache == NULL)
+        return;
+
+    for (size_t i = 0; i < cache->shardCount; i++)
+    {
+        CacheShard *shard = &cache->shards[i];
+
+        while (shard->lruHead != NULL)
+        {
+            CacheEntry *entry = shard->lruHead;
+            shard->lruHead = entry->lruNext;
+            cacheRelease(entry);
+        }
+
+        free(shard->buckets);
+        pthread_mutex_destroy(&shard->lock);
+    }
+
+    free(cache->shards);
+    free(cache);
+}
+
+CacheEntry *createCacheEntry(
+    const char *key,
+    size_t keyLen,
+    int status,
+    const char *headers,
+    size_t headersLen,
+    const char *body,
+    size_t bodyLen,
+    long ttlMs)
+{
+    size_t size = sizeof(CacheEntry) + keyLen + headersLen + bodyLen;
+    CacheEntry *entry = malloc(size);
+    if (entry == NULL)
+        return NULL;
+
+    memset(entry, 0, sizeof(CacheEntry));
+    char *data = (char *)(entry + 1);
+
+    memcpy(data, key, keyLen);
+    entry->key = data;
+    entry->keyLen = keyLen;
+    data += keyLen;
+
+    memcpy(data, headers, headersLen);
+    entry->headers = data;
+    entry->headersLen = headersLen;
+    data += headersLen;
+
+    memcpy(data, body, bodyLen);
+    entry->body = data;
+    entry->bodyLen = bodyLen;
+
+    entry->status = status;
+    entry->storedAt = monotonicMs();
+    entry->expiresAt = ttlMs > 0 ? entry->storedAt + ttlMs : 0;
+    entry->hash = hashKey(key, keyLen);
+    entry->size = size;
+    atomic_init(&entry->refs, 1);
+    return entry;
+}
+
+long long cacheEntryAge(const CacheEntry *entry)
+{
+    return monotonicMs() - entry->storedAt;
+}
+
+static CacheShard *shardOf(ResponseCache *cache, uint64_t hash)
+{
+    // the low bits pick the bucket, the shard comes from the high ones
+    return &cache->shards[(hash >> 48) & (cache->shardCount - 1)];
+}
+
+// the functions below are called with the shard lock held
+
+static CacheEntry **findLink(CacheShard *shard, const char *key, size_t keyLen, uint64_t hash)
+{
+    CacheEntry **link = &shard->buckets[hash & (shard->bucketCount - 1)];
+
+    for (; *link != NULL; link = &(*link)->hashNext)
+        if ((*link)->hash == hash && (*link)->keyLen == keyLen && memcmp((*link)->key, key, keyLen) == 0)
+            return link;
+    return link;
+}
+
+static void lruUnlink(CacheShard *shard, CacheEntry *entry)
+{
+    if (entry->lruPrev != NULL)
+        entry->lruPrev->lruNext = entry->lruNext;
+    else
+        shard->lruHead = entry->lruNext;
+
+    if (entry->lruNext != NULL)
+        entry->lruNext->lruPrev = entry->lruPrev;
+    else
+        shard->lruTail = entry->lruPrev;
+
+    entry->lruPrev = entry->lruNext = NULL;
+}
+
+static void lruPushFront(CacheShard *shard, CacheEntry *entry)
+{
+    entry->lruPrev = NULL;
+    entry->lruNext = shard->lruHead;
+    if (shard->lruHead != NULL)
+        shard->lruHead->lruPrev = entry;
+    else
+        shard->lruTail = entry;
+    shard->lruHead = entry;
+}
+
+// take the entry out of the shard, the reference of the shard is dropped
+static void removeEntry(CacheShard *shard, CacheEntry *entry)
+{
+    CacheEntry **link = findLink(shard, entry->key, entry->keyLen, entry->hash);
+    *link = entry->hashNext;
+    lruUnlink(shard, entry);
+
+    shard->entries--;
+    shard->bytes -= entry->size;
+    cacheRelease(entry);
+}
+
+static void growBuckets(CacheShard *shard)
+{
+    size_t count = shard->bucketCount * 2;
+    CacheEntry **buckets = calloc(count, sizeof(CacheEntry *));
+    if (buckets == NULL)
+        return;
+
+    for (size_t i = 0; i < shard->bucketCount; i++)
+    {
+        CacheEntry *entry = shard->buckets[i];
+        while (entry != NULL)
+        {
+            CacheEntry *next = entry->hashNext;
+            CacheEntry **bucket = &buckets[entry->hash & (count - 1)];
+            entry->hashNext = *bucket;
+            *bucket = entry;
+            entry = next;
+        }
+    }
+
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->bucketCount = count;
+}
+
+// the shard takes a reference, older entries of the key and the least recently used
+// ones are dropped to make room
+static void storeEntry(CacheShard *shard, CacheEntry *entry)
+{
+    if (entry->expiresAt == 0 || entry->size > shard->maxBytes)
+        return;
+
+    CacheEntry *old = *findLink(shard, entry->key, entry->keyLen, entry->hash);
+    if (old != NULL)
+        removeEntry(shard, old);
+
+    while (shard->bytes + entry->size > shard->maxBytes && shard->lruTail != NULL)
+    {
+        removeEntry(shard, shard->lruTail);
+        shard->stats.evicted++;
+    }
+
+    if (shard->entries >= shard->bucketCount)
+        growBuckets(shard);
+
+    CacheEntry **bucket = &shard->buckets[entry->hash & (shard->bucketCount - 1)];
+    entry->hashNext = *bucket;
+    *bucket = entry;
+    lruPushFront(shard, entry);
+
+    atomic_fetch_add_explicit(&entry->refs, 1, memory_order_relaxed);
+    shard->entries++;
+    shard->bytes += entry->size;
+    shard->stats.stored++;
+}
+
+static InFlight *findInFlight(CacheShard *shard, const char *key, size_t keyLen, uint64_t hash)
+{
+    for (InFlight *flight = shard->inFlight; flight != NULL; flight = flight->next)
+        if (flight->hash == hash && flight->keyLen == keyLen && memcmp(flight->key, key, keyLen) == 0)
+            return flight;
+    return NULL;
+}
+
+static void unlinkInFlight(CacheShard *shard, InFlight *flight)
+{
+    InFlight **link = &shard->inFlight;
+    while (*link != flight)
+        link = &(*link)->next;
+    *link = flight->next;
+}
+
+static void freeInFlight(InFlight *flight)
+{
+    cacheRelease(flight->entry);
+    pthread_cond_destroy(&flight->done);
+    free(flight);
+}
+
+// sleep until the leader of the key is done, returns its entry (referenced), NULL with
+// *failed set when its fetch failed, or NULL when its response cannot be shared
+static CacheEntry *waitForLeader(CacheShard *shard, InFlight *flight, int *failed)
+{
+    flight->waiters++;
+    while (!flight->finished)
+        pthread_cond_wait(&flight->done, &shard->lock);
+
+    CacheEntry *entry = flight->entry;
+    if (entry != NULL)
+        atomic_fetch_add_explicit(&entry->refs, 1, memory_order_relaxed);
+    *failed = flight->failed;
+
+    // the leader left already, the last waiter cleans up
+    if (--flight->waiters == 0)
+        freeInFlight(flight);
+    return entry;
+}
+
+CacheEntry *cacheGet(ResponseCache *cache, const char *key, size_t keyLen, CacheFetch fetch, void *arg, CacheResult *result)
+{
+    uint64_t hash = hashKey(key, keyLen);
+    CacheShard *shard = shardOf(cache, hash);
+
+    pthread_mutex_lock(&shard->lock);
+
+    CacheEntry *entry = *findLink(shard, key, keyLen, hash);
+    if (entry != NULL && entry->expiresAt <= monotonicMs())
+    {
+        removeEntry(shard, entry);
+        shard->stats.expired++;
+        entry = NULL;
+    }
+
+    if (entry != NULL)
+    {
+        lruUnlink(shard, entry);
+        lruPushFront(shard, entry);
+        atomic_fetch_add_explicit(&entry->refs, 1, memory_order_relaxed);
+        shard->stats.hits++;
+        pthread_mutex_unlock(&shard->lock);
+
+        *result = CACHE_HIT;
+        return entry;
+    }
+
+    InFlight *flight = findInFlight(shard, key, keyLen, hash);
+    if (flight != NULL)
+    {
+        int failed;
+        entry = waitForLeader(shard, flight, &failed);
+        if (entry != NULL)
+            shard->stats.coalesced++;
+        pthread_mutex_unlock(&shard->lock);
+
+        // an upstream which just failed is not asked again by every waiter
+        if (entry != NULL || failed)
+        {
+            *result = CACHE_COALESCED;
+            return entry;
+        }
+
+        // not cacheable (private, no-store), every waiter needs a response of its own
+        *result = CACHE_MISS;
+        return fetch(arg);
+    }
+
+    // this caller fetches, others asking for the key meanwhile wait for it
+    flight = calloc(1, sizeof(InFlight));
+    if (flight != NULL)
+    {
+        flight->key = key;
+        flight->keyLen = keyLen;
+        flight->hash = hash;
+        pthread_cond_init(&flight->done, NULL);
+        flight->next = shard->inFlight;
+        shard->inFlight = flight;
+    }
+    shard->stats.misses++;
+    pthread_mutex_unlock(&shard->lock);
+
+    entry = fetch(arg);
+    *result = CACHE_MISS;
+
+    pthread_mutex_lock(&shard->lock);
+
+    if (entry != NULL)
+        storeEntry(shard, entry);
+
+    if (flight != NULL)
+    {
+        unlinkInFlight(shard, flight);
+        flight->finished = 1;
+        flight->failed = entry == NULL;
+        if (entry != NULL && entry->expiresAt != 0)
+        {
+            flight->entry = entry;
+            atomic_fetch_add_explicit(&entry->refs, 1, memory_order_relaxed);
+        }
+
+        if (flight->waiters > 0)
+            pthread_cond_broadcast(&flight->done);
+        else
+            freeInFlight(flight);
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+    return entry;
+}
+
+void cacheRemove(ResponseCache *cache, const char *key, size_t keyLen)
+{
+    uint64_t hash = hashKey(key, keyLen);
+    CacheShard *shard = shardOf(cache, hash);
+
+    pthread_mutex_lock(&shard->lock);
+    CacheEntry *entry = *findLink(shard, key, keyLen, hash);
+    if (entry != NULL)
+        removeEntry(shard, entry);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void getCacheStats(ResponseCache *cache, CacheStats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+
+    for (size_t i = 0; i < cache->shardCount; i++)
+    {
+        CacheShard *shard = &cache->shards[i];
+
+        pthread_mutex_lock(&shard->lock);
+        stats->hits += shard->stats.hits;
+        stats->misses += shard->stats.misses;
+        stats->coalesced += shard->stats.coalesced;
+        stats->stored += shard->stats.stored;
+        stats->evicted += shard->stats.evicted;
+        stats->expired += shard->stats.expired;
+        stats->entries += shard->entries;
+        stats->bytes += shard->bytes;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
@@ -0,0 +1,94 @@
+// sharded in-memory response cache
+// - keys hash to one of the shards, each with its own lock, hash table and lru list, so
+//   threads looking up different keys rarely wait for each other
+// - every shard holds at most its part of maxBytes, least recently used entries are evicted
+//   first, entries past their ttl are dropped when they are found
+// - concurrent misses of one key are coalesced: the first caller fetches, the others wait
+//   for its result instead of fetching the same thing again
+// - entries are reference counted, a hit is used without holding any lock
+
+#ifndef RESPONSE_CACHE_H
+#define RESPONSE_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+typedef struct CacheEntry
+{
+    // key, headers and body live in the same allocation
+    const char *key;
+    size_t keyLen;
+    int status;
+    const char *headers; // "Name: value\r\n" lines
+    size_t headersLen;
+    const char *body;
+    size_t bodyLen;
+    long long storedAt;  // monotonic ms
+    long long expiresAt; // monotonic ms, 0 when not cacheable
+
+    // owned by the cache
+    atomic_int refs;
+    uint64_t hash;
+    size_t size;
+    struct CacheEntry *hashNext;
+    struct CacheEntry *lruPrev, *lruNext;
+} CacheEntry;
+
+typedef enum
+{
+    CACHE_HIT,       // fresh entry from the cache
+    CACHE_MISS,      // fetched by this caller
+    CACHE_COALESCED  // fetched by a concurrent caller of the same key
+} CacheResult;
+
+typedef struct
+{
+    size_t hits;
+    size_t misses;
+    size_t coalesced;
+    size_t stored;
+    size_t evicted; // for room
+    size_t expired;
+    size_t entries;
+    size_t bytes;
+} CacheStats;
+
+typedef struct ResponseCache ResponseCache;
+
+// new entry with one reference for the caller, NULL when the fetch failed
+// ttlMs <= 0 makes it uncacheable, it then only goes to the caller
+typedef CacheEntry *(*CacheFetch)(void *arg);
+
+// shards 0 picks one per online cpu (rounded up to a power of 2)
+ResponseCache *createResponseCache(size_t maxBytes, int shards);
+
+// entries still referenced by callers are freed when they release them
+void destroyResponseCache(ResponseCache *cache);
+
+// copy everything into one entry, ttlMs <= 0 for a response which must not be stored
+CacheEntry *createCacheEntry(
+    const char *key,
+    size_t keyLen,
+    int status,
+    const char *headers,
+    size_t headersLen,
+    const char *body,
+    size_t bodyLen,
+    long ttlMs);
+
+// fresh entry of the key, fetched on a miss (one fetch for concurrent misses of the key)
+// returns the entry, to be released after use, or NULL when the fetch failed
+CacheEntry *cacheGet(ResponseCache *cache, const char *key, size_t keyLen, CacheFetch fetch, void *arg, CacheResult *result);
+
+void cacheRelease(CacheEntry *entry);
+
+// drop the entry of the key, for requests which change the resource
+void cacheRemove(ResponseCache *cache, const char *key, size_t keyLen);
+
+// milliseconds since the entry was stored
+long long cacheEntryAge(const CacheEntry *entry);
+
+void getCacheStats(ResponseCache *cache, CacheStats *stats);
+
+#endif
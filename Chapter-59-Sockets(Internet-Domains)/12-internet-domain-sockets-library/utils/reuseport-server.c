@@ -0,0 +1,151 @@
+#include "reuseport-server.h"
+#include "pool-backend.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <linux/filter.h>
+
+typedef struct
+{
+    int sfd;
+    int cpu; // -1 when it runs unpinned
+    ServerBackend backend;
+    const StreamHandlers *handlers;
+    void *userData;
+    int status;
+} Worker;
+
+int attachCpuSteering(int sfd, int groupSize)
+{
+    // classic bpf: A = cpu of the softirq; A %= groupSize; return A (index in the group)
+    struct sock_filter code[] = {
+        {BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU},
+        {BPF_ALU | BPF_MOD | BPF_K, 0, 0, (unsigned int)groupSize},
+        {BPF_RET | BPF_A, 0, 0, 0},
+    };
+    struct sock_fprog program = {
+        .len = sizeof(code) / sizeof(code[0]),
+        .filter = code,
+    };
+
+    return setsockopt(sfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program));
+}
+
+// the nth cpu this process may run on (wrapping around), the ids need not be contiguous
+static int nthAllowedCpu(const cpu_set_t *allowed, int n)
+{
+    n %= CPU_COUNT(allowed);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        if (CPU_ISSET(cpu, allowed) && n-- == 0)
+            return cpu;
+    return -1;
+}
+
+static void *runWorker(void *arg)
+{
+    Worker *worker = arg;
+
+    // the workers already cover the cpus, so each gets a pool of one thread, pinned like itself
+    if (worker->backend == BACKEND_POOL)
+        worker->status = runPoolServer(worker->sfd, 1, worker->handlers, worker->userData);
+    else
+        worker->status = runStreamServer(worker->sfd, worker->backend, worker->handlers, worker->userData);
+    if (worker->status == -1)
+        perror("worker");
+    return NULL;
+}
+
+int runReusePortServer(const ReusePortConfig *config, const StreamHandlers *handlers, void *userData)
+{
+    // the affinity mask (taskset, cgroups) can be smaller than the online cpus
+    cpu_set_t allowed;
+    int cpus = sched_getaffinity(0, sizeof(allowed), &allowed) == 0 ? CPU_COUNT(&allowed) : 0;
+
+    int workers = config->workers > 0 ? config->workers : cpus > 0 ? cpus : 1;
+
+    Worker *pool = calloc(workers, sizeof(Worker));
+    pthread_t *threads = calloc(workers, sizeof(pthread_t));
+    if (pool == NULL || threads == NULL)
+    {
+        free(pool);
+        free(threads);
+        return -1;
+    }
+
+    // bind every listener before any worker starts, the bind order is the index used by the bpf program
+    for (int i = 0; i < workers; i++)
+    {
+        struct sockaddr_storage addr;
+        pool[i].sfd = createReusePortServer(config->domain, SOCK_STREAM, config->port, config->backlog, config->ip, &addr);
+        if (pool[i].sfd == -1)
+        {
+            int savedErrno = errno;
+            while (i-- > 0)
+                close(pool[i].sfd);
+            free(pool);
+            free(threads);
+            errno = savedErrno;
+            return -1;
+        }
+
+        pool[i].cpu = cpus > 0 ? nthAllowedCpu(&allowed, i) : -1;
+        pool[i].backend = config->backend;
+        pool[i].handlers = handlers;
+        pool[i].userData = userData;
+    }
+
+    if (config->steerByCpu && attachCpuSteering(pool[0].sfd, workers) == -1)
+        perror("SO_ATTACH_REUSEPORT_CBPF (clients are hashed instead)");
+
+    printf("server is listening on port %d with %d workers...\n", config->port, workers);
+
+    int started = 0;
+    for (; started < workers; started++)
+    {
+        pthread_attr_t attr;
+        cpu_set_t cpuSet;
+        int status = -1;
+
+        // pinned from the first instruction, so the loop never migrates
+        if (pool[started].cpu != -1)
+        {
+            pthread_attr_init(&attr);
+            CPU_ZERO(&cpuSet);
+            CPU_SET(pool[started].cpu, &cpuSet);
+            if (pthread_attr_setaffinity_np(&attr, sizeof(cpuSet), &cpuSet) == 0)
+                status = pthread_create(&threads[started], &attr, runWorker, &pool[started]);
+            pthread_attr_destroy(&attr);
+        }
+
+        // the cpu went away meanwhile or could not be set, the worker still runs, just unpinned
+        if (status != 0)
+        {
+            if (pool[started].cpu != -1)
+                fprintf(stderr, "worker %d could not be pinned to cpu %d, running unpinned\n", started, pool[started].cpu);
+            pool[started].cpu = -1;
+            status = pthread_create(&threads[started], NULL, runWorker, &pool[started]);
+        }
+
+        if (status != 0)
+        {
+            errno = status;
+            perror("pthread_create");
+            break;
+        }
+    }
+
+    int result = started == workers ? 0 : -1;
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+        if (pool[i].status == -1)
+            result = -1;
+    }
+
+    for (int i = 0; i < workers; i++)
+        close(pool[i].sfd);
+
+    free(pool);
+    free(threads);
+    return result;
+}
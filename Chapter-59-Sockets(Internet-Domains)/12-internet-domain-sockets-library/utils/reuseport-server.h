@@ -0,0 +1,31 @@
+// multi worker tcp server on SO_REUSEPORT listeners
+// - every worker thread owns one listener and runs its own backend loop
+// - worker i is pinned to the i-th cpu of the affinity mask (modulo its size), unpinned when
+//   that fails, with the pool backend its pool has a single thread
+// - the kernel hashes new clients over the listeners, or with cpu steering
+//   a bpf program picks the listener of the cpu which received the connection
+// so accepting scales with the cores instead of sharing one accept queue
+
+#ifndef REUSEPORT_SERVER_H
+#define REUSEPORT_SERVER_H
+
+#include "stream-server.h"
+
+typedef struct
+{
+    int domain;
+    int port;
+    const char *ip;
+    int backlog;
+    int workers;    // <= 0 means one per cpu the process may run on
+    int steerByCpu; // attach the cpu steering bpf program
+    ServerBackend backend;
+} ReusePortConfig;
+
+// returns -1 when the listeners could not be set up or a worker failed
+int runReusePortServer(const ReusePortConfig *config, const StreamHandlers *handlers, void *userData);
+
+// make the group of sfd pick listener (cpu % groupSize), listeners are numbered in bind order
+int attachCpuSteering(int sfd, int groupSize);
+
+#endif
@@ -1,39 +1,196 @@
 #include "socket-library.h"
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+// per thread scratch buffer, formatting a message does not allocate unless it is larger
+static __thread char messageBuffer[MESSAGE_BUFFER_SIZE];
+
+// format once into the buffer, only messages which do not fit go to the heap
+// returns the formatted message, *onHeap tells whether it must be freed
+static char *formatMessage(char *buffer, size_t bufferSize, size_t *len, int *onHeap, const char *format, va_list args)
+{
+    va_list copy;
+    va_copy(copy, args);
+    int size = vsnprintf(buffer, bufferSize, format, copy);
+    va_end(copy);
+
+    *onHeap = 0;
+    if (size < 0)
+        return NULL;
+
+    *len = size;
+    if ((size_t)size < bufferSize)
+        return buffer;
+
+    // oversize message, +1 for \0
+    char *heapBuffer = (char *)malloc(size + 1);
+    if (heapBuffer == NULL)
+        return NULL;
+
+    vsnprintf(heapBuffer, size + 1, format, args);
+    *onHeap = 1;
+    return heapBuffer;
+}
+
+ssize_t vsendMessageWithBuffer(int fd, int flags, char *buffer, size_t bufferSize, const char *format, va_list args)
+{
+    size_t len;
+    int onHeap;
+    char *message = formatMessage(buffer, bufferSize, &len, &onHeap, format, args);
+    if (message == NULL)
+        return -1;
+
+    ssize_t bytes_sent = send(fd, message, len, flags); // null terminator is not sent
+
+    metricsIncrement(METRIC_SYSCALLS);
+    if (bytes_sent > 0)
+        metricsAdd(METRIC_BYTES_OUT, bytes_sent);
+
+    if (onHeap)
+        free(message);
+    return bytes_sent;
+}
+
+ssize_t sendMessageWithBuffer(int fd, int flags, char *buffer, size_t bufferSize, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    ssize_t bytes_sent = vsendMessageWithBuffer(fd, flags, buffer, bufferSize, format, args);
+    va_end(args);
+    return bytes_sent;
+}
 
 ssize_t sendMessage(int fd, int flags, const char *format, ...)
 {
     va_list args;
     va_start(args, format);
+    ssize_t bytes_sent = vsendMessageWithBuffer(fd, flags, messageBuffer, MESSAGE_BUFFER_SIZE, format, args);
+    va_end(args);
+    return bytes_sent;
+}
 
-    size_t size = vsnprintf(NULL, 0, format, args) + 1; // +1 for \0
-    if (size <= 0)
-    {
-        va_end(args);
+// bytes moved from the file to the pipe per splice
+#define SPLICE_CHUNK_SIZE (64 * 1024)
+
+// wait until a non-blocking socket can take more, returns -1 on error
+static int waitWritable(int fd)
+{
+    struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+    while (poll(&pfd, 1, -1) == -1)
+        if (errno != EINTR)
+            return -1;
+    return 0;
+}
+
+// file -> pipe -> socket, the pages are moved, not copied
+static ssize_t spliceFileRange(int sockFd, int fileFd, off_t offset, size_t len)
+{
+    int pipeFds[2];
+    if (pipe2(pipeFds, O_CLOEXEC) == -1)
         return -1;
-    }
 
-    ssize_t bytes_sent = -1;
-    char *buffer = (char *)malloc(size); // Dynamic allocation for consistency
+    size_t total = 0;
+    int failed = 0;
+
+    // pipes and sockets have no offsets, they are read from where they are
+    off_t *position = lseek(fileFd, 0, SEEK_CUR) == -1 ? NULL : &offset;
 
-    if (buffer == NULL)
+    while (total < len && !failed)
     {
-        va_end(args);
-        return -1; // Allocation failure
+        size_t chunk = len - total < SPLICE_CHUNK_SIZE ? len - total : SPLICE_CHUNK_SIZE;
+        ssize_t inPipe = splice(fileFd, position, pipeFds[1], NULL, chunk, SPLICE_F_MOVE);
+        if (inPipe <= 0)
+        {
+            if (inPipe == -1 && errno == EINTR)
+                continue;
+            failed = inPipe == -1;
+            break;
+        }
+
+        // what is in the pipe has left the file, it must reach the socket before returning
+        while (inPipe > 0)
+        {
+            ssize_t moved = splice(pipeFds[0], NULL, sockFd, NULL, inPipe, SPLICE_F_MOVE | (total + inPipe < len ? SPLICE_F_MORE : 0));
+            if (moved == -1)
+            {
+                if (errno == EINTR || ((errno == EAGAIN || errno == EWOULDBLOCK) && waitWritable(sockFd) == 0))
+                    continue;
+                failed = 1;
+                break;
+            }
+            inPipe -= moved;
+            total += moved;
+        }
     }
 
-    va_start(args, format); // Restart va_list for vsnprintf
-    if (vsnprintf(buffer, size, format, args) < 0)
+    int savedErrno = errno;
+    close(pipeFds[0]);
+    close(pipeFds[1]);
+    errno = savedErrno;
+    return failed && total == 0 ? -1 : (ssize_t)total;
+}
+
+ssize_t sendFileRange(int sockFd, int fileFd, off_t offset, size_t len)
+{
+    size_t total = 0;
+
+    while (total < len)
     {
-        free(buffer);
-        va_end(args);
-        return -1;
+        // the offset is passed explicitly, the file position is never touched
+        ssize_t sent = sendfile(sockFd, fileFd, &offset, len - total);
+        if (sent == -1)
+        {
+            if (errno == EINTR)
+                continue;
+
+            // file type without sendfile support, or a pipe (no offsets)
+            if (errno == EINVAL || errno == ENOSYS || errno == ESPIPE)
+            {
+                ssize_t spliced = spliceFileRange(sockFd, fileFd, offset, len - total);
+                if (spliced == -1)
+                    return total > 0 ? (ssize_t)total : -1;
+                return total + spliced;
+            }
+
+            // socket buffer is full (or failed), the caller continues from total
+            return total > 0 ? (ssize_t)total : -1;
+        }
+
+        // file is shorter than expected
+        if (sent == 0)
+            break;
+        total += sent;
     }
-    va_end(args); // va_end after vsnprintf
+    return total;
+}
 
-    bytes_sent = send(fd, buffer, size - 1, flags); // size -1 to prevent sending null terminator
+ssize_t sendFileWithHeader(int sockFd, const void *header, size_t headerLen, int fileFd, off_t offset, size_t len)
+{
+    size_t headerSent = 0;
 
-    free(buffer);
-    return bytes_sent;
+    // without a file range nothing would push the held back header out
+    int flags = MSG_NOSIGNAL | (len > 0 ? MSG_MORE : 0);
+
+    while (headerSent < headerLen)
+    {
+        ssize_t sent = send(sockFd, (const char *)header + headerSent, headerLen - headerSent, flags);
+        if (sent == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return headerSent > 0 ? (ssize_t)headerSent : -1;
+        }
+        headerSent += sent;
+    }
+
+    ssize_t fileSent = sendFileRange(sockFd, fileFd, offset, len);
+    if (fileSent == -1)
+        return headerSent > 0 ? (ssize_t)headerSent : -1;
+    return headerSent + fileSent;
 }
 
 // handle receive via TCP
@@ -42,6 +199,12 @@ ssize_t recvMessage(int fd, int flags, char *buffer, size_t bufferSize)
     // receive data
     ssize_t bytes_read = recv(fd, buffer, bufferSize - 1, flags);
 
+    metricsIncrement(METRIC_SYSCALLS);
+    if (bytes_read > 0)
+        metricsAdd(METRIC_BYTES_IN, bytes_read);
+    else if (bytes_read == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        metricsIncrement(METRIC_EAGAIN);
+
     // make the buffer null terminated
     if (bytes_read >= 0)
         buffer[bytes_read] = '\0';
@@ -60,7 +223,8 @@ ssize_t recvAllData(int fd, char *buffer, size_t bufferSize, int flags)
     while (totalReceivedBytes < usedSize)
     {
 
-        if ((receivedBytes = recv(fd, buffer + totalReceivedBytes, usedSize, flags)) <= 0)
+        // only the space which is still free
+        if ((receivedBytes = recv(fd, buffer + totalReceivedBytes, usedSize - totalReceivedBytes, flags)) <= 0)
             break;
         totalReceivedBytes += receivedBytes;
     }
@@ -77,34 +241,18 @@ ssize_t sendMessagePacket(int fd, int flags, struct sockaddr *addr, socklen_t ad
     va_list args;
     va_start(args, format);
 
-    size_t size = vsnprintf(NULL, 0, format, args) + 1; // +1 for \0
-    if (size <= 0)
-    {
-        va_end(args);
-        return -1;
-    }
-
-    ssize_t bytes_sent = -1;
-    char *buffer = (char *)malloc(size); // Dynamic allocation for consistency
-
-    if (buffer == NULL)
-    {
-        va_end(args);
-        return -1; // Allocation failure
-    }
+    size_t len;
+    int onHeap;
+    char *message = formatMessage(messageBuffer, MESSAGE_BUFFER_SIZE, &len, &onHeap, format, args);
+    va_end(args);
 
-    va_start(args, format); // Restart va_list for vsnprintf
-    if (vsnprintf(buffer, size, format, args) < 0)
-    {
-        free(buffer);
-        va_end(args);
+    if (message == NULL)
         return -1;
-    }
-    va_end(args); // va_end after vsnprintf
 
-    bytes_sent = sendto(fd, buffer, size - 1, flags, addr, addrLen); // size -1 to prevent sending null terminator
+    ssize_t bytes_sent = sendto(fd, message, len, flags, addr, addrLen); // null terminator is not sent
 
-    free(buffer);
+    if (onHeap)
+        free(message);
     return bytes_sent;
 }
 
@@ -118,31 +266,112 @@ ssize_t recvMessagePacket(int fd, char *buffer, size_t bufferSize, int flags, st
     return bytes_received;
 }
 
+int recvMessagePackets(int fd, Datagram *packets, unsigned int count, int flags)
+{
+    struct mmsghdr msgs[PACKET_BATCH_SIZE];
+    struct iovec iovs[PACKET_BATCH_SIZE];
+
+    if (count > PACKET_BATCH_SIZE)
+        count = PACKET_BATCH_SIZE;
+
+    memset(msgs, 0, sizeof(struct mmsghdr) * count);
+    for (unsigned int i = 0; i < count; i++)
+    {
+        iovs[i].iov_base = packets[i].buffer;
+        iovs[i].iov_len = packets[i].bufferSize - 1; // last byte is for \0
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &packets[i].addr;
+        msgs[i].msg_hdr.msg_namelen = sizeof(packets[i].addr);
+    }
+
+    int received = recvmmsg(fd, msgs, count, flags, NULL);
+
+    for (int i = 0; i < received; i++)
+    {
+        packets[i].len = msgs[i].msg_len;
+        packets[i].truncated = (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) != 0;
+        packets[i].addrLen = msgs[i].msg_hdr.msg_namelen;
+        packets[i].buffer[packets[i].len] = '\0';
+    }
+    return received;
+}
+
+int sendMessagePackets(int fd, Datagram *packets, unsigned int count, int flags)
+{
+    struct mmsghdr msgs[PACKET_BATCH_SIZE];
+    struct iovec iovs[PACKET_BATCH_SIZE];
+    unsigned int total = 0;
+
+    while (total < count)
+    {
+        unsigned int batch = count - total > PACKET_BATCH_SIZE ? PACKET_BATCH_SIZE : count - total;
+
+        memset(msgs, 0, sizeof(struct mmsghdr) * batch);
+        for (unsigned int i = 0; i < batch; i++)
+        {
+            Datagram *packet = &packets[total + i];
+            iovs[i].iov_base = packet->buffer;
+            iovs[i].iov_len = packet->len;
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = packet->addrLen > 0 ? &packet->addr : NULL;
+            msgs[i].msg_hdr.msg_namelen = packet->addrLen;
+        }
+
+        // sendmmsg can stop early, continue from the first unsent datagram
+        int sent = sendmmsg(fd, msgs, batch, flags);
+        if (sent <= 0)
+            return total > 0 ? (int)total : sent;
+        total += sent;
+    }
+    return total;
+}
+
 // create a socket
 int createSocket(int domain, int type, int protocol)
 {
-    int sfd;
-    if ((sfd = socket(domain, type, protocol)) == -1)
-        fatal("socket");
-    return sfd;
+    return socket(domain, type, protocol);
 }
 
 // bind the socket with the provided address
-void bindWithAddress(int sfd, struct sockaddr *addr, socklen_t addrLen)
+int bindWithAddress(int sfd, struct sockaddr *addr, socklen_t addrLen)
 {
-    if (bind(sfd, addr, addrLen) == -1)
-        fatalWithClose(sfd, "bind");
+    return bind(sfd, addr, addrLen);
 }
 
 // connect to local/remote server
 int connectWithServer(int sfd, struct sockaddr *addr, socklen_t addrLen, int exitOnFail)
 {
     int status = connect(sfd, addr, addrLen);
-    if (exitOnFail)
+    if (status == -1 && exitOnFail)
         fatalWithClose(sfd, "connect");
     return status;
 }
 
+// shared by every connection of the process
+static ResolverCache *connectionResolver = NULL;
+
+void useResolverCache(ResolverCache *cache)
+{
+    connectionResolver = cache;
+}
+
+static int lookupAddress(const char *hostname, const char *service, const struct addrinfo *hints, struct addrinfo **res)
+{
+    if (connectionResolver != NULL)
+        return resolverLookup(connectionResolver, hostname, service, hints, res);
+    return getaddrinfo(hostname, service, hints, res);
+}
+
+static void freeLookup(struct addrinfo *res)
+{
+    if (connectionResolver != NULL)
+        resolverFreeAddrInfo(res);
+    else
+        freeaddrinfo(res);
+}
+
 int createConnection(
     int domain,
     int type,
@@ -152,6 +381,12 @@ int createConnection(
 {
     // create a socket for connection
     int cfd = createSocket(domain, type, 0);
+    if (cfd == -1)
+        return -1;
+
+    // tuning is best effort on clients, a missing option is no reason to fail the connection
+    if (type == SOCK_STREAM)
+        tuneClientSocket(cfd);
 
     // for resolving ip adresses
     struct addrinfo hints, *res, *temp;
@@ -170,9 +405,11 @@ int createConnection(
 
     // resolving ip
     int status;
-    if ((status = getaddrinfo(hostname, service, &hints, &res)) != 0)
+    if ((status = lookupAddress(hostname, service, &hints, &res)) != 0)
     {
-        exitAndCloseWithMessage(cfd, gai_strerror(status));
+        close(cfd);
+        errno = EHOSTUNREACH;
+        return -1;
     }
 
     // traverse the ip list
@@ -216,40 +453,320 @@ int createConnection(
     }
 
     // freeing the ip list
-    freeaddrinfo(res);
+    freeLookup(res);
+
+    // every address refused the connection
+    if (temp == NULL)
+    {
+        close(cfd);
+        errno = ECONNREFUSED;
+        return -1;
+    }
+
+    return cfd;
+}
+
+int openConnection(
+    int domain,
+    int type,
+    const char *hostname,
+    const char *service,
+    struct sockaddr_storage *server_addr)
+{
+    struct addrinfo hints, *res, *temp;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = domain;
+    hints.ai_socktype = type;
+
+    if (lookupAddress(hostname, service, &hints, &res) != 0)
+    {
+        errno = EHOSTUNREACH;
+        return -1;
+    }
+
+    int cfd = -1;
+    for (temp = res; temp != NULL; temp = temp->ai_next)
+    {
+        // a socket whose connect failed can not be reused for the next address
+        cfd = socket(temp->ai_family, temp->ai_socktype | SOCK_CLOEXEC, temp->ai_protocol);
+        if (cfd == -1)
+            continue;
+
+        if (temp->ai_socktype == SOCK_STREAM)
+            tuneClientSocket(cfd);
+
+        if (connect(cfd, temp->ai_addr, temp->ai_addrlen) == 0)
+        {
+            if (server_addr != NULL)
+                memcpy(server_addr, temp->ai_addr, temp->ai_addrlen);
+            break;
+        }
+
+        int savedErrno = errno;
+        close(cfd);
+        errno = savedErrno;
+        cfd = -1;
+    }
 
+    freeLookup(res);
+    return cfd;
+}
+
+static long long monotonicMs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// order the attempts ipv6, ipv4, ipv6, ... so one broken family does not delay the other
+static int interleaveFamilies(const struct addrinfo *list, const struct addrinfo **ordered)
+{
+    const struct addrinfo *v6[RACE_MAX_ATTEMPTS], *other[RACE_MAX_ATTEMPTS];
+    int n6 = 0, nOther = 0, count = 0;
+
+    for (; list != NULL; list = list->ai_next)
+    {
+        if (list->ai_family == AF_INET6 && n6 < RACE_MAX_ATTEMPTS)
+            v6[n6++] = list;
+        else if (list->ai_family != AF_INET6 && nOther < RACE_MAX_ATTEMPTS)
+            other[nOther++] = list;
+    }
+
+    for (int i = 0; count < RACE_MAX_ATTEMPTS && (i < n6 || i < nOther); i++)
+    {
+        if (i < n6)
+            ordered[count++] = v6[i];
+        if (i < nOther && count < RACE_MAX_ATTEMPTS)
+            ordered[count++] = other[i];
+    }
+    return count;
+}
+
+int connectRacing(const struct addrinfo *list, int staggerMs, int timeoutMs, struct sockaddr_storage *server_addr)
+{
+    const struct addrinfo *ordered[RACE_MAX_ATTEMPTS];
+    const struct addrinfo *pending[RACE_MAX_ATTEMPTS];
+    struct pollfd fds[RACE_MAX_ATTEMPTS];
+
+    int count = interleaveFamilies(list, ordered);
+    int started = 0, active = 0, winner = -1, lastError = ECONNREFUSED;
+    const struct addrinfo *winnerAddr = NULL;
+
+    long long now = monotonicMs();
+    long long deadline = now + timeoutMs;
+    long long nextStart = now;
+
+    while (winner == -1)
+    {
+        now = monotonicMs();
+        if (now >= deadline)
+        {
+            lastError = ETIMEDOUT;
+            break;
+        }
+
+        // start the next attempt
+        if (started < count && now >= nextStart)
+        {
+            const struct addrinfo *ai = ordered[started++];
+            int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+
+            // no fast open here, its connect returns at once and every attempt would "win"
+            if (fd != -1 && ai->ai_socktype == SOCK_STREAM)
+                applyTuningProfile(fd, currentTuningProfile());
+
+            if (fd == -1)
+                lastError = errno;
+            else if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            {
+                winner = fd;
+                winnerAddr = ai;
+                break;
+            }
+            else if (errno == EINPROGRESS)
+            {
+                pending[active] = ai;
+                fds[active].fd = fd;
+                fds[active].events = POLLOUT;
+                active++;
+                nextStart = now + staggerMs;
+                continue;
+            }
+            else
+            {
+                lastError = errno;
+                close(fd);
+            }
+
+            // failed immediately, the next address goes right away
+            nextStart = now;
+            continue;
+        }
+
+        if (active == 0 && started == count)
+            break;
+
+        long long wakeAt = started < count && nextStart < deadline ? nextStart : deadline;
+        int ready = poll(fds, active, (int)(wakeAt - now));
+        if (ready == -1 && errno != EINTR)
+        {
+            lastError = errno;
+            break;
+        }
+
+        for (int i = 0; ready > 0 && i < active; i++)
+        {
+            if (fds[i].revents == 0)
+                continue;
+
+            int error = 0;
+            socklen_t len = sizeof(error);
+            if (getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1)
+                error = errno;
+
+            if (error == 0)
+            {
+                winner = fds[i].fd;
+                winnerAddr = pending[i];
+                break;
+            }
+
+            // lost, the next address is started without waiting for the stagger
+            lastError = error;
+            close(fds[i].fd);
+            fds[i] = fds[active - 1];
+            pending[i] = pending[active - 1];
+            active--;
+            i--;
+            nextStart = monotonicMs();
+        }
+    }
+
+    // close every attempt which did not win
+    for (int i = 0; i < active; i++)
+        if (fds[i].fd != winner)
+            close(fds[i].fd);
+
+    if (winner == -1)
+    {
+        errno = lastError;
+        return -1;
+    }
+
+    // callers expect a blocking socket like from createConnection
+    int flags = fcntl(winner, F_GETFL);
+    fcntl(winner, F_SETFL, flags & ~O_NONBLOCK);
+
+    if (server_addr != NULL)
+        memcpy(server_addr, winnerAddr->ai_addr, winnerAddr->ai_addrlen);
+    return winner;
+}
+
+int createRacingConnection(
+    int domain,
+    int type,
+    const char *hostname,
+    const char *service,
+    int staggerMs,
+    int timeoutMs,
+    struct sockaddr_storage *server_addr)
+{
+    struct addrinfo hints, *res;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = domain;
+    hints.ai_socktype = type;
+
+    if (lookupAddress(hostname, service, &hints, &res) != 0)
+    {
+        errno = EHOSTUNREACH;
+        return -1;
+    }
+
+    int cfd = connectRacing(res, staggerMs, timeoutMs, server_addr);
+
+    int savedErrno = errno;
+    freeLookup(res);
+    errno = savedErrno;
     return cfd;
 }
 
 // listen for specified no of clients
-void listenToClient(int sfd, int nClients)
+int listenToClient(int sfd, int nClients)
+{
+    return listen(sfd, nClients);
+}
+
+// put the file descriptor in non-blocking mode
+int setNonBlocking(int fd)
 {
-    if (listen(sfd, nClients) == -1)
-        fatalWithClose(sfd, "listen");
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1)
+        return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
 }
 
 // accept client connection
 int acceptClient(int sfd, struct sockaddr *__restrict__ addr, socklen_t *__restrict__ addrLen)
 {
-    int cfd;
-    if ((cfd = accept(sfd, addr, addrLen)) == -1)
-        printf("failed to accept connection\n");
-    return cfd;
+    socklen_t maxLen = addrLen != NULL ? *addrLen : 0;
+
+    while (1)
+    {
+        int cfd = admitClient(sfd, addr, addrLen, SOCK_CLOEXEC);
+        if (cfd != -1)
+        {
+            tuneAcceptedSocket(cfd);
+            return cfd;
+        }
+        if (errno != ECONNABORTED && errno != EINTR)
+            return -1;
+
+        // rejected or shed, wait for the next client
+        if (addrLen != NULL)
+            *addrLen = maxLen;
+    }
 }
 
-// Create server that supports both IPv4 and IPv6
-int createServer(
+// non-fatal counterpart of fatalWithClose, errno is kept for the caller
+static int failWithClose(int fd)
+{
+    int savedErrno = errno;
+    close(fd);
+    errno = savedErrno;
+    return -1;
+}
+
+static int createServerSocket(
     int domain,
     int type,
     int port,
     int backlog,
     const char *ip,
-    struct sockaddr_storage *server_addr)
+    struct sockaddr_storage *server_addr,
+    int reusePort)
 {
     // create a socket
     int sfd = createSocket(domain, type, 0);
+    if (sfd == -1)
+        return -1;
     socklen_t addrLen;
 
+    // allow restarting the server while old connections are in TIME_WAIT
+    int reuse = 1;
+    if (setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) == -1)
+        return failWithClose(sfd);
+
+    // every socket of the group gets its own accept queue, the kernel spreads clients
+    if (reusePort && setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) == -1)
+        return failWithClose(sfd);
+
+    // before listen, so the window scale matches the buffers and accepted sockets inherit them
+    if (type == SOCK_STREAM && tuneListener(sfd) == -1)
+        return failWithClose(sfd);
+
     // initialize the address with 0
     memset(server_addr, 0, sizeof(*server_addr));
 
@@ -261,7 +778,11 @@ int createServer(
         addr4->sin_family = domain;
         addr4->sin_port = htons(port);
 
-        convertToBinaryIP(sfd, domain, ip, (struct in_addr *)&addr4->sin_addr);
+        if (inet_pton(domain, ip, &addr4->sin_addr) != 1)
+        {
+            errno = EINVAL;
+            return failWithClose(sfd);
+        }
     }
 
     // handle ipv6 case
@@ -272,22 +793,83 @@ int createServer(
         addr6->sin6_family = domain;
         addr6->sin6_port = htons(port);
 
-        convertToBinaryIP(sfd, domain, ip, (struct in6_addr *)&addr6->sin6_addr);
+        if (inet_pton(domain, ip, &addr6->sin6_addr) != 1)
+        {
+            errno = EINVAL;
+            return failWithClose(sfd);
+        }
     }
 
-    // throw error when unknow domain encountered
+    // unknown domain
     else
-        exitAndCloseWithMessage(sfd, "Unsupported Domain\n");
+    {
+        errno = EAFNOSUPPORT;
+        return failWithClose(sfd);
+    }
 
     // bind the socket with the address
-    bindWithAddress(sfd, (struct sockaddr *)server_addr, addrLen);
+    if (bindWithAddress(sfd, (struct sockaddr *)server_addr, addrLen) == -1)
+        return failWithClose(sfd);
 
     // listen is required only for TCP
     if (type == SOCK_STREAM)
     {
-        listenToClient(sfd, backlog);
-        printf("server is listening on port %d...\n", port);
+        if (listenToClient(sfd, backlog) == -1)
+            return failWithClose(sfd);
+        if (!reusePort)
+            printf("server is listening on port %d...\n", port);
     }
 
     return sfd;
-}
\ No newline at end of file
+}
+
+// Create server that supports both IPv4 and IPv6
+int createServer(
+    int domain,
+    int type,
+    int port,
+    int backlog,
+    const char *ip,
+    struct sockaddr_storage *server_addr)
+{
+    return createServerSocket(domain, type, port, backlog, ip, server_addr, 0);
+}
+
+int createReusePortServer(
+    int domain,
+    int type,
+    int port,
+    int backlog,
+    const char *ip,
+    struct sockaddr_storage *server_addr)
+{
+    return createServerSocket(domain, type, port, backlog, ip, server_addr, 1);
+}
+
+int createUnixServer(const char *path, int backlog)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(struct sockaddr_un));
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    // bind fails while the file of an earlier run exists, anything but a socket is left alone
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+
+    int sfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sfd == -1)
+        return -1;
+
+    if (bind(sfd, (struct sockaddr *)&addr, sizeof(struct sockaddr_un)) == -1 || listen(sfd, backlog) == -1)
+        return failWithClose(sfd);
+    return sfd;
+}
@@ -1,39 +1,94 @@
-#define _POSIX_C_SOURCE 200809
+#ifndef SOCKET_LIBRARY_H
+#define SOCKET_LIBRARY_H
+
+// gnu extensions are needed for accept4, recvmmsg/sendmmsg, splice etc.
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <netdb.h>
 #include "custom-utilities.h"
+#include "resolver-cache.h"
+#include "admission.h"
+#include "socket-tuning.h"
+#include "metrics.h"
+
+// messages up to this size are formatted without allocating
+#define MESSAGE_BUFFER_SIZE 4096
 
 // send message to client/server
 ssize_t sendMessage(int fd, int flags, const char *format, ...);
 
+// send message formatted in the caller's buffer, heap is used only when it does not fit
+ssize_t sendMessageWithBuffer(int fd, int flags, char *buffer, size_t bufferSize, const char *format, ...);
+
+// va_list version of sendMessageWithBuffer
+ssize_t vsendMessageWithBuffer(int fd, int flags, char *buffer, size_t bufferSize, const char *format, va_list args);
+
 // receive data from client/server
 ssize_t recvMessage(int fd, int flags, char *buffer, size_t bufferSize);
 
 // receieve all the data in the buffer at max its size
 ssize_t recvAllData(int fd, char *buffer, size_t bufferSize, int flags);
 
+// send len bytes of a file from offset without copying them through user space
+// sendfile, or splice through a pipe when the file does not support it
+// (the splice fallback waits for a full socket, data in the pipe cannot be put back;
+// it also takes pipes, which are read from their current position)
+// returns the bytes sent, fewer when a non-blocking socket filled up, or -1
+ssize_t sendFileRange(int sockFd, int fileFd, off_t offset, size_t len);
+
+// header then file range, the header is held back with MSG_MORE so both share segments
+// returns header and file bytes sent together, or -1
+ssize_t sendFileWithHeader(int sockFd, const void *header, size_t headerLen, int fileFd, off_t offset, size_t len);
+
 // send data via udp packets
 ssize_t sendMessagePacket(int fd, int flags, struct sockaddr *addr, socklen_t addrLen, const char *format, ...);
 
 // receive data via udp packet
 ssize_t recvMessagePacket(int fd, char *buffer, size_t bufferSize, int flags, struct sockaddr *addr, socklen_t *addrLen);
 
+// datagrams moved per recvmmsg/sendmmsg call
+#define PACKET_BATCH_SIZE 64
+
+// one datagram of a batch, with the address it came from / goes to
+typedef struct
+{
+    char *buffer;
+    size_t bufferSize;
+    size_t len;
+    int truncated; // the datagram was longer than bufferSize - 1, the rest is lost
+    struct sockaddr_storage addr;
+    socklen_t addrLen;
+} Datagram;
+
+// receive up to count datagrams with recvmmsg, returns how many were received or -1
+// every buffer is null terminated, so at most bufferSize - 1 bytes are stored and longer
+// datagrams come back with truncated set
+int recvMessagePackets(int fd, Datagram *packets, unsigned int count, int flags);
+
+// send count datagrams with sendmmsg, returns how many were sent or -1
+int sendMessagePackets(int fd, Datagram *packets, unsigned int count, int flags);
+
+// the helpers below return -1 with errno set instead of exiting, the caller decides
+
 // create a socket
 int createSocket(int domain, int type, int protocol);
 
 // bind the socket with the provided address
-void bindWithAddress(int sfd, struct sockaddr *addr, socklen_t addrLen);
+int bindWithAddress(int sfd, struct sockaddr *addr, socklen_t addrLen);
 
-// connect to local/remote server
+// connect to local/remote server, exitOnFail exits the process when connect fails
 int connectWithServer(int sfd, struct sockaddr *addr, socklen_t addrLen, int exitOnFail);
 
-// create a conenction with server
+// create a conenction with server, returns -1 when no address could be connected
 int createConnection(
     int domain,
     int type,
@@ -41,17 +96,67 @@ int createConnection(
     const char *service,
     struct sockaddr_storage *server_addr);
 
+// createConnection/openConnection resolve through this cache, NULL goes back to plain getaddrinfo
+void useResolverCache(ResolverCache *cache);
+
+// like createConnection but every resolved address is tried on a fresh socket
+// returns the connected socket or -1 (errno is set, EHOSTUNREACH when resolving failed)
+int openConnection(
+    int domain,
+    int type,
+    const char *hostname,
+    const char *service,
+    struct sockaddr_storage *server_addr);
+
+// addresses raced by one connectRacing call, the rest of the list is ignored
+#define RACE_MAX_ATTEMPTS 32
+
+// "happy eyeballs" connect: non-blocking attempts to every address, ipv6 and ipv4 interleaved,
+// a new attempt starts every staggerMs (or as soon as one fails), the first connected
+// socket wins and the others are closed
+// returns the connected (blocking) socket or -1, errno ETIMEDOUT when timeoutMs passed
+int connectRacing(const struct addrinfo *list, int staggerMs, int timeoutMs, struct sockaddr_storage *server_addr);
+
+// resolve then connectRacing, never exits
+int createRacingConnection(
+    int domain,
+    int type,
+    const char *hostname,
+    const char *service,
+    int staggerMs,
+    int timeoutMs,
+    struct sockaddr_storage *server_addr);
+
 // listen for specified no of clients
-void listenToClient(int sfd, int nClients);
+int listenToClient(int sfd, int nClients);
 
-// accept client connection
+// accept client connection through the admission control,
+// rejected and shed clients are skipped, returns -1 only on an accept error
 int acceptClient(int sfd, struct sockaddr *__restrict__ addr, socklen_t *__restrict__ addrLen);
 
-// Create server that supports both IPv4 and IPv6
+// Create server that supports both IPv4 and IPv6, returns -1 on failure
 int createServer(
     int domain,
     int type,
     int port,
     int backlog,
     const char *ip,
-    struct sockaddr_storage *server_addr);
\ No newline at end of file
+    struct sockaddr_storage *server_addr);
+
+// same as createServer with SO_REUSEPORT, call it once per listener of the group
+int createReusePortServer(
+    int domain,
+    int type,
+    int port,
+    int backlog,
+    const char *ip,
+    struct sockaddr_storage *server_addr);
+
+// unix domain stream listener on path, a socket file left by an earlier run is replaced
+// returns -1 (errno ENAMETOOLONG when the path does not fit sun_path)
+int createUnixServer(const char *path, int backlog);
+
+// put the file descriptor in non-blocking mode
+int setNonBlocking(int fd);
+
+#endif
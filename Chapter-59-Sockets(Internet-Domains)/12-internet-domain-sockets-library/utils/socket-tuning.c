@@ -0,0 +1,126 @@
+#include "socket-library.h"
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+static SocketTuning socketTuning = {.profile = TUNING_DEFAULT};
+
+int parseTuningProfile(const char *name)
+{
+    if (strcmp(name, "default") == 0)
+        return TUNING_DEFAULT;
+    if (strcmp(name, "low-latency") == 0)
+        return TUNING_LOW_LATENCY;
+    if (strcmp(name, "bulk") == 0)
+        return TUNING_BULK;
+    return -1;
+}
+
+const char *tuningProfileName(TuningProfile profile)
+{
+    switch (profile)
+    {
+    case TUNING_LOW_LATENCY:
+        return "low-latency";
+    case TUNING_BULK:
+        return "bulk";
+    default:
+        return "default";
+    }
+}
+
+void useSocketTuning(const SocketTuning *tuning)
+{
+    if (tuning != NULL)
+        socketTuning = *tuning;
+    else
+        memset(&socketTuning, 0, sizeof(socketTuning));
+}
+
+TuningProfile currentTuningProfile(void)
+{
+    return socketTuning.profile;
+}
+
+static int setIntOption(int fd, int level, int name, int value)
+{
+    return setsockopt(fd, level, name, &value, sizeof(value));
+}
+
+// the kernel doubles the value for its bookkeeping and caps it at net.core.wmem_max/rmem_max
+static int setBuffers(int fd, int size)
+{
+    int status = setIntOption(fd, SOL_SOCKET, SO_SNDBUF, size);
+    if (setIntOption(fd, SOL_SOCKET, SO_RCVBUF, size) == -1)
+        status = -1;
+    return status;
+}
+
+int applyTuningProfile(int fd, TuningProfile profile)
+{
+    int status = 0;
+
+    switch (profile)
+    {
+    case TUNING_LOW_LATENCY:
+        if (setIntOption(fd, IPPROTO_TCP, TCP_NODELAY, 1) == -1 ||
+            setIntOption(fd, IPPROTO_TCP, TCP_QUICKACK, 1) == -1)
+            status = -1;
+        if (setBuffers(fd, LOW_LATENCY_BUFFER_SIZE) == -1)
+            status = -1;
+        break;
+
+    case TUNING_BULK:
+        if (setBuffers(fd, BULK_BUFFER_SIZE) == -1 ||
+            setIntOption(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, BULK_NOTSENT_LOWAT) == -1)
+            status = -1;
+        break;
+
+    case TUNING_DEFAULT:
+        break;
+    }
+    return status;
+}
+
+int tuneListener(int sfd)
+{
+    int status = applyTuningProfile(sfd, socketTuning.profile);
+
+    // SYN data is handed to the server with accept, one round trip less for returning clients
+    if (socketTuning.fastOpenQueue > 0 &&
+        setIntOption(sfd, IPPROTO_TCP, TCP_FASTOPEN, socketTuning.fastOpenQueue) == -1)
+        status = -1;
+
+    // clients which connect and send nothing never wake up the server
+    if (socketTuning.deferAcceptSeconds > 0 &&
+        setIntOption(sfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, socketTuning.deferAcceptSeconds) == -1)
+        status = -1;
+
+    return status;
+}
+
+int tuneClientSocket(int fd)
+{
+    int status = applyTuningProfile(fd, socketTuning.profile);
+
+    if (socketTuning.fastOpenQueue > 0 && setIntOption(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1) == -1)
+        status = -1;
+    return status;
+}
+
+int tuneAcceptedSocket(int cfd)
+{
+    // buffers, TCP_NODELAY and TCP_NOTSENT_LOWAT came with the listener
+    if (socketTuning.profile == TUNING_LOW_LATENCY)
+        return refreshQuickAck(cfd);
+    return 0;
+}
+
+int refreshQuickAck(int fd)
+{
+    return setIntOption(fd, IPPROTO_TCP, TCP_QUICKACK, 1);
+}
+
+int setCork(int fd, int on)
+{
+    return setIntOption(fd, IPPROTO_TCP, TCP_CORK, on);
+}
@@ -0,0 +1,62 @@
+// named socket option profiles
+// - low-latency: TCP_NODELAY, TCP_QUICKACK and small buffers, so nothing waits in a queue
+// - bulk: large buffers and TCP_NOTSENT_LOWAT, Nagle stays on; writers batch with
+//   MSG_MORE or setCork so only full segments leave
+// the process wide tuning is applied by the socket library when it creates listeners and
+// client sockets and by every backend right after accept
+// listeners can also get TCP_FASTOPEN and TCP_DEFER_ACCEPT
+
+#ifndef SOCKET_TUNING_H
+#define SOCKET_TUNING_H
+
+typedef enum
+{
+    TUNING_DEFAULT, // kernel defaults, nothing is set
+    TUNING_LOW_LATENCY,
+    TUNING_BULK
+} TuningProfile;
+
+typedef struct
+{
+    TuningProfile profile;
+    int fastOpenQueue;      // TCP_FASTOPEN queue of listeners, also enables it on client sockets, 0 = off
+    int deferAcceptSeconds; // TCP_DEFER_ACCEPT of listeners, accept only once data arrived, 0 = off
+} SocketTuning;
+
+#define LOW_LATENCY_BUFFER_SIZE (32 * 1024)
+#define BULK_BUFFER_SIZE (4 * 1024 * 1024)
+
+// bulk senders wake up only when this much of the send buffer is left unsent
+#define BULK_NOTSENT_LOWAT (256 * 1024)
+
+// parse "default", "low-latency" or "bulk", returns -1 for unknown names
+int parseTuningProfile(const char *name);
+
+const char *tuningProfileName(TuningProfile profile);
+
+// copied, NULL goes back to the kernel defaults
+void useSocketTuning(const SocketTuning *tuning);
+
+// profile of useSocketTuning
+TuningProfile currentTuningProfile(void);
+
+// set the options of the profile on a tcp socket, returns -1 when one of them failed
+int applyTuningProfile(int fd, TuningProfile profile);
+
+// before bind/listen: profile (buffers are inherited by accepted sockets), fast open, defer accept
+int tuneListener(int sfd);
+
+// before connect: profile and TCP_FASTOPEN_CONNECT when fast open is on
+// (connect then returns at once, the SYN leaves with the first write)
+int tuneClientSocket(int fd);
+
+// right after accept, TCP_QUICKACK is not inherited from the listener
+int tuneAcceptedSocket(int cfd);
+
+// TCP_QUICKACK is reset by the kernel, low-latency readers set it again after each read
+int refreshQuickAck(int fd);
+
+// hold partial segments until uncorked (or 200ms passed)
+int setCork(int fd, int on);
+
+#endif
@@ -0,0 +1,351 @@
+#include "stream-server.h"
+#include "uring-backend.h"
+#include "pool-backend.h"
+#include <errno.h>
+#include <poll.h>
+
+#define STREAM_BUFFER_SIZE 4096
+#define STREAM_MAX_EVENTS 1024
+#define FILE_COPY_CHUNK_SIZE (64 * 1024)
+
+// callbacks must stay the first member, connections only keep a pointer to them
+typedef struct
+{
+    ConnectionCallbacks callbacks;
+    const StreamHandlers *handlers;
+} StreamContext;
+
+static const StreamHandlers *handlersOf(Connection *conn)
+{
+    return ((const StreamContext *)conn->callbacks)->handlers;
+}
+
+int parseServerBackend(const char *name)
+{
+    if (strcmp(name, "blocking") == 0)
+        return BACKEND_BLOCKING;
+    if (strcmp(name, "epoll") == 0)
+        return BACKEND_EPOLL;
+    if (strcmp(name, "uring") == 0)
+        return BACKEND_URING;
+    if (strcmp(name, "pool") == 0)
+        return BACKEND_POOL;
+    return -1;
+}
+
+ssize_t connectionSend(Connection *conn, const void *data, size_t len)
+{
+    if (conn->ops != NULL)
+        return conn->ops->send(conn, data, len);
+
+    if (outputQueueAppend(&conn->output, data, len) == -1)
+        return -1;
+    return (ssize_t)len;
+}
+
+// for backends without sendFile, the file goes through their send path in chunks
+static int sendFileByCopy(Connection *conn, int fileFd, off_t offset, size_t len)
+{
+    char *buffer = malloc(FILE_COPY_CHUNK_SIZE);
+    int status = buffer != NULL ? 0 : -1;
+
+    while (buffer != NULL && len > 0)
+    {
+        ssize_t bytes_read = pread(fileFd, buffer, len < FILE_COPY_CHUNK_SIZE ? len : FILE_COPY_CHUNK_SIZE, offset);
+        if (bytes_read == -1 && errno == EINTR)
+            continue;
+        if (bytes_read <= 0 || conn->ops->send(conn, buffer, bytes_read) == -1)
+        {
+            status = -1;
+            break;
+        }
+        offset += bytes_read;
+        len -= bytes_read;
+    }
+
+    free(buffer);
+    close(fileFd);
+    return status;
+}
+
+int connectionSendFile(Connection *conn, int fileFd, off_t offset, size_t len)
+{
+    if (conn->ops == NULL)
+        return outputQueueAppendFile(&conn->output, fileFd, offset, len);
+
+    if (conn->ops->sendFile != NULL)
+        return conn->ops->sendFile(conn, fileFd, offset, len);
+    return sendFileByCopy(conn, fileFd, offset, len);
+}
+
+int connectionPrintf(Connection *conn, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+
+    int size;
+    if (conn->ops != NULL)
+    {
+        // the backend keeps its own copy, so a stack buffer is enough here
+        char buffer[MESSAGE_BUFFER_SIZE];
+        size = vsnprintf(buffer, sizeof(buffer), format, args);
+        if (size >= (int)sizeof(buffer))
+            size = -1;
+        if (size >= 0)
+            size = conn->ops->send(conn, buffer, size);
+    }
+    else
+        size = outputQueueVPrintf(&conn->output, format, args);
+
+    va_end(args);
+    return size;
+}
+
+int connectionFlush(Connection *conn)
+{
+    // other backends submit their sends themselves
+    if (conn->ops != NULL || outputQueueDepth(&conn->output) == 0)
+        return 0;
+
+    return outputQueueFlush(&conn->output, conn->fd) == -1 ? -1 : 0;
+}
+
+size_t connectionQueueDepth(Connection *conn)
+{
+    if (conn->ops != NULL)
+        return conn->ops->queuedBytes(conn);
+    return outputQueueDepth(&conn->output);
+}
+
+// closing with unread input would reset the connection and drop the responses still in the
+// socket buffer, so the output is shut down and the input read and discarded until eof
+static void lingerConnection(Connection *conn)
+{
+    char buffer[STREAM_BUFFER_SIZE];
+    ssize_t bytes_received;
+
+    if (!conn->lingering)
+    {
+        conn->lingering = 1;
+        shutdown(conn->fd, SHUT_WR);
+    }
+
+    while ((bytes_received = recv(conn->fd, buffer, sizeof(buffer), 0)) > 0)
+        conn->discarded += bytes_received;
+
+    if (bytes_received == 0 || (errno != EAGAIN && errno != EWOULDBLOCK) || conn->discarded >= LINGER_MAX_BYTES)
+        closeConnection(conn);
+}
+
+void connectionClose(Connection *conn)
+{
+    if (conn->ops != NULL)
+        conn->ops->close(conn);
+
+    // blocking backend closes the socket itself once the handler returns
+    else if (conn->loop == NULL)
+        conn->closed = 1;
+
+    // responses queued before closing still have to reach the client
+    else if (!conn->closeWhenFlushed)
+    {
+        conn->closeWhenFlushed = 1;
+        if (connectionFlush(conn) == -1)
+            closeConnection(conn);
+        else if (outputQueueDepth(&conn->output) == 0)
+            lingerConnection(conn);
+    }
+}
+
+static void onStreamOpen(Connection *conn)
+{
+    const StreamHandlers *handlers = handlersOf(conn);
+    if (handlers->onOpen != NULL)
+        handlers->onOpen(conn);
+
+    // greeting queued by the handler
+    if (!conn->closed && connectionFlush(conn) == -1)
+        connectionClose(conn);
+}
+
+static void onStreamClose(Connection *conn)
+{
+    const StreamHandlers *handlers = handlersOf(conn);
+    if (handlers->onClose != NULL)
+        handlers->onClose(conn);
+}
+
+// drain the socket, as the event loop is edge triggered
+static void onStreamReadable(Connection *conn)
+{
+    const StreamHandlers *handlers = handlersOf(conn);
+    char buffer[STREAM_BUFFER_SIZE + 1];
+    ssize_t bytes_received = 0;
+
+    if (conn->lingering)
+    {
+        lingerConnection(conn);
+        return;
+    }
+
+    // nothing is handled anymore, only the queued output is waited for
+    if (conn->closeWhenFlushed)
+        return;
+
+    // the client does not read its responses, stop reading its requests until it does
+    conn->readPaused = 0;
+
+    // a handler which closed the connection gets no more data
+    while (!conn->closed && !conn->closeWhenFlushed)
+    {
+        if (outputQueueDepth(&conn->output) > OUTPUT_HIGH_WATER)
+        {
+            conn->readPaused = 1;
+            break;
+        }
+
+        if ((bytes_received = recvMessage(conn->fd, 0, buffer, sizeof(buffer))) <= 0)
+            break;
+        handlers->onData(conn, buffer, bytes_received);
+    }
+
+    if (conn->closed)
+        return;
+
+    // every response of this batch goes out with one syscall
+    if (connectionFlush(conn) == -1)
+    {
+        closeConnection(conn);
+        return;
+    }
+
+    if (conn->closeWhenFlushed || conn->readPaused)
+    {
+        if (conn->closeWhenFlushed && !conn->lingering && outputQueueDepth(&conn->output) == 0)
+            lingerConnection(conn);
+        return;
+    }
+
+    // the client is done sending, but may still read: onStreamWritable closes once it has all
+    if (bytes_received == 0 && outputQueueDepth(&conn->output) > 0)
+        conn->closeWhenFlushed = 1;
+    else if (bytes_received == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+        closeConnection(conn);
+}
+
+// socket buffer drained, send the remainder and resume paused reads
+static void onStreamWritable(Connection *conn)
+{
+    if (connectionFlush(conn) == -1)
+    {
+        closeConnection(conn);
+        return;
+    }
+
+    if (conn->closeWhenFlushed && outputQueueDepth(&conn->output) == 0)
+        lingerConnection(conn);
+    else if (conn->readPaused && outputQueueDepth(&conn->output) <= OUTPUT_HIGH_WATER)
+        onStreamReadable(conn);
+}
+
+ConnectionCallbacks *createStreamCallbacks(const StreamHandlers *handlers)
+{
+    StreamContext *context = malloc(sizeof(StreamContext));
+    if (context == NULL)
+        return NULL;
+
+    context->callbacks.onOpen = onStreamOpen;
+    context->callbacks.onReadable = onStreamReadable;
+    context->callbacks.onWritable = onStreamWritable;
+    context->callbacks.onClose = onStreamClose;
+    context->handlers = handlers;
+    return &context->callbacks;
+}
+
+static int runEpollServer(int sfd, StreamContext *context, void *userData)
+{
+    EventLoop *loop = createEventLoop(STREAM_MAX_EVENTS);
+    if (loop == NULL)
+        return -1;
+
+    int status = eventLoopAddListener(loop, sfd, &context->callbacks, userData);
+    if (status == 0)
+        status = eventLoopRun(loop);
+
+    destroyEventLoop(loop);
+    return status;
+}
+
+// one client at a time, until it disconnects
+static int runBlockingServer(int sfd, StreamContext *context, void *userData)
+{
+    char buffer[STREAM_BUFFER_SIZE + 1];
+
+    while (1)
+    {
+        Connection conn;
+        memset(&conn, 0, sizeof(conn));
+        conn.addrLen = sizeof(conn.addr);
+        conn.callbacks = &context->callbacks;
+        conn.userData = userData;
+
+        if ((conn.fd = acceptClient(sfd, (struct sockaddr *)&conn.addr, &conn.addrLen)) == -1)
+        {
+            // out of fds or memory, retrying right away would only spin
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+                poll(NULL, 0, ACCEPT_BACKOFF_MS);
+            continue;
+        }
+
+        onStreamOpen(&conn);
+
+        // blocking socket, so a flush only returns once everything is written
+        ssize_t bytes_received;
+        while (!conn.closed && (bytes_received = recvMessage(conn.fd, 0, buffer, sizeof(buffer))) > 0)
+        {
+            context->handlers->onData(&conn, buffer, bytes_received);
+            if (connectionFlush(&conn) == -1)
+                break;
+        }
+
+        // closed by the handler: the client may still be sending, see lingerConnection
+        if (conn.closed)
+        {
+            shutdown(conn.fd, SHUT_WR);
+            while (conn.discarded < LINGER_MAX_BYTES && (bytes_received = recv(conn.fd, buffer, sizeof(buffer), 0)) > 0)
+                conn.discarded += bytes_received;
+        }
+
+        onStreamClose(&conn);
+        close(conn.fd);
+        freeOutputQueue(&conn.output);
+        releaseClient();
+    }
+    return 0;
+}
+
+int runStreamServer(int sfd, ServerBackend backend, const StreamHandlers *handlers, void *userData)
+{
+    StreamContext context = {
+        .callbacks = {
+            .onOpen = onStreamOpen,
+            .onReadable = onStreamReadable,
+            .onWritable = onStreamWritable,
+            .onClose = onStreamClose,
+        },
+        .handlers = handlers,
+    };
+
+    switch (backend)
+    {
+    case BACKEND_BLOCKING:
+        return runBlockingServer(sfd, &context, userData);
+    case BACKEND_EPOLL:
+        return runEpollServer(sfd, &context, userData);
+    case BACKEND_URING:
+        return runUringServer(sfd, handlers, userData);
+    case BACKEND_POOL:
+        return runPoolServer(sfd, 0, handlers, userData);
+    }
+    return -1;
+}
@@ -0,0 +1,65 @@
+// backend independent tcp server
+// - the same handlers run on the blocking, epoll, io_uring or thread pool backend, the pool
+//   is the default of the servers
+// - handlers only see Connection, connectionSend and connectionClose
+
+#ifndef STREAM_SERVER_H
+#define STREAM_SERVER_H
+
+#include "event-loop.h"
+
+typedef enum
+{
+    BACKEND_BLOCKING, // accept -> recv loop, one client at a time
+    BACKEND_EPOLL,    // edge triggered event loop
+    BACKEND_URING,    // io_uring completions
+    BACKEND_POOL      // epoll one-shot events handled by a work stealing thread pool
+} ServerBackend;
+
+typedef struct
+{
+    void (*onOpen)(Connection *conn);
+    // data is null terminated, valid only during the call
+    void (*onData)(Connection *conn, const char *data, size_t len);
+    void (*onClose)(Connection *conn);
+} StreamHandlers;
+
+// serve clients of the listening socket until a fatal error, returns -1 on error
+int runStreamServer(int sfd, ServerBackend backend, const StreamHandlers *handlers, void *userData);
+
+// callbacks running the handlers on connections of an event loop owned by the caller,
+// for loops which get their clients some other way than a listener (free with free)
+ConnectionCallbacks *createStreamCallbacks(const StreamHandlers *handlers);
+
+// parse "blocking", "epoll", "uring" or "pool", returns -1 for unknown names
+int parseServerBackend(const char *name);
+
+// stop reading from a client while this much output is queued for it
+#define OUTPUT_HIGH_WATER (1024 * 1024)
+
+// input a closed connection discards before it gives up on a clean close
+#define LINGER_MAX_BYTES (1024 * 1024)
+
+// queue the data on the connection whatever backend owns it
+// it is written once the current batch of input is handled (one syscall per batch)
+ssize_t connectionSend(Connection *conn, const void *data, size_t len);
+
+// queue a file range, sent with sendfile where the backend allows it
+// the connection owns fileFd from now on, returns -1 on failure
+int connectionSendFile(Connection *conn, int fileFd, off_t offset, size_t len);
+
+// format directly into the output queue of the connection
+int connectionPrintf(Connection *conn, const char *format, ...);
+
+// write queued output now, returns -1 when the connection failed
+int connectionFlush(Connection *conn);
+
+// bytes queued but not yet accepted by the socket
+size_t connectionQueueDepth(Connection *conn);
+
+// close the connection whatever backend owns it
+// queued output is sent first, then the write side is shut down and the input discarded until
+// the client closes too, so unread requests cannot make the close reset the connection
+void connectionClose(Connection *conn);
+
+#endif
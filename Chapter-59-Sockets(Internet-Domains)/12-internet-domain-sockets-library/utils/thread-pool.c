@@ -0,0 +1,445 @@
+#include "thread-pool.h"
+#include "metrics.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#define DEQUE_INITIAL_CAPACITY 256
+#define CACHE_LINE 64
+
+// a steal lost the race against another thief or the owner, the victim may still have work
+#define STEAL_ABORT ((PoolTask *)1)
+
+typedef struct DequeArray
+{
+    size_t capacity; // power of 2
+    struct DequeArray *retired; // older arrays, thieves can still be reading them
+    _Atomic(PoolTask *) slots[];
+} DequeArray;
+
+// chase-lev deque, owner works at the bottom and thieves take from the top
+typedef struct
+{
+    _Atomic long top;
+    char pad[CACHE_LINE - sizeof(long)];
+    _Atomic long bottom;
+    _Atomic(DequeArray *) array;
+} Deque;
+
+typedef struct
+{
+    Deque deque;
+    ThreadPool *pool;
+    int index;
+    uint32_t seed;
+    pthread_t thread;
+} __attribute__((aligned(CACHE_LINE))) Worker;
+
+struct ThreadPool
+{
+    Worker *workers;
+    int size;
+
+    // tasks from threads outside the pool
+    pthread_mutex_t lock;
+    pthread_cond_t wakeUp;
+    PoolTask *injectedHead, *injectedTail;
+    atomic_size_t injected;
+
+    atomic_int sleepers;
+    int stopping;
+};
+
+static __thread Worker *currentWorker = NULL;
+
+static DequeArray *createDequeArray(size_t capacity)
+{
+    DequeArray *array = malloc(sizeof(DequeArray) + capacity * sizeof(_Atomic(PoolTask *)));
+    if (array == NULL)
+        return NULL;
+
+    array->capacity = capacity;
+    array->retired = NULL;
+    return array;
+}
+
+static int initDeque(Deque *deque)
+{
+    DequeArray *array = createDequeArray(DEQUE_INITIAL_CAPACITY);
+    if (array == NULL)
+        return -1;
+
+    atomic_init(&deque->top, 0);
+    atomic_init(&deque->bottom, 0);
+    atomic_init(&deque->array, array);
+    return 0;
+}
+
+static void freeDeque(Deque *deque)
+{
+    DequeArray *array = atomic_load(&deque->array);
+    while (array != NULL)
+    {
+        DequeArray *retired = array->retired;
+        free(array);
+        array = retired;
+    }
+}
+
+// owner only, the old array stays alive until the pool is destroyed
+static DequeArray *growDeque(Deque *deque, DequeArray *old, long top, long bottom)
+{
+    DequeArray *array = createDequeArray(old->capacity * 2);
+    if (array == NULL)
+        return NULL;
+
+    for (long i = top; i < bottom; i++)
+        atomic_store_explicit(&array->slots[i & (array->capacity - 1)],
+                              atomic_load_explicit(&old->slots[i & (old->capacity - 1)], memory_order_relaxed),
+                              memory_order_relaxed);
+
+    array->retired = old;
+    atomic_store_explicit(&deque->array, array, memory_order_release);
+    return array;
+}
+
+static int dequePush(Deque *deque, PoolTask *task)
+{
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    DequeArray *array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+
+    if (bottom - top > (long)array->capacity - 1 && (array = growDeque(deque, array, top, bottom)) == NULL)
+        return -1;
+
+    atomic_store_explicit(&array->slots[bottom & (array->capacity - 1)], task, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    return 0;
+}
+
+static PoolTask *dequeTake(Deque *deque)
+{
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    DequeArray *array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    // empty
+    if (top > bottom)
+    {
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return NULL;
+    }
+
+    PoolTask *task = atomic_load_explicit(&array->slots[bottom & (array->capacity - 1)], memory_order_relaxed);
+
+    // last task, a thief may be taking it at the same time
+    if (top == bottom)
+    {
+        if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed))
+            task = NULL;
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    }
+    return task;
+}
+
+static PoolTask *dequeSteal(Deque *deque)
+{
+    long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+
+    if (top >= bottom)
+        return NULL;
+
+    DequeArray *array = atomic_load_explicit(&deque->array, memory_order_acquire);
+    PoolTask *task = atomic_load_explicit(&array->slots[top & (array->capacity - 1)], memory_order_relaxed);
+
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed))
+        return STEAL_ABORT;
+    return task;
+}
+
+// called with the lock held
+static PoolTask *popInjected(ThreadPool *pool)
+{
+    PoolTask *task = pool->injectedHead;
+    if (task == NULL)
+        return NULL;
+
+    pool->injectedHead = task->next;
+    if (pool->injectedHead == NULL)
+        pool->injectedTail = NULL;
+    atomic_fetch_sub(&pool->injected, 1);
+    return task;
+}
+
+static uint32_t nextRandom(Worker *worker)
+{
+    // xorshift32
+    uint32_t x = worker->seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return worker->seed = x;
+}
+
+// own deque first, then the injection queue, then random victims
+static PoolTask *findTask(Worker *self, int lockHeld)
+{
+    ThreadPool *pool = self->pool;
+
+    PoolTask *task = dequeTake(&self->deque);
+    if (task != NULL)
+        return task;
+
+    if (atomic_load(&pool->injected) > 0)
+    {
+        if (!lockHeld)
+            pthread_mutex_lock(&pool->lock);
+        task = popInjected(pool);
+        if (!lockHeld)
+            pthread_mutex_unlock(&pool->lock);
+        if (task != NULL)
+            return task;
+    }
+
+    if (pool->size == 1)
+        return NULL;
+
+    // an aborted steal means there was work, look again before giving up
+    int aborted;
+    do
+    {
+        aborted = 0;
+        int start = nextRandom(self) % pool->size;
+
+        for (int i = 0; i < pool->size; i++)
+        {
+            Worker *victim = &pool->workers[(start + i) % pool->size];
+            if (victim == self)
+                continue;
+
+            task = dequeSteal(&victim->deque);
+            if (task == STEAL_ABORT)
+                aborted = 1;
+            else if (task != NULL)
+                return task;
+        }
+    } while (aborted);
+
+    return NULL;
+}
+
+static void *runWorker(void *arg)
+{
+    Worker *self = arg;
+    ThreadPool *pool = self->pool;
+    currentWorker = self;
+
+    while (1)
+    {
+        PoolTask *task = findTask(self, 0);
+        if (task != NULL)
+        {
+            metricsAdd(METRIC_POOL_QUEUED_TASKS, -1);
+            task->run(task);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+
+        // announce the sleep before the last look, a submitter either sees us or we see its task
+        atomic_fetch_add(&pool->sleepers, 1);
+        task = findTask(self, 1);
+
+        if (task == NULL && !pool->stopping)
+            pthread_cond_wait(&pool->wakeUp, &pool->lock);
+
+        atomic_fetch_sub(&pool->sleepers, 1);
+        int stop = task == NULL && pool->stopping;
+        pthread_mutex_unlock(&pool->lock);
+
+        if (task != NULL)
+        {
+            metricsAdd(METRIC_POOL_QUEUED_TASKS, -1);
+            task->run(task);
+        }
+        else if (stop)
+            break;
+    }
+    return NULL;
+}
+
+ThreadPool *createThreadPool(int threads)
+{
+    if (threads <= 0)
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads <= 0)
+        threads = 1;
+
+    ThreadPool *pool = calloc(1, sizeof(ThreadPool));
+    if (pool == NULL)
+        return NULL;
+
+    pool->workers = aligned_alloc(CACHE_LINE, sizeof(Worker) * threads);
+    if (pool->workers == NULL)
+    {
+        free(pool);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wakeUp, NULL);
+    atomic_init(&pool->injected, 0);
+    atomic_init(&pool->sleepers, 0);
+
+    // every deque exists before any thread can try to steal from it
+    for (int i = 0; i < threads; i++)
+    {
+        Worker *worker = &pool->workers[i];
+        worker->pool = pool;
+        worker->index = i;
+        worker->seed = 2463534242u + i * 7919u;
+        if (initDeque(&worker->deque) == -1)
+        {
+            while (i-- > 0)
+                freeDeque(&pool->workers[i].deque);
+            free(pool->workers);
+            free(pool);
+            return NULL;
+        }
+    }
+
+    pool->size = threads;
+    for (int i = 0; i < threads; i++)
+    {
+        if (pthread_create(&pool->workers[i].thread, NULL, runWorker, &pool->workers[i]) != 0)
+        {
+            // stop the threads already running, they may steal from any deque
+            pthread_mutex_lock(&pool->lock);
+            pool->stopping = 1;
+            pthread_cond_broadcast(&pool->wakeUp);
+            pthread_mutex_unlock(&pool->lock);
+
+            for (int j = 0; j < i; j++)
+                pthread_join(pool->workers[j].thread, NULL);
+            for (int j = 0; j < threads; j++)
+                freeDeque(&pool->workers[j].deque);
+
+            pthread_cond_destroy(&pool->wakeUp);
+            pthread_mutex_destroy(&pool->lock);
+            free(pool->workers);
+            free(pool);
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+void destroyThreadPool(ThreadPool *pool)
+{
+    if (pool == NULL)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->wakeUp);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->size; i++)
+        pthread_join(pool->workers[i].thread, NULL);
+
+    for (int i = 0; i < pool->size; i++)
+        freeDeque(&pool->workers[i].deque);
+
+    pthread_cond_destroy(&pool->wakeUp);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->workers);
+    free(pool);
+}
+
+int threadPoolSubmit(ThreadPool *pool, PoolTask *task)
+{
+    Worker *self = currentWorker;
+
+    if (self != NULL && self->pool == pool)
+    {
+        if (dequePush(&self->deque, task) == -1)
+            return -1;
+        metricsIncrement(METRIC_POOL_QUEUED_TASKS);
+
+        // pairs with the sleepers increment of a worker going to sleep
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_load_explicit(&pool->sleepers, memory_order_relaxed) > 0)
+        {
+            pthread_mutex_lock(&pool->lock);
+            pthread_cond_signal(&pool->wakeUp);
+            pthread_mutex_unlock(&pool->lock);
+        }
+        return 0;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+
+    task->next = NULL;
+    if (pool->injectedTail != NULL)
+        pool->injectedTail->next = task;
+    else
+        pool->injectedHead = task;
+    pool->injectedTail = task;
+    atomic_fetch_add(&pool->injected, 1);
+    metricsIncrement(METRIC_POOL_QUEUED_TASKS);
+
+    if (atomic_load(&pool->sleepers) > 0)
+        pthread_cond_signal(&pool->wakeUp);
+
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+typedef struct
+{
+    PoolTask task;
+    void (*function)(void *arg);
+    void *arg;
+} FunctionTask;
+
+static void runFunctionTask(PoolTask *task)
+{
+    FunctionTask *functionTask = (FunctionTask *)task;
+    functionTask->function(functionTask->arg);
+    free(functionTask);
+}
+
+int threadPoolSubmitFunction(ThreadPool *pool, void (*function)(void *arg), void *arg)
+{
+    FunctionTask *functionTask = malloc(sizeof(FunctionTask));
+    if (functionTask == NULL)
+        return -1;
+
+    functionTask->task.run = runFunctionTask;
+    functionTask->function = function;
+    functionTask->arg = arg;
+
+    if (threadPoolSubmit(pool, &functionTask->task) == -1)
+    {
+        free(functionTask);
+        return -1;
+    }
+    return 0;
+}
+
+int threadPoolCurrentWorker(void)
+{
+    return currentWorker != NULL ? currentWorker->index : -1;
+}
+
+int threadPoolSize(const ThreadPool *pool)
+{
+    return pool->size;
+}
@@ -0,0 +1,40 @@
+// work stealing thread pool
+// - every worker owns a chase-lev deque: it pushes/pops at the bottom without locks
+// - idle workers steal from the top of a randomly chosen victim
+// - tasks submitted from outside the pool go through a small locked injection queue
+// - sleeping workers are woken only when someone is actually asleep
+// tasks are intrusive: embed a PoolTask in your own struct, nothing is allocated per task
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <stddef.h>
+
+typedef struct ThreadPool ThreadPool;
+
+typedef struct PoolTask
+{
+    void (*run)(struct PoolTask *task);
+    struct PoolTask *next; // used by the injection queue
+} PoolTask;
+
+// threads <= 0 means one per online cpu
+ThreadPool *createThreadPool(int threads);
+
+// runs the tasks still queued, then joins the workers
+void destroyThreadPool(ThreadPool *pool);
+
+// from a worker the task goes to its own deque, otherwise to the injection queue
+// the task must stay valid until it has run, returns -1 when the deque could not grow
+int threadPoolSubmit(ThreadPool *pool, PoolTask *task);
+
+// allocating version for plain functions
+int threadPoolSubmitFunction(ThreadPool *pool, void (*function)(void *arg), void *arg);
+
+// index of the calling worker in its pool, -1 for threads outside any pool
+int threadPoolCurrentWorker(void);
+
+// number of worker threads
+int threadPoolSize(const ThreadPool *pool);
+
+#endif
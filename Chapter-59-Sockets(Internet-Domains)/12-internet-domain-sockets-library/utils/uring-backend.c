@@ -0,0 +1,741 @@
+#include "uring-backend.h"
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES 4096
+#define URING_BUFFER_GROUP 0
+#define URING_BUFFER_COUNT 4096 // power of 2, required by the buffer ring
+#define URING_BUFFER_SIZE 4096
+
+typedef enum
+{
+    OP_ACCEPT,
+    OP_ACCEPT_BACKOFF,
+    OP_RECV,
+    OP_SEND
+} UringOpType;
+
+typedef struct UringConnection UringConnection;
+
+// every sqe points to one of these through user_data
+typedef struct
+{
+    UringOpType type;
+    UringConnection *conn;
+} UringOp;
+
+typedef struct SendBuffer
+{
+    UringOp op;
+    struct SendBuffer *next;
+    size_t len;
+    size_t offset;
+    int inFlight;
+    char data[];
+} SendBuffer;
+
+typedef struct
+{
+    int fd;
+
+    // submission queue
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned sqEntries;
+    unsigned sqLocalTail;
+    unsigned toSubmit;
+    struct io_uring_sqe *sqes;
+
+    // completion queue
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_cqe *cqes;
+
+    // mappings
+    void *sqRing, *cqRing;
+    size_t sqRingSize, cqRingSize, sqesSize;
+
+    // provided buffers for recv
+    struct io_uring_buf_ring *bufRing;
+    size_t bufRingSize;
+    char *bufMemory;
+    unsigned short bufTail;
+} Uring;
+
+typedef struct
+{
+    Uring ring;
+    int sfd;
+    UringOp acceptOp;
+    UringOp backoffOp; // timeout after which accepting starts again
+    struct __kernel_timespec backoff;
+    const StreamHandlers *handlers;
+    void *userData;
+
+    // connections with sends waiting for the next submission
+    UringConnection *dirty;
+} UringServer;
+
+struct UringConnection
+{
+    Connection conn; // must stay first, handlers only see this
+    UringServer *server;
+    UringOp recvOp;
+
+    SendBuffer *sendHead, *sendTail;
+    size_t queuedBytes;
+    int sendsInFlight;
+    int opsInFlight;
+    int closing;
+    int failed;
+    int isDirty;
+    UringConnection *nextDirty;
+    size_t discarded; // input read after closing
+};
+
+static int uringSetup(unsigned entries, struct io_uring_params *params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+static int uringRegister(int fd, unsigned opcode, void *arg, unsigned nrArgs)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nrArgs);
+}
+
+static void uringFree(Uring *ring)
+{
+    if (ring->bufRing != NULL)
+        munmap(ring->bufRing, ring->bufRingSize);
+    free(ring->bufMemory);
+    if (ring->sqes != NULL)
+        munmap(ring->sqes, ring->sqesSize);
+    if (ring->cqRing != NULL && ring->cqRing != ring->sqRing)
+        munmap(ring->cqRing, ring->cqRingSize);
+    if (ring->sqRing != NULL)
+        munmap(ring->sqRing, ring->sqRingSize);
+    if (ring->fd > 0)
+        close(ring->fd);
+}
+
+// register the provided buffer ring which multishot recv picks buffers from
+static int uringSetupBuffers(Uring *ring)
+{
+    ring->bufRingSize = URING_BUFFER_COUNT * sizeof(struct io_uring_buf);
+    ring->bufRing = mmap(NULL, ring->bufRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->bufRing == MAP_FAILED)
+    {
+        ring->bufRing = NULL;
+        return -1;
+    }
+
+    // +1 on every buffer so the received data can be null terminated
+    ring->bufMemory = malloc((size_t)URING_BUFFER_COUNT * (URING_BUFFER_SIZE + 1));
+    if (ring->bufMemory == NULL)
+        return -1;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)ring->bufRing;
+    reg.ring_entries = URING_BUFFER_COUNT;
+    reg.bgid = URING_BUFFER_GROUP;
+
+    if (uringRegister(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+        return -1;
+
+    for (unsigned short bid = 0; bid < URING_BUFFER_COUNT; bid++)
+    {
+        struct io_uring_buf *buf = &ring->bufRing->bufs[bid];
+        buf->addr = (unsigned long)(ring->bufMemory + (size_t)bid * (URING_BUFFER_SIZE + 1));
+        buf->len = URING_BUFFER_SIZE;
+        buf->bid = bid;
+    }
+    ring->bufTail = URING_BUFFER_COUNT;
+    __atomic_store_n(&ring->bufRing->tail, ring->bufTail, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// give a consumed buffer back to the kernel
+static void uringRecycleBuffer(Uring *ring, unsigned short bid)
+{
+    struct io_uring_buf *buf = &ring->bufRing->bufs[ring->bufTail & (URING_BUFFER_COUNT - 1)];
+    buf->addr = (unsigned long)(ring->bufMemory + (size_t)bid * (URING_BUFFER_SIZE + 1));
+    buf->len = URING_BUFFER_SIZE;
+    buf->bid = bid;
+    ring->bufTail++;
+    __atomic_store_n(&ring->bufRing->tail, ring->bufTail, __ATOMIC_RELEASE);
+}
+
+static int uringInit(Uring *ring)
+{
+    struct io_uring_params params;
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+
+    // multishot operations post many completions per submission
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+    params.cq_entries = URING_ENTRIES * 4;
+
+    ring->fd = uringSetup(URING_ENTRIES, &params);
+
+    // older kernels, retry without the optional flags
+    if (ring->fd == -1 && errno == EINVAL)
+    {
+        memset(&params, 0, sizeof(params));
+        ring->fd = uringSetup(URING_ENTRIES, &params);
+    }
+    if (ring->fd == -1)
+        return -1;
+
+    ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring->cqRingSize > ring->sqRingSize)
+            ring->sqRingSize = ring->cqRingSize;
+        ring->cqRingSize = ring->sqRingSize;
+    }
+
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sqRing == MAP_FAILED)
+    {
+        ring->sqRing = NULL;
+        uringFree(ring);
+        return -1;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        ring->cqRing = ring->sqRing;
+    else
+    {
+        ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cqRing == MAP_FAILED)
+        {
+            ring->cqRing = NULL;
+            uringFree(ring);
+            return -1;
+        }
+    }
+
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        ring->sqes = NULL;
+        uringFree(ring);
+        return -1;
+    }
+
+    char *sq = ring->sqRing;
+    ring->sqHead = (unsigned *)(sq + params.sq_off.head);
+    ring->sqTail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned *)(sq + params.sq_off.array);
+    ring->sqEntries = params.sq_entries;
+    ring->sqLocalTail = *ring->sqTail;
+
+    // sqe i always sits in slot i, so the array is filled only once
+    for (unsigned i = 0; i < ring->sqEntries; i++)
+        ring->sqArray[i] = i;
+
+    char *cq = ring->cqRing;
+    ring->cqHead = (unsigned *)(cq + params.cq_off.head);
+    ring->cqTail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    if (uringSetupBuffers(ring) == -1)
+    {
+        uringFree(ring);
+        return -1;
+    }
+    return 0;
+}
+
+// publish queued sqes and optionally wait for completions
+static int uringSubmit(Uring *ring, unsigned waitFor)
+{
+    __atomic_store_n(ring->sqTail, ring->sqLocalTail, __ATOMIC_RELEASE);
+
+    int submitted = uringEnter(ring->fd, ring->toSubmit, waitFor, waitFor ? IORING_ENTER_GETEVENTS : 0);
+    metricsIncrement(METRIC_SYSCALLS);
+    if (submitted == -1)
+        return -1;
+
+    ring->toSubmit -= submitted;
+    return submitted;
+}
+
+// sqes which can be taken without uringGetSqe submitting on its own
+static unsigned uringSpace(Uring *ring)
+{
+    return ring->sqEntries - (ring->sqLocalTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE));
+}
+
+static struct io_uring_sqe *uringGetSqe(Uring *ring)
+{
+    // queue is full, hand what we have to the kernel first
+    while (ring->sqLocalTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) >= ring->sqEntries)
+    {
+        if (uringSubmit(ring, 0) == -1 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            return NULL;
+    }
+
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sqLocalTail & *ring->sqMask];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sqLocalTail++;
+    ring->toSubmit++;
+    return sqe;
+}
+
+static int armAccept(UringServer *server)
+{
+    struct io_uring_sqe *sqe = uringGetSqe(&server->ring);
+    if (sqe == NULL)
+        return -1;
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = server->sfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = (unsigned long)&server->acceptOp;
+    return 0;
+}
+
+// the accept is armed again when the timeout completes
+static int armAcceptBackoff(UringServer *server)
+{
+    struct io_uring_sqe *sqe = uringGetSqe(&server->ring);
+    if (sqe == NULL)
+        return -1;
+
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (unsigned long)&server->backoff;
+    sqe->len = 1;
+    sqe->user_data = (unsigned long)&server->backoffOp;
+    return 0;
+}
+
+static int armRecv(UringConnection *uconn)
+{
+    struct io_uring_sqe *sqe = uringGetSqe(&uconn->server->ring);
+    if (sqe == NULL)
+        return -1;
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = uconn->conn.fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = (unsigned long)&uconn->recvOp;
+
+    uconn->opsInFlight++;
+    return 0;
+}
+
+static void markDirty(UringConnection *uconn)
+{
+    if (uconn->isDirty)
+        return;
+    uconn->isDirty = 1;
+    uconn->nextDirty = uconn->server->dirty;
+    uconn->server->dirty = uconn;
+}
+
+static void freeSendQueue(UringConnection *uconn)
+{
+    while (uconn->sendHead != NULL)
+    {
+        SendBuffer *buf = uconn->sendHead;
+        uconn->sendHead = buf->next;
+        free(buf);
+    }
+    uconn->sendTail = NULL;
+    metricsAdd(METRIC_OUTPUT_QUEUED_BYTES, -(int64_t)uconn->queuedBytes);
+    uconn->queuedBytes = 0;
+}
+
+// release the connection once the kernel holds no reference to it
+static void releaseIfIdle(UringConnection *uconn)
+{
+    if (!uconn->closing || uconn->opsInFlight > 0 || uconn->isDirty)
+        return;
+
+    close(uconn->conn.fd);
+    freeSendQueue(uconn);
+    free(uconn);
+    releaseClient();
+}
+
+// the recv stays armed and discards the input until the client closes too (connectionClose),
+// a failed connection or one which sent too much is shut down at once
+static void shutdownConnection(UringConnection *uconn)
+{
+    int how = uconn->failed || uconn->discarded >= LINGER_MAX_BYTES ? SHUT_RDWR : SHUT_WR;
+    shutdown(uconn->conn.fd, how);
+}
+
+static void uringClose(Connection *conn)
+{
+    UringConnection *uconn = (UringConnection *)conn;
+    if (uconn->closing)
+        return;
+    uconn->closing = 1;
+
+    if (uconn->server->handlers->onClose != NULL)
+        uconn->server->handlers->onClose(conn);
+
+    // the final completion of the armed recv releases the connection
+    // queued data is flushed first, then the send completion shuts it down
+    if (uconn->sendHead == NULL)
+        shutdownConnection(uconn);
+}
+
+static ssize_t uringSend(Connection *conn, const void *data, size_t len)
+{
+    UringConnection *uconn = (UringConnection *)conn;
+    if (uconn->failed || (uconn->closing && uconn->sendHead == NULL))
+    {
+        errno = EPIPE;
+        return -1;
+    }
+
+    SendBuffer *buf = malloc(sizeof(SendBuffer) + len);
+    if (buf == NULL)
+        return -1;
+
+    buf->op.type = OP_SEND;
+    buf->op.conn = uconn;
+    buf->next = NULL;
+    buf->len = len;
+    buf->offset = 0;
+    buf->inFlight = 0;
+    memcpy(buf->data, data, len);
+
+    if (uconn->sendTail != NULL)
+        uconn->sendTail->next = buf;
+    else
+        uconn->sendHead = buf;
+    uconn->sendTail = buf;
+    uconn->queuedBytes += len;
+    metricsAdd(METRIC_OUTPUT_QUEUED_BYTES, len);
+
+    // submitted together with every other send of this iteration
+    markDirty(uconn);
+    return (ssize_t)len;
+}
+
+static size_t uringQueuedBytes(Connection *conn)
+{
+    return ((UringConnection *)conn)->queuedBytes;
+}
+
+static const ConnectionOps uringOps = {
+    .send = uringSend,
+    .close = uringClose,
+    .queuedBytes = uringQueuedBytes,
+};
+
+// submit the queued buffers as one linked chain, so they reach the socket in order
+// returns -1 when the submission queue had no room, the buffers stay queued
+static int flushSends(UringConnection *uconn)
+{
+    // previous chain is still running, ordering would not be guaranteed
+    if (uconn->sendsInFlight > 0)
+        return 0;
+
+    // a chain split by a submission would run as two chains side by side, so it is cut
+    // to the free space; the rest follows once this part completed
+    Uring *ring = &uconn->server->ring;
+    unsigned space = uringSpace(ring);
+    if (space == 0 && uringSubmit(ring, 0) != -1)
+        space = uringSpace(ring);
+    if (space == 0)
+        return -1;
+
+    struct io_uring_sqe *last = NULL;
+
+    for (SendBuffer *buf = uconn->sendHead; buf != NULL && space > 0; buf = buf->next, space--)
+    {
+        struct io_uring_sqe *sqe = uringGetSqe(ring);
+        if (sqe == NULL)
+            break;
+
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = uconn->conn.fd;
+        sqe->addr = (unsigned long)(buf->data + buf->offset);
+        sqe->len = buf->len - buf->offset;
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = (unsigned long)&buf->op;
+
+        buf->inFlight = 1;
+        uconn->sendsInFlight++;
+        uconn->opsInFlight++;
+        last = sqe;
+    }
+
+    // the chain ends at the last send
+    if (last != NULL)
+        last->flags &= ~IOSQE_IO_LINK;
+    return 0;
+}
+
+static void flushDirtyConnections(UringServer *server)
+{
+    // no room in the submission queue, tried again after the next submission
+    UringConnection *retry = NULL;
+
+    while (server->dirty != NULL)
+    {
+        UringConnection *uconn = server->dirty;
+        server->dirty = uconn->nextDirty;
+
+        if (flushSends(uconn) == -1)
+        {
+            uconn->nextDirty = retry;
+            retry = uconn;
+            continue;
+        }
+
+        uconn->isDirty = 0;
+        releaseIfIdle(uconn);
+    }
+    server->dirty = retry;
+}
+
+static void handleAccept(UringServer *server, struct io_uring_cqe *cqe)
+{
+    // multishot accept stopped (error or overflow), arm it again
+    int stopped = !(cqe->flags & IORING_CQE_F_MORE);
+
+    if (cqe->res < 0)
+    {
+        int error = -cqe->res;
+
+        // out of fds, without shedding the re-armed accept would fail again right away
+        if ((error == EMFILE || error == ENFILE) && shedClient(server->sfd) == 0)
+        {
+            if (stopped)
+                armAccept(server);
+            return;
+        }
+
+        // nothing to shed, re-arming right away would only spin
+        if (error == EMFILE || error == ENFILE || error == ENOBUFS || error == ENOMEM)
+        {
+            if (stopped && armAcceptBackoff(server) == -1)
+                armAccept(server);
+            return;
+        }
+
+        if (stopped)
+            armAccept(server);
+        errno = error;
+        perror("accept");
+        return;
+    }
+
+    if (stopped)
+        armAccept(server);
+
+    // multishot accept has no batches, the limit is applied per completion
+    if (admitAcceptedClient(cqe->res) == -1)
+        return;
+
+    UringConnection *uconn = calloc(1, sizeof(UringConnection));
+    if (uconn == NULL)
+    {
+        close(cqe->res);
+        releaseClient();
+        return;
+    }
+
+    tuneAcceptedSocket(cqe->res);
+    uconn->server = server;
+    uconn->conn.fd = cqe->res;
+    uconn->conn.userData = server->userData;
+    uconn->conn.ops = &uringOps;
+    uconn->recvOp.type = OP_RECV;
+    uconn->recvOp.conn = uconn;
+
+    // multishot accept does not report the peer address
+    uconn->conn.addrLen = sizeof(uconn->conn.addr);
+    getpeername(uconn->conn.fd, (struct sockaddr *)&uconn->conn.addr, &uconn->conn.addrLen);
+
+    if (server->handlers->onOpen != NULL)
+        server->handlers->onOpen(&uconn->conn);
+
+    if (!uconn->closing)
+        armRecv(uconn);
+    releaseIfIdle(uconn);
+}
+
+static void handleRecv(UringConnection *uconn, struct io_uring_cqe *cqe)
+{
+    UringServer *server = uconn->server;
+
+    if (cqe->flags & IORING_CQE_F_BUFFER)
+    {
+        unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        char *data = server->ring.bufMemory + (size_t)bid * (URING_BUFFER_SIZE + 1);
+
+        if (cqe->res > 0)
+            metricsAdd(METRIC_BYTES_IN, cqe->res);
+
+        if (cqe->res > 0 && !uconn->closing)
+        {
+            data[cqe->res] = '\0';
+            server->handlers->onData(&uconn->conn, data, cqe->res);
+        }
+        else if (cqe->res > 0)
+        {
+            // input after closing is only counted, see shutdownConnection
+            uconn->discarded += cqe->res;
+            if (uconn->discarded >= LINGER_MAX_BYTES)
+                shutdownConnection(uconn);
+        }
+        uringRecycleBuffer(&server->ring, bid);
+    }
+
+    // recv is still armed
+    if (cqe->flags & IORING_CQE_F_MORE)
+        return;
+
+    uconn->opsInFlight--;
+
+    // buffers ran out, not an error of the connection
+    if (cqe->res == -ENOBUFS && uconn->discarded < LINGER_MAX_BYTES)
+    {
+        armRecv(uconn);
+        return;
+    }
+
+    // peer closed or the connection failed
+    if (cqe->res <= 0)
+        uringClose(&uconn->conn);
+    else if (uconn->discarded < LINGER_MAX_BYTES)
+        armRecv(uconn);
+
+    releaseIfIdle(uconn);
+}
+
+static void handleSend(SendBuffer *buf, struct io_uring_cqe *cqe)
+{
+    UringConnection *uconn = buf->op.conn;
+
+    buf->inFlight = 0;
+    uconn->sendsInFlight--;
+    uconn->opsInFlight--;
+
+    if (cqe->res >= 0)
+    {
+        buf->offset += cqe->res;
+        uconn->queuedBytes -= cqe->res;
+        metricsAdd(METRIC_BYTES_OUT, cqe->res);
+        metricsAdd(METRIC_OUTPUT_QUEUED_BYTES, -(int64_t)cqe->res);
+    }
+
+    // real failure, nothing more can be delivered
+    if (cqe->res < 0 && cqe->res != -ECANCELED)
+        uconn->failed = 1;
+
+    // sent completely or dropped, chains complete in order so this is the head
+    if (buf->offset == buf->len || uconn->failed)
+    {
+        uconn->queuedBytes -= buf->len - buf->offset;
+        metricsAdd(METRIC_OUTPUT_QUEUED_BYTES, -(int64_t)(buf->len - buf->offset));
+        uconn->sendHead = buf->next;
+        if (uconn->sendHead == NULL)
+            uconn->sendTail = NULL;
+        free(buf);
+    }
+
+    if (uconn->failed)
+        uringClose(&uconn->conn);
+
+    if (uconn->sendsInFlight == 0)
+    {
+        if (uconn->failed)
+            freeSendQueue(uconn);
+
+        // short send or cancelled links, resubmit the remainder
+        if (uconn->sendHead != NULL)
+            markDirty(uconn);
+
+        // everything the closing handler queued is sent
+        else if (uconn->closing)
+            shutdownConnection(uconn);
+    }
+    releaseIfIdle(uconn);
+}
+
+int runUringServer(int sfd, const StreamHandlers *handlers, void *userData)
+{
+    UringServer server;
+    memset(&server, 0, sizeof(server));
+    server.sfd = sfd;
+    server.handlers = handlers;
+    server.userData = userData;
+    server.acceptOp.type = OP_ACCEPT;
+    server.backoffOp.type = OP_ACCEPT_BACKOFF;
+    server.backoff.tv_sec = ACCEPT_BACKOFF_MS / 1000;
+    server.backoff.tv_nsec = ACCEPT_BACKOFF_MS % 1000 * 1000000L;
+
+    if (uringInit(&server.ring) == -1)
+        return -1;
+
+    Uring *ring = &server.ring;
+
+    if (armAccept(&server) == -1)
+    {
+        uringFree(ring);
+        return -1;
+    }
+
+    while (1)
+    {
+        flushDirtyConnections(&server);
+
+        // one syscall submits everything queued and waits for the next completion
+        if (uringSubmit(ring, 1) == -1 && errno != EINTR && errno != EBUSY && errno != EAGAIN)
+            break;
+
+        unsigned head = *ring->cqHead;
+        unsigned tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+
+        for (; head != tail; head++)
+        {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cqMask];
+            UringOp *op = (UringOp *)(unsigned long)cqe->user_data;
+
+            switch (op->type)
+            {
+            case OP_ACCEPT:
+                handleAccept(&server, cqe);
+                break;
+            case OP_ACCEPT_BACKOFF:
+                armAccept(&server);
+                break;
+            case OP_RECV:
+                handleRecv(op->conn, cqe);
+                break;
+            case OP_SEND:
+                handleSend((SendBuffer *)op, cqe);
+                break;
+            }
+        }
+
+        __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+    }
+
+    perror("io_uring_enter");
+    uringFree(ring);
+    return -1;
+}
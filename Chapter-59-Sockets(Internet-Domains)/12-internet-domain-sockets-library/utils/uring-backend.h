@@ -0,0 +1,14 @@
+// io_uring backend of the stream server, talks to the kernel with raw syscalls
+// - one multishot accept for the listener
+// - multishot recv per connection, data lands in a provided buffer ring
+// - sends queued in the same iteration are submitted as one linked chain
+
+#ifndef URING_BACKEND_H
+#define URING_BACKEND_H
+
+#include "stream-server.h"
+
+// serve clients of the listening socket, returns -1 when io_uring is unavailable
+int runUringServer(int sfd, const StreamHandlers *handlers, void *userData);
+
+#endif
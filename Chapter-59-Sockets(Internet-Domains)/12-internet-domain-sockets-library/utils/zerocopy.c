@@ -0,0 +1,294 @@
+#include "zerocopy.h"
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <linux/errqueue.h>
+
+// smallest buffer handed out, small messages share the same size class
+#define ZEROCOPY_MIN_BUFFER MESSAGE_BUFFER_SIZE
+
+int initZeroCopySocket(ZeroCopySocket *zc, int fd, size_t threshold)
+{
+    memset(zc, 0, sizeof(*zc));
+    zc->fd = fd;
+    zc->threshold = threshold > 0 ? threshold : ZEROCOPY_DEFAULT_THRESHOLD;
+
+    // older kernels or socket types without support, every send is a plain copy then
+    int on = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == -1)
+        zc->threshold = SIZE_MAX;
+    return 0;
+}
+
+ZeroCopyBuffer *zeroCopyGetBuffer(ZeroCopySocket *zc, size_t size)
+{
+    // first fit, the pool is small
+    for (ZeroCopyBuffer **link = &zc->freeBuffers; *link != NULL; link = &(*link)->next)
+    {
+        ZeroCopyBuffer *buffer = *link;
+        if (buffer->capacity < size)
+            continue;
+
+        *link = buffer->next;
+        zc->freeCount--;
+        buffer->next = NULL;
+        return buffer;
+    }
+
+    size_t capacity = size > ZEROCOPY_MIN_BUFFER ? size : ZEROCOPY_MIN_BUFFER;
+    ZeroCopyBuffer *buffer = malloc(sizeof(ZeroCopyBuffer) + capacity);
+    if (buffer == NULL)
+        return NULL;
+
+    buffer->next = NULL;
+    buffer->capacity = capacity;
+    buffer->sendsInFlight = 0;
+    return buffer;
+}
+
+void zeroCopyPutBuffer(ZeroCopySocket *zc, ZeroCopyBuffer *buffer)
+{
+    if (zc->freeCount >= ZEROCOPY_POOL_SIZE)
+    {
+        free(buffer);
+        return;
+    }
+
+    buffer->next = zc->freeBuffers;
+    zc->freeBuffers = buffer;
+    zc->freeCount++;
+}
+
+static int addPending(ZeroCopySocket *zc, ZeroCopyBuffer *buffer)
+{
+    ZeroCopyPending *pending = malloc(sizeof(ZeroCopyPending));
+    if (pending == NULL)
+        return -1;
+
+    pending->next = NULL;
+    pending->id = zc->nextId;
+    pending->buffer = buffer;
+
+    if (zc->pendingTail != NULL)
+        zc->pendingTail->next = pending;
+    else
+        zc->pendingHead = pending;
+    zc->pendingTail = pending;
+
+    if (buffer->sendsInFlight++ == 0)
+        zc->buffersInFlight++;
+    return 0;
+}
+
+// sends lo..hi are done, the range wraps like the kernel counter
+static void completeRange(ZeroCopySocket *zc, uint32_t lo, uint32_t hi)
+{
+    ZeroCopyPending *prev = NULL, *pending = zc->pendingHead;
+
+    // usually in order, but a retransmission can complete an older send later
+    while (pending != NULL)
+    {
+        ZeroCopyPending *next = pending->next;
+
+        if ((uint32_t)(pending->id - lo) > (uint32_t)(hi - lo))
+        {
+            prev = pending;
+            pending = next;
+            continue;
+        }
+
+        if (prev != NULL)
+            prev->next = next;
+        else
+            zc->pendingHead = next;
+        if (zc->pendingTail == pending)
+            zc->pendingTail = prev;
+
+        ZeroCopyBuffer *buffer = pending->buffer;
+        if (--buffer->sendsInFlight == 0)
+        {
+            zc->buffersInFlight--;
+            zeroCopyPutBuffer(zc, buffer);
+        }
+
+        free(pending);
+        pending = next;
+    }
+}
+
+// one notification off the error queue, returns sends completed, 0 when empty or -1
+static int readCompletion(ZeroCopySocket *zc)
+{
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if (recvmsg(zc->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+        return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+
+    int completed = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (!((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+              (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)))
+            continue;
+
+        struct sock_extended_err *err = (struct sock_extended_err *)CMSG_DATA(cmsg);
+        if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY || err->ee_errno != 0)
+            continue;
+
+        // ee_info..ee_data is the range of send ids, coalesced by the kernel
+        uint32_t lo = err->ee_info, hi = err->ee_data;
+        uint32_t count = hi - lo + 1;
+
+        if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+            zc->copiedSends += count;
+
+        completeRange(zc, lo, hi);
+        completed += count;
+    }
+    return completed;
+}
+
+int zeroCopyReap(ZeroCopySocket *zc, int timeoutMs)
+{
+    if (zc->pendingHead == NULL)
+        return 0;
+
+    // a non-empty error queue is reported as POLLERR
+    if (timeoutMs != 0)
+    {
+        struct pollfd pfd = {.fd = zc->fd, .events = 0};
+        if (poll(&pfd, 1, timeoutMs) == -1 && errno != EINTR)
+            return -1;
+    }
+
+    int total = 0, completed;
+    while ((completed = readCompletion(zc)) > 0)
+        total += completed;
+
+    return completed == -1 && total == 0 ? -1 : total;
+}
+
+ssize_t zeroCopySendBuffer(ZeroCopySocket *zc, ZeroCopyBuffer *buffer, size_t len, int flags)
+{
+    // keep the pool flowing, completions of earlier sends are usually there by now
+    zeroCopyReap(zc, 0);
+
+    int zeroCopy = len >= zc->threshold;
+    int retried = 0;
+    size_t sent = 0;
+
+    while (sent < len)
+    {
+        ssize_t bytes_sent = send(zc->fd, buffer->data + sent, len - sent, flags | (zeroCopy ? MSG_ZEROCOPY : 0));
+        if (bytes_sent == -1)
+        {
+            if (errno == EINTR)
+                continue;
+
+            // too many pages pinned (optmem limit), wait for completions once, then copy
+            if (zeroCopy && errno == ENOBUFS)
+            {
+                if (!retried)
+                    zeroCopyReap(zc, 10);
+                else
+                    zeroCopy = 0;
+                retried = 1;
+                continue;
+            }
+            break;
+        }
+
+        if (zeroCopy)
+        {
+            // the kernel holds the pages until the completion with this id arrives
+            if (addPending(zc, buffer) == -1)
+            {
+                // untracked now, the buffer can never be reused safely
+                zc->nextId++;
+                zc->zeroCopySends++;
+                return sent + bytes_sent;
+            }
+            zc->nextId++;
+            zc->zeroCopySends++;
+        }
+        else
+            zc->plainSends++;
+
+        sent += bytes_sent;
+    }
+
+    if (buffer->sendsInFlight == 0)
+        zeroCopyPutBuffer(zc, buffer);
+
+    return sent > 0 ? (ssize_t)sent : -1;
+}
+
+ssize_t sendMessageZeroCopy(ZeroCopySocket *zc, int flags, const char *format, ...)
+{
+    ZeroCopyBuffer *buffer = zeroCopyGetBuffer(zc, ZEROCOPY_MIN_BUFFER);
+    if (buffer == NULL)
+        return -1;
+
+    va_list args;
+    va_start(args, format);
+    int size = vsnprintf(buffer->data, buffer->capacity, format, args);
+    va_end(args);
+
+    if (size < 0)
+    {
+        zeroCopyPutBuffer(zc, buffer);
+        return -1;
+    }
+
+    // +1 as vsnprintf always writes the terminator
+    if ((size_t)size >= buffer->capacity)
+    {
+        zeroCopyPutBuffer(zc, buffer);
+        if ((buffer = zeroCopyGetBuffer(zc, size + 1)) == NULL)
+            return -1;
+
+        va_start(args, format);
+        vsnprintf(buffer->data, size + 1, format, args);
+        va_end(args);
+    }
+
+    return zeroCopySendBuffer(zc, buffer, size, flags);
+}
+
+static long long monotonicMs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+void freeZeroCopySocket(ZeroCopySocket *zc, int timeoutMs)
+{
+    long long deadline = monotonicMs() + timeoutMs;
+    long long now;
+
+    while (zc->pendingHead != NULL && (now = monotonicMs()) < deadline)
+        if (zeroCopyReap(zc, (int)(deadline - now)) == -1)
+            break;
+
+    // the kernel may still read these pages, the buffers are leaked on purpose
+    while (zc->pendingHead != NULL)
+    {
+        ZeroCopyPending *pending = zc->pendingHead;
+        zc->pendingHead = pending->next;
+        free(pending);
+    }
+    zc->pendingTail = NULL;
+
+    while (zc->freeBuffers != NULL)
+    {
+        ZeroCopyBuffer *buffer = zc->freeBuffers;
+        zc->freeBuffers = buffer->next;
+        free(buffer);
+    }
+    zc->freeCount = 0;
+}
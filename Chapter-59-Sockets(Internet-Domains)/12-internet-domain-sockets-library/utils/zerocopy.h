@@ -0,0 +1,81 @@
+// MSG_ZEROCOPY sends for large payloads
+// - payloads of at least threshold bytes are sent with MSG_ZEROCOPY: the kernel pins the
+//   pages instead of copying them, so the buffer must stay untouched until the kernel
+//   reports on the socket error queue that it is done with it
+// - every send owns a buffer of a small pool; completions (ranges of send ids) hand the
+//   buffers back to the pool, smaller payloads use a plain send from the same buffers
+// - when the kernel had to copy anyway (loopback, devices without scatter-gather) the
+//   completion says so, copiedSends counts them
+// one ZeroCopySocket per socket, not thread safe
+
+#ifndef ZEROCOPY_H
+#define ZEROCOPY_H
+
+#include "socket-library.h"
+#include <stdint.h>
+
+// below this a copy is cheaper than pinning pages and reading the completion
+#define ZEROCOPY_DEFAULT_THRESHOLD (16 * 1024)
+
+// free buffers kept for reuse, the rest are released when they come back
+#define ZEROCOPY_POOL_SIZE 64
+
+typedef struct ZeroCopyBuffer
+{
+    struct ZeroCopyBuffer *next;
+    size_t capacity;
+    int sendsInFlight; // zerocopy sends of this buffer not completed yet
+    char data[];
+} ZeroCopyBuffer;
+
+// one zerocopy send call, completions arrive in this order
+typedef struct ZeroCopyPending
+{
+    struct ZeroCopyPending *next;
+    uint32_t id;
+    ZeroCopyBuffer *buffer;
+} ZeroCopyPending;
+
+typedef struct
+{
+    int fd;
+    size_t threshold; // SIZE_MAX when the socket does not support SO_ZEROCOPY
+    uint32_t nextId;  // the kernel numbers zerocopy sends per socket from 0
+
+    ZeroCopyPending *pendingHead, *pendingTail;
+    ZeroCopyBuffer *freeBuffers;
+    size_t freeCount;
+
+    // statistics
+    size_t zeroCopySends;
+    size_t copiedSends; // completed, but the kernel copied the data after all
+    size_t plainSends;
+    size_t buffersInFlight;
+} ZeroCopySocket;
+
+// enable SO_ZEROCOPY on the socket, without it every send falls back to a plain copy
+// returns -1 only when the state cannot be set up
+int initZeroCopySocket(ZeroCopySocket *zc, int fd, size_t threshold);
+
+// wait up to timeoutMs for outstanding completions, then free every buffer
+// buffers still owned by the kernel are leaked rather than freed under it
+void freeZeroCopySocket(ZeroCopySocket *zc, int timeoutMs);
+
+// buffer of at least size bytes, from the pool when one is free
+ZeroCopyBuffer *zeroCopyGetBuffer(ZeroCopySocket *zc, size_t size);
+
+// give an unsent buffer back
+void zeroCopyPutBuffer(ZeroCopySocket *zc, ZeroCopyBuffer *buffer);
+
+// send len bytes of the buffer, which belongs to zc from now on (also on failure)
+// loops until everything is sent on blocking sockets, returns bytes sent or -1
+ssize_t zeroCopySendBuffer(ZeroCopySocket *zc, ZeroCopyBuffer *buffer, size_t len, int flags);
+
+// sendMessage through a pooled buffer, zerocopy when the message reaches the threshold
+ssize_t sendMessageZeroCopy(ZeroCopySocket *zc, int flags, const char *format, ...);
+
+// read the completions queued on the socket error queue and recycle their buffers,
+// waits up to timeoutMs for the first one (0 does not wait), returns sends completed or -1
+int zeroCopyReap(ZeroCopySocket *zc, int timeoutMs);
+
+#endif
@@ -0,0 +1,127 @@
+// compares plain send with MSG_ZEROCOPY over loopback tcp at different payload sizes
+// - send: one buffer, copied into the kernel by every send
+// - zerocopy: pooled buffers, pinned by the kernel until the completion arrives
+// the payload is written before every send in both modes, as a server producing responses would
+// on loopback the receiver copies the pinned pages itself, most completions report a copy
+// usage: ./zerocopy-benchmark [megabytes per run]
+
+#include "utils/zerocopy.h"
+#include <pthread.h>
+#include <time.h>
+
+#define DEFAULT_MEGABYTES 256
+#define BENCHMARK_PORT 3400
+#define DRAIN_BUFFER_SIZE (1024 * 1024)
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *drain(void *arg)
+{
+    int sfd = *(int *)arg;
+    char *buffer = malloc(DRAIN_BUFFER_SIZE);
+
+    int cfd = acceptClient(sfd, NULL, NULL);
+    if (cfd == -1 || buffer == NULL)
+        fatal("accept");
+
+    while (recv(cfd, buffer, DRAIN_BUFFER_SIZE, 0) > 0)
+        ;
+
+    // everything arrived, tell the sender
+    send(cfd, "", 1, MSG_NOSIGNAL);
+    close(cfd);
+    free(buffer);
+    return NULL;
+}
+
+static void run(int sfd, size_t payload, long megabytes, int zeroCopy)
+{
+    pthread_t reader;
+    if (pthread_create(&reader, NULL, drain, &sfd) != 0)
+        fatal("pthread_create");
+
+    char service[16];
+    snprintf(service, sizeof(service), "%d", BENCHMARK_PORT);
+    int cfd = openConnection(AF_INET, SOCK_STREAM, "127.0.0.1", service, NULL);
+    if (cfd == -1)
+        fatal("openConnection");
+
+    ZeroCopySocket zc;
+    initZeroCopySocket(&zc, cfd, zeroCopy ? payload : SIZE_MAX);
+
+    char *plain = malloc(payload);
+    if (plain == NULL)
+        fatal("malloc");
+
+    long messages = megabytes * 1024 * 1024 / payload;
+    double start = now();
+
+    for (long i = 0; i < messages; i++)
+    {
+        ssize_t sent;
+        if (zeroCopy)
+        {
+            ZeroCopyBuffer *buffer = zeroCopyGetBuffer(&zc, payload);
+            if (buffer == NULL)
+                fatal("zeroCopyGetBuffer");
+            memset(buffer->data, (int)i, payload);
+            sent = zeroCopySendBuffer(&zc, buffer, payload, MSG_NOSIGNAL);
+        }
+        else
+        {
+            memset(plain, (int)i, payload);
+            sent = send(cfd, plain, payload, MSG_NOSIGNAL);
+        }
+
+        if (sent != (ssize_t)payload)
+            fatal("send");
+    }
+
+    // the receiver has everything once it answers the end of stream
+    char done;
+    shutdown(cfd, SHUT_WR);
+    recv(cfd, &done, 1, 0);
+    double seconds = now() - start;
+
+    // the last completions may still be on their way
+    size_t zeroCopySends = zc.zeroCopySends;
+    freeZeroCopySocket(&zc, 1000);
+
+    printf("%8zu KB  %-9s %9.1f MB/s", payload / 1024, zeroCopy ? "zerocopy" : "send", megabytes / seconds);
+    if (zeroCopy)
+        printf("  zerocopy sends %zu, copied by the kernel %zu", zeroCopySends, zc.copiedSends);
+    printf("\n");
+
+    free(plain);
+    close(cfd);
+    pthread_join(reader, NULL);
+}
+
+int main(int argc, char const *argv[])
+{
+    long megabytes = argc > 1 ? atol(argv[1]) : DEFAULT_MEGABYTES;
+    size_t payloads[] = {4 * 1024, 16 * 1024, 64 * 1024, 256 * 1024, 1024 * 1024, 4 * 1024 * 1024};
+    int count = sizeof(payloads) / sizeof(payloads[0]);
+
+    if (megabytes <= 0)
+        exitWithMessage("usage: ./zerocopy-benchmark [megabytes per run]\n");
+
+    struct sockaddr_storage addr;
+    int sfd = createServer(AF_INET, SOCK_STREAM, BENCHMARK_PORT, 1, "127.0.0.1", &addr);
+    if (sfd == -1)
+        fatal("createServer");
+
+    for (int i = 0; i < count; i++)
+    {
+        run(sfd, payloads[i], megabytes, 0);
+        run(sfd, payloads[i], megabytes, 1);
+    }
+
+    close(sfd);
+    return 0;
+}